@@ -23,6 +23,9 @@ config :ex_clamav_server, ExClamavServer.DefinitionSync,
   interval_ms: :timer.hours(1),
   run_on_start: true
 
+# Traces are only exported when an OTLP endpoint is configured (see runtime.exs).
+config :opentelemetry, traces_exporter: :none
+
 config :logger, :console,
   format: "$time $metadata[$level] $message\n",
   metadata: [:request_id, :reference_id]
@@ -37,6 +37,15 @@ if config_env() == :prod do
     database_path: database_path,
     freshclam_config: System.get_env("FRESHCLAM_CONFIG")
 
+  # Export traces (HTTP, Ecto, scan queueing and engine spans) over OTLP
+  if otlp_endpoint = System.get_env("OTEL_EXPORTER_OTLP_ENDPOINT") do
+    config :opentelemetry, traces_exporter: :otlp
+
+    config :opentelemetry_exporter,
+      otlp_protocol: :http_protobuf,
+      otlp_endpoint: otlp_endpoint
+  end
+
   # Configure log level at runtime
   log_level =
     case System.get_env("LOG_LEVEL", "info") do
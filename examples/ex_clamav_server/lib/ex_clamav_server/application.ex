@@ -49,6 +49,10 @@ defmodule ExClamavServer.Application do
 
     skip_clamav? = Application.get_env(:ex_clamav_server, :skip_clamav, false)
 
+    # HTTP and database spans; scan spans come from ExClamav.Tracing
+    OpentelemetryBandit.setup()
+    OpentelemetryEcto.setup([:ex_clamav_server, :repo])
+
     children =
       [
         # PostgreSQL connection pool
@@ -19,9 +19,16 @@ defmodule ExClamavServer.ScanWorker do
 
   Each instance identifies itself using `node()` combined with the system hostname,
   so that the `scanned_by` field in the database can trace which pod handled the scan.
+
+  ## Tracing
+
+  The caller's OpenTelemetry context is carried into the task, so the
+  `scan_worker.scan` span (and the engine's `ex_clamav.scan` spans beneath it)
+  belong to the trace of the upload request that created the job.
   """
 
   require Logger
+  require OpenTelemetry.Tracer, as: Tracer
 
   alias ExClamavServer.ScanJob
 
@@ -38,10 +45,15 @@ defmodule ExClamavServer.ScanWorker do
       # shape without spawning a task that would crash immediately.
       {:ok, self()}
     else
+      ctx = OpenTelemetry.Ctx.get_current()
+
       task =
         Task.Supervisor.async_nolink(
           ExClamavServer.ScanTaskSupervisor,
-          fn -> perform_scan(job) end
+          fn ->
+            OpenTelemetry.Ctx.attach(ctx)
+            perform_scan(job)
+          end
         )
 
       {:ok, task.pid}
@@ -56,6 +68,14 @@ defmodule ExClamavServer.ScanWorker do
   """
   @spec perform_scan(ScanJob.t()) :: {:ok, ScanJob.t()} | {:error, term()}
   def perform_scan(%ScanJob{} = job) do
+    Tracer.with_span "scan_worker.scan", %{
+      attributes: %{"scan.reference_id": job.reference_id, "scan.file_size": job.file_size}
+    } do
+      claim_and_scan(job)
+    end
+  end
+
+  defp claim_and_scan(%ScanJob{} = job) do
     instance_id = instance_identifier()
 
     Logger.metadata(reference_id: job.reference_id)
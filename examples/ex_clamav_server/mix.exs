@@ -32,7 +32,12 @@ defmodule ExClamavServer.MixProject do
       {:ecto_sql, "~> 3.12"},
       {:postgrex, "~> 0.19"},
       {:jason, "~> 1.4"},
-      {:ecto, "~> 3.12"}
+      {:ecto, "~> 3.12"},
+      {:opentelemetry, "~> 1.5"},
+      {:opentelemetry_api, "~> 1.4"},
+      {:opentelemetry_exporter, "~> 1.8"},
+      {:opentelemetry_bandit, "~> 0.2"},
+      {:opentelemetry_ecto, "~> 1.2"}
     ]
   end
 
@@ -40,7 +45,7 @@ defmodule ExClamavServer.MixProject do
     [
       ex_clamav_server: [
         include_executables_for: [:unix],
-        applications: [runtime_tools: :permanent],
+        applications: [runtime_tools: :permanent, opentelemetry: :temporary],
         steps: [:assemble, :tar]
       ]
     ]
@@ -52,10 +52,19 @@ defmodule ExClamav do
   defdelegate new_engine, to: Engine
   defdelegate scan_file(engine, file_path, options \\ 0), to: Engine
   defdelegate scan_buffer(engine, buffer, options \\ 0), to: Engine
+  defdelegate open_file(file_path), to: Engine
+  defdelegate scan_file_range(engine, file, offset, length, options \\ 0), to: Engine
   defdelegate free(engine), to: Engine
   defdelegate load_database(engine, database_path), to: Engine
   defdelegate compile(engine), to: Engine
   defdelegate get_database_version(engine), to: Engine
+  defdelegate get_database_time(engine), to: Engine
+
+  defdelegate lookup_hash(index \\ ExClamav.HashIndex, digest, size),
+    to: ExClamav.HashIndex,
+    as: :lookup
+
+  defdelegate stream_scan(enumerable, opts \\ []), to: ExClamav.ScanStream, as: :stream
 
   # ---------------------------------------------------------------------------
   # Helper functions
@@ -78,7 +87,8 @@ defmodule ExClamav do
     apply(Nif, function, args)
   end
 
-  defp default_database_path do
+  @doc false
+  def default_database_path do
     # Common database locations
     possible_paths = [
       "/var/lib/clamav",
@@ -0,0 +1,170 @@
+defmodule ExClamav.Allowlist do
+  @moduledoc """
+  A curated allowlist of known-good SHA-256 digests, checked before the engine.
+
+  Trusted bulk content (signed build artifacts, vendor installers) does not
+  need a multi-second engine scan every time it is seen. `build/2` compiles a
+  hash list into a compact sorted file with a 65,536-bucket prefix index;
+  `load/2` maps it read-only with `mmap(2)`, so lookups never copy the list
+  into the BEAM heap, cost one small binary search, and share page cache with
+  every other process on the host that maps the same file.
+
+  Loaded allowlists are registered under a name in `:persistent_term`, which
+  makes `member?/2` callable from any process without a server round trip.
+  Reloading a name atomically swaps in the new file; the old mapping is
+  released once no process references it.
+
+  ## Usage
+
+      {:ok, 120_000} =
+        ExClamav.Allowlist.build_from_file("trusted.sha256", "/var/lib/app/trusted.alw")
+
+      {:ok, 120_000} = ExClamav.Allowlist.load(:trusted, "/var/lib/app/trusted.alw")
+
+      ExClamav.Allowlist.member?(:trusted, :crypto.hash(:sha256, data))
+      #=> true
+
+  `ExClamav.ClamavGenServer` accepts `allowlist: :trusted` to answer
+  `{:ok, :clean}` for allowlisted content without scanning, and
+  `ExClamav.Pipeline.Stages.allowlist/1` does the same inside a pipeline.
+
+  ## Telemetry
+
+  * `[:ex_clamav, :allowlist, :lookup]` — every `member?/2` call.
+    Measurements: `:count` (always `1`). Metadata: `:name` and `:result`
+    (`:hit` or `:miss`).
+  """
+
+  @type name :: atom()
+  @type digest :: <<_::256>>
+
+  @magic "EXCLALW1"
+  @buckets 65_536
+
+  @doc """
+  Write an allowlist file from SHA-256 digests, given as 32-byte binaries or
+  64-character hex strings. Duplicates are removed. Returns the entry count.
+  """
+  @spec build(Enumerable.t(), Path.t()) :: {:ok, non_neg_integer()} | {:error, String.t()}
+  def build(digests, path) do
+    digests = digests |> Enum.map(&decode!/1) |> Enum.sort() |> Enum.dedup()
+    count = length(digests)
+
+    buckets = Enum.frequencies_by(digests, fn <<prefix::16, _::binary>> -> prefix end)
+
+    {starts, ^count} =
+      Enum.map_reduce(0..(@buckets - 1), 0, fn prefix, position ->
+        {position, position + Map.get(buckets, prefix, 0)}
+      end)
+
+    index = for position <- starts ++ [count], into: <<>>, do: <<position::little-32>>
+
+    case write_atomic(path, [@magic, <<count::little-64>>, index | digests]) do
+      :ok -> {:ok, count}
+      {:error, _reason} = error -> error
+    end
+  rescue
+    e in ArgumentError -> {:error, Exception.message(e)}
+  end
+
+  @doc """
+  Build an allowlist from a text file with one hex digest per line.
+
+  Anything after the digest on a line is ignored, so `sha256sum` output
+  works as-is; blank lines and lines starting with `#` are skipped.
+  """
+  @spec build_from_file(Path.t(), Path.t()) :: {:ok, non_neg_integer()} | {:error, String.t()}
+  def build_from_file(source, path) do
+    if File.regular?(source) do
+      source
+      |> File.stream!()
+      |> Stream.map(&String.trim/1)
+      |> Stream.reject(&(&1 == "" or String.starts_with?(&1, "#")))
+      |> Stream.map(&(&1 |> String.split(~r/\s+/, parts: 2) |> hd()))
+      |> build(path)
+    else
+      {:error, "Allowlist source #{source} does not exist"}
+    end
+  end
+
+  @doc """
+  Map an allowlist file and register it under `name`, replacing any
+  allowlist previously loaded under that name.
+  """
+  @spec load(name(), Path.t()) :: {:ok, non_neg_integer()} | {:error, String.t()}
+  def load(name, path) when is_atom(name) do
+    case ExClamav.Nif.allowlist_open(path) do
+      {:ok, ref, count} ->
+        :persistent_term.put({__MODULE__, name}, %{ref: ref, count: count, path: path})
+        {:ok, count}
+
+      {:error, reason} ->
+        {:error, IO.chardata_to_string(reason)}
+    end
+  end
+
+  @doc """
+  Forget the allowlist registered under `name`.
+  """
+  @spec unload(name()) :: :ok
+  def unload(name) do
+    :persistent_term.erase({__MODULE__, name})
+    :ok
+  end
+
+  @doc """
+  Check whether a SHA-256 digest is allowlisted. Unknown names never match.
+  """
+  @spec member?(name(), digest()) :: boolean()
+  def member?(name, <<_::256>> = digest) do
+    hit =
+      case :persistent_term.get({__MODULE__, name}, nil) do
+        %{ref: ref} -> ExClamav.Nif.allowlist_lookup(ref, digest)
+        nil -> false
+      end
+
+    :telemetry.execute([:ex_clamav, :allowlist, :lookup], %{count: 1}, %{
+      name: name,
+      result: if(hit, do: :hit, else: :miss)
+    })
+
+    hit
+  end
+
+  @doc """
+  Returns the path and entry count of a loaded allowlist.
+  """
+  @spec info(name()) :: %{path: Path.t(), count: non_neg_integer()} | nil
+  def info(name) do
+    case :persistent_term.get({__MODULE__, name}, nil) do
+      %{path: path, count: count} -> %{path: path, count: count}
+      nil -> nil
+    end
+  end
+
+  # ── Helpers ──────────────────────────────────────────────────────────────
+
+  defp decode!(<<_::256>> = digest), do: digest
+
+  defp decode!(hex) when is_binary(hex) and byte_size(hex) == 64 do
+    case Base.decode16(hex, case: :mixed) do
+      {:ok, digest} -> digest
+      :error -> raise ArgumentError, "Invalid SHA-256 digest: #{hex}"
+    end
+  end
+
+  defp decode!(other), do: raise(ArgumentError, "Invalid SHA-256 digest: #{inspect(other)}")
+
+  defp write_atomic(path, data) do
+    tmp = "#{path}.tmp-#{System.unique_integer([:positive])}"
+
+    with :ok <- File.write(tmp, data),
+         :ok <- File.rename(tmp, path) do
+      :ok
+    else
+      {:error, reason} ->
+        File.rm(tmp)
+        {:error, reason |> :file.format_error() |> IO.chardata_to_string()}
+    end
+  end
+end
@@ -0,0 +1,220 @@
+defmodule ExClamav.Archive do
+  @moduledoc """
+  Member-level scanning of zip archives with a per-member verdict cache.
+
+  Users often re-upload zip bundles in which most members have not changed,
+  yet each upload is normally scanned from scratch. `ExClamav.Archive`
+  enumerates the members, hashes each one as it is extracted and looks its
+  verdict up in an `ExClamav.VerdictCache`; only new or changed members go
+  through the engine. The archive verdict is the first infected member's, or
+  `{:ok, :clean}` when every member is clean, so rescanning a mostly
+  unchanged bundle costs little more than decompressing it.
+
+  Cached member verdicts follow the cache's generation: a cache subscribed
+  to the `DefinitionUpdater` drops them whenever new definitions are loaded.
+
+  Before the members, the zip itself goes through the engine once with
+  archive parsing off, so signatures written against the container still
+  match; that verdict is cached by the archive's digest. Anything the member
+  walk cannot handle — content that is not a zip, encrypted or corrupt
+  archives, or archives beyond the limits below — is scanned whole by the
+  engine instead, so the result is never weaker than a plain scan.
+
+  ## Usage
+
+      ExClamav.Archive.scan_file(engine, "/uploads/bundle.zip", cache: ExClamav.VerdictCache)
+      #=> {:ok, :clean}
+
+  ## Options
+
+  * `:cache`           — `ExClamav.VerdictCache` holding member verdicts, or
+    `nil` to disable caching (default: `ExClamav.VerdictCache`).
+  * `:max_members`     — larger archives are scanned whole (default: `10_000`).
+  * `:max_member_size` — uncompressed member size above which the archive
+    is scanned whole (default: 100 MiB).
+  * `:scan_options`    — libclamav scan options for engine scans (default: `0`).
+
+  ## Telemetry
+
+  * `[:ex_clamav, :archive, :scan]` — after every archive scan.
+    Measurements: `:duration` (native time units), `:members` and
+    `:scanned` (members sent to the engine, not counting the container).
+    Metadata: `:mode` (`:members` or `:whole`).
+  """
+
+  alias ExClamav.ClamavGenServer
+  alias ExClamav.Engine
+  alias ExClamav.VerdictCache
+
+  @type target :: Engine.t() | GenServer.server()
+  @type verdict :: {:ok, :clean} | {:virus, String.t()} | {:error, String.t()}
+
+  @type option ::
+          {:cache, atom() | nil}
+          | {:max_members, pos_integer()}
+          | {:max_member_size, pos_integer()}
+          | {:scan_options, non_neg_integer()}
+
+  # CL_SCAN_ARCHIVE in `ExClamav.Engine` scan options.
+  @parse_archive 0x1
+
+  @defaults [
+    cache: VerdictCache,
+    max_members: 10_000,
+    max_member_size: 100 * 1024 * 1024,
+    scan_options: 0
+  ]
+
+  @doc """
+  Scan a zip archive on disk member by member.
+  """
+  @spec scan_file(target(), Path.t(), [option()]) :: verdict()
+  def scan_file(target, path, opts \\ []) do
+    scan(target, {:file, path}, Keyword.merge(@defaults, opts))
+  end
+
+  @doc """
+  Scan a zip archive held in memory member by member.
+  """
+  @spec scan_buffer(target(), binary(), [option()]) :: verdict()
+  def scan_buffer(target, buffer, opts \\ []) when is_binary(buffer) do
+    scan(target, {:buffer, buffer}, Keyword.merge(@defaults, opts))
+  end
+
+  defp scan(target, source, opts) do
+    started = System.monotonic_time()
+
+    result =
+      case open(source) do
+        {:ok, zip} ->
+          try do
+            scan_members(target, source, zip, opts)
+          after
+            :zip.zip_close(zip)
+          end
+
+        :error ->
+          :whole
+      end
+
+    {verdict, measurements, mode} =
+      case result do
+        :whole -> {scan_whole(target, source, opts), %{members: 0, scanned: 1}, :whole}
+        {verdict, counts} -> {verdict, counts, :members}
+      end
+
+    :telemetry.execute(
+      [:ex_clamav, :archive, :scan],
+      Map.put(measurements, :duration, System.monotonic_time() - started),
+      %{mode: mode}
+    )
+
+    verdict
+  end
+
+  defp open({:file, path}), do: zip_open(String.to_charlist(path))
+  defp open({:buffer, buffer}), do: zip_open(buffer)
+
+  defp zip_open(archive) do
+    case :zip.zip_open(archive, [:memory]) do
+      {:ok, zip} -> {:ok, zip}
+      {:error, _reason} -> :error
+    end
+  end
+
+  # Returns :whole when the archive has to be scanned in one piece.
+  defp scan_members(target, source, zip, opts) do
+    with {:ok, [_comment | entries]} <- :zip.zip_list_dir(zip),
+         files = Enum.reject(entries, &directory?/1),
+         true <- length(files) <= opts[:max_members],
+         true <- Enum.all?(files, &(member_size(&1) <= opts[:max_member_size])) do
+      case scan_container(target, source, opts) do
+        {:ok, :clean} -> scan_files(target, zip, files, opts)
+        verdict -> {verdict, %{members: 0, scanned: 0}}
+      end
+    else
+      _ -> :whole
+    end
+  end
+
+  defp scan_files(target, zip, files, opts) do
+    files
+    |> Enum.reduce_while({{:ok, :clean}, %{members: 0, scanned: 0}}, fn entry, {_, counts} ->
+      case scan_member(target, zip, entry, opts) do
+        {:ok, verdict, scanned?} ->
+          counts = %{
+            members: counts.members + 1,
+            scanned: counts.scanned + if(scanned?, do: 1, else: 0)
+          }
+
+          case verdict do
+            {:ok, :clean} -> {:cont, {verdict, counts}}
+            _virus_or_error -> {:halt, {verdict, counts}}
+          end
+
+        :whole ->
+          {:halt, :whole}
+      end
+    end)
+  end
+
+  # The zip as a file in its own right, without descending into members.
+  # ClamavGenServer already scans with archive parsing off.
+  defp scan_container(target, source, opts) do
+    opts = Keyword.update!(opts, :scan_options, &Bitwise.band(&1, Bitwise.bnot(@parse_archive)))
+    scan_fun = fn -> scan_whole(target, source, opts) end
+
+    with cache when cache != nil <- opts[:cache],
+         {:ok, digest} <- source_digest(source) do
+      VerdictCache.fetch(cache, :crypto.hash(:sha256, ["container", 0, digest]), scan_fun)
+    else
+      _ -> scan_fun.()
+    end
+  end
+
+  defp source_digest({:file, path}), do: VerdictCache.file_digest(path)
+  defp source_digest({:buffer, buffer}), do: {:ok, VerdictCache.digest(buffer)}
+
+  defp scan_member(target, zip, {:zip_file, name, _info, _comment, _offset, _size}, opts) do
+    case :zip.zip_get(name, zip) do
+      {:ok, {_name, data}} ->
+        scan_fun = fn -> scan_data(target, data, opts) end
+
+        case opts[:cache] do
+          nil ->
+            {:ok, scan_fun.(), true}
+
+          cache ->
+            digest = VerdictCache.digest(data)
+
+            case VerdictCache.get(cache, digest) do
+              {:ok, verdict} -> {:ok, verdict, false}
+              :miss -> {:ok, VerdictCache.fetch(cache, digest, scan_fun), true}
+            end
+        end
+
+      {:error, _reason} ->
+        :whole
+    end
+  end
+
+  defp directory?({:zip_file, name, _info, _comment, _offset, _size}),
+    do: List.last(name) == ?/
+
+  defp member_size({:zip_file, _name, info, _comment, _offset, _size}), do: elem(info, 1)
+
+  defp scan_data(%Engine{} = engine, data, opts),
+    do: Engine.scan_buffer(engine, data, opts[:scan_options])
+
+  defp scan_data(server, data, _opts), do: ClamavGenServer.scan_buffer(server, data)
+
+  defp scan_whole(%Engine{} = engine, {:file, path}, opts),
+    do: Engine.scan_file(engine, path, opts[:scan_options])
+
+  defp scan_whole(%Engine{} = engine, {:buffer, buffer}, opts),
+    do: Engine.scan_buffer(engine, buffer, opts[:scan_options])
+
+  defp scan_whole(server, {:file, path}, _opts), do: ClamavGenServer.scan_file(server, path)
+  defp scan_whole(server, {:buffer, buffer}, _opts),
+    do: ClamavGenServer.scan_buffer(server, buffer)
+end
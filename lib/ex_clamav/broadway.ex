@@ -0,0 +1,97 @@
+if Code.ensure_loaded?(Broadway) do
+  defmodule ExClamav.Broadway do
+    @moduledoc """
+    Scan Broadway messages in batches against an `ExClamav.ClamavGenServer`.
+
+    Calling `ClamavGenServer.scan_file/2` from `handle_message/3` blocks each
+    processor on one scan at a time, so throughput is set by the processor
+    count rather than by the scan pool. `scan/2` is meant for
+    `handle_batch/4` instead: it queues every message of the batch on the pool
+    at once and waits for all verdicts. The pool's `:max_concurrency` bounds
+    the scans in flight and its scheduler orders them by cost; while the pool
+    is saturated the batchers wait, Broadway stops asking the producer for
+    more, and ingestion runs at the engine's real capacity.
+
+    Requires the optional `:broadway` dependency.
+
+    ## Usage
+
+        defmodule MyApp.Uploads do
+          use Broadway
+
+          def start_link(_opts) do
+            Broadway.start_link(__MODULE__,
+              name: __MODULE__,
+              producer: [module: {BroadwaySQS.Producer, queue_url: "..."}],
+              processors: [default: [concurrency: 2]],
+              batchers: [scan: [concurrency: 2, batch_size: 50, batch_timeout: 100]]
+            )
+          end
+
+          @impl true
+          def handle_message(_processor, message, _context),
+            do: Broadway.Message.put_batcher(message, :scan)
+
+          @impl true
+          def handle_batch(:scan, messages, _batch_info, _context),
+            do: ExClamav.Broadway.scan(messages, source: &{:file, &1.data})
+        end
+
+    Keep `batch_size` times the batcher concurrency at or above the pool's
+    `:max_concurrency`, so the pool never runs dry between batches.
+
+    Each message gets its verdict in `metadata.clamav_verdict`. Infected
+    messages are marked failed with `{:virus, name}` (unless `:on_virus` is
+    `:keep`) and scan errors with their error string, so Broadway's
+    `handle_failed/2` and acknowledgement handle them like any other failure.
+
+    ## Options
+
+    * `:server`   — the `ClamavGenServer` to scan with (default: `ExClamav.ClamavGenServer`).
+    * `:source`   — `fn message -> {:file, path} | {:buffer, binary} end`
+      (default: binary `data` is scanned as a buffer; `{:file, _}` and
+      `{:buffer, _}` data is used as is).
+    * `:on_virus` — `:fail` or `:keep` (default: `:fail`).
+    * `:tenant`, `:priority`, `:deadline` — passed to the pool for every
+      message (see `ExClamav.ClamavGenServer.scan_file/3`).
+    """
+
+    alias Broadway.Message
+    alias ExClamav.ClamavGenServer
+
+    @type option ::
+            {:server, GenServer.server()}
+            | {:source, (Message.t() -> ClamavGenServer.item())}
+            | {:on_virus, :fail | :keep}
+            | ClamavGenServer.scan_option()
+
+    @doc """
+    Scan a list of messages, returning them with verdicts attached, in order.
+    """
+    @spec scan([Message.t()], [option()]) :: [Message.t()]
+    def scan(messages, opts \\ []) when is_list(messages) do
+      server = Keyword.get(opts, :server, ClamavGenServer)
+      source = Keyword.get(opts, :source, &default_source/1)
+      on_virus = Keyword.get(opts, :on_virus, :fail)
+      scan_opts = Keyword.take(opts, [:tenant, :priority, :deadline])
+
+      verdicts = ClamavGenServer.scan_many(server, Enum.map(messages, source), scan_opts)
+
+      messages
+      |> Enum.zip(verdicts)
+      |> Enum.map(fn {message, verdict} ->
+        message
+        |> Map.update!(:metadata, &Map.put(&1, :clamav_verdict, verdict))
+        |> mark(verdict, on_virus)
+      end)
+    end
+
+    defp default_source(%Message{data: data}) when is_binary(data), do: {:buffer, data}
+    defp default_source(%Message{data: {kind, _} = item}) when kind in [:file, :buffer], do: item
+
+    defp mark(message, {:ok, :clean}, _on_virus), do: message
+    defp mark(message, {:virus, _name}, :keep), do: message
+    defp mark(message, {:virus, _name} = virus, :fail), do: Message.failed(message, virus)
+    defp mark(message, {:error, reason}, _on_virus), do: Message.failed(message, reason)
+  end
+end
@@ -2,15 +2,17 @@ defmodule ExClamav.ClamavGenServer do
   @moduledoc """
   A `GenServer` wrapper around a long-lived ClamAV engine.
 
-  This server lazily initializes (or reuses) a compiled engine and serializes scan
-  requests across callers. Keeping the engine alive avoids reloading the virus
-  database for every scan, which significantly reduces latency in test suites or
-  services that need frequent scans.
+  This server lazily initializes (or reuses) a compiled engine and runs scan
+  requests from all callers on a bounded pool. Keeping the engine alive avoids
+  reloading the virus database for every scan, which significantly reduces
+  latency in test suites or services that need frequent scans.
 
   ## Features
 
   * Automatically loads and compiles the ClamAV database on boot.
   * Exposes synchronous `scan_file/2` and `scan_buffer/2` helpers.
+  * Schedules queued scans shortest-expected-job-first using a cost model
+    learned from measured scan throughput (see "Scheduling").
   * Guarantees engine resources are released when the server terminates.
   * Optionally subscribes to `ExClamav.DefinitionUpdater` and automatically
     reloads the engine when virus definitions are updated.
@@ -26,21 +28,143 @@ defmodule ExClamav.ClamavGenServer do
 
   When definitions are updated, the server will restart its engine with the
   new database, ensuring scans always use the latest signatures.
+
+  ## Scheduling
+
+  Up to `:max_concurrency` scans run at once. Waiting scans are not served
+  in arrival order: scans of equal size can differ in cost by three orders
+  of magnitude depending on type (a zip versus plain text), so FIFO order
+  lets one expensive scan delay every cheap one behind it. Instead, each
+  request is classified with `ExClamav.FileType`, its duration is predicted
+  from a per-type throughput average learned online from completed scans,
+  and the shortest expected scan runs first. Waiting time ages a request's
+  rank (`:aging` seconds of predicted cost per second waited), so
+  expensive scans cannot starve.
+
+  Requests can carry a `:tenant` key. Each tenant has its own queue and
+  tenants share scan time by weighted fair queuing, so a tenant bulk
+  uploading archives gets its weight's share of the engine rather than all
+  of it. A tenant can also get a token-bucket byte-rate quota; while its
+  bucket is empty its requests wait even if the pool is idle:
+
+      {ClamavGenServer,
+       max_concurrency: 8,
+       tenants: [interactive: [weight: 4], batch: [weight: 1, rate: 50_000_000]]}
+
+      ClamavGenServer.scan_file(ClamavGenServer, path, tenant: :batch)
+
+  Above both, requests can carry a `:priority` class and a `:deadline`. A
+  higher class always starts first, so a batch sweep never delays a
+  user-facing check. Within a class, a deadline overrides tenant fairness
+  only once it is close, i.e. once waiting another scan would miss it.
+  A request that reaches the front of the queue after its deadline is
+  answered with `{:error, "deadline exceeded"}` instead of being scanned,
+  leaving the capacity to requests that can still meet theirs:
+
+      deadline = System.monotonic_time(:millisecond) + 200
+      ClamavGenServer.scan_buffer(ClamavGenServer, upload, priority: :high, deadline: deadline)
+
+  * `[:ex_clamav, :scheduler, :scan]` — after every scan. Measurements:
+    `:wait`, `:duration` and `:predicted` (native time units), and
+    `:prediction_error` (relative, `|duration - predicted| / predicted`).
+    Metadata: `:type`, `:size`, `:tenant` and `:priority`.
+  * `[:ex_clamav, :scheduler, :expired]` — when a request is dropped at its
+    deadline. Measurements: `:wait` and `:lateness` (native time units).
+    Metadata: as above.
+
+  `status/1` reports the queue length, running scans, learned throughput
+  and the moving average of the prediction error per type, and the queue
+  length, weight, and number of quota throttles and expired requests per
+  tenant.
+
+  ## Freshness and reload metrics
+
+  `status/1` reports the build time and age of the definitions currently
+  serving scans, and how long the last reload took end to end. Telemetry:
+
+  * `[:ex_clamav, :engine, :reload]` — after every reload triggered by an
+    update. Measurements: `:duration` (engine rebuild) and `:latency` (from
+    the update event to the new engine serving), both in native time units.
+    Metadata: `:database_path`, `:version` and `:result` (`:ok` or `:error`).
+  * `[:ex_clamav, :definitions, :age]` — emitted by `emit_metrics/1`, meant
+    to be polled (for example by `:telemetry_poller`) for freshness SLOs.
+    Measurements: `:age` in seconds. Metadata: `:database_version`.
   """
 
   use GenServer
 
+  alias ExClamav.Allowlist
+  alias ExClamav.ClamavGenServer.Scheduler
+  alias ExClamav.DefinitionUpdater.Snapshots
   alias ExClamav.Engine
+  alias ExClamav.FileType
+  alias ExClamav.SharedVerdictCache
+  alias ExClamav.Tracing
+  alias ExClamav.VerdictCache
 
   require Logger
 
-  defstruct engine: nil, database_path: "/var/lib/clamav", auto_reload: false, updater: nil
+  defstruct engine: nil,
+            database_path: "/var/lib/clamav",
+            auto_reload: false,
+            updater: nil,
+            allowlist: nil,
+            shared_cache: nil,
+            cache_generation: nil,
+            loaded_at: nil,
+            last_reload: nil,
+            max_concurrency: 1,
+            scheduler: nil,
+            task_sup: nil,
+            load: nil,
+            running: %{},
+            retired: [],
+            dispatch_timer: nil,
+            tracing: false
 
   @type t :: %__MODULE__{
           engine: Engine.t() | nil,
           database_path: Path.t() | nil,
           auto_reload: boolean(),
-          updater: GenServer.server() | nil
+          updater: GenServer.server() | nil,
+          allowlist: ExClamav.Allowlist.name() | nil,
+          shared_cache: SharedVerdictCache.name() | nil,
+          cache_generation: SharedVerdictCache.generation() | nil,
+          loaded_at: DateTime.t() | nil,
+          last_reload: %{duration_ms: non_neg_integer(), latency_ms: non_neg_integer()} | nil,
+          max_concurrency: pos_integer(),
+          scheduler: Scheduler.t() | nil,
+          load: :atomics.atomics_ref() | nil,
+          task_sup: pid() | nil,
+          running: %{reference() => map()},
+          retired: [Engine.t()],
+          dispatch_timer: reference() | nil,
+          tracing: boolean()
+        }
+
+  @type status :: %{
+          database_path: Path.t() | nil,
+          database_version: non_neg_integer() | nil,
+          cache_generation: SharedVerdictCache.generation() | nil,
+          definitions_built_at: DateTime.t() | nil,
+          definitions_age_s: non_neg_integer() | nil,
+          loaded_at: DateTime.t() | nil,
+          last_reload_duration_ms: non_neg_integer() | nil,
+          last_reload_latency_ms: non_neg_integer() | nil,
+          scheduler: %{
+            queued: non_neg_integer(),
+            running: non_neg_integer(),
+            throughput: %{FileType.t() => non_neg_integer()},
+            prediction_error: %{FileType.t() => float()},
+            tenants: %{
+              Scheduler.tenant() => %{
+                queued: non_neg_integer(),
+                weight: pos_integer(),
+                throttled: non_neg_integer(),
+                expired: non_neg_integer()
+              }
+            }
+          }
         }
 
   @type option ::
@@ -48,6 +172,19 @@ defmodule ExClamav.ClamavGenServer do
           | {:database_path, Path.t() | nil}
           | {:auto_reload, boolean()}
           | {:updater, GenServer.server()}
+          | {:allowlist, ExClamav.Allowlist.name()}
+          | {:shared_cache, SharedVerdictCache.name()}
+          | {:max_concurrency, pos_integer()}
+          | {:aging, number()}
+          | {:tenants, [{Scheduler.tenant(), Scheduler.tenant_config()}]}
+          | {:tracing, boolean()}
+
+  @type scan_option ::
+          {:tenant, Scheduler.tenant()}
+          | {:priority, Scheduler.priority()}
+          | {:deadline, integer()}
+
+  @type item :: {:file, Path.t()} | {:buffer, binary()}
 
   @standard_scan_option 0
 
@@ -59,6 +196,19 @@ defmodule ExClamav.ClamavGenServer do
     reloads the engine when definitions change (default: `false`).
   * `:updater`       — the `DefinitionUpdater` server to subscribe to
     (default: `ExClamav.DefinitionUpdater`).
+  * `:allowlist`     — name of a loaded `ExClamav.Allowlist`; allowlisted
+    content is reported `{:ok, :clean}` without scanning (default: none).
+  * `:shared_cache`  — name of an open `ExClamav.SharedVerdictCache`
+    consulted before and filled after each scan (default: none).
+  * `:max_concurrency` — scans run in parallel on the shared engine
+    (default: `System.schedulers_online/0`).
+  * `:aging`         — seconds of predicted cost a waiting scan gains per
+    second waited (default: `1.0`).
+  * `:tenants`       — per-tenant `:weight` (share of scan time, default `1`),
+    `:rate` (byte-rate quota, bytes/s) and `:burst` (bucket size in bytes,
+    default `:rate`), keyed by tenant (default: none).
+  * `:tracing`       — record OpenTelemetry spans for each scan, see
+    `ExClamav.Tracing` (default: `true` when `:opentelemetry_api` is present).
   """
   @spec start_link([option()]) :: GenServer.on_start()
   def start_link(opts \\ []) do
@@ -95,20 +245,166 @@ defmodule ExClamav.ClamavGenServer do
 
   @doc """
   Scan a file path using the managed engine.
+
+  * `:tenant`   — the tenant the scan is accounted to (default: `:default`).
+  * `:priority` — `:high`, `:normal` or `:low`; queued scans of a higher
+    class always start first (default: `:normal`).
+  * `:deadline` — absolute deadline in `System.monotonic_time(:millisecond)`;
+    within a class a scan close to its deadline starts first, and a scan still
+    queued at its deadline returns `{:error, "deadline exceeded"}` without
+    being run (default: none).
   """
-  @spec scan_file(GenServer.server(), Path.t()) ::
+  @spec scan_file(GenServer.server(), Path.t(), [scan_option()]) ::
           {:ok, :clean} | {:virus, String.t()} | {:error, String.t()}
-  def scan_file(server \\ __MODULE__, file_path) do
-    GenServer.call(server, {:scan_file, file_path}, :infinity)
+  def scan_file(server \\ __MODULE__, file_path, opts \\ []) do
+    GenServer.call(server, request({:file, file_path}, opts), :infinity)
   end
 
   @doc """
   Scan an in-memory binary using the managed engine.
+
+  Accepts the same options as `scan_file/3`.
   """
-  @spec scan_buffer(GenServer.server(), binary()) ::
+  @spec scan_buffer(GenServer.server(), binary(), [scan_option()]) ::
           {:ok, :clean} | {:virus, String.t()} | {:error, String.t()}
-  def scan_buffer(server \\ __MODULE__, buffer) when is_binary(buffer) do
-    GenServer.call(server, {:scan_buffer, buffer}, :infinity)
+  def scan_buffer(server \\ __MODULE__, buffer, opts \\ []) when is_binary(buffer) do
+    GenServer.call(server, request({:buffer, buffer}, opts), :infinity)
+  end
+
+  @doc """
+  Scan several files and buffers at once, returning verdicts in input order.
+
+  All items are queued on the server before the first verdict is awaited,
+  so a single caller can keep the whole scan pool busy and the scheduler
+  can order the items by cost. Accepts the same options as `scan_file/3`,
+  applied to every item.
+
+      ClamavGenServer.scan_many(ClamavGenServer, [{:file, path}, {:buffer, data}])
+      #=> [{:ok, :clean}, {:virus, "Eicar-Test-Signature"}]
+  """
+  @spec scan_many(GenServer.server(), [item()], [scan_option()]) ::
+          [{:ok, :clean} | {:virus, String.t()} | {:error, String.t()}]
+  def scan_many(server \\ __MODULE__, items, opts \\ []) do
+    items
+    |> Enum.map(&:gen_server.send_request(server, request(&1, opts)))
+    |> Enum.map(fn request_id ->
+      case :gen_server.receive_response(request_id, :infinity) do
+        {:reply, verdict} -> verdict
+        {:error, {reason, _server}} -> exit({reason, {__MODULE__, :scan_many, [server]}})
+      end
+    end)
+  end
+
+  @doc """
+  Scan a list of files and buffers as a single job, returning verdicts in
+  input order.
+
+  Unlike `scan_many/3`, the whole list takes one slot of the pool and one
+  native call (`ExClamav.Engine.scan_batch/3`), which saves per-item
+  overhead when scanning many small items. The scheduler learns the cost of
+  batches separately from single scans. Accepts the same options as
+  `scan_file/3`; a deadline applies to the batch as a whole.
+  """
+  @spec scan_batch(GenServer.server(), [item()], [scan_option()]) ::
+          [{:ok, :clean} | {:virus, String.t()} | {:error, String.t()}]
+  def scan_batch(server \\ __MODULE__, items, opts \\ []) when is_list(items) do
+    size =
+      Enum.reduce(items, 0, fn
+        {:buffer, buffer}, acc -> acc + byte_size(buffer)
+        {:file, file_path}, acc -> acc + describe_file(file_path).size
+      end)
+
+    info = Map.merge(%{type: :batch, size: size}, job_options(opts))
+    GenServer.call(server, {:scan_batch, items, info}, :infinity)
+  end
+
+  defp request({:file, file_path}, opts),
+    do: {:scan_file, file_path, Map.merge(describe_file(file_path), job_options(opts))}
+
+  defp request({:buffer, buffer}, opts) when is_binary(buffer) do
+    info = %{type: FileType.detect(buffer), size: byte_size(buffer)}
+    {:scan_buffer, buffer, Map.merge(info, job_options(opts))}
+  end
+
+  defp job_options(opts) do
+    deadline =
+      case Keyword.get(opts, :deadline) do
+        nil -> nil
+        deadline -> System.convert_time_unit(deadline, :millisecond, :native)
+      end
+
+    %{
+      tenant: Keyword.get(opts, :tenant, :default),
+      priority: Keyword.get(opts, :priority, :normal),
+      deadline: deadline,
+      trace_ctx: Tracing.current_context()
+    }
+  end
+
+  # Classification reads a few bytes in the caller, keeping file I/O out of
+  # the server. Unreadable files are left for the engine to report.
+  defp describe_file(file_path) do
+    with {:ok, %File.Stat{size: size}} <- File.stat(file_path),
+         {:ok, head} <- read_head(file_path) do
+      %{type: FileType.detect(head), size: size}
+    else
+      _ -> %{type: :binary, size: 0}
+    end
+  end
+
+  defp read_head(file_path) do
+    File.open(file_path, [:read, :raw, :binary], fn io ->
+      case IO.binread(io, 512) do
+        data when is_binary(data) -> data
+        _eof -> ""
+      end
+    end)
+  end
+
+  @doc """
+  Report the freshness of the definitions serving scans and the cost of the
+  last reload.
+  """
+  @spec status(GenServer.server()) :: status()
+  def status(server \\ __MODULE__) do
+    GenServer.call(server, :status)
+  end
+
+  @doc """
+  The scans queued and running on a local `server`, without calling it.
+
+  The server publishes the count whenever it changes; requests still in its
+  mailbox, such as those arriving during a synchronous engine reload, are
+  added on top. Returns `:error` if the server is not running.
+  """
+  @spec load(GenServer.server()) :: {:ok, non_neg_integer()} | :error
+  def load(server \\ __MODULE__) do
+    with pid when is_pid(pid) and node(pid) == node() <- GenServer.whereis(server),
+         {:message_queue_len, mailbox} <- Process.info(pid, :message_queue_len),
+         load when load != nil <- :persistent_term.get({__MODULE__, pid, :load}, nil) do
+      {:ok, :atomics.get(load, 1) + mailbox}
+    else
+      _ -> :error
+    end
+  end
+
+  @doc """
+  Emit `[:ex_clamav, :definitions, :age]` for the definitions currently loaded.
+
+  Intended as a `:telemetry_poller` measurement:
+  `{ExClamav.ClamavGenServer, :emit_metrics, []}`.
+  """
+  @spec emit_metrics(GenServer.server()) :: :ok
+  def emit_metrics(server \\ __MODULE__) do
+    case status(server) do
+      %{definitions_age_s: age, database_version: version} when is_integer(age) ->
+        :telemetry.execute([:ex_clamav, :definitions, :age], %{age: age}, %{
+          database_version: version
+        })
+
+      _ ->
+        :ok
+    end
   end
 
   # ---------------------------------------------------------------------------
@@ -120,15 +416,30 @@ defmodule ExClamav.ClamavGenServer do
     database_path = Keyword.get(opts, :database_path)
     auto_reload = Keyword.get(opts, :auto_reload, false)
     updater = Keyword.get(opts, :updater, ExClamav.DefinitionUpdater)
+    allowlist = Keyword.get(opts, :allowlist)
+    shared_cache = Keyword.get(opts, :shared_cache)
+    max_concurrency = Keyword.get(opts, :max_concurrency, System.schedulers_online())
 
     # Initialize the default allocator (CL_INIT_DEFAULT)
     ExClamav.Engine.init(1)
 
+    {:ok, task_sup} = Task.Supervisor.start_link()
+
+    load = :atomics.new(1, signed: false)
+    :persistent_term.put({__MODULE__, self(), :load}, load)
+
     state = %__MODULE__{
       engine: nil,
       database_path: database_path,
       auto_reload: auto_reload,
-      updater: updater
+      updater: updater,
+      allowlist: allowlist,
+      shared_cache: shared_cache,
+      max_concurrency: max_concurrency,
+      scheduler: Scheduler.new(Keyword.take(opts, [:aging, :tenants])),
+      task_sup: task_sup,
+      load: load,
+      tracing: Keyword.get(opts, :tracing, Tracing.available?())
     }
 
     {:ok, state, {:continue, :init}}
@@ -145,9 +456,15 @@ defmodule ExClamav.ClamavGenServer do
       )
     end
 
-    case ExClamav.new_engine_with_database(state.database_path) do
+    # A versioned `current` link is resolved once, so the whole load reads a
+    # single immutable snapshot even if an update flips the link meanwhile.
+    database_path = state.database_path && Snapshots.resolve(state.database_path)
+    generation = cache_generation(state, database_path)
+
+    case ExClamav.new_engine_with_database(database_path) do
       {:ok, engine} ->
-        {:noreply, %{state | engine: engine}}
+        {:noreply,
+         %{state | engine: engine, cache_generation: generation, loaded_at: DateTime.utc_now()}}
 
       {:error, reason} ->
         {:stop, {:failed_to_initialize_engine, reason}}
@@ -155,33 +472,98 @@ defmodule ExClamav.ClamavGenServer do
   end
 
   @impl true
-  def handle_call({:scan_file, file_path}, _from, %__MODULE__{} = state) do
-    reply = Engine.scan_file(state.engine, file_path, @standard_scan_option)
-    {:reply, reply, state}
+  def handle_call({:scan_file, file_path, info}, from, %__MODULE__{} = state) do
+    {:noreply, enqueue(state, {:scan_file, file_path}, info, from)}
+  end
+
+  @impl true
+  def handle_call({:scan_buffer, buffer, info}, from, %__MODULE__{} = state) do
+    {:noreply, enqueue(state, {:scan_buffer, buffer}, info, from)}
+  end
+
+  @impl true
+  def handle_call({:scan_batch, items, info}, from, %__MODULE__{} = state) do
+    {:noreply, enqueue(state, {:scan_batch, items}, info, from)}
   end
 
   @impl true
-  def handle_call({:scan_buffer, buffer}, _from, %__MODULE__{} = state) do
-    reply = Engine.scan_buffer(state.engine, buffer, @standard_scan_option)
-    {:reply, reply, state}
+  def handle_call(:status, _from, %__MODULE__{} = state) do
+    {built_at, age} = definitions_time(state.engine)
+
+    status = %{
+      database_path: state.database_path,
+      database_version: database_version(state.engine),
+      cache_generation: state.cache_generation,
+      definitions_built_at: built_at,
+      definitions_age_s: age,
+      loaded_at: state.loaded_at,
+      last_reload_duration_ms: state.last_reload && state.last_reload.duration_ms,
+      last_reload_latency_ms: state.last_reload && state.last_reload.latency_ms,
+      scheduler: Map.put(Scheduler.stats(state.scheduler), :running, map_size(state.running))
+    }
+
+    {:reply, status, state}
   end
 
   @impl true
   def handle_info({:clamav_definition_updated, metadata}, %__MODULE__{} = state) do
     Logger.info("ClamavGenServer: definitions updated, reloading engine")
     db_path = metadata[:database_path] || state.database_path
+    started = System.monotonic_time()
+    generation = cache_generation(state, db_path)
 
-    case ExClamav.restart_engine(state.engine, db_path) do
+    # The old engine keeps serving until the new one is ready, and is freed
+    # once the scans still running on it have finished.
+    case ExClamav.new_engine_with_database(db_path) do
       {:ok, new_engine} ->
-        Logger.info("ClamavGenServer: engine reloaded successfully")
-        {:noreply, %{state | engine: new_engine, database_path: db_path}}
+        now = DateTime.utc_now()
+        last_reload = emit_reload(metadata, db_path, started, :ok)
+
+        Logger.info(
+          "ClamavGenServer: engine reloaded in #{last_reload.duration_ms} ms, " <>
+            "#{last_reload.latency_ms} ms after the update"
+        )
+
+        state = %{
+          state
+          | engine: new_engine,
+            cache_generation: generation,
+            database_path: db_path,
+            loaded_at: now,
+            last_reload: last_reload,
+            retired: [state.engine | state.retired]
+        }
+
+        {:noreply, free_retired(state)}
 
       {:error, reason} ->
         Logger.error("ClamavGenServer: failed to reload engine — #{reason}")
+        emit_reload(metadata, db_path, started, :error)
         {:noreply, state}
     end
   end
 
+  def handle_info({task_ref, {verdict, timings}}, %__MODULE__{running: running} = state)
+      when is_map_key(running, task_ref) do
+    Process.demonitor(task_ref, [:flush])
+    {:noreply, complete(state, task_ref, verdict, timings)}
+  end
+
+  def handle_info(
+        {:DOWN, task_ref, :process, _pid, reason},
+        %__MODULE__{running: running} = state
+      )
+      when is_map_key(running, task_ref) do
+    started = running[task_ref].started_at
+    verdict = error_reply(running[task_ref], "Scan crashed: #{inspect(reason)}")
+    timings = %{started: started, duration: System.monotonic_time() - started}
+    {:noreply, complete(state, task_ref, verdict, timings)}
+  end
+
+  def handle_info(:dispatch, %__MODULE__{} = state) do
+    {:noreply, dispatch(%{state | dispatch_timer: nil})}
+  end
+
   def handle_info({:clamav_definition_update_failed, metadata}, state) do
     Logger.warning("ClamavGenServer: definition update failed — #{inspect(metadata[:reason])}")
     {:noreply, state}
@@ -191,11 +573,229 @@ defmodule ExClamav.ClamavGenServer do
     {:noreply, state}
   end
 
+  # Latency runs from the update event (`updated_at`) to now, so it includes
+  # notification delivery and any queueing ahead of the reload.
+  defp emit_reload(metadata, db_path, started, result) do
+    duration = System.monotonic_time() - started
+
+    latency =
+      case metadata[:updated_at] do
+        %DateTime{} = updated_at ->
+          System.convert_time_unit(
+            max(DateTime.diff(DateTime.utc_now(), updated_at, :microsecond), 0),
+            :microsecond,
+            :native
+          )
+
+        _ ->
+          duration
+      end
+
+    :telemetry.execute(
+      [:ex_clamav, :engine, :reload],
+      %{duration: duration, latency: latency},
+      %{database_path: db_path, version: metadata[:version], result: result}
+    )
+
+    %{
+      duration_ms: System.convert_time_unit(duration, :native, :millisecond),
+      latency_ms: System.convert_time_unit(latency, :native, :millisecond)
+    }
+  end
+
+  # ---------------------------------------------------------------------------
+  # Scheduling
+  # ---------------------------------------------------------------------------
+
+  defp enqueue(state, request, info, from) do
+    job = Map.merge(info, %{request: request, from: from})
+    dispatch(%{state | scheduler: Scheduler.push(state.scheduler, job, System.monotonic_time())})
+  end
+
+  defp dispatch(%__MODULE__{} = state) do
+    with true <- map_size(state.running) < state.max_concurrency,
+         {:ok, job, scheduler} <- Scheduler.pop(state.scheduler, System.monotonic_time()) do
+      scan = Map.take(state, [:engine, :allowlist, :shared_cache, :cache_generation])
+      job = Map.merge(job, %{engine: state.engine, started_at: System.monotonic_time()})
+
+      task =
+        Task.Supervisor.async_nolink(state.task_sup, fn ->
+          started = System.monotonic_time()
+          verdict = run_scan(scan, job.request)
+          {verdict, %{started: started, duration: System.monotonic_time() - started}}
+        end)
+
+      dispatch(%{state | scheduler: scheduler, running: Map.put(state.running, task.ref, job)})
+    else
+      {:expired, job, scheduler} ->
+        dispatch(expire(%{state | scheduler: scheduler}, job))
+
+      {:wait, ms, scheduler} ->
+        %{state | scheduler: scheduler} |> schedule_dispatch(ms) |> publish_load()
+
+      _ ->
+        publish_load(state)
+    end
+  end
+
+  defp publish_load(state) do
+    :atomics.put(state.load, 1, Scheduler.size(state.scheduler) + map_size(state.running))
+    state
+  end
+
+  # Capacity goes to requests that can still meet their deadline; the
+  # caller of one that cannot gets an error instead of a late verdict.
+  defp expire(state, job) do
+    now = System.monotonic_time()
+    GenServer.reply(job.from, error_reply(job, "deadline exceeded"))
+
+    if state.tracing, do: Tracing.record_expired(job, now)
+
+    :telemetry.execute(
+      [:ex_clamav, :scheduler, :expired],
+      %{wait: now - job.enqueued_at, lateness: now - job.deadline},
+      %{type: job.type, size: job.size, tenant: job.tenant, priority: job.priority}
+    )
+
+    state
+  end
+
+  # Every backlogged tenant is over its byte-rate quota; retry once the
+  # first bucket has refilled. New requests dispatch as usual meanwhile.
+  defp schedule_dispatch(%__MODULE__{dispatch_timer: nil} = state, ms),
+    do: %{state | dispatch_timer: Process.send_after(self(), :dispatch, ms)}
+
+  defp schedule_dispatch(state, _ms), do: state
+
+  defp complete(state, task_ref, verdict, %{duration: duration} = timings) do
+    {job, running} = Map.pop(state.running, task_ref)
+    GenServer.reply(job.from, verdict)
+
+    if state.tracing, do: Tracing.record_scan(job, timings, verdict)
+
+    {scheduler, error} = Scheduler.observe(state.scheduler, job, duration)
+
+    :telemetry.execute(
+      [:ex_clamav, :scheduler, :scan],
+      %{
+        wait: job.started_at - job.enqueued_at,
+        duration: duration,
+        predicted: job.predicted,
+        prediction_error: error
+      },
+      %{type: job.type, size: job.size, tenant: job.tenant, priority: job.priority}
+    )
+
+    %{state | running: running, scheduler: scheduler}
+    |> free_retired()
+    |> dispatch()
+  end
+
+  # Engines replaced by a reload are freed once no running scan uses them.
+  defp free_retired(%__MODULE__{retired: retired, running: running} = state) do
+    in_use = running |> Map.values() |> MapSet.new(& &1.engine)
+    {busy, idle} = Enum.split_with(retired, &MapSet.member?(in_use, &1))
+    Enum.each(idle, &Engine.free/1)
+    %{state | retired: busy}
+  end
+
+  defp error_reply(%{request: {:scan_batch, items}}, reason),
+    do: List.duplicate({:error, reason}, length(items))
+
+  defp error_reply(_job, reason), do: {:error, reason}
+
+  # The allowlist and shared cache work per item, so batches only take the
+  # native batch path when neither is configured.
+  defp run_scan(%{allowlist: nil, shared_cache: nil} = scan, {:scan_batch, items}) do
+    case Engine.scan_batch(scan.engine, items, @standard_scan_option) do
+      {:error, _reason} = error -> List.duplicate(error, length(items))
+      verdicts -> verdicts
+    end
+  end
+
+  defp run_scan(scan, {:scan_batch, items}) do
+    Enum.map(items, fn
+      {:file, file_path} -> run_scan(scan, {:scan_file, file_path})
+      {:buffer, buffer} -> run_scan(scan, {:scan_buffer, buffer})
+    end)
+  end
+
+  defp run_scan(scan, {:scan_file, file_path}) do
+    by_digest(
+      scan,
+      fn -> VerdictCache.file_digest(file_path) end,
+      fn -> Engine.scan_file(scan.engine, file_path, @standard_scan_option) end
+    )
+  end
+
+  defp run_scan(scan, {:scan_buffer, buffer}) do
+    by_digest(
+      scan,
+      fn -> {:ok, VerdictCache.digest(buffer)} end,
+      fn -> Engine.scan_buffer(scan.engine, buffer, @standard_scan_option) end
+    )
+  end
+
+  # The content is only hashed when an allowlist or shared cache needs it;
+  # unreadable content goes straight to the engine, which reports the error.
+  defp by_digest(%{allowlist: nil, shared_cache: nil}, _digest_fun, scan_fun), do: scan_fun.()
+
+  defp by_digest(scan, digest_fun, scan_fun) do
+    case digest_fun.() do
+      {:ok, digest} ->
+        cond do
+          scan.allowlist && Allowlist.member?(scan.allowlist, digest) ->
+            {:ok, :clean}
+
+          scan.shared_cache ->
+            SharedVerdictCache.fetch(scan.shared_cache, digest, scan.cache_generation, scan_fun)
+
+          true ->
+            scan_fun.()
+        end
+
+      {:error, _reason} ->
+        scan_fun.()
+    end
+  end
+
+  # Shared verdicts are keyed on the files the engine was loaded from; the
+  # daily version libclamav reports misses main, bytecode and local changes.
+  defp cache_generation(%__MODULE__{shared_cache: nil}, _database_path), do: nil
+
+  defp cache_generation(_state, database_path) do
+    SharedVerdictCache.generation(database_path || ExClamav.default_database_path())
+  end
+
+  defp database_version(nil), do: nil
+
+  defp database_version(engine) do
+    case Engine.get_database_version(engine) do
+      version when is_integer(version) -> version
+      _ -> nil
+    end
+  end
+
+  defp definitions_time(nil), do: {nil, nil}
+
+  defp definitions_time(engine) do
+    case Engine.get_database_time(engine) do
+      {:ok, built_at} -> {built_at, max(DateTime.diff(DateTime.utc_now(), built_at), 0)}
+      _ -> {nil, nil}
+    end
+  end
+
+  # Engines still used by running scans are left to the resource destructor,
+  # which runs once the last scan holding them returns.
   @impl true
-  def terminate(_reason, %__MODULE__{engine: nil}), do: :ok
+  def terminate(_reason, %__MODULE__{engine: nil}) do
+    :persistent_term.erase({__MODULE__, self(), :load})
+    :ok
+  end
 
-  def terminate(_reason, %__MODULE__{engine: engine}) do
-    Engine.free(engine)
+  def terminate(_reason, %__MODULE__{engine: engine} = state) do
+    :persistent_term.erase({__MODULE__, self(), :load})
+    free_retired(%{state | retired: [engine | state.retired]})
     :ok
   end
 end
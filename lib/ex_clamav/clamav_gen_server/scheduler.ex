@@ -0,0 +1,304 @@
+defmodule ExClamav.ClamavGenServer.Scheduler do
+  @moduledoc false
+
+  # Per-tenant shortest-expected-job-first queues with aging, shared by
+  # weighted fair queuing and driven by an online cost model, under strict
+  # priority classes and earliest-deadline-first ordering.
+  #
+  # Scan cost depends far more on content type than on size, so the model
+  # keeps, per `ExClamav.FileType`, an exponentially weighted moving average
+  # of the throughput (bytes per second) measured on completed scans. A job's
+  # predicted cost is its size over that throughput; sizes below @min_bytes
+  # count as @min_bytes, which stands in for the fixed per-scan overhead.
+  # Batches of mixed items are learned as their own `:batch` type.
+  #
+  # Within a tenant, jobs are ordered by `predicted + aging * enqueued_at`.
+  # At any instant this ranks jobs exactly like `predicted - aging * waited`,
+  # so a job's priority improves steadily while it waits and expensive jobs
+  # cannot starve, yet the key never changes after insertion and a plain
+  # ordered set suffices.
+  #
+  # Across tenants, start-time fair queuing picks the backlogged tenant with
+  # the smallest start tag `max(vtime, finish)`, then advances its finish tag
+  # by the job's predicted cost over the tenant's weight. Predicted scan time
+  # is the service being shared, so a tenant uploading archives gets its
+  # weight's share of engine time, not of requests. A tenant with a byte-rate
+  # quota is additionally skipped while its token bucket is empty; a job may
+  # overdraw the bucket, which then has to refill before the next one.
+  #
+  # Priority class comes before both, and a higher class always runs first.
+  # Within a tenant, queues are ordered by `{class, deadline, cost key}`, so
+  # a tenant's deadlines go first among its own jobs. Across tenants a
+  # deadline only overrides fair queuing once it is close: a head job whose
+  # slack (deadline minus now minus its predicted cost) is below the cost of
+  # the job fair queuing would pick runs first, earliest deadline first.
+  # Otherwise tenants are picked by start tag, with deadlines only breaking
+  # ties. A job whose deadline has passed when it reaches the front is
+  # returned as expired instead of run.
+
+  alias ExClamav.FileType
+
+  @type tenant :: term()
+  @type priority :: :high | :normal | :low
+
+  @type job :: %{
+          required(:type) => FileType.t() | :batch,
+          required(:size) => non_neg_integer(),
+          optional(:tenant) => tenant(),
+          optional(:priority) => priority(),
+          optional(:deadline) => integer() | nil,
+          optional(atom()) => term()
+        }
+
+  @type tenant_config :: [weight: pos_integer(), rate: pos_integer(), burst: pos_integer()]
+
+  @type t :: %__MODULE__{
+          tenants: %{tenant() => map()},
+          config: %{tenant() => tenant_config()},
+          vtime: number(),
+          seq: non_neg_integer(),
+          aging: number(),
+          alpha: float(),
+          throughput: %{(FileType.t() | :batch) => float()},
+          errors: %{(FileType.t() | :batch) => float()}
+        }
+
+  defstruct tenants: %{},
+            config: %{},
+            vtime: 0,
+            seq: 0,
+            aging: 1.0,
+            alpha: 0.2,
+            throughput: %{},
+            errors: %{}
+
+  # Assumed for types without measurements yet; deliberately optimistic so
+  # unseen types get measured early.
+  @initial_throughput 50.0 * 1024 * 1024
+  @min_bytes 64 * 1024
+
+  @ranks %{high: 0, normal: 1, low: 2}
+
+  @doc false
+  def new(opts \\ []) do
+    %__MODULE__{
+      aging: Keyword.get(opts, :aging, 1.0),
+      alpha: Keyword.get(opts, :alpha, 0.2),
+      config: Map.new(Keyword.get(opts, :tenants, []))
+    }
+  end
+
+  @doc false
+  # Predicted scan duration in native time units.
+  def predict(%__MODULE__{throughput: throughput}, type, size) do
+    bytes_per_second = Map.get(throughput, type, @initial_throughput)
+    seconds = max(size, @min_bytes) / bytes_per_second
+    round(seconds * System.convert_time_unit(1, :second, :native))
+  end
+
+  @doc false
+  def push(%__MODULE__{} = scheduler, %{type: type, size: size} = job, now) do
+    predicted = predict(scheduler, type, size)
+    key = Map.get(job, :tenant, :default)
+    priority = Map.get(job, :priority, :normal)
+    deadline = Map.get(job, :deadline)
+
+    job =
+      Map.merge(job, %{
+        tenant: key,
+        priority: priority,
+        deadline: deadline,
+        predicted: predicted,
+        enqueued_at: now
+      })
+
+    rank = Map.fetch!(@ranks, priority)
+    order = {rank, deadline || :infinity, predicted + scheduler.aging * now, scheduler.seq}
+
+    tenant = Map.get_lazy(scheduler.tenants, key, fn -> new_tenant(scheduler, key, now) end)
+    tenant = %{tenant | queue: :gb_sets.add_element({order, job}, tenant.queue)}
+
+    %{
+      scheduler
+      | tenants: Map.put(scheduler.tenants, key, tenant),
+        seq: scheduler.seq + 1
+    }
+  end
+
+  defp new_tenant(scheduler, key, now) do
+    config = Map.get(scheduler.config, key, [])
+    burst = config[:burst] || config[:rate]
+
+    %{
+      queue: :gb_sets.empty(),
+      weight: Keyword.get(config, :weight, 1),
+      rate: config[:rate],
+      burst: burst,
+      tokens: burst,
+      refilled_at: now,
+      finish: 0,
+      blocked: false,
+      throttled: 0,
+      expired: 0
+    }
+  end
+
+  @doc false
+  # Returns the next job, `{:expired, job, scheduler}` for a job whose
+  # deadline passed while it waited, or `{:wait, ms, scheduler}` when every
+  # backlogged tenant is over its quota and the earliest bucket refills in
+  # `ms` milliseconds.
+  def pop(%__MODULE__{} = scheduler, now) do
+    scheduler = prune(scheduler)
+
+    backlogged =
+      for {key, tenant} <- scheduler.tenants, not :gb_sets.is_empty(tenant.queue) do
+        {key, refill(tenant, now)}
+      end
+
+    {eligible, over_quota} = Enum.split_with(backlogged, fn {_key, t} -> within_quota?(t) end)
+
+    tenants =
+      Enum.reduce(backlogged, scheduler.tenants, fn
+        {key, %{blocked: false} = t}, acc ->
+          if within_quota?(t),
+            do: Map.put(acc, key, t),
+            else: Map.put(acc, key, %{t | blocked: true, throttled: t.throttled + 1})
+
+        {key, t}, acc ->
+          Map.put(acc, key, t)
+      end)
+
+    scheduler = %{scheduler | tenants: tenants}
+
+    case {eligible, over_quota} do
+      {[], []} ->
+        :empty
+
+      {[], _} ->
+        ms = over_quota |> Enum.map(fn {_key, t} -> refill_ms(t) end) |> Enum.min()
+        {:wait, ms, scheduler}
+
+      _ ->
+        take(scheduler, pick_tenant(scheduler, eligible, now), now)
+    end
+  end
+
+  defp pick_tenant(scheduler, eligible, now) do
+    heads =
+      for {key, t} <- eligible do
+        {{rank, deadline, _cost, _seq}, job} = :gb_sets.smallest(t.queue)
+        {key, rank, deadline, max(scheduler.vtime, t.finish), job}
+      end
+
+    class = heads |> Enum.map(&elem(&1, 1)) |> Enum.min()
+    heads = Enum.filter(heads, &(elem(&1, 1) == class))
+
+    {fair_key, _rank, _deadline, _start, fair_job} =
+      Enum.min_by(heads, fn {_key, _rank, deadline, start, _job} -> {start, deadline} end)
+
+    urgent =
+      for {key, _rank, _deadline, _start, %{deadline: deadline} = job} <- heads,
+          deadline != nil and deadline - now - job.predicted < fair_job.predicted,
+          do: {deadline, key}
+
+    case urgent do
+      [] -> fair_key
+      _ -> urgent |> Enum.min_by(&elem(&1, 0)) |> elem(1)
+    end
+  end
+
+  defp take(scheduler, key, now) do
+    tenant = Map.fetch!(scheduler.tenants, key)
+    {{_order, job}, queue} = :gb_sets.take_smallest(tenant.queue)
+
+    if job.deadline && job.deadline <= now do
+      tenant = %{tenant | queue: queue, expired: tenant.expired + 1}
+      {:expired, job, %{scheduler | tenants: Map.put(scheduler.tenants, key, tenant)}}
+    else
+      start(scheduler, key, %{tenant | queue: queue}, job)
+    end
+  end
+
+  defp start(scheduler, key, tenant, job) do
+    start = max(scheduler.vtime, tenant.finish)
+
+    tenant = %{
+      tenant
+      | finish: start + job.predicted / tenant.weight,
+        tokens: tenant.tokens && tenant.tokens - job.size,
+        blocked: false
+    }
+
+    {:ok, job, %{scheduler | tenants: Map.put(scheduler.tenants, key, tenant), vtime: start}}
+  end
+
+  # Unconfigured tenants are forgotten once idle and caught up with virtual
+  # time, so per-request tenant keys do not accumulate; their state would be
+  # reset by `max(vtime, finish)` on return anyway.
+  defp prune(%__MODULE__{tenants: tenants, config: config, vtime: vtime} = scheduler) do
+    tenants =
+      Map.filter(tenants, fn {key, t} ->
+        Map.has_key?(config, key) or t.finish > vtime or not :gb_sets.is_empty(t.queue)
+      end)
+
+    %{scheduler | tenants: tenants}
+  end
+
+  defp within_quota?(%{rate: nil}), do: true
+  defp within_quota?(%{tokens: tokens}), do: tokens > 0
+
+  defp refill(%{rate: nil} = tenant, _now), do: tenant
+
+  defp refill(tenant, now) do
+    elapsed = System.convert_time_unit(now - tenant.refilled_at, :native, :microsecond)
+    tokens = min(tenant.burst, tenant.tokens + tenant.rate * elapsed / 1_000_000)
+    %{tenant | tokens: tokens, refilled_at: now}
+  end
+
+  defp refill_ms(tenant), do: max(ceil(-tenant.tokens / tenant.rate * 1000), 1)
+
+  @doc false
+  def size(%__MODULE__{tenants: tenants}) do
+    Enum.reduce(tenants, 0, fn {_key, t}, acc -> acc + :gb_sets.size(t.queue) end)
+  end
+
+  @doc false
+  # Feed a measured duration (native units) back into the model. Returns the
+  # relative prediction error of the job alongside the updated scheduler.
+  def observe(%__MODULE__{alpha: alpha} = scheduler, job, duration) do
+    %{type: type, size: size, predicted: predicted} = job
+    seconds = max(duration, 1) / System.convert_time_unit(1, :second, :native)
+    sample = max(size, @min_bytes) / seconds
+    error = abs(duration - predicted) / max(predicted, 1)
+
+    scheduler = %{
+      scheduler
+      | throughput: Map.update(scheduler.throughput, type, sample, &ewma(&1, sample, alpha)),
+        errors: Map.update(scheduler.errors, type, error, &ewma(&1, error, alpha))
+    }
+
+    {scheduler, error}
+  end
+
+  defp ewma(current, sample, alpha), do: current + alpha * (sample - current)
+
+  @doc false
+  def stats(%__MODULE__{} = scheduler) do
+    %{
+      queued: size(scheduler),
+      throughput: Map.new(scheduler.throughput, fn {type, bps} -> {type, round(bps)} end),
+      prediction_error: scheduler.errors,
+      tenants:
+        Map.new(scheduler.tenants, fn {key, t} ->
+          {key,
+           %{
+             queued: :gb_sets.size(t.queue),
+             weight: t.weight,
+             throttled: t.throttled,
+             expired: t.expired
+           }}
+        end)
+    }
+  end
+end
@@ -0,0 +1,415 @@
+defmodule ExClamav.Cluster do
+  @moduledoc """
+  Load-aware scan routing across the nodes of a BEAM cluster.
+
+  Every node runs one `ExClamav.Cluster` router next to its local
+  `ExClamav.ClamavGenServer`. Routers join a `:pg` group and periodically
+  advertise their load — the scans queued and running on the scan server plus
+  the number of routed scans in flight — to their peers. Callers read the advertised loads
+  from a local ETS table and send each request to the less loaded of two
+  randomly sampled members ("power of two choices"), which balances the fleet
+  without herding every caller onto the same momentarily idle node.
+
+  ## Features
+
+  * Membership tracked with `:pg`, so nodes joining or leaving the cluster are
+    picked up automatically.
+  * Routing decisions are made in the calling process from an ETS snapshot;
+    the router itself never sits on the request path.
+  * `scan_file/2` sends the path to peers when `:shared_storage` is enabled and
+    the file contents otherwise. Local scans always pass the path.
+  * If a peer disappears mid-request, the scan is retried on the local node.
+  * Optional hash-affinity routing (`routing: :hash`) so duplicate content
+    reaches the node whose `ExClamav.VerdictCache` already holds its verdict.
+
+  ## Hash-affinity routing
+
+  With `routing: :hash`, the SHA-256 of the content picks the member by
+  rendezvous (highest random weight) hashing, so every node agrees on the
+  owner of a digest and membership changes only move the keys of the member
+  that joined or left. To keep one popular digest from overloading its owner,
+  routing follows the "consistent hashing with bounded loads" rule: members are
+  tried in rendezvous order and the first whose load is within
+  `(1 + balance_factor)` times the cluster average is chosen.
+
+  The digest travels with the request, so a member started with `:cache`
+  checks its verdict cache without hashing the content a second time.
+
+  ## Usage
+
+      children = [
+        {ExClamav.ClamavGenServer, auto_reload: true},
+        {ExClamav.Cluster, server: ExClamav.ClamavGenServer, shared_storage: true}
+      ]
+
+      ExClamav.Cluster.scan_file(ExClamav.Cluster, "/shared/uploads/file.bin")
+
+  ## Options
+
+  * `:name`                  — registered name, also used to locate the load table (default: `ExClamav.Cluster`).
+  * `:server`                — the local `ClamavGenServer` (default: `ExClamav.ClamavGenServer`).
+  * `:scope`                 — `:pg` scope, started on demand (default: `:ex_clamav`).
+  * `:group`                 — `:pg` group joined by all routers (default: `:scanners`).
+  * `:advertise_interval_ms` — how often load is published to peers (default: `1_000`).
+  * `:shared_storage`        — whether file paths are valid on every node (default: `false`).
+  * `:routing`               — `:load` (power of two choices) or `:hash` (default: `:load`).
+  * `:balance_factor`        — bounded-load slack for hash routing (default: `0.25`).
+  * `:cache`                 — a local `ExClamav.VerdictCache` consulted before scanning (default: `nil`).
+  """
+
+  use GenServer
+
+  alias ExClamav.ClamavGenServer
+  alias ExClamav.VerdictCache
+
+  require Logger
+
+  @type option ::
+          {:name, atom()}
+          | {:server, GenServer.server()}
+          | {:scope, atom()}
+          | {:group, term()}
+          | {:advertise_interval_ms, pos_integer()}
+          | {:shared_storage, boolean()}
+          | {:routing, :load | :hash}
+          | {:balance_factor, float()}
+          | {:cache, atom() | nil}
+
+  @type member :: %{
+          pid: pid(),
+          node: node(),
+          queue_depth: non_neg_integer(),
+          in_flight: non_neg_integer()
+        }
+
+  @type scan_result :: {:ok, :clean} | {:virus, String.t()} | {:error, String.t()}
+
+  defstruct [
+    :name,
+    :table,
+    :server,
+    :scope,
+    :group,
+    :monitor_ref,
+    :advertise_interval_ms,
+    :task_sup,
+    :cache,
+    in_flight: 0
+  ]
+
+  @default_scope :ex_clamav
+  @default_group :scanners
+  @default_interval_ms 1_000
+  @default_balance_factor 0.25
+
+  # ── Public API ─────────────────────────────────────────────────────────────
+
+  @doc """
+  Starts the router.
+
+  See module documentation for available options.
+  """
+  @spec start_link([option()]) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    name = Keyword.get(opts, :name, __MODULE__)
+    GenServer.start_link(__MODULE__, Keyword.put(opts, :name, name), name: name)
+  end
+
+  @doc """
+  Returns a child spec for supervision trees.
+  """
+  @spec child_spec([option()]) :: Supervisor.child_spec()
+  def child_spec(opts) do
+    %{
+      id: Keyword.get(opts, :name, __MODULE__),
+      start: {__MODULE__, :start_link, [opts]},
+      shutdown: 5_000,
+      restart: :permanent,
+      type: :worker
+    }
+  end
+
+  @doc """
+  Scan an in-memory binary on the least loaded cluster member.
+  """
+  @spec scan_buffer(atom(), binary()) :: scan_result()
+  def scan_buffer(router \\ __MODULE__, buffer) when is_binary(buffer) do
+    route(router, {:scan_buffer, buffer})
+  end
+
+  @doc """
+  Scan a file on the least loaded cluster member.
+
+  Peers receive the path when the router was started with
+  `shared_storage: true`, and the file contents otherwise.
+  """
+  @spec scan_file(atom(), Path.t()) :: scan_result()
+  def scan_file(router \\ __MODULE__, file_path) do
+    route(router, {:scan_file, file_path})
+  end
+
+  @doc """
+  Returns the members known to the router together with their last
+  advertised load.
+  """
+  @spec members(atom()) :: [member()]
+  def members(router \\ __MODULE__) do
+    router
+    |> table()
+    |> :ets.tab2list()
+    |> Enum.flat_map(fn
+      {pid, node, queue_depth, in_flight, _updated_at} ->
+        [%{pid: pid, node: node, queue_depth: queue_depth, in_flight: in_flight}]
+
+      _config ->
+        []
+    end)
+  end
+
+  # ── Routing ───────────────────────────────────────────────────────────────
+
+  defp route(router, request) do
+    table = table(router)
+    {request, digest} = with_digest(request, table)
+
+    case pick_member(table, digest) do
+      nil ->
+        {:error, "no scan nodes available"}
+
+      {pid, member_node} ->
+        :ets.update_counter(table, pid, {4, 1}, {pid, member_node, 0, 0, 0})
+        routed = {prepare(request, member_node, table), digest}
+
+        try do
+          GenServer.call(pid, {:routed_scan, routed}, :infinity)
+        catch
+          :exit, reason when member_node != node() ->
+            Logger.warning(
+              "Cluster: #{inspect(member_node)} failed mid-scan — #{inspect(reason)}, retrying locally"
+            )
+
+            :ets.delete(table, pid)
+            GenServer.call(router, {:routed_scan, {request, digest}}, :infinity)
+        end
+    end
+  end
+
+  defp with_digest(request, table) do
+    if routing(table) == :hash do
+      case content_digest(request) do
+        {:ok, digest} -> {request, digest}
+        {:error, _reason} -> {request, nil}
+      end
+    else
+      {request, nil}
+    end
+  end
+
+  defp content_digest({:scan_buffer, buffer}), do: {:ok, VerdictCache.digest(buffer)}
+  defp content_digest({:scan_file, path}), do: VerdictCache.file_digest(path)
+
+  defp live_members(table) do
+    stale_before = System.monotonic_time(:millisecond) - 3 * advertise_interval(table)
+
+    for {pid, member_node, queue_depth, in_flight, updated_at} <- :ets.tab2list(table),
+        member_node == node() or updated_at >= stale_before,
+        do: {pid, member_node, queue_depth + in_flight}
+  end
+
+  defp pick_member(table, nil), do: pick_least_loaded(live_members(table))
+  defp pick_member(table, digest), do: pick_by_hash(live_members(table), digest, table)
+
+  # Power of two choices over the advertised load, preferring the local node
+  # on ties so we avoid shipping bytes across the distribution channel.
+  defp pick_least_loaded([]), do: nil
+  defp pick_least_loaded([{pid, member_node, _score}]), do: {pid, member_node}
+
+  defp pick_least_loaded(candidates) do
+    [a, b] = Enum.take_random(candidates, 2)
+    {pid, member_node, _score} = Enum.min_by([a, b], &load_key/1)
+    {pid, member_node}
+  end
+
+  defp load_key({_pid, member_node, score}), do: {score, if(member_node == node(), do: 0, else: 1)}
+
+  # Rendezvous hashing with a bounded-load cap: walk members in descending
+  # weight for this digest and take the first one under the cap. The cap is
+  # always at least 1, so an idle cluster follows pure affinity.
+  defp pick_by_hash([], _digest, _table), do: nil
+
+  defp pick_by_hash(candidates, digest, table) do
+    total = Enum.reduce(candidates, 0, fn {_pid, _node, score}, acc -> acc + score end)
+    cap = Float.ceil((1 + balance_factor(table)) * (total + 1) / length(candidates))
+
+    # Weights key on the node name so ownership survives router restarts.
+    ranked =
+      Enum.sort_by(
+        candidates,
+        fn {pid, member_node, _score} ->
+          {:erlang.phash2({digest, member_node}), :erlang.phash2({digest, pid})}
+        end,
+        :desc
+      )
+
+    {pid, member_node, _score} =
+      Enum.find(ranked, hd(ranked), fn {_pid, _node, score} -> score + 1 <= cap end)
+
+    {pid, member_node}
+  end
+
+  defp prepare({:scan_file, path}, member_node, table) do
+    if member_node == node() or shared_storage?(table) do
+      {:scan_file, path}
+    else
+      case File.read(path) do
+        {:ok, buffer} -> {:scan_buffer, buffer}
+        {:error, _reason} -> {:scan_file, path}
+      end
+    end
+  end
+
+  defp prepare(request, _member_node, _table), do: request
+
+  defp table(router) when is_atom(router), do: :persistent_term.get({__MODULE__, router})
+
+  defp advertise_interval(table), do: :ets.lookup_element(table, :advertise_interval_ms, 2)
+  defp routing(table), do: :ets.lookup_element(table, :routing, 2)
+  defp balance_factor(table), do: :ets.lookup_element(table, :balance_factor, 2)
+  defp shared_storage?(table), do: :ets.lookup_element(table, :shared_storage, 2)
+
+  # ── GenServer Callbacks ────────────────────────────────────────────────────
+
+  @impl true
+  def init(opts) do
+    Process.flag(:trap_exit, true)
+
+    name = Keyword.fetch!(opts, :name)
+    scope = Keyword.get(opts, :scope, @default_scope)
+    group = Keyword.get(opts, :group, @default_group)
+    interval = Keyword.get(opts, :advertise_interval_ms, @default_interval_ms)
+
+    case :pg.start(scope) do
+      {:ok, _pid} -> :ok
+      {:error, {:already_started, _pid}} -> :ok
+    end
+
+    table = :ets.new(__MODULE__, [:set, :public, read_concurrency: true, write_concurrency: true])
+    :ets.insert(table, {:advertise_interval_ms, interval})
+    :ets.insert(table, {:shared_storage, Keyword.get(opts, :shared_storage, false)})
+    :ets.insert(table, {:routing, Keyword.get(opts, :routing, :load)})
+    :ets.insert(
+      table,
+      {:balance_factor, Keyword.get(opts, :balance_factor, @default_balance_factor)}
+    )
+    :persistent_term.put({__MODULE__, name}, table)
+
+    {:ok, task_sup} = Task.Supervisor.start_link()
+
+    :ok = :pg.join(scope, group, self())
+    {monitor_ref, pids} = :pg.monitor(scope, group)
+    now = System.monotonic_time(:millisecond)
+    Enum.each(pids, &:ets.insert(table, {&1, node(&1), 0, 0, now}))
+
+    state = %__MODULE__{
+      name: name,
+      table: table,
+      server: Keyword.get(opts, :server, ClamavGenServer),
+      scope: scope,
+      group: group,
+      monitor_ref: monitor_ref,
+      advertise_interval_ms: interval,
+      task_sup: task_sup,
+      cache: Keyword.get(opts, :cache)
+    }
+
+    send(self(), :advertise)
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_call({:routed_scan, {request, digest}}, from, state) do
+    server = state.server
+    cache = state.cache
+    router = self()
+
+    Task.Supervisor.start_child(state.task_sup, fn ->
+      try do
+        GenServer.reply(from, cached_scan(cache, server, request, digest))
+      after
+        send(router, :routed_scan_done)
+      end
+    end)
+
+    {:noreply, %{state | in_flight: state.in_flight + 1}}
+  end
+
+  @impl true
+  def handle_info(:routed_scan_done, state) do
+    {:noreply, %{state | in_flight: max(state.in_flight - 1, 0)}}
+  end
+
+  def handle_info(:advertise, state) do
+    case ClamavGenServer.load(state.server) do
+      {:ok, queue_depth} ->
+        load = {self(), node(), queue_depth, state.in_flight, 0}
+        :ets.insert(state.table, put_elem(load, 4, System.monotonic_time(:millisecond)))
+
+        for pid <- :pg.get_members(state.scope, state.group), pid != self() do
+          send(pid, {:cluster_load, load})
+        end
+
+      # Without a running server this node takes no scans: it leaves the
+      # local table and peers drop it once its last advertisement is stale.
+      :error ->
+        :ets.delete(state.table, self())
+    end
+
+    Process.send_after(self(), :advertise, state.advertise_interval_ms)
+    {:noreply, state}
+  end
+
+  def handle_info({:cluster_load, {pid, member_node, queue_depth, in_flight, _}}, state) do
+    now = System.monotonic_time(:millisecond)
+    :ets.insert(state.table, {pid, member_node, queue_depth, in_flight, now})
+    {:noreply, state}
+  end
+
+  def handle_info({ref, :join, _group, pids}, %__MODULE__{monitor_ref: ref} = state) do
+    now = System.monotonic_time(:millisecond)
+    Enum.each(pids, &:ets.insert_new(state.table, {&1, node(&1), 0, 0, now}))
+    {:noreply, state}
+  end
+
+  def handle_info({ref, :leave, _group, pids}, %__MODULE__{monitor_ref: ref} = state) do
+    Enum.each(pids, &:ets.delete(state.table, &1))
+    {:noreply, state}
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, state) do
+    :persistent_term.erase({__MODULE__, state.name})
+    :ok
+  end
+
+  # ── Internal ──────────────────────────────────────────────────────────────
+
+  defp cached_scan(nil, server, request, _digest), do: run_scan(server, request)
+
+  defp cached_scan(cache, server, request, nil) do
+    case content_digest(request) do
+      {:ok, digest} -> cached_scan(cache, server, request, digest)
+      {:error, _reason} -> run_scan(server, request)
+    end
+  end
+
+  defp cached_scan(cache, server, request, digest) do
+    VerdictCache.fetch(cache, digest, fn -> run_scan(server, request) end)
+  end
+
+  defp run_scan(server, {:scan_file, path}), do: ClamavGenServer.scan_file(server, path)
+  defp run_scan(server, {:scan_buffer, buffer}), do: ClamavGenServer.scan_buffer(server, buffer)
+end
@@ -1,7 +1,8 @@
 defmodule ExClamav.DefinitionUpdater do
   @moduledoc """
   A GenServer that periodically updates ClamAV virus definitions using `freshclam`
-  and notifies subscribed listeners when definitions change.
+  (or the in-process `ExClamav.DefinitionUpdater.Mirror` updater) and notifies
+  subscribed listeners when definitions change.
 
   ## Features
 
@@ -10,8 +11,13 @@ defmodule ExClamav.DefinitionUpdater do
   * Pub/sub notification — any process can subscribe and receive messages
     when definitions are updated.
   * Manual trigger via `update_now/1` for on-demand refreshes.
+  * Optional `mode: :native` applying `.cdiff` patches from a mirror
+    in-process, without a `freshclam` binary or configuration.
+  * Optional immutable, versioned database directories with an atomically
+    flipped `current` symlink and `rollback/1`.
   * **Non-blocking** — freshclam runs in a background Task so the GenServer
     remains responsive to subscribe/status/unsubscribe calls at all times.
+  * Telemetry for update duration and per-file size changes (see below).
 
   ## Notifications
 
@@ -24,11 +30,30 @@ defmodule ExClamav.DefinitionUpdater do
 
       %{
         database_path: String.t(),
+        version: String.t() | nil,
         fingerprint: list(),
         previous_fingerprint: list(),
+        duration_ms: non_neg_integer(),
+        size_deltas: %{String.t() => integer()},
         updated_at: DateTime.t()
       }
 
+  With `:keep_versions` set, `database_path` is the immutable snapshot that
+  was just published and `version` its name; otherwise `version` is `nil`.
+
+  ## Telemetry
+
+  * `[:ex_clamav, :definition_update, :stop]` — emitted after every update
+    attempt.
+    * Measurements: `:duration` (native time units) and `:bytes_changed`
+      (sum of absolute per-file size changes).
+    * Metadata: `:database_path`, `:mode`, `:result` (`:updated`,
+      `:up_to_date` or `:error`) and `:size_deltas` (filename to size change
+      in bytes; new files count from 0, removed files go to 0).
+
+  `updated_at` in the notification metadata marks the update event; engines
+  measure their reload latency from it (see `ExClamav.ClamavGenServer`).
+
   ## Usage
 
       # Start the updater (usually under a supervisor)
@@ -57,10 +82,48 @@ defmodule ExClamav.DefinitionUpdater do
   * `:freshclam_config`    — optional path to a `freshclam.conf` file.
   * `:name`                — GenServer name registration (default: `ExClamav.DefinitionUpdater`).
   * `:run_on_start`        — whether to trigger an update immediately on start (default: `true`).
+  * `:mode`                — `:freshclam` runs the binary, `:native` uses `ExClamav.DefinitionUpdater.Mirror` (default: `:freshclam`).
+  * `:mirror`              — mirror URL or directory for `:native` mode (default: `"https://database.clamav.net"`).
+  * `:mirror_options`      — further `ExClamav.DefinitionUpdater.Mirror` options for `:native` mode (default: `[]`).
+  * `:keep_versions`       — enables versioned snapshots and sets how many to retain (default: `nil` — update in place).
+
+  ## Native mode
+
+  `mode: :native` fetches `.cdiff` patches and applies them to the local
+  `.cld` files inside the BEAM, falling back to a verified full `.cvd`
+  download when patching is not possible. A local directory works as a
+  mirror, which suits air-gapped deployments:
+
+      ExClamav.DefinitionUpdater.start_link(
+        database_path: "/var/lib/clamav",
+        mode: :native,
+        mirror: "file:///srv/clamav-mirror"
+      )
+
+  ## Versioned databases
+
+  Updating the directory engines load from means a reload can race with
+  `freshclam` and pick up a half-written set. With `keep_versions: n` the
+  `:database_path` becomes a root holding immutable snapshots:
+
+      /var/lib/clamav/versions/20261018T101500.000000Z/
+      /var/lib/clamav/current -> versions/20261018T101500.000000Z
+
+  Each update runs against a staging copy of the current snapshot. If it
+  changes anything, the new set must load into a fresh engine before it is
+  published and `current` is flipped with a single `rename(2)`. Subscribers
+  are handed the resolved snapshot path, so a reload is always one clean load
+  of a set that will never change underneath it. The newest `n` snapshots
+  are kept, and `rollback/1` flips `current` back to the previous one.
+  Loose databases found in the root on first start become the initial
+  snapshot; point engines at `<root>/current`.
   """
 
   use GenServer
 
+  alias ExClamav.DefinitionUpdater.Mirror
+  alias ExClamav.DefinitionUpdater.Snapshots
+
   require Logger
 
   # ── Types ──────────────────────────────────────────────────────────────────
@@ -73,8 +136,12 @@ defmodule ExClamav.DefinitionUpdater do
           subscriber_count: non_neg_integer(),
           last_update_at: DateTime.t() | nil,
           last_result: :updated | :up_to_date | {:error, String.t()} | nil,
+          last_duration_ms: non_neg_integer() | nil,
+          last_size_deltas: %{String.t() => integer()},
           fingerprint: fingerprint(),
-          updating: boolean()
+          updating: boolean(),
+          current_version: String.t() | nil,
+          versions: [String.t()]
         }
 
   @type option ::
@@ -84,6 +151,10 @@ defmodule ExClamav.DefinitionUpdater do
           | {:freshclam_config, Path.t()}
           | {:name, GenServer.name()}
           | {:run_on_start, boolean()}
+          | {:mode, :freshclam | :native}
+          | {:mirror, String.t()}
+          | {:mirror_options, [ExClamav.DefinitionUpdater.Mirror.option()]}
+          | {:keep_versions, pos_integer() | nil}
 
   defstruct [
     :database_path,
@@ -95,6 +166,12 @@ defmodule ExClamav.DefinitionUpdater do
     :last_result,
     :run_on_start,
     :update_task_ref,
+    :update_started_at,
+    :last_duration_ms,
+    last_size_deltas: %{},
+    mode: :freshclam,
+    mirror_options: [],
+    keep_versions: nil,
     fingerprint: [],
     subscribers: %{}
   ]
@@ -187,6 +264,18 @@ defmodule ExClamav.DefinitionUpdater do
     GenServer.call(server, :status)
   end
 
+  @doc """
+  Flip `current` back to the previous definitions snapshot.
+
+  Only available with `:keep_versions`. Subscribers receive
+  `{:clamav_definition_updated, metadata}` for the restored snapshot, so
+  engines reload it like any other update. Returns the restored version.
+  """
+  @spec rollback(GenServer.server()) :: {:ok, String.t()} | {:error, String.t()}
+  def rollback(server \\ __MODULE__) do
+    GenServer.call(server, :rollback)
+  end
+
   # ── GenServer Callbacks ────────────────────────────────────────────────────
 
   @impl true
@@ -196,6 +285,15 @@ defmodule ExClamav.DefinitionUpdater do
     freshclam_path = Keyword.get(opts, :freshclam_path, detect_freshclam())
     freshclam_config = Keyword.get(opts, :freshclam_config)
     run_on_start = Keyword.get(opts, :run_on_start, true)
+    mode = Keyword.get(opts, :mode, :freshclam)
+
+    mirror_options =
+      case Keyword.fetch(opts, :mirror) do
+        {:ok, mirror} -> Keyword.put(Keyword.get(opts, :mirror_options, []), :mirror, mirror)
+        :error -> Keyword.get(opts, :mirror_options, [])
+      end
+
+    keep_versions = Keyword.get(opts, :keep_versions)
 
     state = %__MODULE__{
       database_path: database_path,
@@ -203,15 +301,17 @@ defmodule ExClamav.DefinitionUpdater do
       freshclam_path: freshclam_path,
       freshclam_config: freshclam_config,
       run_on_start: run_on_start,
-      fingerprint: compute_fingerprint(database_path),
+      mode: mode,
+      mirror_options: mirror_options,
+      keep_versions: keep_versions,
       update_task_ref: nil
     }
 
-    if run_on_start do
-      {:ok, state, {:continue, :initial_update}}
+    with :ok <- init_snapshots(state) do
+      state = %{state | fingerprint: compute_fingerprint(serving_path(state))}
+      init_schedule(state)
     else
-      timer_ref = schedule_update(interval_ms)
-      {:ok, %{state | timer_ref: timer_ref}}
+      {:error, reason} -> {:stop, {:snapshot_init_failed, reason}}
     end
   end
 
@@ -254,13 +354,64 @@ defmodule ExClamav.DefinitionUpdater do
       subscriber_count: map_size(state.subscribers),
       last_update_at: state.last_update_at,
       last_result: state.last_result,
+      last_duration_ms: state.last_duration_ms,
+      last_size_deltas: state.last_size_deltas,
       fingerprint: state.fingerprint,
-      updating: state.update_task_ref != nil
+      updating: state.update_task_ref != nil,
+      current_version: current_version(state),
+      versions: if(state.keep_versions, do: Snapshots.list(state.database_path), else: [])
     }
 
     {:reply, status, state}
   end
 
+  def handle_call(:rollback, _from, %__MODULE__{keep_versions: nil} = state) do
+    {:reply, {:error, "versioned databases are not enabled"}, state}
+  end
+
+  def handle_call(:rollback, _from, %__MODULE__{update_task_ref: ref} = state) when ref != nil do
+    {:reply, {:error, "an update is in progress"}, state}
+  end
+
+  def handle_call(:rollback, _from, state) do
+    started_at = System.monotonic_time()
+
+    case Snapshots.rollback(state.database_path) do
+      {:ok, version, path} ->
+        Logger.warning("DefinitionUpdater: rolled definitions back to #{version}")
+        new_fingerprint = compute_fingerprint(path)
+        size_deltas = size_deltas(state.fingerprint, new_fingerprint)
+        duration = System.monotonic_time() - started_at
+        duration_ms = System.convert_time_unit(duration, :native, :millisecond)
+        now = DateTime.utc_now()
+
+        metadata = %{
+          database_path: path,
+          version: version,
+          fingerprint: new_fingerprint,
+          previous_fingerprint: state.fingerprint,
+          duration_ms: duration_ms,
+          size_deltas: size_deltas,
+          updated_at: now
+        }
+
+        broadcast(state.subscribers, {:clamav_definition_updated, metadata})
+
+        {:reply, {:ok, version},
+         %{
+           state
+           | fingerprint: new_fingerprint,
+             last_update_at: now,
+             last_result: :updated,
+             last_duration_ms: duration_ms,
+             last_size_deltas: size_deltas
+         }}
+
+      {:error, _reason} = error ->
+        {:reply, error, state}
+    end
+  end
+
   def handle_call(:update_now, _from, state) do
     if state.update_task_ref != nil do
       {:reply, :already_updating, state}
@@ -304,6 +455,7 @@ defmodule ExClamav.DefinitionUpdater do
   def handle_info({:DOWN, ref, :process, _pid, reason}, %__MODULE__{update_task_ref: ref} = state) do
     # The async freshclam Task crashed.
     Logger.error("DefinitionUpdater: freshclam task crashed — #{inspect(reason)}")
+    emit_update(state, System.monotonic_time() - state.update_started_at, :error, %{})
     now = DateTime.utc_now()
 
     metadata = %{
@@ -345,19 +497,82 @@ defmodule ExClamav.DefinitionUpdater do
   # ── Internal: Async Update ────────────────────────────────────────────────
 
   defp start_async_update(state) do
-    Logger.info("DefinitionUpdater: running freshclam update for #{state.database_path}")
+    Logger.info("DefinitionUpdater: running #{state.mode} update for #{state.database_path}")
 
     # Capture the values we need in the Task closure (don't capture the whole state).
-    freshclam_path = state.freshclam_path
-    freshclam_config = state.freshclam_config
+    update = update_fun(state)
     database_path = state.database_path
+    keep_versions = state.keep_versions
 
     task =
       Task.async(fn ->
-        run_freshclam_in_task(freshclam_path, freshclam_config, database_path)
+        if keep_versions do
+          run_versioned_update(update, database_path, keep_versions)
+        else
+          update.(database_path)
+        end
       end)
 
-    %{state | update_task_ref: task.ref}
+    %{state | update_task_ref: task.ref, update_started_at: System.monotonic_time()}
+  end
+
+  defp update_fun(%__MODULE__{mode: :native, mirror_options: mirror_options}) do
+    fn database_path ->
+      case Mirror.update(database_path, mirror_options) do
+        {:ok, _updated} -> :ok
+        {:error, _reason} = error -> error
+      end
+    end
+  end
+
+  defp update_fun(state) do
+    freshclam_path = state.freshclam_path
+    freshclam_config = state.freshclam_config
+
+    fn database_path ->
+      run_freshclam_in_task(freshclam_path, freshclam_config, database_path)
+    end
+  end
+
+  # Update a staging copy of the current snapshot and publish it only if
+  # something changed and the new set loads into a fresh engine.
+  defp run_versioned_update(update, root, keep_versions) do
+    with {:ok, staging} <- Snapshots.stage(root) do
+      before = compute_fingerprint(staging)
+
+      try do
+        with :ok <- update.(staging) do
+          if compute_fingerprint(staging) == before do
+            :ok
+          else
+            publish_snapshot(root, staging, keep_versions)
+          end
+        end
+      after
+        Snapshots.discard(staging)
+      end
+    end
+  end
+
+  defp publish_snapshot(root, staging, keep_versions) do
+    with :ok <- verify_snapshot(staging),
+         {:ok, version, _path} <- Snapshots.commit(root, staging) do
+      Logger.info("DefinitionUpdater: published definitions version #{version}")
+      Snapshots.prune(root, keep_versions)
+    end
+  end
+
+  defp verify_snapshot(path) do
+    ExClamav.Engine.init(1)
+
+    case ExClamav.new_engine_with_database(path) do
+      {:ok, engine} ->
+        ExClamav.Engine.free(engine)
+        :ok
+
+      {:error, reason} ->
+        {:error, "new definitions failed to load: #{reason}"}
+    end
   end
 
   defp run_freshclam_in_task(nil, _freshclam_config, _database_path) do
@@ -386,32 +601,56 @@ defmodule ExClamav.DefinitionUpdater do
 
   defp handle_freshclam_result(freshclam_result, state) do
     previous_fingerprint = state.fingerprint
+    duration = System.monotonic_time() - state.update_started_at
+    duration_ms = System.convert_time_unit(duration, :native, :millisecond)
 
     case freshclam_result do
       :ok ->
-        new_fingerprint = compute_fingerprint(state.database_path)
+        serving_path = serving_path(state)
+        new_fingerprint = compute_fingerprint(serving_path)
+        size_deltas = size_deltas(previous_fingerprint, new_fingerprint)
         now = DateTime.utc_now()
 
         if new_fingerprint != previous_fingerprint do
-          Logger.info("DefinitionUpdater: virus definitions updated")
+          Logger.info("DefinitionUpdater: virus definitions updated in #{duration_ms} ms")
+          emit_update(state, duration, :updated, size_deltas)
 
           metadata = %{
-            database_path: state.database_path,
+            database_path: serving_path,
+            version: current_version(state),
             fingerprint: new_fingerprint,
             previous_fingerprint: previous_fingerprint,
+            duration_ms: duration_ms,
+            size_deltas: size_deltas,
             updated_at: now
           }
 
           broadcast(state.subscribers, {:clamav_definition_updated, metadata})
 
-          %{state | fingerprint: new_fingerprint, last_update_at: now, last_result: :updated}
+          %{
+            state
+            | fingerprint: new_fingerprint,
+              last_update_at: now,
+              last_result: :updated,
+              last_duration_ms: duration_ms,
+              last_size_deltas: size_deltas
+          }
         else
           Logger.info("DefinitionUpdater: definitions are up to date")
-          %{state | last_update_at: now, last_result: :up_to_date}
+          emit_update(state, duration, :up_to_date, %{})
+
+          %{
+            state
+            | last_update_at: now,
+              last_result: :up_to_date,
+              last_duration_ms: duration_ms,
+              last_size_deltas: %{}
+          }
         end
 
       {:error, reason} ->
         Logger.error("DefinitionUpdater: freshclam update failed — #{reason}")
+        emit_update(state, duration, :error, %{})
         now = DateTime.utc_now()
 
         metadata = %{
@@ -422,12 +661,72 @@ defmodule ExClamav.DefinitionUpdater do
 
         broadcast(state.subscribers, {:clamav_definition_update_failed, metadata})
 
-        %{state | last_update_at: now, last_result: {:error, reason}}
+        %{
+          state
+          | last_update_at: now,
+            last_result: {:error, reason},
+            last_duration_ms: duration_ms
+        }
     end
   end
 
+  defp emit_update(state, duration, result, size_deltas) do
+    bytes_changed = size_deltas |> Map.values() |> Enum.map(&abs/1) |> Enum.sum()
+
+    :telemetry.execute(
+      [:ex_clamav, :definition_update, :stop],
+      %{duration: duration, bytes_changed: bytes_changed},
+      %{
+        database_path: state.database_path,
+        mode: state.mode,
+        result: result,
+        size_deltas: size_deltas
+      }
+    )
+  end
+
+  # Per-file size change between two fingerprints; unchanged files are omitted.
+  defp size_deltas(previous, current) do
+    before = Map.new(previous, fn {name, size, _mtime} -> {name, size} end)
+    now = Map.new(current, fn {name, size, _mtime} -> {name, size} end)
+
+    before
+    |> Map.keys()
+    |> Enum.concat(Map.keys(now))
+    |> Enum.uniq()
+    |> Map.new(fn name -> {name, Map.get(now, name, 0) - Map.get(before, name, 0)} end)
+    |> Map.reject(fn {_name, delta} -> delta == 0 end)
+  end
+
   # ── Internal: Helpers ─────────────────────────────────────────────────────
 
+  defp init_snapshots(%__MODULE__{keep_versions: nil}), do: :ok
+  defp init_snapshots(state), do: Snapshots.init(state.database_path)
+
+  defp init_schedule(%__MODULE__{run_on_start: run_on_start, interval_ms: interval_ms} = state) do
+    if run_on_start do
+      {:ok, state, {:continue, :initial_update}}
+    else
+      timer_ref = schedule_update(interval_ms)
+      {:ok, %{state | timer_ref: timer_ref}}
+    end
+  end
+
+  # Engines load the resolved snapshot, never the `current` link itself.
+  defp serving_path(%__MODULE__{keep_versions: nil, database_path: database_path}),
+    do: database_path
+
+  defp serving_path(state), do: Snapshots.resolve(Snapshots.current_link(state.database_path))
+
+  defp current_version(%__MODULE__{keep_versions: nil}), do: nil
+
+  defp current_version(state) do
+    case Snapshots.current(state.database_path) do
+      {:ok, version, _path} -> version
+      :none -> nil
+    end
+  end
+
   defp build_freshclam_args(freshclam_config, database_path) do
     args = ["--datadir=#{database_path}"]
 
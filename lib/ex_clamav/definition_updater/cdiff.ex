@@ -0,0 +1,151 @@
+defmodule ExClamav.DefinitionUpdater.CDiff do
+  @moduledoc false
+
+  # Interpreter for ClamAV `.cdiff` incremental patches. A cdiff is a gzipped
+  # script of line-oriented edits against the files inside a `.cld` container,
+  # followed by `:<dsig>`. Supported commands:
+  #
+  #   OPEN <file>                    start editing <file> (created if missing)
+  #   ADD <line>                     append <line> to the open file
+  #   DEL <n> <prefix>               delete original line <n>, which must start with <prefix>
+  #   XCHG <n> <prefix> <line>       replace original line <n> (checked against <prefix>)
+  #   CLOSE                          apply the edits to the open file
+  #   UNLINK <file>                  remove <file>
+  #
+  # Line numbers always refer to the file as it was when OPENed, so edits are
+  # collected and applied together on CLOSE, exactly as freshclam does.
+  #
+  # The dsig is an RSA signature over the script's MD5. libclamav has no
+  # public call to check it, so it is split off unverified here; `Mirror`
+  # only applies patches whose `.sha256` sidecar matched.
+
+  @dsig_window 350
+
+  @doc false
+  # Split a `.cdiff` into its gzipped script and trailing signature.
+  def split(cdiff) when byte_size(cdiff) > 0 do
+    window = binary_part(cdiff, byte_size(cdiff), -min(@dsig_window, byte_size(cdiff)))
+
+    case :binary.matches(window, ":") do
+      [] ->
+        {:error, "cdiff has no signature trailer"}
+
+      matches ->
+        {position, 1} = List.last(matches)
+        data_size = byte_size(cdiff) - byte_size(window) + position
+        {:ok, binary_part(cdiff, 0, data_size)}
+    end
+  end
+
+  def split(_cdiff), do: {:error, "empty cdiff"}
+
+  @doc false
+  def apply_patch(files, cdiff) do
+    with {:ok, data} <- split(cdiff),
+         {:ok, script} <- gunzip(data) do
+      script
+      |> String.split("\n")
+      |> Enum.reject(&(&1 == ""))
+      |> Enum.reduce_while({:ok, files, nil}, fn line, {:ok, files, open} ->
+        case command(line, files, open) do
+          {:ok, files, open} -> {:cont, {:ok, files, open}}
+          {:error, _reason} = error -> {:halt, error}
+        end
+      end)
+      |> case do
+        {:ok, files, nil} -> {:ok, files}
+        {:ok, _files, {name, _edits}} -> {:error, "cdiff left #{name} open"}
+        {:error, _reason} = error -> error
+      end
+    end
+  end
+
+  defp gunzip(data) do
+    {:ok, :zlib.gunzip(data)}
+  rescue
+    ErlangError -> {:error, "cdiff is not valid gzip data"}
+  end
+
+  # ── Commands ─────────────────────────────────────────────────────────────
+
+  defp command("OPEN " <> name, files, nil) do
+    {:ok, files, {name, %{adds: [], dels: %{}, xchg: %{}}}}
+  end
+
+  defp command("ADD " <> line, files, {name, edits}) do
+    {:ok, files, {name, %{edits | adds: [line | edits.adds]}}}
+  end
+
+  defp command("DEL " <> args, files, {name, edits}) do
+    with {:ok, number, prefix} <- line_ref(args) do
+      {:ok, files, {name, %{edits | dels: Map.put(edits.dels, number, prefix)}}}
+    end
+  end
+
+  defp command("XCHG " <> args, files, {name, edits}) do
+    with {:ok, number, rest} <- line_ref(args),
+         [prefix, line] <- String.split(rest, " ", parts: 2) do
+      {:ok, files, {name, %{edits | xchg: Map.put(edits.xchg, number, {prefix, line})}}}
+    else
+      _ -> {:error, "malformed XCHG: #{args}"}
+    end
+  end
+
+  defp command("CLOSE", files, {name, edits}) do
+    with {:ok, content} <- close(name, Map.get(files, name, ""), edits) do
+      {:ok, Map.put(files, name, content), nil}
+    end
+  end
+
+  defp command("UNLINK " <> name, files, nil) do
+    {:ok, Map.delete(files, name), nil}
+  end
+
+  defp command(line, _files, _open) do
+    {:error, "unsupported cdiff command: #{String.slice(line, 0, 40)}"}
+  end
+
+  defp line_ref(args) do
+    with [number, rest] <- String.split(args, " ", parts: 2),
+         {number, ""} <- Integer.parse(number) do
+      {:ok, number, rest}
+    else
+      _ -> {:error, "malformed line reference: #{args}"}
+    end
+  end
+
+  defp close(name, content, edits) do
+    lines = String.split(content, "\n")
+    lines = if List.last(lines) == "", do: Enum.drop(lines, -1), else: lines
+
+    lines
+    |> Enum.with_index(1)
+    |> Enum.reduce_while({:ok, []}, fn {line, number}, {:ok, acc} ->
+      case edit(line, Map.get(edits.dels, number), Map.get(edits.xchg, number)) do
+        {:ok, nil} -> {:cont, {:ok, acc}}
+        {:ok, line} -> {:cont, {:ok, [line | acc]}}
+        :mismatch -> {:halt, {:error, "cdiff does not match #{name} at line #{number}"}}
+      end
+    end)
+    |> case do
+      {:ok, kept} ->
+        lines = Enum.reverse(kept, Enum.reverse(edits.adds))
+        {:ok, if(lines == [], do: "", else: Enum.join(lines, "\n") <> "\n")}
+
+      {:error, _reason} = error ->
+        error
+    end
+  end
+
+  defp edit(line, nil, nil), do: {:ok, line}
+
+  defp edit(line, prefix, nil) when is_binary(prefix) do
+    if String.starts_with?(line, prefix), do: {:ok, nil}, else: :mismatch
+  end
+
+  defp edit(line, nil, {prefix, replacement}) do
+    if String.starts_with?(line, prefix), do: {:ok, replacement}, else: :mismatch
+  end
+
+  defp edit(_line, _del, _xchg), do: :mismatch
+end
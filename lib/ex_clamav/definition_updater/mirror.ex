@@ -0,0 +1,446 @@
+defmodule ExClamav.DefinitionUpdater.Mirror do
+  @moduledoc """
+  In-process definition updates from a ClamAV database mirror.
+
+  Instead of shelling out to `freshclam`, `update/2` compares the local
+  database versions with the mirror's, downloads the `.cdiff` patches in
+  between and applies them to the local `.cld` containers in-process. If a
+  patch is missing, fails verification or does not apply cleanly, the full
+  `.cvd` is downloaded and checked with `ExClamav.Engine.verify_cvd/1` before
+  it is used.
+
+  Patched containers are verified against the SHA-256 digests in their own
+  `<db>.info` manifest, and patches themselves against the `.sha256`
+  sidecar published next to them on the mirror. The signature trailing each
+  patch cannot be checked outside libclamav, so by default a patch without
+  a sidecar is not applied and the signed `.cvd` is downloaded instead.
+
+  Mirrors may be `http://`, `https://` or `file://` URLs, or plain directory
+  paths, so definitions can be served from a local directory in air-gapped
+  deployments and tests. Every file replaced in the database directory is
+  written to a temporary file, synced and renamed over the old one, so a
+  crash never leaves a half-written database behind.
+
+  ## Mirror layout
+
+      <db>.cvd                full signed database; its header gives the latest version
+      <db>-<version>.cdiff    patch from <version - 1> to <version>
+      <file>.sha256           hex SHA-256 digest of <file>; optional for .cvd files
+
+  ## Usage
+
+      {:ok, updated} =
+        ExClamav.DefinitionUpdater.Mirror.update("/var/lib/clamav",
+          mirror: "file:///srv/clamav-mirror"
+        )
+
+      updated
+      #=> ["daily"]
+
+  ## Options
+
+  * `:mirror`            — mirror URL or directory (default: `"https://database.clamav.net"`).
+  * `:databases`         — databases to keep current (default: `["main", "daily", "bytecode"]`).
+  * `:max_cdiffs`        — largest version gap bridged with patches (default: `50`).
+  * `:require_checksums` — download the full `.cvd` rather than apply a patch without a
+    `.sha256` sidecar (default: `true`).
+  * `:timeout`           — HTTP request timeout in ms (default: `60_000`).
+  """
+
+  require Logger
+
+  alias ExClamav.DefinitionUpdater.CDiff
+  alias ExClamav.Engine
+
+  @type option ::
+          {:mirror, String.t()}
+          | {:databases, [String.t()]}
+          | {:max_cdiffs, non_neg_integer()}
+          | {:require_checksums, boolean()}
+          | {:timeout, timeout()}
+
+  @type header :: %{
+          version: non_neg_integer(),
+          signatures: non_neg_integer(),
+          fields: [String.t()]
+        }
+
+  @defaults [
+    mirror: "https://database.clamav.net",
+    databases: ["main", "daily", "bytecode"],
+    max_cdiffs: 50,
+    require_checksums: true,
+    timeout: 60_000
+  ]
+
+  @header_size 512
+
+  @doc """
+  Bring the databases in `database_path` up to the mirror's versions.
+
+  Returns the names of the databases that changed.
+  """
+  @spec update(Path.t(), [option()]) :: {:ok, [String.t()]} | {:error, String.t()}
+  def update(database_path, opts \\ []) do
+    opts = Keyword.merge(@defaults, opts)
+
+    with :ok <- posix(File.mkdir_p(database_path)) do
+      opts[:databases]
+      |> Enum.reduce_while({:ok, []}, fn db, {:ok, updated} ->
+        case update_database(database_path, db, opts) do
+          :up_to_date -> {:cont, {:ok, updated}}
+          :updated -> {:cont, {:ok, [db | updated]}}
+          {:error, reason} -> {:halt, {:error, "#{db}: #{reason}"}}
+        end
+      end)
+      |> case do
+        {:ok, updated} -> {:ok, Enum.reverse(updated)}
+        {:error, _reason} = error -> error
+      end
+    end
+  end
+
+  defp update_database(dir, db, opts) do
+    with {:ok, remote} <- remote_header(db, opts) do
+      case local_database(dir, db) do
+        {:ok, %{header: %{version: version}}} when version >= remote.version ->
+          :up_to_date
+
+        {:ok, local} when remote.version - local.header.version <= opts[:max_cdiffs] ->
+          case patch(dir, db, local, remote, opts) do
+            :ok ->
+              :updated
+
+            {:error, reason} ->
+              Logger.warning(
+                "DefinitionUpdater: #{db} incremental update failed (#{reason}), " <>
+                  "downloading the full database"
+              )
+
+              download(dir, db, opts)
+          end
+
+        _ ->
+          download(dir, db, opts)
+      end
+    end
+  end
+
+  # ── Incremental updates ──────────────────────────────────────────────────
+
+  defp patch(dir, db, local, remote, opts) do
+    with {:ok, files} <- unpack(local.body) do
+      (local.header.version + 1)..remote.version
+      |> Enum.reduce_while({:ok, files}, fn version, {:ok, files} ->
+        name = "#{db}-#{version}.cdiff"
+
+        with {:ok, cdiff} <- fetch(name, opts),
+             :ok <- verify_checksum(name, cdiff, opts[:require_checksums], opts),
+             {:ok, files} <- CDiff.apply_patch(files, cdiff) do
+          {:cont, {:ok, files}}
+        else
+          {:error, :not_found} -> {:halt, {:error, "#{name} not found on mirror"}}
+          {:error, reason} -> {:halt, {:error, "#{name}: #{reason}"}}
+        end
+      end)
+      |> case do
+        {:ok, files} ->
+          with :ok <- verify_info(db, files),
+               :ok <- write_cld(dir, db, remote, files) do
+            remove(Path.join(dir, db <> ".cvd"))
+          end
+
+        {:error, _reason} = error ->
+          error
+      end
+    end
+  end
+
+  defp unpack(<<0x1F, 0x8B, _::binary>> = body), do: untar(body, [:memory, :compressed])
+  defp unpack(body), do: untar(body, [:memory])
+
+  defp untar(body, options) do
+    case :erl_tar.extract({:binary, body}, options) do
+      {:ok, entries} ->
+        {:ok, Map.new(entries, fn {name, data} -> {List.to_string(name), data} end)}
+
+      {:error, reason} ->
+        {:error, "cannot unpack container: #{inspect(reason)}"}
+    end
+  end
+
+  # <db>.info lists "name:size:sha256" for every file of the container; it
+  # is patched along with them, so it describes the expected result.
+  defp verify_info(db, files) do
+    case Map.fetch(files, db <> ".info") do
+      :error ->
+        :ok
+
+      {:ok, info} ->
+        info
+        |> String.split("\n")
+        |> Enum.find_value(:ok, fn line ->
+          with [name, size, <<_::binary-64>> = digest] <-
+                 String.split(String.trim_trailing(line, "\r"), ":"),
+               {size, ""} <- Integer.parse(size) do
+            check_entry(files, name, size, String.downcase(digest))
+          else
+            _ -> nil
+          end
+        end)
+    end
+  end
+
+  defp check_entry(files, name, size, digest) do
+    case Map.fetch(files, name) do
+      {:ok, data} when byte_size(data) == size ->
+        if sha256(data) == digest, do: nil, else: {:error, "#{name} does not match its digest"}
+
+      {:ok, _data} ->
+        {:error, "#{name} has the wrong size"}
+
+      :error ->
+        {:error, "#{name} is missing"}
+    end
+  end
+
+  # CLDs are plain tarballs behind the header. Their MD5 and signature
+  # fields are placeholders: only full CVDs are signed.
+  defp write_cld(dir, db, remote, files) do
+    tar = Path.join(dir, ".#{db}.tar.#{System.unique_integer([:positive])}")
+    entries = for {name, data} <- Enum.sort(files), do: {String.to_charlist(name), data}
+    fields = remote.fields |> List.replace_at(5, "X") |> List.replace_at(6, "X")
+    header = encode_header(%{remote | fields: fields})
+
+    try do
+      with :ok <- create_tar(tar, entries),
+           {:ok, body} <- posix(File.read(tar)) do
+        write_atomic(Path.join(dir, db <> ".cld"), [header, body])
+      end
+    after
+      File.rm(tar)
+    end
+  end
+
+  defp create_tar(path, entries) do
+    case :erl_tar.create(String.to_charlist(path), entries) do
+      :ok -> :ok
+      {:error, reason} -> {:error, "cannot write container: #{inspect(reason)}"}
+    end
+  end
+
+  # ── Full downloads ───────────────────────────────────────────────────────
+
+  defp download(dir, db, opts) do
+    name = db <> ".cvd"
+    path = Path.join(dir, name)
+    tmp = "#{path}.download-#{System.unique_integer([:positive])}"
+
+    try do
+      # The .cvd is signed, and the signature is checked by verify_cvd/1.
+      with {:ok, cvd} <- fetch(name, opts),
+           :ok <- verify_checksum(name, cvd, false, opts),
+           :ok <- write_atomic(tmp, cvd),
+           :ok <- Engine.verify_cvd(tmp),
+           :ok <- posix(File.rename(tmp, path)),
+           :ok <- remove(Path.join(dir, db <> ".cld")) do
+        :updated
+      else
+        {:error, :not_found} -> {:error, "#{name} not found on mirror"}
+        {:error, reason} -> {:error, "#{name}: #{reason}"}
+      end
+    after
+      File.rm(tmp)
+    end
+  end
+
+  defp verify_checksum(name, data, required?, opts) do
+    case fetch(name <> ".sha256", opts) do
+      {:ok, sidecar} ->
+        expected = sidecar |> String.split() |> List.first("") |> String.downcase()
+        if expected == sha256(data), do: :ok, else: {:error, "checksum mismatch"}
+
+      {:error, :not_found} ->
+        if required?, do: {:error, "no checksum published"}, else: :ok
+
+      {:error, _reason} = error ->
+        error
+    end
+  end
+
+  defp sha256(data), do: :sha256 |> :crypto.hash(data) |> Base.encode16(case: :lower)
+
+  # ── Headers ──────────────────────────────────────────────────────────────
+
+  defp local_database(dir, db) do
+    [db <> ".cld", db <> ".cvd"]
+    |> Enum.map(&Path.join(dir, &1))
+    |> Enum.find(&File.regular?/1)
+    |> case do
+      nil ->
+        :none
+
+      path ->
+        with {:ok, <<header::binary-size(@header_size), body::binary>>} <- File.read(path),
+             {:ok, header} <- parse_header(header) do
+          {:ok, %{path: path, header: header, body: body}}
+        else
+          _ -> :none
+        end
+    end
+  end
+
+  defp remote_header(db, opts) do
+    name = db <> ".cvd"
+
+    case fetch(name, opts, @header_size) do
+      {:ok, <<header::binary-size(@header_size), _::binary>>} -> parse_header(header)
+      {:ok, _short} -> {:error, "#{name} on mirror is truncated"}
+      {:error, :not_found} -> {:error, "#{name} not found on mirror"}
+      {:error, _reason} = error -> error
+    end
+  end
+
+  @doc false
+  # "ClamAV-VDB:<build time>:<version>:<signatures>:<flevel>:<md5>:<dsig>:<builder>:<stime>"
+  @spec parse_header(binary()) :: {:ok, header()} | {:error, String.t()}
+  def parse_header("ClamAV-VDB:" <> _ = header) do
+    fields = header |> String.trim_trailing(<<0>>) |> String.trim_trailing() |> String.split(":")
+
+    with [_magic, _time, version, signatures | _] when length(fields) >= 8 <- fields,
+         {version, ""} <- Integer.parse(version),
+         {signatures, ""} <- Integer.parse(signatures) do
+      {:ok, %{version: version, signatures: signatures, fields: fields}}
+    else
+      _ -> {:error, "malformed database header"}
+    end
+  end
+
+  def parse_header(_header), do: {:error, "not a ClamAV database"}
+
+  defp encode_header(%{fields: fields}) do
+    fields |> Enum.join(":") |> String.pad_trailing(@header_size)
+  end
+
+  # ── Mirror access ────────────────────────────────────────────────────────
+
+  defp fetch(name, opts, limit \\ nil) do
+    case URI.parse(opts[:mirror]) do
+      %URI{scheme: scheme} when scheme in ["http", "https"] ->
+        http_get(String.trim_trailing(opts[:mirror], "/") <> "/" <> name, limit, opts)
+
+      %URI{scheme: "file", path: dir} ->
+        read_local(Path.join(dir, name), limit)
+
+      %URI{scheme: nil} ->
+        read_local(Path.join(opts[:mirror], name), limit)
+
+      %URI{scheme: scheme} ->
+        {:error, "unsupported mirror scheme #{scheme}"}
+    end
+  end
+
+  defp read_local(path, limit) do
+    result =
+      case limit do
+        nil ->
+          File.read(path)
+
+        limit ->
+          with {:ok, fd} <- File.open(path, [:read, :binary, :raw]) do
+            try do
+              case :file.read(fd, limit) do
+                :eof -> {:ok, <<>>}
+                other -> other
+              end
+            after
+              File.close(fd)
+            end
+          end
+      end
+
+    case result do
+      {:error, :enoent} -> {:error, :not_found}
+      other -> posix(other)
+    end
+  end
+
+  defp http_get(url, limit, opts) do
+    with {:ok, _} <- Application.ensure_all_started(:inets),
+         {:ok, _} <- Application.ensure_all_started(:ssl) do
+      headers = [{~c"user-agent", ~c"ExClamav"}]
+      headers = if limit, do: [{~c"range", ~c"bytes=0-#{limit - 1}"} | headers], else: headers
+
+      http_opts = [
+        timeout: opts[:timeout],
+        ssl: [
+          verify: :verify_peer,
+          cacerts: :public_key.cacerts_get(),
+          customize_hostname_check: [
+            match_fun: :public_key.pkix_verify_hostname_match_fun(:https)
+          ]
+        ]
+      ]
+
+      case :httpc.request(:get, {String.to_charlist(url), headers}, http_opts,
+             body_format: :binary
+           ) do
+        {:ok, {{_, status, _}, _headers, body}} when status in [200, 206] ->
+          {:ok, body}
+
+        {:ok, {{_, status, _}, _headers, _body}} when status in [403, 404] ->
+          {:error, :not_found}
+
+        {:ok, {{_, status, _}, _headers, _body}} ->
+          {:error, "HTTP #{status} from #{url}"}
+
+        {:error, reason} ->
+          {:error, "request to #{url} failed: #{inspect(reason)}"}
+      end
+    else
+      {:error, reason} -> {:error, "cannot start HTTP client: #{inspect(reason)}"}
+    end
+  end
+
+  # ── Files ────────────────────────────────────────────────────────────────
+
+  @doc false
+  # Write through a synced temporary file renamed over `path`, so readers see
+  # either the old or the new contents and never a partial file.
+  @spec write_atomic(Path.t(), iodata()) :: :ok | {:error, String.t()}
+  def write_atomic(path, data) do
+    tmp = "#{path}.tmp-#{System.unique_integer([:positive])}"
+
+    result =
+      with {:ok, fd} <- File.open(tmp, [:write, :binary, :raw]) do
+        try do
+          with :ok <- :file.write(fd, data), do: :file.sync(fd)
+        after
+          File.close(fd)
+        end
+      end
+
+    with :ok <- posix(result),
+         :ok <- posix(File.rename(tmp, path)) do
+      :ok
+    else
+      error ->
+        File.rm(tmp)
+        error
+    end
+  end
+
+  defp remove(path) do
+    case File.rm(path) do
+      :ok -> :ok
+      {:error, :enoent} -> :ok
+      error -> posix(error)
+    end
+  end
+
+  defp posix({:error, reason}) when is_atom(reason) do
+    {:error, reason |> :file.format_error() |> IO.chardata_to_string()}
+  end
+
+  defp posix(result), do: result
+end
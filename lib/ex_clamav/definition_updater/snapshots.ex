@@ -0,0 +1,207 @@
+defmodule ExClamav.DefinitionUpdater.Snapshots do
+  @moduledoc false
+
+  # Immutable, versioned database directories:
+  #
+  #   <root>/versions/<version>/    one complete definition set, never modified
+  #   <root>/versions/.staging-*    work area for an update in progress
+  #   <root>/current                symlink to versions/<version>
+  #
+  # An update copies the current snapshot into a staging directory, runs
+  # freshclam (or the mirror updater) against it, and only after the new set
+  # has been verified renames it into versions/ and flips `current` with a
+  # rename(2) over the old link. Readers therefore always see a complete set,
+  # and engines given a resolved snapshot path never observe a later update.
+
+  @versions "versions"
+  @current "current"
+  @database_extensions ~w(.cvd .cld .cud)
+
+  @doc false
+  # Create the layout; loose databases already in `root` become the first snapshot.
+  def init(root) do
+    with :ok <- posix(File.mkdir_p(Path.join(root, @versions))) do
+      # Staging directories left behind by a crashed update are never published.
+      [root, @versions, ".staging-*"]
+      |> Path.join()
+      |> Path.wildcard(match_dot: true)
+      |> Enum.each(&File.rm_rf/1)
+
+      case current(root) do
+        {:ok, _version, _path} ->
+          :ok
+
+        :none ->
+          seed(root)
+      end
+    end
+  end
+
+  defp seed(root) do
+    loose =
+      root
+      |> Path.join("*")
+      |> Path.wildcard()
+      |> Enum.filter(&(Path.extname(&1) in @database_extensions and File.regular?(&1)))
+
+    if loose == [] do
+      :ok
+    else
+      with {:ok, staging} <- stage(root),
+           :ok <- copy_files(loose, staging),
+           {:ok, _version, _path} <- commit(root, staging) do
+        :ok
+      end
+    end
+  end
+
+  @doc false
+  def current_link(root), do: Path.join(root, @current)
+
+  @doc false
+  def current(root) do
+    case :file.read_link(current_link(root)) do
+      {:ok, target} ->
+        path = Path.expand(List.to_string(target), root)
+        if File.dir?(path), do: {:ok, Path.basename(path), path}, else: :none
+
+      {:error, _reason} ->
+        :none
+    end
+  end
+
+  @doc false
+  # Resolve a `current` link to the snapshot it points at; other paths are
+  # returned unchanged.
+  def resolve(path) do
+    case :file.read_link(path) do
+      {:ok, target} -> Path.expand(List.to_string(target), Path.dirname(path))
+      {:error, _reason} -> path
+    end
+  end
+
+  @doc false
+  def list(root) do
+    root
+    |> Path.join(@versions)
+    |> File.ls()
+    |> case do
+      {:ok, entries} -> entries |> Enum.reject(&String.starts_with?(&1, ".")) |> Enum.sort()
+      {:error, _reason} -> []
+    end
+  end
+
+  @doc false
+  def stage(root) do
+    staging = Path.join([root, @versions, ".staging-#{System.unique_integer([:positive])}"])
+
+    with :ok <- posix(File.mkdir_p(staging)) do
+      case current(root) do
+        {:ok, _version, path} ->
+          files = path |> Path.join("*") |> Path.wildcard() |> Enum.filter(&File.regular?/1)
+
+          case copy_files(files, staging) do
+            :ok ->
+              {:ok, staging}
+
+            error ->
+              discard(staging)
+              error
+          end
+
+        :none ->
+          {:ok, staging}
+      end
+    end
+  end
+
+  # Files are copied rather than hard-linked: freshclam rewrites some files
+  # in place, which would silently change older snapshots through the link.
+  defp copy_files(files, dir) do
+    Enum.reduce_while(files, :ok, fn file, :ok ->
+      case posix(File.cp(file, Path.join(dir, Path.basename(file)))) do
+        :ok -> {:cont, :ok}
+        error -> {:halt, error}
+      end
+    end)
+  end
+
+  @doc false
+  def discard(staging) do
+    File.rm_rf(staging)
+    :ok
+  end
+
+  @doc false
+  # Publish a verified staging directory as the newest version and make it current.
+  def commit(root, staging) do
+    version = new_version(root)
+    path = Path.join([root, @versions, version])
+
+    with :ok <- posix(File.rename(staging, path)),
+         :ok <- activate(root, version) do
+      {:ok, version, path}
+    end
+  end
+
+  defp new_version(root) do
+    version = Calendar.strftime(DateTime.utc_now(), "%Y%m%dT%H%M%S.%fZ")
+    if version in list(root), do: new_version(root), else: version
+  end
+
+  @doc false
+  def activate(root, version) do
+    link = current_link(root)
+    tmp = "#{link}.tmp-#{System.unique_integer([:positive])}"
+
+    with :ok <- posix(File.ln_s(Path.join(@versions, version), tmp)),
+         :ok <- posix(File.rename(tmp, link)) do
+      :ok
+    else
+      error ->
+        File.rm(tmp)
+        error
+    end
+  end
+
+  @doc false
+  # Point `current` at the version before the one currently serving.
+  def rollback(root) do
+    with {:ok, version, _path} <- current(root),
+         previous when previous != nil <- previous_version(root, version),
+         :ok <- activate(root, previous) do
+      {:ok, previous, Path.join([root, @versions, previous])}
+    else
+      :none -> {:error, "no current definitions version"}
+      nil -> {:error, "no earlier definitions version to roll back to"}
+      {:error, _reason} = error -> error
+    end
+  end
+
+  defp previous_version(root, version) do
+    root |> list() |> Enum.filter(&(&1 < version)) |> List.last()
+  end
+
+  @doc false
+  # Keep the newest `keep` versions plus whichever one is current.
+  def prune(root, keep) do
+    current =
+      case current(root) do
+        {:ok, version, _path} -> version
+        :none -> nil
+      end
+
+    root
+    |> list()
+    |> Enum.reverse()
+    |> Enum.drop(keep)
+    |> Enum.reject(&(&1 == current))
+    |> Enum.each(&File.rm_rf(Path.join([root, @versions, &1])))
+  end
+
+  defp posix({:error, reason}) when is_atom(reason) do
+    {:error, reason |> :file.format_error() |> IO.chardata_to_string()}
+  end
+
+  defp posix(result), do: result
+end
@@ -0,0 +1,292 @@
+defmodule ExClamav.DiskImage.Ext4 do
+  @moduledoc false
+
+  # Read-only ext2/3/4 walker. Starting at the root inode it lists every
+  # regular file with the byte extents holding its data, resolved from extent
+  # trees (ext4) or classic block maps (ext2/3). Small files stored inline in
+  # the inode are returned as their contents. Unallocated ranges are holes and
+  # read back as zeros.
+  #
+  # Images may be hostile: each directory inode is walked at most once, so
+  # hard-linked or looping directories cannot fan the walk out, and a
+  # filesystem with more than @max_entries entries is given up on (the caller
+  # then scans the partition whole).
+
+  import Bitwise
+
+  alias ExClamav.DiskImage
+
+  @superblock_offset 1024
+  @magic 0xEF53
+  @root_inode 2
+  @max_depth 64
+  @max_entries 1_000_000
+
+  @incompat_64bit 0x80
+  @extents_flag 0x80000
+  @inline_data_flag 0x10000000
+
+  @doc false
+  def probe(fd, offset) do
+    case DiskImage.pread(fd, offset + @superblock_offset + 56, 2) do
+      {:ok, <<@magic::little-16>>} -> true
+      _ -> false
+    end
+  end
+
+  @doc false
+  def walk(fd, offset) do
+    fs = fd |> DiskImage.pread!(offset + @superblock_offset, 1024) |> parse_superblock(offset)
+    walk = %{visited: MapSet.new([@root_inode]), entries: 0}
+    {files, _walk} = walk_dir(fd, fs, @root_inode, "", 0, walk)
+    {:ok, files}
+  catch
+    :throw, {:disk_image, reason} -> {:error, reason}
+  end
+
+  # ── Superblock and inodes ────────────────────────────────────────────────
+
+  defp parse_superblock(superblock, offset) do
+    <<_inodes::little-32, _blocks::little-32, _reserved::little-32, _free_blocks::little-32,
+      _free_inodes::little-32, first_data_block::little-32, log_block_size::little-32,
+      _log_cluster_size::little-32, _blocks_per_group::little-32, _clusters_per_group::little-32,
+      inodes_per_group::little-32, _::binary-12, @magic::little-16, _::binary-18,
+      rev_level::little-32, _::binary-8, inode_size::little-16, _::binary-6,
+      incompat::little-32, _::binary-154, desc_size::little-16, _::binary>> = superblock
+
+    block_size = 1024 <<< log_block_size
+
+    %{
+      offset: offset,
+      block_size: block_size,
+      inodes_per_group: inodes_per_group,
+      inode_size: if(rev_level == 0, do: 128, else: inode_size),
+      desc_size: descriptor_size(incompat, desc_size),
+      descriptors_offset: offset + (first_data_block + 1) * block_size
+    }
+  rescue
+    MatchError -> throw({:disk_image, "Invalid ext superblock"})
+  end
+
+  defp descriptor_size(incompat, desc_size) do
+    if (incompat &&& @incompat_64bit) != 0 and desc_size >= 64, do: desc_size, else: 32
+  end
+
+  defp read_inode(fd, fs, number) do
+    group = div(number - 1, fs.inodes_per_group)
+    index = rem(number - 1, fs.inodes_per_group)
+
+    descriptor = DiskImage.pread!(fd, fs.descriptors_offset + group * fs.desc_size, fs.desc_size)
+    <<_::binary-8, table_lo::little-32, _::binary>> = descriptor
+
+    table_hi =
+      case descriptor do
+        <<_::binary-40, hi::little-32, _::binary>> -> hi
+        _ -> 0
+      end
+
+    table = table_hi <<< 32 ||| table_lo
+    inode = DiskImage.pread!(fd, block_offset(fs, table) + index * fs.inode_size, 128)
+
+    <<mode::little-16, _uid::16, size_lo::little-32, _times::binary-16, _gid::16,
+      _links::16, _sectors::32, flags::little-32, _osd1::32, i_block::binary-60,
+      _generation::32, _acl::32, size_hi::little-32, _::binary>> = inode
+
+    %{mode: mode, size: size_hi <<< 32 ||| size_lo, flags: flags, i_block: i_block}
+  end
+
+  defp block_offset(fs, block), do: fs.offset + block * fs.block_size
+
+  defp directory?(%{mode: mode}), do: (mode &&& 0xF000) == 0x4000
+  defp regular?(%{mode: mode}), do: (mode &&& 0xF000) == 0x8000
+
+  # ── Data layout ──────────────────────────────────────────────────────────
+
+  defp layout(_fd, _fs, %{flags: flags, size: size, i_block: i_block})
+       when (flags &&& @inline_data_flag) != 0 do
+    # Only the first 60 bytes live in i_block; the rest would sit in an
+    # extended attribute, which this walker does not read.
+    {:inline, binary_part(i_block, 0, min(size, 60))}
+  end
+
+  defp layout(fd, fs, %{flags: flags, size: size, i_block: i_block})
+       when (flags &&& @extents_flag) != 0 do
+    {:extents, fd |> extent_runs(fs, i_block, 0) |> to_byte_extents(fs, size)}
+  end
+
+  defp layout(fd, fs, %{size: size, i_block: i_block}) do
+    {:extents, fd |> block_map_runs(fs, i_block, size) |> to_byte_extents(fs, size)}
+  end
+
+  # Runs are {logical_block, physical_block, block_count}.
+  defp to_byte_extents(runs, fs, size) do
+    runs
+    |> Enum.sort()
+    |> Enum.flat_map(fn {logical, physical, count} ->
+      start = logical * fs.block_size
+      length = min(count * fs.block_size, size - start)
+
+      if length > 0, do: [{start, block_offset(fs, physical), length}], else: []
+    end)
+  end
+
+  defp extent_runs(_fd, _fs, _node, depth) when depth > @max_depth, do: []
+
+  defp extent_runs(
+         fd,
+         fs,
+         <<0xF30A::little-16, count::little-16, _max::16, tree_depth::little-16, _gen::32,
+           rest::binary>>,
+         depth
+       ) do
+    entries = binary_part(rest, 0, min(count * 12, byte_size(rest)))
+
+    if tree_depth == 0 do
+      # Uninitialised extents (length > 32768) read as zeros, i.e. holes.
+      for <<entry::binary-12 <- entries>>,
+          <<block::little-32, length::little-16, start_hi::little-16, start_lo::little-32>> <-
+            [entry],
+          length <= 32_768,
+          do: {block, start_hi <<< 32 ||| start_lo, length}
+    else
+      for <<_block::little-32, leaf_lo::little-32, leaf_hi::little-16, _::16 <- entries>>,
+          leaf <- [read_block(fd, fs, leaf_hi <<< 32 ||| leaf_lo)],
+          run <- extent_runs(fd, fs, leaf, depth + 1),
+          do: run
+    end
+  end
+
+  defp extent_runs(_fd, _fs, _node, _depth), do: throw({:disk_image, "Invalid ext4 extent tree"})
+
+  # Classic block map: 12 direct pointers, then single, double and triple
+  # indirect blocks.
+  defp block_map_runs(fd, fs, i_block, size) do
+    <<direct::binary-48, single::little-32, double::little-32, triple::little-32>> = i_block
+    per_block = div(fs.block_size, 4)
+    blocks = div(size + fs.block_size - 1, fs.block_size)
+
+    direct_blocks = for <<block::little-32 <- direct>>, do: block
+
+    {runs, _next} =
+      [{single, 1}, {double, 2}, {triple, 3}]
+      |> Enum.reduce({indexed(direct_blocks, 0), 12}, fn {block, level}, {runs, next} ->
+        span = Integer.pow(per_block, level)
+
+        if next < blocks and block != 0 do
+          {runs ++ indirect(fd, fs, block, level, next, blocks), next + span}
+        else
+          {runs, next + span}
+        end
+      end)
+
+    runs
+    |> Enum.reject(fn {logical, physical, _} -> physical == 0 or logical >= blocks end)
+    |> merge_runs()
+  end
+
+  defp indirect(fd, fs, block, 1, first, limit) do
+    fd
+    |> read_block(fs, block)
+    |> pointers()
+    |> indexed(first)
+    |> Enum.take_while(fn {logical, _, _} -> logical < limit end)
+  end
+
+  defp indirect(fd, fs, block, level, first, limit) do
+    span = Integer.pow(div(fs.block_size, 4), level - 1)
+
+    fd
+    |> read_block(fs, block)
+    |> pointers()
+    |> Enum.with_index()
+    |> Enum.flat_map(fn {child, i} ->
+      start = first + i * span
+
+      if child != 0 and start < limit do
+        indirect(fd, fs, child, level - 1, start, limit)
+      else
+        []
+      end
+    end)
+  end
+
+  defp pointers(block), do: for(<<pointer::little-32 <- block>>, do: pointer)
+
+  defp indexed(blocks, first) do
+    blocks
+    |> Enum.with_index(first)
+    |> Enum.map(fn {physical, logical} -> {logical, physical, 1} end)
+  end
+
+  defp merge_runs(runs) do
+    runs
+    |> Enum.reduce([], fn
+      {logical, physical, 1}, [{l, p, count} | rest]
+      when logical == l + count and physical == p + count ->
+        [{l, p, count + 1} | rest]
+
+      run, acc ->
+        [run | acc]
+    end)
+    |> Enum.reverse()
+  end
+
+  defp read_block(fd, fs, block), do: DiskImage.pread!(fd, block_offset(fs, block), fs.block_size)
+
+  # ── Directories ──────────────────────────────────────────────────────────
+
+  # `walk` carries the directory inodes already visited and the number of
+  # entries seen so far across the whole filesystem.
+  defp walk_dir(fd, fs, number, prefix, depth, walk) do
+    inode = read_inode(fd, fs, number)
+
+    fd
+    |> read_contents(fs, inode)
+    |> parse_entries([])
+    |> Enum.flat_map_reduce(walk, fn {child, name}, walk ->
+      walk = count_entry(walk)
+      path = prefix <> "/" <> name
+      child_inode = read_inode(fd, fs, child)
+
+      cond do
+        directory?(child_inode) and depth < @max_depth and
+            not MapSet.member?(walk.visited, child) ->
+          walk = %{walk | visited: MapSet.put(walk.visited, child)}
+          walk_dir(fd, fs, child, path, depth + 1, walk)
+
+        regular?(child_inode) ->
+          {[%{path: path, size: child_inode.size, layout: layout(fd, fs, child_inode)}], walk}
+
+        true ->
+          {[], walk}
+      end
+    end)
+  end
+
+  defp count_entry(%{entries: entries}) when entries >= @max_entries do
+    throw({:disk_image, "more than #{@max_entries} directory entries"})
+  end
+
+  defp count_entry(walk), do: %{walk | entries: walk.entries + 1}
+
+  defp read_contents(fd, fs, inode) do
+    case layout(fd, fs, inode) do
+      {:inline, data} ->
+        data
+
+      {:extents, extents} ->
+        DiskImage.read_extents!(fd, extents, inode.size)
+    end
+  end
+
+  defp parse_entries(<<child::little-32, rec_len::little-16, name_len, _type, rest::binary>>, acc)
+       when rec_len >= 8 and rec_len - 8 <= byte_size(rest) and name_len <= rec_len - 8 do
+    <<name::binary-size(name_len), _::binary>> = rest
+    <<_::binary-size(rec_len - 8), next::binary>> = rest
+
+    acc = if child != 0 and name not in [".", ".."], do: [{child, name} | acc], else: acc
+    parse_entries(next, acc)
+  end
+
+  defp parse_entries(_data, acc), do: Enum.reverse(acc)
+end
@@ -0,0 +1,268 @@
+defmodule ExClamav.DiskImage.FAT do
+  @moduledoc false
+
+  # Read-only FAT12/16/32 walker. Lists every regular file of a volume with
+  # the byte extents its cluster chain occupies in the image, so the files can
+  # be scanned in place. Long file names are decoded; deleted entries and
+  # volume labels are skipped.
+  #
+  # Images may be hostile: each directory cluster is walked at most once, so
+  # entries pointing back up the tree cannot fan the walk out, and a volume
+  # with more than @max_entries entries is given up on (the caller then scans
+  # the partition whole).
+
+  import Bitwise
+
+  alias ExClamav.DiskImage
+
+  @max_depth 64
+  @max_entries 1_000_000
+
+  @doc false
+  def probe(fd, offset) do
+    case DiskImage.pread(fd, offset, 512) do
+      {:ok,
+       <<jump, _::binary-10, bps::little-16, spc, _reserved::16, fats, _::binary-493, 0x55,
+         0xAA>>} ->
+        jump in [0xEB, 0xE9] and bps in [512, 1024, 2048, 4096] and spc > 0 and
+          (spc &&& (spc - 1)) == 0 and fats > 0
+
+      _ ->
+        false
+    end
+  end
+
+  @doc false
+  def walk(fd, offset) do
+    volume = fd |> DiskImage.pread!(offset, 512) |> parse_boot_sector(offset)
+    volume = Map.put(volume, :fat, DiskImage.pread!(fd, volume.fat_offset, volume.fat_bytes))
+
+    {root, visited} =
+      case volume.type do
+        :fat32 ->
+          {read_chain(fd, volume, volume.root_cluster), MapSet.new([volume.root_cluster])}
+
+        _ ->
+          {DiskImage.pread!(fd, volume.root_offset, volume.root_bytes), MapSet.new()}
+      end
+
+    {files, _walk} = walk_dir(fd, volume, root, "", 0, %{visited: visited, entries: 0})
+    {:ok, files}
+  catch
+    :throw, {:disk_image, reason} -> {:error, reason}
+  end
+
+  # ── Boot sector ──────────────────────────────────────────────────────────
+
+  defp parse_boot_sector(
+         <<_jump::binary-3, _oem::binary-8, bps::little-16, spc, reserved::little-16, fats,
+           root_entries::little-16, total16::little-16, _media, fat_size16::little-16,
+           _geometry::binary-8, total32::little-32, fat_size32::little-32, _flags::16,
+           _version::16, root_cluster::little-32, _rest::binary>>,
+         offset
+       )
+       when bps > 0 and spc > 0 and fats > 0 do
+    fat_size = if fat_size16 != 0, do: fat_size16, else: fat_size32
+    total = if total16 != 0, do: total16, else: total32
+    root_sectors = div(root_entries * 32 + bps - 1, bps)
+    first_data = reserved + fats * fat_size + root_sectors
+
+    if fat_size == 0 or total <= first_data do
+      throw({:disk_image, "Invalid FAT boot sector"})
+    end
+
+    clusters = div(total - first_data, spc)
+
+    %{
+      cluster_bytes: bps * spc,
+      clusters: clusters,
+      fat_offset: offset + reserved * bps,
+      fat_bytes: fat_size * bps,
+      root_offset: offset + (reserved + fats * fat_size) * bps,
+      root_bytes: root_entries * 32,
+      root_cluster: root_cluster,
+      data_offset: offset + first_data * bps,
+      type:
+        cond do
+          clusters < 4085 -> :fat12
+          clusters < 65_525 -> :fat16
+          true -> :fat32
+        end
+    }
+  end
+
+  defp parse_boot_sector(_sector, _offset), do: throw({:disk_image, "Invalid FAT boot sector"})
+
+  # ── Cluster chains ───────────────────────────────────────────────────────
+
+  defp chain(volume, first) do
+    # A corrupt FAT can contain cycles; no chain is longer than the volume.
+    chain(volume, first, volume.clusters, [])
+  end
+
+  defp chain(volume, cluster, remaining, acc)
+       when remaining > 0 and cluster >= 2 and cluster < volume.clusters + 2 do
+    chain(volume, next_cluster(volume, cluster), remaining - 1, [cluster | acc])
+  end
+
+  defp chain(_volume, _cluster, _remaining, acc), do: Enum.reverse(acc)
+
+  # FAT12 packs two 12-bit entries into three bytes.
+  defp next_cluster(%{type: :fat12, fat: fat}, n) do
+    value =
+      case fat_entry(fat, n + div(n, 2), 16) do
+        nil -> 0
+        value when (n &&& 1) == 0 -> value &&& 0xFFF
+        value -> value >>> 4
+      end
+
+    end_of_chain(value, 0xFF7)
+  end
+
+  defp next_cluster(%{type: :fat16, fat: fat}, n) do
+    (fat_entry(fat, n * 2, 16) || 0) |> end_of_chain(0xFFF7)
+  end
+
+  defp next_cluster(%{type: :fat32, fat: fat}, n) do
+    ((fat_entry(fat, n * 4, 32) || 0) &&& 0x0FFFFFFF) |> end_of_chain(0x0FFFFFF7)
+  end
+
+  # Bad-cluster and end-of-chain markers both end the walk.
+  defp end_of_chain(value, bad) when value >= bad, do: 0
+  defp end_of_chain(value, _bad), do: value
+
+  defp fat_entry(fat, offset, bits) when offset + div(bits, 8) <= byte_size(fat) do
+    <<_::binary-size(offset), value::little-size(bits), _::binary>> = fat
+    value
+  end
+
+  defp fat_entry(_fat, _offset, _bits), do: nil
+
+  defp cluster_extents(volume, clusters, size) do
+    clusters
+    |> Enum.reduce([], fn
+      cluster, [{first, count} | rest] when cluster == first + count ->
+        [{first, count + 1} | rest]
+
+      cluster, runs ->
+        [{cluster, 1} | runs]
+    end)
+    |> Enum.reverse()
+    |> Enum.map_reduce(0, fn {first, count}, logical ->
+      physical = volume.data_offset + (first - 2) * volume.cluster_bytes
+      length = min(count * volume.cluster_bytes, max(size - logical, 0))
+      {{logical, physical, length}, logical + count * volume.cluster_bytes}
+    end)
+    |> elem(0)
+    |> Enum.reject(fn {_logical, _physical, length} -> length == 0 end)
+  end
+
+  defp read_chain(fd, volume, first) do
+    clusters = chain(volume, first)
+
+    volume
+    |> cluster_extents(clusters, length(clusters) * volume.cluster_bytes)
+    |> Enum.map(fn {_logical, physical, length} -> DiskImage.pread!(fd, physical, length) end)
+    |> IO.iodata_to_binary()
+  end
+
+  # ── Directories ──────────────────────────────────────────────────────────
+
+  # `walk` carries the directory clusters already visited and the number of
+  # entries seen so far across the whole volume.
+  defp walk_dir(fd, volume, data, prefix, depth, walk) do
+    data
+    |> parse_entries([], [])
+    |> Enum.flat_map_reduce(walk, fn {name, attributes, cluster, size}, walk ->
+      path = prefix <> "/" <> name
+
+      cond do
+        name in [".", ".."] ->
+          {[], walk}
+
+        (attributes &&& 0x10) != 0 ->
+          walk = count_entry(walk)
+
+          if depth < @max_depth and cluster >= 2 and not MapSet.member?(walk.visited, cluster) do
+            walk = %{walk | visited: MapSet.put(walk.visited, cluster)}
+            walk_dir(fd, volume, read_chain(fd, volume, cluster), path, depth + 1, walk)
+          else
+            {[], walk}
+          end
+
+        true ->
+          extents = cluster_extents(volume, chain(volume, cluster), size)
+          {[%{path: path, size: size, layout: {:extents, extents}}], count_entry(walk)}
+      end
+    end)
+  end
+
+  defp count_entry(%{entries: entries}) when entries >= @max_entries do
+    throw({:disk_image, "more than #{@max_entries} directory entries"})
+  end
+
+  defp count_entry(walk), do: %{walk | entries: walk.entries + 1}
+
+  defp parse_entries(<<0, _::binary>>, _long_name, acc), do: Enum.reverse(acc)
+
+  defp parse_entries(<<0xE5, _::binary-31, rest::binary>>, _long_name, acc) do
+    parse_entries(rest, [], acc)
+  end
+
+  # Long-name entries precede their short entry, last fragment first.
+  defp parse_entries(
+         <<_order, part1::binary-10, 0x0F, _type, _checksum, part2::binary-12, _cluster::16,
+           part3::binary-4, rest::binary>>,
+         long_name,
+         acc
+       ) do
+    parse_entries(rest, [part1, part2, part3 | long_name], acc)
+  end
+
+  defp parse_entries(
+         <<short_name::binary-11, attributes, _times::binary-8, high::little-16,
+           _modified::binary-4, low::little-16, size::little-32, rest::binary>>,
+         long_name,
+         acc
+       ) do
+    if (attributes &&& 0x08) != 0 do
+      parse_entries(rest, [], acc)
+    else
+      name = decode_long_name(long_name) || decode_short_name(short_name)
+      parse_entries(rest, [], [{name, attributes, high <<< 16 ||| low, size} | acc])
+    end
+  end
+
+  defp parse_entries(_data, _long_name, acc), do: Enum.reverse(acc)
+
+  defp decode_long_name([]), do: nil
+
+  defp decode_long_name(parts) do
+    name =
+      for <<unit::little-16 <- IO.iodata_to_binary(parts)>>,
+          reduce: {<<>>, false} do
+        {name, true} -> {name, true}
+        {name, false} when unit in [0x0000, 0xFFFF] -> {name, true}
+        {name, false} -> {<<name::binary, unit::little-16>>, false}
+      end
+      |> elem(0)
+
+    case :unicode.characters_to_binary(name, {:utf16, :little}) do
+      decoded when is_binary(decoded) and decoded != "" -> decoded
+      _ -> nil
+    end
+  end
+
+  defp decode_short_name(<<base::binary-8, extension::binary-3>>) do
+    base =
+      case String.trim_trailing(base, " ") do
+        <<0x05, rest::binary>> -> <<0xE5, rest::binary>>
+        base -> base
+      end
+
+    case String.trim_trailing(extension, " ") do
+      "" -> base
+      extension -> base <> "." <> extension
+    end
+  end
+end
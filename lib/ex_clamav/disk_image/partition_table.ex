@@ -0,0 +1,218 @@
+defmodule ExClamav.DiskImage.PartitionTable do
+  @moduledoc """
+  Read-only MBR and GPT partition table parser for raw disk images.
+
+  Extended MBR partitions are followed through their EBR chain, and a
+  protective MBR (type `0xEE`) hands over to the GPT header at LBA 1. Offsets
+  and lengths are reported in bytes from the start of the image.
+  """
+
+  alias ExClamav.DiskImage
+
+  defmodule Partition do
+    @moduledoc """
+    A partition inside a disk image.
+
+    `type` is the MBR type byte, or the GPT partition type GUID as a
+    lowercase string. `name` is only set for GPT partitions.
+    """
+
+    defstruct [:index, :scheme, :type, :name, :offset, :length]
+
+    @type t :: %__MODULE__{
+            index: non_neg_integer(),
+            scheme: :mbr | :gpt | :none,
+            type: non_neg_integer() | String.t() | nil,
+            name: String.t() | nil,
+            offset: non_neg_integer(),
+            length: non_neg_integer()
+          }
+  end
+
+  @sector 512
+  @extended_types [0x05, 0x0F, 0x85]
+  @max_logical 128
+
+  @doc """
+  Read the partition table of an image opened in `:raw` mode.
+
+  Images without a recognisable table (for example a bare filesystem image)
+  are reported as a single partition covering `image_size` bytes.
+  """
+  @spec read(:file.io_device(), non_neg_integer()) ::
+          {:ok, :mbr | :gpt | :none, [Partition.t()]} | {:error, String.t()}
+  def read(fd, image_size) do
+    case DiskImage.pread(fd, 0, @sector) do
+      {:ok, <<_boot::binary-446, entries::binary-64, 0x55, 0xAA>> = mbr} ->
+        primary = parse_mbr_entries(entries)
+
+        cond do
+          Enum.any?(primary, fn {type, _lba, _count} -> type == 0xEE end) ->
+            read_gpt(fd)
+
+          filesystem_boot_sector?(mbr) or primary == [] ->
+            {:ok, :none, [whole_image(image_size)]}
+
+          true ->
+            read_mbr(fd, primary)
+        end
+
+      {:ok, _sector} ->
+        {:ok, :none, [whole_image(image_size)]}
+
+      {:error, _reason} = error ->
+        error
+    end
+  end
+
+  # ── MBR ──────────────────────────────────────────────────────────────────
+
+  defp parse_mbr_entries(entries) do
+    for <<entry::binary-16 <- entries>>,
+        <<_status, _chs_first::24, type, _chs_last::24, lba::little-32, count::little-32>> <-
+          [entry],
+        type != 0 and count > 0,
+        do: {type, lba, count}
+  end
+
+  defp read_mbr(fd, primary) do
+    {partitions, _index} =
+      Enum.flat_map_reduce(primary, 0, fn {type, lba, count}, index ->
+        if type in @extended_types do
+          logical = read_logical(fd, lba, lba, @max_logical)
+
+          Enum.map_reduce(logical, index, fn {logical_type, logical_lba, logical_count}, i ->
+            {mbr_partition(i, logical_type, logical_lba, logical_count), i + 1}
+          end)
+        else
+          {[mbr_partition(index, type, lba, count)], index + 1}
+        end
+      end)
+
+    {:ok, :mbr, partitions}
+  end
+
+  # Each EBR describes one logical partition (relative to the EBR itself) and
+  # links to the next EBR (relative to the start of the extended partition).
+  defp read_logical(_fd, _extended_lba, _ebr_lba, 0), do: []
+
+  defp read_logical(fd, extended_lba, ebr_lba, remaining) do
+    case DiskImage.pread(fd, ebr_lba * @sector, @sector) do
+      {:ok, <<_boot::binary-446, entries::binary-64, 0x55, 0xAA>>} ->
+        case parse_mbr_entries(entries) do
+          [{type, lba, count} | rest] ->
+            partition = {type, ebr_lba + lba, count}
+
+            case rest do
+              [{next_type, next_lba, _} | _] when next_type in @extended_types ->
+                next_ebr = extended_lba + next_lba
+                [partition | read_logical(fd, extended_lba, next_ebr, remaining - 1)]
+
+              _ ->
+                [partition]
+            end
+
+          [] ->
+            []
+        end
+
+      _ ->
+        []
+    end
+  end
+
+  defp mbr_partition(index, type, lba, count) do
+    %Partition{
+      index: index,
+      scheme: :mbr,
+      type: type,
+      offset: lba * @sector,
+      length: count * @sector
+    }
+  end
+
+  # A FAT volume's boot sector also ends in 0x55AA; its "partition entries"
+  # are boot code, so do not read them as a table.
+  defp filesystem_boot_sector?(<<0xEB, _, 0x90, _::binary>> = sector) do
+    binary_part(sector, 54, 3) == "FAT" or binary_part(sector, 82, 5) == "FAT32"
+  end
+
+  defp filesystem_boot_sector?(_sector), do: false
+
+  # ── GPT ──────────────────────────────────────────────────────────────────
+
+  defp read_gpt(fd) do
+    # The header sits at LBA 1; try 512- and 4096-byte logical sectors.
+    Enum.find_value([512, 4096], {:error, "Invalid GPT header"}, fn sector_size ->
+      case DiskImage.pread(fd, sector_size, 92) do
+        {:ok,
+         <<"EFI PART", _revision::32, _header_size::little-32, _crc::32, _reserved::32,
+           _current::little-64, _backup::little-64, _first_usable::little-64,
+           _last_usable::little-64, _disk_guid::binary-16, entries_lba::little-64,
+           count::little-32, entry_size::little-32, _entries_crc::32>>}
+        when entry_size >= 128 ->
+          read_gpt_entries(fd, sector_size, entries_lba, count, entry_size)
+
+        _ ->
+          nil
+      end
+    end)
+  end
+
+  defp read_gpt_entries(fd, sector_size, entries_lba, count, entry_size) do
+    with {:ok, table} <- DiskImage.pread(fd, entries_lba * sector_size, count * entry_size) do
+      partitions =
+        for <<entry::binary-size(entry_size) <- table>>,
+            <<type::binary-16, _unique::binary-16, first::little-64, last::little-64,
+              _attributes::little-64, name::binary-72, _rest::binary>> <- [entry],
+            type != <<0::128>> and last >= first do
+          {type, first, last, name}
+        end
+
+      partitions =
+        partitions
+        |> Enum.with_index()
+        |> Enum.map(fn {{type, first, last, name}, index} ->
+          %Partition{
+            index: index,
+            scheme: :gpt,
+            type: guid_to_string(type),
+            name: decode_gpt_name(name),
+            offset: first * sector_size,
+            length: (last - first + 1) * sector_size
+          }
+        end)
+
+      {:ok, :gpt, partitions}
+    end
+  end
+
+  # GPT GUIDs store the first three fields little-endian.
+  defp guid_to_string(<<a::little-32, b::little-16, c::little-16, d::binary-2, e::binary-6>>) do
+    [
+      hex(a, 8),
+      hex(b, 4),
+      hex(c, 4),
+      Base.encode16(d, case: :lower),
+      Base.encode16(e, case: :lower)
+    ]
+    |> Enum.join("-")
+  end
+
+  defp hex(value, width) do
+    value |> Integer.to_string(16) |> String.downcase() |> String.pad_leading(width, "0")
+  end
+
+  defp decode_gpt_name(name) do
+    name
+    |> :unicode.characters_to_binary({:utf16, :little})
+    |> case do
+      decoded when is_binary(decoded) -> decoded |> String.split(<<0>>) |> hd()
+      _ -> nil
+    end
+  end
+
+  defp whole_image(image_size) do
+    %Partition{index: 0, scheme: :none, offset: 0, length: image_size}
+  end
+end
@@ -10,6 +10,9 @@ defmodule ExClamav.Engine do
 
   @type t :: %__MODULE__{ref: reference()}
 
+  @typedoc "A file opened with `open_file/1` for byte-range scanning."
+  @type open_file :: %{ref: reference(), size: non_neg_integer()}
+
   @doc """
   Initialize the ClamAV library.
 
@@ -95,6 +98,88 @@ defmodule ExClamav.Engine do
     end
   end
 
+  @doc """
+  Verify the header, MD5 checksum and digital signature of a `.cvd` file.
+
+  Used to check a downloaded database before it replaces the live copy.
+  """
+  @spec verify_cvd(String.t()) :: :ok | {:error, String.t()}
+  def verify_cvd(file_path) do
+    with :ok <- init() do
+      case call_nif(:cvd_verify, [file_path]) do
+        :ok -> :ok
+        {:error, reason} -> {:error, IO.chardata_to_string(reason)}
+      end
+    end
+  end
+
+  @doc """
+  Open a file once for repeated byte-range scans.
+
+  The returned handle keeps a single read-only descriptor open until it is
+  garbage collected. Scans of different ranges of the same handle may run
+  concurrently; each reads through `pread(2)` without moving a shared offset.
+  """
+  @spec open_file(String.t()) :: {:ok, open_file()} | {:error, String.t()}
+  def open_file(file_path) do
+    case call_nif(:file_open, [file_path]) do
+      {:ok, ref, size} -> {:ok, %{ref: ref, size: size}}
+      {:error, reason} -> {:error, IO.chardata_to_string(reason)}
+    end
+  end
+
+  @doc """
+  Scan `length` bytes of a file starting at `offset`, without copying them out.
+
+  `file` is either a path or a handle from `open_file/1`. The range is scanned
+  as if it were a standalone file, which makes it possible to scan members of
+  container formats or partitions of disk images in place. Ranges reaching
+  past the end of the file return `{:error, "Range exceeds file size"}`.
+  """
+  @spec scan_file_range(
+          t(),
+          String.t() | open_file(),
+          non_neg_integer(),
+          non_neg_integer(),
+          non_neg_integer()
+        ) :: {:ok, :clean} | {:virus, String.t()} | {:error, String.t()}
+  def scan_file_range(%__MODULE__{ref: ref}, file, offset, length, options \\ 0)
+      when is_integer(offset) and offset >= 0 and is_integer(length) and length >= 0 do
+    file = if is_map(file), do: file.ref, else: file
+
+    case call_nif(:scan_file_range, [ref, file, offset, length, options]) do
+      {:ok, :clean} = clean -> clean
+      {:ok, :virus, name} -> {:virus, normalize_virus_name(name)}
+      {:error, reason} -> {:error, IO.chardata_to_string(reason)}
+    end
+  end
+
+  @doc """
+  Scan a list of files and buffers in a single native call.
+
+  Items are `{:file, path}` or `{:buffer, binary}`. Verdicts are returned in
+  input order; a failing item yields `{:error, reason}` in its position
+  without affecting the others. Batching saves the per-call overhead of
+  scanning many small items one by one, but a batch occupies one dirty
+  scheduler until its last item is done, so keep batches modest.
+  """
+  @spec scan_batch(t(), [{:file, String.t()} | {:buffer, binary()}], non_neg_integer()) ::
+          [{:ok, :clean} | {:virus, String.t()} | {:error, String.t()}]
+          | {:error, String.t()}
+  def scan_batch(%__MODULE__{ref: ref}, items, options \\ 0) when is_list(items) do
+    case call_nif(:scan_batch, [ref, items, options]) do
+      {:ok, results} ->
+        Enum.map(results, fn
+          {:ok, :clean} = clean -> clean
+          {:ok, :virus, name} -> {:virus, normalize_virus_name(name)}
+          {:error, reason} -> {:error, IO.chardata_to_string(reason)}
+        end)
+
+      {:error, reason} ->
+        {:error, IO.chardata_to_string(reason)}
+    end
+  end
+
   @doc """
   Get the database version.
   """
@@ -103,6 +188,19 @@ defmodule ExClamav.Engine do
     call_nif(:get_database_version, [ref])
   end
 
+  @doc """
+  Get the build time of the newest loaded database.
+
+  Useful to report how old the definitions serving traffic are.
+  """
+  @spec get_database_time(t()) :: {:ok, DateTime.t()} | {:error, String.t()}
+  def get_database_time(%__MODULE__{ref: ref}) do
+    case call_nif(:get_database_time, [ref]) do
+      seconds when is_integer(seconds) -> DateTime.from_unix(seconds)
+      {:error, reason} -> {:error, IO.chardata_to_string(reason)}
+    end
+  end
+
   @doc """
   Explicitly free the engine resources.
 
@@ -0,0 +1,79 @@
+defmodule ExClamav.FileType do
+  @moduledoc """
+  Cheap content type sniffing from leading magic bytes.
+
+  Scan cost depends far more on type than on size: a container or
+  executable goes through unpackers and parsers, plain text through the
+  pattern matchers only. `detect/1` classifies content from its first bytes
+  so scheduling and tiering decisions can be made before the engine sees it.
+  It is a heuristic, not libclamav's own type recognition.
+  """
+
+  @type t ::
+          :pe
+          | :elf
+          | :macho
+          | :zip
+          | :rar
+          | :seven_zip
+          | :gzip
+          | :bzip2
+          | :xz
+          | :pdf
+          | :ole2
+          | :rtf
+          | :html
+          | :text
+          | :binary
+          | :empty
+
+  @text_sample 512
+
+  @doc """
+  Classify `data` by its magic bytes. Only the first few hundred bytes are
+  examined.
+  """
+  @spec detect(binary()) :: t()
+  def detect(<<>>), do: :empty
+  def detect(<<"MZ", _::binary>>), do: :pe
+  def detect(<<0x7F, "ELF", _::binary>>), do: :elf
+  def detect(<<0xFE, 0xED, 0xFA, b, _::binary>>) when b in [0xCE, 0xCF], do: :macho
+  def detect(<<b, 0xFA, 0xED, 0xFE, _::binary>>) when b in [0xCE, 0xCF], do: :macho
+  def detect(<<0xCA, 0xFE, 0xBA, 0xBE, _::binary>>), do: :macho
+  def detect(<<"PK", b, c, _::binary>>) when {b, c} in [{3, 4}, {5, 6}, {7, 8}], do: :zip
+  def detect(<<"Rar!", 0x1A, 0x07, _::binary>>), do: :rar
+  def detect(<<"7z", 0xBC, 0xAF, 0x27, 0x1C, _::binary>>), do: :seven_zip
+  def detect(<<0x1F, 0x8B, _::binary>>), do: :gzip
+  def detect(<<"BZh", _::binary>>), do: :bzip2
+  def detect(<<0xFD, "7zXZ", 0, _::binary>>), do: :xz
+  def detect(<<"%PDF-", _::binary>>), do: :pdf
+  def detect(<<0xD0, 0xCF, 0x11, 0xE0, 0xA1, 0xB1, 0x1A, 0xE1, _::binary>>), do: :ole2
+  def detect(<<"{\\rtf", _::binary>>), do: :rtf
+
+  def detect(data) do
+    sample = binary_part(data, 0, min(byte_size(data), @text_sample))
+
+    cond do
+      not text?(sample) -> :binary
+      html?(sample) -> :html
+      true -> :text
+    end
+  end
+
+  # Text allows a truncated multi-byte sequence at the end of the sample.
+  defp text?(sample) do
+    if String.contains?(sample, <<0>>) do
+      false
+    else
+      case :unicode.characters_to_binary(sample) do
+        {:error, _valid, _rest} -> false
+        _complete_or_incomplete -> true
+      end
+    end
+  end
+
+  defp html?(sample) do
+    sample = sample |> String.trim_leading() |> String.downcase()
+    String.starts_with?(sample, ["<!doctype html", "<html", "<script", "<svg"])
+  end
+end
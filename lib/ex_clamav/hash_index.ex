@@ -0,0 +1,367 @@
+defmodule ExClamav.HashIndex do
+  @moduledoc """
+  Hash-only reputation lookups against the hash signatures of a ClamAV database.
+
+  A full `scan_buffer` runs every parser and pattern matcher, which is wasted
+  work when a feed only needs to know whether some exact content is known
+  malware. `ExClamav.HashIndex` extracts the whole-file hash signatures
+  (`.hdb` for MD5/SHA-1, `.hsb` for SHA-256) from a database directory,
+  including those packed inside `.cvd`/`.cld` containers, into an ETS table.
+  `lookup/3` then answers from the calling process with a single ETS read,
+  which makes it suitable for pre-hashed inventories of millions of files.
+
+  False-positive entries (`.fp`, `.sfp`) are honoured. Section hashes
+  (`.mdb`, `.msb`) and PUA databases are not indexed: they do not identify a
+  whole file, or are not loaded by the engine by default.
+
+  ## Usage
+
+      children = [
+        {ExClamav.DefinitionUpdater, database_path: "/var/lib/clamav"},
+        {ExClamav.HashIndex,
+         database_path: "/var/lib/clamav", updater: ExClamav.DefinitionUpdater}
+      ]
+
+      ExClamav.HashIndex.lookup(:crypto.hash(:sha256, data), byte_size(data))
+      #=> {:virus, "Win.Trojan.Example-1"} | :unknown
+
+  ## Options
+
+  * `:name`          — registered name, also used to locate the table (default: `ExClamav.HashIndex`).
+  * `:database_path` — database directory to index (default: `"/var/lib/clamav"`).
+  * `:updater`       — optional `DefinitionUpdater` to subscribe to; updates rebuild the index.
+
+  ## Telemetry
+
+  * `[:ex_clamav, :hash_index, :build]` — after every (re)build.
+    Measurements: `:duration` (native time units) and `:entries`.
+    Metadata: `:name`, `:database_path` and `:result` (`:ok` or `:error`).
+  """
+
+  use GenServer
+
+  require Logger
+
+  alias ExClamav.DefinitionUpdater.Snapshots
+
+  @type digest :: <<_::128>> | <<_::160>> | <<_::256>> | String.t()
+
+  @type option ::
+          {:name, atom()}
+          | {:database_path, Path.t()}
+          | {:updater, GenServer.server()}
+
+  defstruct [:name, :database_path, entries: 0, built_at: nil]
+
+  @default_database_path "/var/lib/clamav"
+
+  @signature_extensions ~w(.hdb .hsb)
+  @false_positive_extensions ~w(.fp .sfp)
+  @container_extensions ~w(.cvd .cld)
+
+  @header_size 512
+
+  # How long a replaced table outlives the swap, for lookups already using it.
+  @drop_delay :timer.seconds(5)
+
+  # ── Public API ─────────────────────────────────────────────────────────────
+
+  @doc """
+  Starts the index and builds it in the background.
+
+  See module documentation for available options.
+  """
+  @spec start_link([option()]) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    name = Keyword.get(opts, :name, __MODULE__)
+    GenServer.start_link(__MODULE__, Keyword.put(opts, :name, name), name: name)
+  end
+
+  @doc """
+  Returns a child spec for supervision trees.
+  """
+  @spec child_spec([option()]) :: Supervisor.child_spec()
+  def child_spec(opts) do
+    %{
+      id: Keyword.get(opts, :name, __MODULE__),
+      start: {__MODULE__, :start_link, [opts]},
+      shutdown: 5_000,
+      restart: :permanent,
+      type: :worker
+    }
+  end
+
+  @doc """
+  Look up content by its MD5, SHA-1 or SHA-256 digest and size in bytes.
+
+  Digests may be given raw or hex-encoded. Returns `{:virus, name}` when a
+  hash signature matches, `:unknown` otherwise — which only means no *hash*
+  signature matched, not that the content is clean.
+  """
+  @spec lookup(atom(), digest(), non_neg_integer()) :: {:virus, String.t()} | :unknown
+  def lookup(index \\ __MODULE__, digest, size) when is_integer(size) and size >= 0 do
+    table = :persistent_term.get({__MODULE__, index})
+    hash = normalize(digest)
+
+    if false_positive?(table, hash, size) do
+      :unknown
+    else
+      case :ets.lookup(table, {hash, size}) do
+        [{_key, name}] ->
+          {:virus, name}
+
+        [] ->
+          case :ets.lookup(table, {hash, :any}) do
+            [{_key, name}] -> {:virus, name}
+            [] -> :unknown
+          end
+      end
+    end
+  end
+
+  defp false_positive?(table, hash, size) do
+    :ets.member(table, {:fp, hash, size}) or :ets.member(table, {:fp, hash, :any})
+  end
+
+  @doc """
+  Rebuild the index, optionally from a different database directory.
+  """
+  @spec rebuild(atom(), Path.t() | nil) :: {:ok, non_neg_integer()} | {:error, String.t()}
+  def rebuild(index \\ __MODULE__, database_path \\ nil) do
+    GenServer.call(index, {:rebuild, database_path}, :infinity)
+  end
+
+  @doc """
+  Returns the indexed database path, entry count and time of the last build.
+  """
+  @spec info(atom()) :: %{
+          database_path: Path.t(),
+          entries: non_neg_integer(),
+          built_at: DateTime.t() | nil
+        }
+  def info(index \\ __MODULE__) do
+    GenServer.call(index, :info)
+  end
+
+  # ── Index construction ─────────────────────────────────────────────────────
+
+  @doc false
+  # Parse every hash database in `database_path` into a new ETS table.
+  def build_table(database_path) do
+    path = Snapshots.resolve(database_path)
+
+    with {:ok, files} <- list_databases(path),
+         {:ok, sources} <- read_sources(files) do
+      table = :ets.new(__MODULE__, [:set, :public, read_concurrency: true])
+
+      # Signatures first, so false-positive entries are never overwritten.
+      sources
+      |> Enum.sort_by(fn {name, _data} -> Path.extname(name) in @false_positive_extensions end)
+      |> Enum.each(fn {name, data} -> insert_lines(table, Path.extname(name), data) end)
+
+      {:ok, table}
+    end
+  end
+
+  defp list_databases(path) do
+    case File.ls(path) do
+      {:ok, entries} ->
+        {:ok,
+         entries
+         |> Enum.sort()
+         |> Enum.map(&Path.join(path, &1))
+         |> Enum.filter(&(indexed?(&1) or Path.extname(&1) in @container_extensions))}
+
+      {:error, reason} ->
+        {:error, "cannot list #{path}: #{:file.format_error(reason)}"}
+    end
+  end
+
+  defp indexed?(name) do
+    Path.extname(name) in (@signature_extensions ++ @false_positive_extensions)
+  end
+
+  defp read_sources(files) do
+    Enum.reduce_while(files, {:ok, []}, fn file, {:ok, acc} ->
+      case read_source(file) do
+        {:ok, sources} -> {:cont, {:ok, sources ++ acc}}
+        {:error, reason} -> {:halt, {:error, "#{Path.basename(file)}: #{reason}"}}
+      end
+    end)
+  end
+
+  defp read_source(file) do
+    with {:ok, data} <- posix(File.read(file)) do
+      if Path.extname(file) in @container_extensions do
+        unpack(data)
+      else
+        {:ok, [{Path.basename(file), data}]}
+      end
+    end
+  end
+
+  # Containers are a 512-byte header followed by a (possibly gzipped) tarball;
+  # only the hash databases are extracted.
+  defp unpack(<<_header::binary-size(@header_size), body::binary>>) do
+    options = if match?(<<0x1F, 0x8B, _::binary>>, body), do: [:compressed], else: []
+
+    with {:ok, names} <- :erl_tar.table({:binary, body}, options),
+         wanted = Enum.filter(names, &indexed?(List.to_string(&1))),
+         {:ok, entries} <- extract(body, wanted, options) do
+      {:ok, Enum.map(entries, fn {name, data} -> {List.to_string(name), data} end)}
+    else
+      {:error, reason} -> {:error, "cannot unpack container: #{inspect(reason)}"}
+    end
+  end
+
+  defp unpack(_data), do: {:error, "truncated container"}
+
+  defp extract(_body, [], _options), do: {:ok, []}
+
+  defp extract(body, names, options) do
+    :erl_tar.extract({:binary, body}, [:memory, {:files, names} | options])
+  end
+
+  # Lines are "hash:size:name[:flevel...]"; SHA-256 entries may use "*" for
+  # any size.
+  defp insert_lines(table, extension, data) do
+    false_positive? = extension in @false_positive_extensions
+
+    data
+    |> String.split("\n", trim: true)
+    |> Enum.each(fn line ->
+      with [hex, size, name | _rest] <- String.split(String.trim_trailing(line), ":"),
+           {:ok, hash} <- Base.decode16(hex, case: :mixed),
+           {:ok, size} <- parse_size(size) do
+        if false_positive? do
+          :ets.insert(table, {{:fp, hash, size}})
+        else
+          :ets.insert(table, {{hash, size}, name})
+        end
+      end
+    end)
+  end
+
+  defp parse_size("*"), do: {:ok, :any}
+
+  defp parse_size(size) do
+    case Integer.parse(size) do
+      {size, ""} -> {:ok, size}
+      _ -> :error
+    end
+  end
+
+  # 32 bytes is either a raw SHA-256 or a hex MD5. A raw digest made only of
+  # hex digits is astronomically unlikely, so the character set decides.
+  defp normalize(digest) when byte_size(digest) in [32, 40, 64] do
+    case Base.decode16(digest, case: :mixed) do
+      {:ok, hash} -> hash
+      :error -> normalize_raw(digest)
+    end
+  end
+
+  defp normalize(digest), do: normalize_raw(digest)
+
+  defp normalize_raw(<<_::128>> = hash), do: hash
+  defp normalize_raw(<<_::160>> = hash), do: hash
+  defp normalize_raw(<<_::256>> = hash), do: hash
+  defp normalize_raw(other), do: raise(ArgumentError, "invalid digest: #{inspect(other)}")
+
+  # ── GenServer Callbacks ────────────────────────────────────────────────────
+
+  @impl true
+  def init(opts) do
+    name = Keyword.fetch!(opts, :name)
+    database_path = Keyword.get(opts, :database_path, @default_database_path)
+
+    # Lookups before the first build simply miss.
+    empty = :ets.new(__MODULE__, [:set, :public, read_concurrency: true])
+    :persistent_term.put({__MODULE__, name}, empty)
+
+    case Keyword.fetch(opts, :updater) do
+      {:ok, updater} -> ExClamav.DefinitionUpdater.subscribe(updater)
+      :error -> :ok
+    end
+
+    {:ok, %__MODULE__{name: name, database_path: database_path}, {:continue, :build}}
+  end
+
+  @impl true
+  def handle_continue(:build, state) do
+    {_reply, state} = build(state, state.database_path)
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_call({:rebuild, database_path}, _from, state) do
+    {reply, state} = build(state, database_path || state.database_path)
+    {:reply, reply, state}
+  end
+
+  def handle_call(:info, _from, state) do
+    {:reply, Map.take(state, [:database_path, :entries, :built_at]), state}
+  end
+
+  @impl true
+  def handle_info({:clamav_definition_updated, metadata}, state) do
+    Logger.debug("HashIndex: definitions updated, rebuilding index")
+    {_reply, state} = build(state, metadata[:database_path] || state.database_path)
+    {:noreply, state}
+  end
+
+  def handle_info({:drop, table}, state) do
+    :ets.delete(table)
+    {:noreply, state}
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, state) do
+    :persistent_term.erase({__MODULE__, state.name})
+    :ok
+  end
+
+  # The new table is published before the old one is deleted, so concurrent
+  # lookups always see a complete index. Deletion waits @drop_delay, so a
+  # lookup that read the old table just before the swap can still finish.
+  defp build(state, database_path) do
+    started = System.monotonic_time()
+    result = build_table(database_path)
+    duration = System.monotonic_time() - started
+
+    case result do
+      {:ok, table} ->
+        entries = :ets.info(table, :size)
+        old = :persistent_term.get({__MODULE__, state.name})
+        :persistent_term.put({__MODULE__, state.name}, table)
+        Process.send_after(self(), {:drop, old}, @drop_delay)
+
+        emit(state.name, database_path, duration, entries, :ok)
+
+        {{:ok, entries},
+         %{state | database_path: database_path, entries: entries, built_at: DateTime.utc_now()}}
+
+      {:error, reason} = error ->
+        Logger.error("HashIndex: failed to index #{database_path} — #{reason}")
+        emit(state.name, database_path, duration, state.entries, :error)
+        {error, state}
+    end
+  end
+
+  defp emit(name, database_path, duration, entries, result) do
+    :telemetry.execute(
+      [:ex_clamav, :hash_index, :build],
+      %{duration: duration, entries: entries},
+      %{name: name, database_path: database_path, result: result}
+    )
+  end
+
+  defp posix({:error, reason}) when is_atom(reason) do
+    {:error, reason |> :file.format_error() |> IO.chardata_to_string()}
+  end
+
+  defp posix(result), do: result
+end
@@ -0,0 +1,252 @@
+defmodule ExClamav.ICAP do
+  @moduledoc """
+  An ICAP/1.0 (RFC 3507) service front end for proxy-based content scanning.
+
+  Forward proxies (Squid, HAProxy SPOE bridges, commercial gateways) send
+  `REQMOD` / `RESPMOD` requests with the HTTP message encapsulated in the ICAP
+  body. The listener scans the encapsulated body with the shared engine held by
+  an `ExClamav.ClamavGenServer`, so proxy traffic and application scans use a
+  single loaded database.
+
+  ## Features
+
+  * Streams chunked encapsulated bodies off the socket, spooling to a
+    temporary file once `:max_memory_body` is exceeded.
+  * Supports `Preview` (answering `100 Continue` when more data is needed) and
+    `Allow: 204` so clean content is never echoed back to the proxy.
+  * Infected content is replaced with an HTTP `403 Forbidden` response and the
+    threat name is reported in `X-Infection-Found` / `X-Virus-ID`.
+  * Persistent connections — each connection is served by its own process and
+    handles requests in a loop until the proxy closes it.
+
+  ## Usage
+
+      children = [
+        {ExClamav.ClamavGenServer, name: ExClamav.ClamavGenServer},
+        {ExClamav.ICAP, port: 1344, server: ExClamav.ClamavGenServer}
+      ]
+
+      Supervisor.start_link(children, strategy: :rest_for_one)
+
+  ## Options
+
+  * `:port`             — TCP port to listen on (default: `1344`, `0` picks a free port).
+  * `:ip`               — interface to bind (default: `{127, 0, 0, 1}`).
+  * `:server`           — the `ClamavGenServer` that performs scans (default: `ExClamav.ClamavGenServer`).
+  * `:acceptors`        — number of acceptor processes (default: `10`).
+  * `:max_connections`  — concurrent connection limit (default: `1024`).
+  * `:preview_size`     — preview size advertised in `OPTIONS` responses (default: `4096`).
+  * `:max_memory_body`  — bytes buffered in memory before spooling to disk (default: 8 MB).
+  * `:max_chunk_size`   — largest body chunk a client may announce; larger ones get a `400` (default: 16 MB).
+  * `:tmp_dir`          — directory used for spooled bodies (default: `System.tmp_dir!/0`).
+  * `:istag`            — ICAP service tag (default: derived from start time).
+  * `:idle_timeout`     — ms to wait for the next request on a persistent connection (default: `60_000`).
+  * `:request_timeout`  — ms to wait for data within a request (default: `30_000`).
+  * `:name`             — GenServer name registration (default: `ExClamav.ICAP`).
+  """
+
+  use GenServer
+
+  alias ExClamav.ICAP.Connection
+
+  require Logger
+
+  @type option ::
+          {:port, :inet.port_number()}
+          | {:ip, :inet.ip_address()}
+          | {:server, GenServer.server()}
+          | {:acceptors, pos_integer()}
+          | {:max_connections, pos_integer()}
+          | {:preview_size, non_neg_integer()}
+          | {:max_memory_body, pos_integer()}
+          | {:max_chunk_size, pos_integer()}
+          | {:tmp_dir, Path.t()}
+          | {:istag, String.t()}
+          | {:idle_timeout, timeout()}
+          | {:request_timeout, timeout()}
+          | {:name, GenServer.name()}
+
+  defstruct [:listen_socket, :port, :connection_sup, :conn_opts, acceptors: []]
+
+  @default_port 1344
+  @handoff_timeout 5_000
+
+  @doc """
+  Starts the ICAP listener.
+
+  See module documentation for available options.
+  """
+  @spec start_link([option()]) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    genserver_opts =
+      case Keyword.fetch(opts, :name) do
+        {:ok, nil} -> []
+        {:ok, name} -> [name: name]
+        :error -> [name: __MODULE__]
+      end
+
+    GenServer.start_link(__MODULE__, opts, genserver_opts)
+  end
+
+  @doc """
+  Returns a child spec for supervision trees.
+  """
+  @spec child_spec([option()]) :: Supervisor.child_spec()
+  def child_spec(opts) do
+    id =
+      case Keyword.fetch(opts, :name) do
+        {:ok, nil} -> __MODULE__
+        {:ok, name} -> name
+        :error -> __MODULE__
+      end
+
+    %{
+      id: id,
+      start: {__MODULE__, :start_link, [opts]},
+      shutdown: 5_000,
+      restart: :permanent,
+      type: :worker
+    }
+  end
+
+  @doc """
+  Returns the TCP port the listener is bound to. Useful when started with `port: 0`.
+  """
+  @spec port(GenServer.server()) :: :inet.port_number()
+  def port(server \\ __MODULE__) do
+    GenServer.call(server, :port)
+  end
+
+  # ── GenServer Callbacks ────────────────────────────────────────────────────
+
+  @impl true
+  def init(opts) do
+    Process.flag(:trap_exit, true)
+
+    port = Keyword.get(opts, :port, @default_port)
+    ip = Keyword.get(opts, :ip, {127, 0, 0, 1})
+    acceptors = Keyword.get(opts, :acceptors, 10)
+    max_connections = Keyword.get(opts, :max_connections, 1024)
+
+    conn_opts = [
+      server: Keyword.get(opts, :server, ExClamav.ClamavGenServer),
+      max_connections: max_connections,
+      preview_size: Keyword.get(opts, :preview_size, 4096),
+      max_memory_body: Keyword.get(opts, :max_memory_body, 8 * 1024 * 1024),
+      max_chunk_size: Keyword.get(opts, :max_chunk_size, 16 * 1024 * 1024),
+      tmp_dir: Keyword.get(opts, :tmp_dir, System.tmp_dir!()),
+      istag: Keyword.get(opts, :istag, default_istag()),
+      idle_timeout: Keyword.get(opts, :idle_timeout, 60_000),
+      request_timeout: Keyword.get(opts, :request_timeout, 30_000)
+    ]
+
+    listen_opts = [
+      :binary,
+      ip: ip,
+      active: false,
+      reuseaddr: true,
+      nodelay: true,
+      backlog: 1024
+    ]
+
+    with {:ok, listen_socket} <- :gen_tcp.listen(port, listen_opts),
+         {:ok, bound_port} <- :inet.port(listen_socket),
+         {:ok, connection_sup} <- Task.Supervisor.start_link(max_children: max_connections) do
+      state = %__MODULE__{
+        listen_socket: listen_socket,
+        port: bound_port,
+        connection_sup: connection_sup,
+        conn_opts: conn_opts
+      }
+
+      pids = for _ <- 1..acceptors, do: start_acceptor(state)
+      Logger.info("ICAP: listening on #{:inet.ntoa(ip)}:#{bound_port}")
+      {:ok, %{state | acceptors: pids}}
+    else
+      {:error, reason} -> {:stop, {:listen_failed, reason}}
+    end
+  end
+
+  @impl true
+  def handle_call(:port, _from, state) do
+    {:reply, state.port, state}
+  end
+
+  @impl true
+  def handle_info({:EXIT, pid, reason}, state) do
+    if pid in state.acceptors do
+      if reason != :normal do
+        Logger.warning("ICAP: acceptor exited — #{inspect(reason)}, restarting")
+      end
+
+      acceptors = [start_acceptor(state) | List.delete(state.acceptors, pid)]
+      {:noreply, %{state | acceptors: acceptors}}
+    else
+      {:noreply, state}
+    end
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, state) do
+    :gen_tcp.close(state.listen_socket)
+    :ok
+  end
+
+  # ── Internal: Acceptors ───────────────────────────────────────────────────
+
+  defp start_acceptor(state) do
+    %__MODULE__{listen_socket: listen_socket, connection_sup: sup, conn_opts: conn_opts} = state
+    spawn_link(fn -> accept_loop(listen_socket, sup, conn_opts) end)
+  end
+
+  defp accept_loop(listen_socket, sup, conn_opts) do
+    case :gen_tcp.accept(listen_socket) do
+      {:ok, socket} ->
+        hand_off(socket, sup, conn_opts)
+        accept_loop(listen_socket, sup, conn_opts)
+
+      {:error, :closed} ->
+        :ok
+
+      {:error, reason} ->
+        exit({:accept_failed, reason})
+    end
+  end
+
+  defp hand_off(socket, sup, conn_opts) do
+    child =
+      Task.Supervisor.start_child(sup, fn ->
+        receive do
+          {:socket_ready, ^socket} -> Connection.serve(socket, conn_opts)
+        after
+          @handoff_timeout -> :ok
+        end
+      end)
+
+    case child do
+      {:ok, pid} ->
+        # The socket may already be closed by the peer; the acceptor must
+        # survive that and never leave the child waiting for it.
+        case :gen_tcp.controlling_process(socket, pid) do
+          :ok ->
+            send(pid, {:socket_ready, socket})
+
+          {:error, _reason} ->
+            Process.exit(pid, :kill)
+            :gen_tcp.close(socket)
+        end
+
+      {:error, :max_children} ->
+        :gen_tcp.send(socket, "ICAP/1.0 503 Service Overloaded\r\n\r\n")
+        :gen_tcp.close(socket)
+    end
+  end
+
+  defp default_istag do
+    "ExClamav-" <> Integer.to_string(System.system_time(:second), 36)
+  end
+end
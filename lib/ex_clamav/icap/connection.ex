@@ -0,0 +1,444 @@
+defmodule ExClamav.ICAP.Connection do
+  @moduledoc false
+
+  # One process per accepted ICAP connection. The socket is read in raw mode
+  # through a small buffered reader so that request lines, encapsulated HTTP
+  # headers and body chunks can be consumed without flipping packet modes.
+  # Requests on the same socket are served in a loop until the client closes
+  # the connection or asks for `Connection: close`.
+
+  alias ExClamav.ClamavGenServer
+  alias ExClamav.ICAP.Protocol
+
+  require Logger
+
+  @max_line_length 8_192
+  @max_header_block 65_536
+  @max_header_lines 100
+  @chunk_slice 65_536
+
+  defstruct [:socket, :opts, buffer: <<>>]
+
+  @doc false
+  @spec serve(:gen_tcp.socket(), keyword()) :: :ok
+  def serve(socket, opts) do
+    loop(%__MODULE__{socket: socket, opts: opts})
+  end
+
+  defp loop(conn) do
+    case handle_request(conn) do
+      {:keep_alive, conn} ->
+        loop(conn)
+
+      {:close, conn} ->
+        :gen_tcp.close(conn.socket)
+        :ok
+    end
+  end
+
+  # ---------------------------------------------------------------------------
+  # Request handling
+  # ---------------------------------------------------------------------------
+
+  defp handle_request(conn) do
+    with {:ok, line, conn} <- read_line(conn, idle_timeout(conn)),
+         {:ok, method, _uri} <- Protocol.parse_request_line(line),
+         {:ok, headers, conn} <- read_headers(conn, %{}, 0, 0) do
+      close? = String.downcase(Map.get(headers, "connection", "")) == "close"
+
+      case dispatch(method, headers, conn) do
+        {:ok, conn} when close? -> {:close, conn}
+        {:ok, conn} -> {:keep_alive, conn}
+        {:error, _reason, conn} -> {:close, conn}
+      end
+    else
+      {:error, :bad_request} ->
+        send_response(conn, Protocol.encode_response(400, "Bad Request", base_headers(conn)))
+        {:close, conn}
+
+      {:error, :too_large} ->
+        send_response(
+          conn,
+          Protocol.encode_response(413, "Request Entity Too Large", base_headers(conn))
+        )
+
+        {:close, conn}
+
+      {:error, _closed_or_timeout} ->
+        {:close, conn}
+    end
+  end
+
+  defp dispatch(:options, _headers, conn) do
+    opts = conn.opts
+
+    headers =
+      base_headers(conn) ++
+        [
+          {"Methods", "REQMOD, RESPMOD"},
+          {"Service", "ExClamav ICAP"},
+          {"Max-Connections", Integer.to_string(Keyword.fetch!(opts, :max_connections))},
+          {"Options-TTL", "3600"},
+          {"Allow", "204"},
+          {"Preview", Integer.to_string(Keyword.fetch!(opts, :preview_size))},
+          {"Transfer-Preview", "*"}
+        ]
+
+    send_response(conn, Protocol.encode_response(200, "OK", headers, [{:null_body, []}]))
+    {:ok, conn}
+  end
+
+  defp dispatch(_mod, headers, conn) do
+    with {:ok, encapsulated} <- Protocol.parse_encapsulated(Map.get(headers, "encapsulated", "")),
+         {:ok, header_len, has_body?} <- Protocol.header_block(encapsulated),
+         :ok <- check_header_length(header_len),
+         {:ok, header_bytes, conn} <- read_bytes(conn, header_len),
+         {:ok, spool, conn} <- read_body(conn, has_body?, preview_size(headers)) do
+      http_sections = split_header_block(encapsulated, header_bytes)
+
+      try do
+        respond(conn, scan_spool(spool, conn.opts), headers, http_sections, spool)
+      after
+        discard_spool(spool)
+      end
+    else
+      {:error, :bad_request} ->
+        send_response(conn, Protocol.encode_response(400, "Bad Request", base_headers(conn)))
+        {:error, :bad_request, conn}
+
+      {:error, reason} ->
+        {:error, reason, conn}
+    end
+  end
+
+  defp respond(conn, {:ok, :clean}, headers, http_sections, spool) do
+    if allow_204?(headers) do
+      send_response(conn, Protocol.encode_response(204, "No Content", base_headers(conn)))
+      {:ok, conn}
+    else
+      # Echo the original message back unmodified.
+      echo(conn, http_sections, spool)
+    end
+  end
+
+  defp respond(conn, {:virus, name}, _headers, _http_sections, _spool) do
+    body = "Blocked: the requested content contains #{name}\n"
+
+    http_headers = [
+      "HTTP/1.1 403 Forbidden\r\n",
+      "Content-Type: text/plain\r\n",
+      "Content-Length: ",
+      Integer.to_string(byte_size(body)),
+      "\r\n\r\n"
+    ]
+
+    headers =
+      base_headers(conn) ++
+        [
+          {"X-Infection-Found", "Type=0; Resolution=2; Threat=#{name};"},
+          {"X-Virus-ID", name}
+        ]
+
+    send_response(
+      conn,
+      Protocol.encode_response(200, "OK", headers, [{:res_hdr, http_headers}, {:res_body, body}])
+    )
+
+    {:ok, conn}
+  end
+
+  defp respond(conn, {:error, reason}, _headers, _http_sections, _spool) do
+    Logger.error("ICAP: scan failed — #{inspect(reason)}")
+    send_response(conn, Protocol.encode_response(500, "Server Error", base_headers(conn)))
+    {:error, reason, conn}
+  end
+
+  defp echo(conn, http_sections, nil) do
+    send_response(
+      conn,
+      Protocol.encode_response(200, "OK", base_headers(conn), http_sections ++ [{:null_body, []}])
+    )
+
+    {:ok, conn}
+  end
+
+  defp echo(conn, http_sections, spool) do
+    sections = http_sections ++ [{body_section_for(http_sections), :chunked}]
+    send_response(conn, Protocol.encode_response(200, "OK", base_headers(conn), sections))
+
+    case send_spool(conn, spool) do
+      :ok -> {:ok, conn}
+      {:error, reason} -> {:error, reason, conn}
+    end
+  end
+
+  # ---------------------------------------------------------------------------
+  # Body spooling
+  # ---------------------------------------------------------------------------
+
+  # Chunks are appended to an in-memory iolist until `:max_memory_body` is
+  # exceeded, after which the spool is moved to a temporary file so a large
+  # download never has to be held in the BEAM heap. Each chunk is read off the
+  # socket in slices of at most `@chunk_slice` bytes, so the advertised chunk
+  # size never dictates how much is buffered at once.
+  defp read_body(conn, false, _preview), do: {:ok, nil, conn}
+
+  defp read_body(conn, true, nil) do
+    read_chunks(conn, {:memory, [], 0})
+  end
+
+  defp read_body(conn, true, _preview_size) do
+    with {:ok, spool, ieof?, conn} <- read_chunks_until_terminator(conn, {:memory, [], 0}) do
+      if ieof? do
+        {:ok, spool, conn}
+      else
+        send_response(conn, "ICAP/1.0 100 Continue\r\n\r\n")
+        read_chunks(conn, spool)
+      end
+    end
+  end
+
+  defp read_chunks(conn, spool) do
+    case read_chunks_until_terminator(conn, spool) do
+      {:ok, spool, _ieof?, conn} -> {:ok, spool, conn}
+      error -> error
+    end
+  end
+
+  defp read_chunks_until_terminator(conn, spool) do
+    case read_chunk(conn, spool) do
+      {:ok, :last, ieof?, conn} ->
+        {:ok, spool, ieof?, conn}
+
+      {:ok, spool, conn} ->
+        read_chunks_until_terminator(conn, spool)
+
+      {:error, reason, spool} ->
+        discard_spool(spool)
+        {:error, reason}
+    end
+  end
+
+  # Errors carry the latest spool so the caller can discard whatever was
+  # written before the failure.
+  defp read_chunk(conn, spool) do
+    with {:ok, line, conn} <- read_line(conn, request_timeout(conn)),
+         {:ok, size, ieof?} <- Protocol.parse_chunk_size(line),
+         :ok <- check_chunk_size(size, conn.opts) do
+      if size == 0 do
+        case read_line(conn, request_timeout(conn)) do
+          {:ok, _trailer, conn} -> {:ok, :last, ieof?, conn}
+          {:error, reason} -> {:error, reason, spool}
+        end
+      else
+        read_chunk_data(conn, spool, size)
+      end
+    else
+      {:error, reason} -> {:error, reason, spool}
+    end
+  end
+
+  defp read_chunk_data(conn, spool, 0) do
+    case read_line(conn, request_timeout(conn)) do
+      {:ok, _crlf, conn} -> {:ok, spool, conn}
+      {:error, reason} -> {:error, reason, spool}
+    end
+  end
+
+  defp read_chunk_data(conn, spool, remaining) do
+    with {:ok, data, conn} <- read_bytes(conn, min(remaining, @chunk_slice)),
+         {:ok, spool} <- spool_append(spool, data, conn.opts) do
+      read_chunk_data(conn, spool, remaining - byte_size(data))
+    else
+      {:error, reason} -> {:error, reason, spool}
+    end
+  end
+
+  defp check_chunk_size(size, opts) do
+    if size <= Keyword.fetch!(opts, :max_chunk_size), do: :ok, else: {:error, :bad_request}
+  end
+
+  defp spool_append({:memory, iodata, size}, data, opts) do
+    new_size = size + byte_size(data)
+
+    if new_size > Keyword.fetch!(opts, :max_memory_body) do
+      path =
+        Path.join(
+          Keyword.fetch!(opts, :tmp_dir),
+          "ex_clamav_icap_#{System.unique_integer([:positive])}"
+        )
+
+      with {:ok, io} <- File.open(path, [:write, :raw, :binary]) do
+        spool = {:file, io, path, new_size}
+
+        case IO.binwrite(io, [iodata, data]) do
+          :ok ->
+            {:ok, spool}
+
+          error ->
+            discard_spool(spool)
+            error
+        end
+      end
+    else
+      {:ok, {:memory, [iodata, data], new_size}}
+    end
+  end
+
+  defp spool_append({:file, io, path, size}, data, _opts) do
+    case IO.binwrite(io, data) do
+      :ok -> {:ok, {:file, io, path, size + byte_size(data)}}
+      error -> error
+    end
+  end
+
+  defp scan_spool(nil, _opts), do: {:ok, :clean}
+
+  defp scan_spool({:memory, iodata, _size}, opts) do
+    ClamavGenServer.scan_buffer(Keyword.fetch!(opts, :server), IO.iodata_to_binary(iodata))
+  end
+
+  defp scan_spool({:file, io, path, _size}, opts) do
+    :ok = File.close(io)
+    ClamavGenServer.scan_file(Keyword.fetch!(opts, :server), path)
+  end
+
+  defp send_spool(conn, {:memory, iodata, _size}) do
+    send_response(conn, Protocol.encode_chunk(iodata))
+  end
+
+  # Spooled bodies can be far larger than `:max_memory_body`, so they are read
+  # back in fixed-size slices and written out as one HTTP chunk each.
+  defp send_spool(conn, {:file, _io, path, _size}) do
+    path
+    |> File.stream!(@chunk_slice)
+    |> Protocol.encode_chunks()
+    |> Enum.reduce_while(:ok, fn chunk, :ok ->
+      case send_response(conn, chunk) do
+        :ok -> {:cont, :ok}
+        error -> {:halt, error}
+      end
+    end)
+  rescue
+    error in File.Error ->
+      Logger.error("ICAP: could not read spooled body — #{Exception.message(error)}")
+      {:error, error.reason}
+  end
+
+  defp discard_spool({:file, io, path, _size}) do
+    File.close(io)
+    File.rm(path)
+    :ok
+  end
+
+  defp discard_spool(_spool), do: :ok
+
+  # ---------------------------------------------------------------------------
+  # Buffered socket reader
+  # ---------------------------------------------------------------------------
+
+  defp read_line(%__MODULE__{buffer: buffer} = conn, timeout) do
+    case :binary.split(buffer, "\n") do
+      [line, rest] ->
+        {:ok, line <> "\n", %{conn | buffer: rest}}
+
+      [_partial] when byte_size(buffer) > @max_line_length ->
+        {:error, :bad_request}
+
+      [_partial] ->
+        with {:ok, conn} <- fill(conn, timeout), do: read_line(conn, timeout)
+    end
+  end
+
+  defp read_bytes(conn, 0), do: {:ok, <<>>, conn}
+
+  defp read_bytes(%__MODULE__{buffer: buffer} = conn, size) when byte_size(buffer) >= size do
+    <<data::binary-size(size), rest::binary>> = buffer
+    {:ok, data, %{conn | buffer: rest}}
+  end
+
+  defp read_bytes(%__MODULE__{buffer: buffer} = conn, size) do
+    case :gen_tcp.recv(conn.socket, size - byte_size(buffer), request_timeout(conn)) do
+      {:ok, data} -> read_bytes(%{conn | buffer: buffer <> data}, size)
+      {:error, _reason} = error -> error
+    end
+  end
+
+  defp fill(conn, timeout) do
+    case :gen_tcp.recv(conn.socket, 0, timeout) do
+      {:ok, data} -> {:ok, %{conn | buffer: conn.buffer <> data}}
+      {:error, _reason} = error -> error
+    end
+  end
+
+  # ICAP headers are bounded like the encapsulated HTTP header block, so a
+  # client cannot grow the header map one short line at a time.
+  defp read_headers(conn, acc, lines, bytes) do
+    with {:ok, line, conn} <- read_line(conn, request_timeout(conn)) do
+      bytes = bytes + byte_size(line)
+
+      cond do
+        line in ["\r\n", "\n"] ->
+          {:ok, acc, conn}
+
+        lines >= @max_header_lines or bytes > @max_header_block ->
+          {:error, :too_large}
+
+        true ->
+          with {:ok, name, value} <- Protocol.parse_header_line(line) do
+            read_headers(conn, Map.put(acc, name, value), lines + 1, bytes)
+          end
+      end
+    end
+  end
+
+  # ---------------------------------------------------------------------------
+  # Helpers
+  # ---------------------------------------------------------------------------
+
+  defp split_header_block(encapsulated, header_bytes) do
+    encapsulated
+    |> Enum.chunk_every(2, 1)
+    |> Enum.flat_map(fn
+      [{section, offset}, {_next, next_offset}] when section in [:req_hdr, :res_hdr] ->
+        [{section, binary_part(header_bytes, offset, next_offset - offset)}]
+
+      _ ->
+        []
+    end)
+  end
+
+  defp check_header_length(length) when length <= @max_header_block, do: :ok
+  defp check_header_length(_length), do: {:error, :bad_request}
+
+  defp body_section_for(http_sections) do
+    if Keyword.has_key?(http_sections, :res_hdr), do: :res_body, else: :req_body
+  end
+
+  defp allow_204?(headers) do
+    headers
+    |> Map.get("allow", "")
+    |> String.split(",", trim: true)
+    |> Enum.any?(&(String.trim(&1) == "204"))
+  end
+
+  defp preview_size(headers) do
+    with {:ok, value} <- Map.fetch(headers, "preview"),
+         {size, ""} <- Integer.parse(value) do
+      size
+    else
+      _ -> nil
+    end
+  end
+
+  defp base_headers(conn) do
+    [{"ISTag", ~s("#{Keyword.fetch!(conn.opts, :istag)}")}]
+  end
+
+  defp send_response(conn, iodata) do
+    :gen_tcp.send(conn.socket, iodata)
+  end
+
+  defp idle_timeout(conn), do: Keyword.fetch!(conn.opts, :idle_timeout)
+  defp request_timeout(conn), do: Keyword.fetch!(conn.opts, :request_timeout)
+end
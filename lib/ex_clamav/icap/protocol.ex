@@ -0,0 +1,196 @@
+defmodule ExClamav.ICAP.Protocol do
+  @moduledoc """
+  Pure parsing and encoding helpers for the ICAP/1.0 wire format (RFC 3507).
+
+  Socket handling lives in `ExClamav.ICAP.Connection`; everything here operates
+  on binaries so it can be tested without a network peer.
+  """
+
+  @type method :: :options | :reqmod | :respmod
+  @type section :: :req_hdr | :res_hdr | :req_body | :res_body | :null_body | :opt_body
+
+  @crlf "\r\n"
+
+  @doc """
+  Parse an ICAP request line such as `"RESPMOD icap://host/scan ICAP/1.0\\r\\n"`.
+  """
+  @spec parse_request_line(binary()) :: {:ok, method(), String.t()} | {:error, :bad_request}
+  def parse_request_line(line) do
+    case String.split(String.trim_trailing(line), " ", trim: true) do
+      [method, uri, "ICAP/1.0"] ->
+        case parse_method(method) do
+          nil -> {:error, :bad_request}
+          method -> {:ok, method, uri}
+        end
+
+      _ ->
+        {:error, :bad_request}
+    end
+  end
+
+  defp parse_method("OPTIONS"), do: :options
+  defp parse_method("REQMOD"), do: :reqmod
+  defp parse_method("RESPMOD"), do: :respmod
+  defp parse_method(_), do: nil
+
+  @doc """
+  Parse a single `Name: value` header line. Header names are downcased.
+  """
+  @spec parse_header_line(binary()) :: {:ok, String.t(), String.t()} | {:error, :bad_request}
+  def parse_header_line(line) do
+    case :binary.split(String.trim_trailing(line), ":") do
+      [name, value] when name != "" ->
+        {:ok, String.downcase(String.trim(name)), String.trim(value)}
+
+      _ ->
+        {:error, :bad_request}
+    end
+  end
+
+  @doc """
+  Parse the `Encapsulated` header into an ordered list of `{section, offset}`.
+
+      iex> ExClamav.ICAP.Protocol.parse_encapsulated("req-hdr=0, res-hdr=137, res-body=296")
+      {:ok, [req_hdr: 0, res_hdr: 137, res_body: 296]}
+  """
+  @spec parse_encapsulated(String.t()) :: {:ok, [{section(), non_neg_integer()}]} | {:error, :bad_request}
+  def parse_encapsulated(value) do
+    value
+    |> String.split(",", trim: true)
+    |> Enum.reduce_while({:ok, []}, fn entry, {:ok, acc} ->
+      with [name, offset] <- String.split(String.trim(entry), "="),
+           {:ok, section} <- parse_section(name),
+           {offset, ""} when offset >= 0 <- Integer.parse(offset) do
+        {:cont, {:ok, [{section, offset} | acc]}}
+      else
+        _ -> {:halt, {:error, :bad_request}}
+      end
+    end)
+    |> case do
+      {:ok, [_ | _] = sections} -> {:ok, Enum.reverse(sections)}
+      _ -> {:error, :bad_request}
+    end
+  end
+
+  defp parse_section("req-hdr"), do: {:ok, :req_hdr}
+  defp parse_section("res-hdr"), do: {:ok, :res_hdr}
+  defp parse_section("req-body"), do: {:ok, :req_body}
+  defp parse_section("res-body"), do: {:ok, :res_body}
+  defp parse_section("null-body"), do: {:ok, :null_body}
+  defp parse_section("opt-body"), do: {:ok, :opt_body}
+  defp parse_section(_), do: :error
+
+  @doc """
+  Split the encapsulated sections into the total length of the HTTP header
+  block and whether a chunked body follows it.
+  """
+  @spec header_block([{section(), non_neg_integer()}]) ::
+          {:ok, non_neg_integer(), boolean()} | {:error, :bad_request}
+  def header_block(sections) do
+    case List.last(sections) do
+      {section, offset} when section in [:req_body, :res_body, :opt_body] -> {:ok, offset, true}
+      {:null_body, offset} -> {:ok, offset, false}
+      _ -> {:error, :bad_request}
+    end
+  end
+
+  @doc """
+  Parse a chunk-size line. Returns the chunk size and whether the `ieof`
+  extension was present (which marks the end of the message in a preview).
+  """
+  @spec parse_chunk_size(binary()) :: {:ok, non_neg_integer(), boolean()} | {:error, :bad_request}
+  def parse_chunk_size(line) do
+    [size | extensions] = String.split(String.trim_trailing(line), ";")
+
+    case Integer.parse(String.trim(size), 16) do
+      {size, ""} when size >= 0 ->
+        ieof? = Enum.any?(extensions, &(String.trim(&1) == "ieof"))
+        {:ok, size, ieof?}
+
+      _ ->
+        {:error, :bad_request}
+    end
+  end
+
+  @doc """
+  Encode an ICAP response. `encapsulated` is a list of `{section, iodata}`
+  where the final section is either a body (encoded as a single chunk) or
+  `:null_body`. A body given as `:chunked` is left for the caller to write
+  with `encode_chunks/1`. Responses without encapsulated sections carry
+  `Encapsulated: null-body=0`, as RFC 3507 requires of every response.
+  """
+  @spec encode_response(pos_integer(), String.t(), [{String.t(), String.t()}], [
+          {section(), iodata() | :chunked}
+        ]) :: iodata()
+  def encode_response(status, reason, headers, encapsulated \\ []) do
+    {encap_header, payload} = encode_encapsulated(encapsulated)
+    headers = headers ++ [{"Encapsulated", encap_header}]
+
+    [
+      "ICAP/1.0 ",
+      Integer.to_string(status),
+      " ",
+      reason,
+      @crlf,
+      Enum.map(headers, fn {name, value} -> [name, ": ", value, @crlf] end),
+      @crlf,
+      payload
+    ]
+  end
+
+  defp encode_encapsulated([]), do: {"null-body=0", []}
+
+  defp encode_encapsulated(sections) do
+    {entries, payload, _offset} =
+      Enum.reduce(sections, {[], [], 0}, fn {section, data}, {entries, payload, offset} ->
+        entry = section_name(section) <> "=" <> Integer.to_string(offset)
+
+        case section do
+          body when body in [:req_body, :res_body, :opt_body] and data == :chunked ->
+            {[entry | entries], payload, offset}
+
+          body when body in [:req_body, :res_body, :opt_body] ->
+            {[entry | entries], [payload | encode_chunk(data)], offset}
+
+          :null_body ->
+            {[entry | entries], payload, offset}
+
+          _header ->
+            {[entry | entries], [payload | data], offset + IO.iodata_length(data)}
+        end
+      end)
+
+    {entries |> Enum.reverse() |> Enum.join(", "), payload}
+  end
+
+  @doc """
+  Encode `data` as a single HTTP chunk followed by the terminating zero chunk.
+  """
+  @spec encode_chunk(iodata()) :: iodata()
+  def encode_chunk(data) do
+    case IO.iodata_length(data) do
+      0 -> ["0", @crlf, @crlf]
+      size -> [Integer.to_string(size, 16), @crlf, data, @crlf, "0", @crlf, @crlf]
+    end
+  end
+
+  @doc """
+  Lazily encode an enumerable of binaries as HTTP chunks, ending with the
+  terminating zero chunk. Empty elements are skipped since a zero-sized chunk
+  would end the body early.
+  """
+  @spec encode_chunks(Enumerable.t()) :: Enumerable.t()
+  def encode_chunks(chunks) do
+    chunks
+    |> Stream.reject(&(IO.iodata_length(&1) == 0))
+    |> Stream.map(&[Integer.to_string(IO.iodata_length(&1), 16), @crlf, &1, @crlf])
+    |> Stream.concat([["0", @crlf, @crlf]])
+  end
+
+  defp section_name(:req_hdr), do: "req-hdr"
+  defp section_name(:res_hdr), do: "res-hdr"
+  defp section_name(:req_body), do: "req-body"
+  defp section_name(:res_body), do: "res-body"
+  defp section_name(:null_body), do: "null-body"
+  defp section_name(:opt_body), do: "opt-body"
+end
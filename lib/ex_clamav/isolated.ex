@@ -0,0 +1,226 @@
+defmodule ExClamav.Isolated do
+  @moduledoc """
+  Crash-isolated scanning through a supervised pool of external worker processes.
+
+  The in-process NIF gives the lowest latency, but a libclamav crash on a
+  malicious file takes the whole BEAM node down with it. In isolated mode each
+  scan runs inside a `clamav_worker` OS process (built alongside the NIF) that
+  owns its own compiled engine. If a worker dies, only the request it was
+  serving fails with `{:error, "scan worker crashed ..."}`; the worker is
+  restarted by its supervisor and the rest of the node keeps serving.
+
+  ## Buffer transfer
+
+  Buffers of at least `:shared_threshold` bytes are copied once into an
+  anonymous `memfd` and the worker opens it through `/proc/<beam pid>/fd/<fd>`,
+  so large payloads never travel through the port pipe. Smaller buffers (and
+  platforms without `memfd_create`) are sent inline.
+
+  ## Zygote mode
+
+  With `zygote: true` a single zygote process loads and compiles the engine
+  and every worker is a child forked from it. The children share the compiled
+  signature pages copy-on-write, so the pool costs about the memory of one
+  engine instead of one per worker. A definition reload starts a new zygote
+  and workers move over to it as they become idle.
+
+  ## Memory caps
+
+  libclamav's file-size and recursion limits do not bound the heap a scan
+  allocates, so a decompression bomb can push a node into the OOM killer.
+  Workers account every allocation made during a scan (on glibc, by
+  interposing `malloc`), report the peak through telemetry and in the
+  results of `scan_file_with_stats/3` and `scan_buffer_with_stats/3` and, with
+  `:max_scan_memory` set, abort a scan that would exceed it with
+  `{:error, "scan memory limit exceeded"}`. The worker survives and serves
+  the next request.
+
+  ## Usage
+
+      children = [
+        {ExClamav.Isolated, database_path: "/var/lib/clamav", pool_size: 4}
+      ]
+
+      ExClamav.Isolated.scan_file(ExClamav.Isolated, "/tmp/upload.bin")
+      ExClamav.Isolated.scan_buffer(ExClamav.Isolated, data)
+
+  ## Telemetry
+
+  * `[:ex_clamav, :isolated, :scan]` — measurements `peak_memory` (bytes);
+    metadata `pool` and `result` (`:clean`, `:virus` or `:memory_limit`).
+
+  ## Options
+
+  * `:name`             — registered name of the pool (default: `ExClamav.Isolated`).
+  * `:database_path`    — ClamAV database directory loaded by each worker (default: `"/var/lib/clamav"`).
+  * `:pool_size`        — number of worker processes (default: `System.schedulers_online/0`).
+  * `:shared_threshold` — minimum buffer size sent through shared memory (default: `65_536`).
+  * `:zygote`           — fork workers from a shared, pre-compiled engine (default: `false`).
+  * `:scan_timeout`     — ms before a stuck worker is killed and the scan fails (default: `:infinity`).
+  * `:max_scan_memory`  — heap bytes a single scan may allocate (default: `:infinity`).
+  * `:auto_reload`      — subscribe to a `DefinitionUpdater` and reload workers one at a time (default: `false`).
+  * `:updater`          — the `DefinitionUpdater` to subscribe to (default: `ExClamav.DefinitionUpdater`).
+  """
+
+  use Supervisor
+
+  alias ExClamav.Isolated.Pool
+  alias ExClamav.Isolated.Worker
+  alias ExClamav.Isolated.Zygote
+
+  @type option ::
+          {:name, atom()}
+          | {:database_path, Path.t()}
+          | {:pool_size, pos_integer()}
+          | {:shared_threshold, non_neg_integer()}
+          | {:zygote, boolean()}
+          | {:scan_timeout, timeout()}
+          | {:max_scan_memory, pos_integer() | :infinity}
+          | {:auto_reload, boolean()}
+          | {:updater, GenServer.server()}
+
+  @type scan_result :: {:ok, :clean} | {:virus, String.t()} | {:error, String.t()}
+
+  @typedoc """
+  Per-scan statistics. `peak_memory` is the scan's peak heap use in bytes
+  (`0` off glibc), or `nil` when the worker failed before reporting it.
+  """
+  @type scan_stats :: %{peak_memory: non_neg_integer() | nil}
+
+  @default_database_path "/var/lib/clamav"
+  @default_shared_threshold 65_536
+
+  @doc """
+  Starts the pool supervisor.
+
+  See module documentation for available options.
+  """
+  @spec start_link([option()]) :: Supervisor.on_start() | {:error, String.t()}
+  def start_link(opts \\ []) do
+    name = Keyword.get(opts, :name, __MODULE__)
+
+    if available?() do
+      Supervisor.start_link(__MODULE__, Keyword.put(opts, :name, name), name: supervisor_name(name))
+    else
+      {:error, "clamav_worker is not available; isolated scanning is only built on Linux"}
+    end
+  end
+
+  @doc """
+  Whether the `clamav_worker` executable was built for this platform.
+  """
+  @spec available?() :: boolean()
+  def available?, do: File.exists?(executable())
+
+  @doc false
+  def executable, do: :filename.join(:code.priv_dir(:ex_clamav), ~c"clamav_worker")
+
+  @doc """
+  Returns a child spec for supervision trees.
+  """
+  @spec child_spec([option()]) :: Supervisor.child_spec()
+  def child_spec(opts) do
+    %{
+      id: Keyword.get(opts, :name, __MODULE__),
+      start: {__MODULE__, :start_link, [opts]},
+      type: :supervisor
+    }
+  end
+
+  @doc """
+  Scan a file path in an isolated worker.
+  """
+  @spec scan_file(atom(), Path.t(), non_neg_integer()) :: scan_result()
+  def scan_file(pool \\ __MODULE__, file_path, options \\ 0) do
+    pool |> scan_file_with_stats(file_path, options) |> elem(0)
+  end
+
+  @doc """
+  Scan an in-memory binary in an isolated worker.
+  """
+  @spec scan_buffer(atom(), binary(), non_neg_integer()) :: scan_result()
+  def scan_buffer(pool \\ __MODULE__, buffer, options \\ 0) when is_binary(buffer) do
+    pool |> scan_buffer_with_stats(buffer, options) |> elem(0)
+  end
+
+  @doc """
+  Like `scan_file/3`, but also returns the scan's `t:scan_stats/0`.
+
+      {{:ok, :clean}, %{peak_memory: 1_482_752}} =
+        ExClamav.Isolated.scan_file_with_stats(ExClamav.Isolated, "/tmp/upload.bin")
+  """
+  @spec scan_file_with_stats(atom(), Path.t(), non_neg_integer()) :: {scan_result(), scan_stats()}
+  def scan_file_with_stats(pool \\ __MODULE__, file_path, options \\ 0) do
+    pool |> Pool.checkout_scan({:scan_file, file_path, options}) |> with_stats()
+  end
+
+  @doc """
+  Like `scan_buffer/3`, but also returns the scan's `t:scan_stats/0`.
+  """
+  @spec scan_buffer_with_stats(atom(), binary(), non_neg_integer()) :: {scan_result(), scan_stats()}
+  def scan_buffer_with_stats(pool \\ __MODULE__, buffer, options \\ 0) when is_binary(buffer) do
+    pool |> Pool.checkout_scan(buffer_request(pool, buffer, options)) |> with_stats()
+  end
+
+  # Crashes, timeouts and worker errors are replied without stats.
+  defp with_stats({:scanned, result, stats}), do: {result, stats}
+  defp with_stats({:error, _reason} = error), do: {error, %{peak_memory: nil}}
+
+  # The shared-buffer resource is carried inside the request so it stays alive
+  # (and the memfd open) until the worker has replied.
+  defp buffer_request(pool, buffer, options) do
+    if byte_size(buffer) >= Pool.shared_threshold(pool) do
+      case ExClamav.Nif.shared_buffer_new(buffer) do
+        {:ok, ref, fd, size} -> {:scan_shared, {ref, fd, size}, options}
+        {:error, _reason} -> {:scan_buffer, buffer, options}
+      end
+    else
+      {:scan_buffer, buffer, options}
+    end
+  end
+
+  # ── Supervisor Callbacks ───────────────────────────────────────────────────
+
+  @impl true
+  def init(opts) do
+    name = Keyword.fetch!(opts, :name)
+    pool_size = Keyword.get(opts, :pool_size, System.schedulers_online())
+    database_path = Keyword.get(opts, :database_path, @default_database_path)
+    zygote = Keyword.get(opts, :zygote, false)
+
+    worker_opts = [
+      pool: name,
+      zygote: zygote,
+      database_path: database_path,
+      scan_timeout: Keyword.get(opts, :scan_timeout, :infinity),
+      max_scan_memory: Keyword.get(opts, :max_scan_memory, :infinity)
+    ]
+
+    pool_opts = [
+      name: name,
+      shared_threshold: Keyword.get(opts, :shared_threshold, @default_shared_threshold),
+      auto_reload: Keyword.get(opts, :auto_reload, false),
+      updater: Keyword.get(opts, :updater, ExClamav.DefinitionUpdater),
+      zygote: zygote
+    ]
+
+    workers =
+      for index <- 1..pool_size do
+        Supervisor.child_spec({Worker, worker_opts}, id: {Worker, index})
+      end
+
+    worker_sup = %{
+      id: :workers,
+      start:
+        {Supervisor, :start_link,
+         [workers, [strategy: :one_for_one, max_restarts: 10 * pool_size, max_seconds: 10]]},
+      type: :supervisor
+    }
+
+    zygote_spec = if zygote, do: [{Zygote, pool: name, database_path: database_path}], else: []
+
+    Supervisor.init([{Pool, pool_opts}] ++ zygote_spec ++ [worker_sup], strategy: :rest_for_one)
+  end
+
+  defp supervisor_name(name), do: Module.concat(name, Supervisor)
+end
@@ -0,0 +1,228 @@
+defmodule ExClamav.Isolated.Pool do
+  @moduledoc false
+
+  # Checkout queue for `ExClamav.Isolated` workers. The pool only hands
+  # requests to idle workers; workers reply to the caller directly and then
+  # check themselves back in, so scan results never pass through this process.
+  # The caller of every checked-out worker is remembered until the worker
+  # checks back in, so a worker that dies with a request in its mailbox (or
+  # before it even got there) still fails that request instead of leaving the
+  # caller waiting forever.
+  #
+  # Definition reloads are staggered: one worker reloads at a time, and an
+  # idle worker is taken out of the idle queue until it has its new engine,
+  # so the rest of the pool keeps serving throughout.
+
+  use GenServer
+
+  alias ExClamav.Isolated.Zygote
+
+  require Logger
+
+  defstruct [
+    :name,
+    :shared_threshold,
+    :auto_reload,
+    :updater,
+    :zygote,
+    :reloading,
+    :reload_path,
+    reloads: [],
+    workers: %{},
+    busy: %{},
+    idle: :queue.new(),
+    waiting: :queue.new()
+  ]
+
+  def start_link(opts) do
+    GenServer.start_link(__MODULE__, opts, name: Keyword.fetch!(opts, :name))
+  end
+
+  def child_spec(opts) do
+    %{
+      id: __MODULE__,
+      start: {__MODULE__, :start_link, [opts]},
+      shutdown: 5_000,
+      restart: :permanent,
+      type: :worker
+    }
+  end
+
+  @doc false
+  def checkout_scan(pool, request) do
+    GenServer.call(pool, {:scan, request}, :infinity)
+  end
+
+  @doc false
+  def shared_threshold(pool) do
+    :persistent_term.get({__MODULE__, pool, :shared_threshold})
+  end
+
+  @doc false
+  def checkin(pool, worker), do: GenServer.cast(pool, {:checkin, worker})
+
+  @doc false
+  def reload_workers(pool), do: GenServer.cast(pool, :reload_workers)
+
+  @doc false
+  def reloaded(pool, worker), do: GenServer.cast(pool, {:reloaded, worker})
+
+  # ── GenServer Callbacks ────────────────────────────────────────────────────
+
+  @impl true
+  def init(opts) do
+    name = Keyword.fetch!(opts, :name)
+    shared_threshold = Keyword.fetch!(opts, :shared_threshold)
+    :persistent_term.put({__MODULE__, name, :shared_threshold}, shared_threshold)
+
+    state = %__MODULE__{
+      name: name,
+      shared_threshold: shared_threshold,
+      auto_reload: Keyword.fetch!(opts, :auto_reload),
+      updater: Keyword.fetch!(opts, :updater),
+      zygote: Keyword.fetch!(opts, :zygote)
+    }
+
+    if state.auto_reload do
+      ExClamav.DefinitionUpdater.subscribe(state.updater)
+    end
+
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_call({:scan, request}, from, state) do
+    case next_idle(state.idle) do
+      {:ok, worker, idle} ->
+        {:noreply, assign(%{state | idle: idle}, worker, from, request)}
+
+      :empty ->
+        waiting = :queue.in({from, request}, state.waiting)
+        {:noreply, %{state | idle: :queue.new(), waiting: waiting}}
+    end
+  end
+
+  @impl true
+  def handle_cast({:checkin, worker}, state) do
+    {:noreply, checkin_worker(state, worker)}
+  end
+
+  def handle_cast(:reload_workers, state) do
+    {:noreply, reload_workers(state, nil)}
+  end
+
+  def handle_cast({:reloaded, worker}, %__MODULE__{reloading: {worker, parked?}} = state) do
+    state = %{state | reloading: nil}
+    state = if parked?, do: checkin_worker(state, worker), else: state
+    {:noreply, reload_next(state)}
+  end
+
+  def handle_cast({:reloaded, _worker}, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info({:DOWN, _ref, :process, worker, _reason}, state) do
+    {from, busy} = Map.pop(state.busy, worker)
+
+    # The worker normally fails its own request before stopping; this covers
+    # requests it never received. A second reply to the same call is dropped.
+    if from, do: GenServer.reply(from, {:error, "scan worker crashed"})
+
+    state = %{
+      state
+      | workers: Map.delete(state.workers, worker),
+        busy: busy,
+        idle: :queue.delete(worker, state.idle),
+        reloads: List.delete(state.reloads, worker)
+    }
+
+    case state.reloading do
+      {^worker, _parked?} -> {:noreply, reload_next(%{state | reloading: nil})}
+      _ -> {:noreply, state}
+    end
+  end
+
+  def handle_info({:clamav_definition_updated, metadata}, state) do
+    Logger.info("Isolated: definitions updated, reloading scan workers")
+
+    # With a zygote only the zygote recompiles; workers reconnect once it is ready.
+    if state.zygote do
+      Zygote.reload(state.name, metadata[:database_path])
+      {:noreply, state}
+    else
+      {:noreply, reload_workers(state, metadata[:database_path])}
+    end
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  # ── Internal ──────────────────────────────────────────────────────────────
+
+  defp checkin_worker(state, worker) do
+    state =
+      if Map.has_key?(state.workers, worker) do
+        state
+      else
+        %{state | workers: Map.put(state.workers, worker, Process.monitor(worker))}
+      end
+
+    state = %{state | busy: Map.delete(state.busy, worker)}
+
+    case :queue.out(state.waiting) do
+      {{:value, {from, request}}, waiting} ->
+        assign(%{state | waiting: waiting}, worker, from, request)
+
+      {:empty, _waiting} ->
+        %{state | idle: :queue.in(worker, state.idle)}
+    end
+  end
+
+  defp assign(state, worker, from, request) do
+    send(worker, {:scan, from, request})
+    %{state | busy: Map.put(state.busy, worker, from)}
+  end
+
+  # Skips idle workers that have already exited but whose DOWN is still
+  # queued behind this request.
+  defp next_idle(idle) do
+    case :queue.out(idle) do
+      {{:value, worker}, idle} ->
+        if Process.alive?(worker), do: {:ok, worker, idle}, else: next_idle(idle)
+
+      {:empty, _idle} ->
+        :empty
+    end
+  end
+
+  # A reload requested while another is running starts over with every
+  # worker, so none is left on the engine of the superseded one.
+  defp reload_workers(state, database_path) do
+    reloads = Map.keys(state.workers)
+
+    reloads =
+      case state.reloading do
+        {worker, _parked?} -> List.delete(reloads, worker) ++ [worker]
+        nil -> reloads
+      end
+
+    reload_next(%{state | reloads: reloads, reload_path: database_path})
+  end
+
+  defp reload_next(%__MODULE__{reloading: nil, reloads: [worker | reloads]} = state) do
+    # A busy worker reloads once its scan is done and then checks itself in.
+    parked? = :queue.member(worker, state.idle)
+    send(worker, {:reload, state.reload_path})
+
+    %{
+      state
+      | reloads: reloads,
+        reloading: {worker, parked?},
+        idle: :queue.delete(worker, state.idle)
+    }
+  end
+
+  defp reload_next(state), do: state
+end
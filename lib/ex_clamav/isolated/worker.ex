@@ -0,0 +1,324 @@
+defmodule ExClamav.Isolated.Worker do
+  @moduledoc false
+
+  # Owns one `clamav_worker` OS process and serves one scan at a time. The
+  # wire protocol is documented at the top of clamav_worker.c. In port mode the
+  # worker spawns its own process; in zygote mode it connects to the pool's
+  # zygote, which forks a scanner for the connection. When the OS process exits
+  # unexpectedly, the in-flight caller receives an error and this GenServer
+  # stops so its supervisor starts a fresh worker.
+  #
+  # Every request carries the pool's per-scan heap cap and every verdict the
+  # scan's peak heap use. Verdicts are replied as `{:scanned, result, stats}`
+  # so `ExClamav.Isolated` can hand the peak to callers that ask for it; it is
+  # also reported through telemetry.
+
+  use GenServer
+
+  alias ExClamav.Isolated
+  alias ExClamav.Isolated.Pool
+  alias ExClamav.Isolated.Zygote
+
+  require Logger
+
+  @load_timeout :timer.minutes(5)
+
+  defstruct [
+    :pool,
+    :zygote,
+    :conn,
+    :os_pid,
+    :database_path,
+    :scan_timeout,
+    :max_scan_memory,
+    :current,
+    :timer_ref,
+    :pending_reload
+  ]
+
+  def start_link(opts) do
+    GenServer.start_link(__MODULE__, opts)
+  end
+
+  def child_spec(opts) do
+    %{
+      id: __MODULE__,
+      start: {__MODULE__, :start_link, [opts]},
+      shutdown: 5_000,
+      restart: :permanent,
+      type: :worker
+    }
+  end
+
+  # ── GenServer Callbacks ────────────────────────────────────────────────────
+
+  @impl true
+  def init(opts) do
+    Process.flag(:trap_exit, true)
+
+    state = %__MODULE__{
+      pool: Keyword.fetch!(opts, :pool),
+      zygote: Keyword.get(opts, :zygote, false),
+      database_path: Keyword.fetch!(opts, :database_path),
+      scan_timeout: Keyword.fetch!(opts, :scan_timeout),
+      max_scan_memory: Keyword.get(opts, :max_scan_memory, :infinity)
+    }
+
+    {:ok, state, {:continue, :connect}}
+  end
+
+  @impl true
+  def handle_continue(:connect, state) do
+    case connect(state, state.database_path) do
+      {:ok, conn, os_pid} ->
+        Pool.checkin(state.pool, self())
+        {:noreply, %{state | conn: conn, os_pid: os_pid}}
+
+      {:error, reason} ->
+        {:stop, {:worker_start_failed, reason}, state}
+    end
+  end
+
+  @impl true
+  def handle_info({:scan, from, request}, state) do
+    send_request(state, encode_request(request, max_memory(state.max_scan_memory)))
+    timer_ref = start_timer(state.scan_timeout)
+    {:noreply, %{state | current: {from, request}, timer_ref: timer_ref}}
+  end
+
+  def handle_info({conn, {:data, reply}}, %__MODULE__{conn: conn} = state) do
+    handle_reply(reply, state)
+  end
+
+  def handle_info({:tcp, conn, reply}, %__MODULE__{conn: conn} = state) do
+    handle_reply(reply, state)
+  end
+
+  def handle_info({conn, {:exit_status, status}}, %__MODULE__{conn: conn} = state) do
+    Logger.error("Isolated: scan worker exited with status #{status}")
+    fail_current(state, "scan worker crashed (exit status #{status})")
+    {:stop, {:worker_exited, status}, %{state | conn: nil}}
+  end
+
+  def handle_info({:tcp_closed, conn}, %__MODULE__{conn: conn} = state) do
+    Logger.error("Isolated: zygote scanner #{state.os_pid} closed its connection")
+    fail_current(state, "scan worker crashed")
+    {:stop, :worker_exited, %{state | conn: nil}}
+  end
+
+  def handle_info(:scan_timeout, %__MODULE__{current: {_from, _request}} = state) do
+    Logger.error("Isolated: scan exceeded #{state.scan_timeout}ms, killing worker")
+    fail_current(state, "scan timed out")
+    kill_worker(state)
+    disconnect(state)
+    {:stop, :scan_timeout, %{state | conn: nil}}
+  end
+
+  def handle_info({:reload, database_path}, state) do
+    database_path = database_path || state.database_path
+
+    # The pool takes an idle worker out of its queue until it reports the
+    # reload done; requests that still arrive simply wait in this mailbox.
+    if state.current do
+      {:noreply, %{state | pending_reload: database_path}}
+    else
+      reload(state, database_path)
+    end
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, state) do
+    fail_current(state, "scan worker stopped")
+    disconnect(state)
+    :ok
+  end
+
+  # ── Internal ──────────────────────────────────────────────────────────────
+
+  defp handle_reply(reply, %__MODULE__{current: {from, _request}} = state) do
+    cancel_timer(state.timer_ref)
+    GenServer.reply(from, decode_reply(reply, state.pool))
+    state = %{state | current: nil, timer_ref: nil}
+
+    case state.pending_reload do
+      nil ->
+        Pool.checkin(state.pool, self())
+        {:noreply, state}
+
+      database_path ->
+        with {:noreply, state} <- reload(%{state | pending_reload: nil}, database_path) do
+          Pool.checkin(state.pool, self())
+          {:noreply, state}
+        end
+    end
+  end
+
+  defp reload(state, database_path) do
+    disconnect(state)
+
+    case connect(state, database_path) do
+      {:ok, conn, os_pid} ->
+        Pool.reloaded(state.pool, self())
+        {:noreply, %{state | conn: conn, os_pid: os_pid, database_path: database_path}}
+
+      {:error, reason} ->
+        {:stop, {:worker_start_failed, reason}, %{state | conn: nil}}
+    end
+  end
+
+  defp connect(%__MODULE__{zygote: true, pool: pool}, _database_path) do
+    path = Zygote.socket_path(pool)
+
+    with {:ok, socket} <- connect_socket(path) do
+      # The forked scanner announces its OS pid so a stuck scan can be killed.
+      case :gen_tcp.recv(socket, 0, @load_timeout) do
+        {:ok, <<?R, _signatures::32, os_pid::32>>} ->
+          :ok = :inet.setopts(socket, active: true)
+          {:ok, socket, os_pid}
+
+        {:ok, <<?E, message::binary>>} ->
+          :gen_tcp.close(socket)
+          {:error, message}
+
+        {:error, reason} ->
+          :gen_tcp.close(socket)
+          {:error, "zygote scanner did not become ready: #{inspect(reason)}"}
+      end
+    end
+  end
+
+  defp connect(_state, database_path), do: open_port(database_path)
+
+  defp connect_socket(path) do
+    case :gen_tcp.connect({:local, path}, 0, [:binary, packet: 4, active: false]) do
+      {:ok, socket} -> {:ok, socket}
+      {:error, reason} -> {:error, "failed to connect to zygote: #{inspect(reason)}"}
+    end
+  end
+
+  defp open_port(database_path) do
+    executable = Isolated.executable()
+
+    port =
+      Port.open({:spawn_executable, executable}, [
+        :binary,
+        :exit_status,
+        :use_stdio,
+        packet: 4,
+        args: [database_path]
+      ])
+
+    {:os_pid, os_pid} = Port.info(port, :os_pid)
+
+    # Loading and compiling the database takes seconds; the worker reports
+    # readiness (or the load error) with its first message.
+    receive do
+      {^port, {:data, <<?R, _signatures::32>>}} ->
+        {:ok, port, os_pid}
+
+      {^port, {:data, <<?E, message::binary>>}} ->
+        {:error, message}
+
+      {^port, {:exit_status, status}} ->
+        {:error, "clamav_worker exited with status #{status}"}
+    after
+      @load_timeout ->
+        Port.close(port)
+        {:error, "clamav_worker did not become ready"}
+    end
+  end
+
+  defp send_request(%__MODULE__{zygote: true, conn: socket}, request) do
+    :gen_tcp.send(socket, request)
+  end
+
+  defp send_request(%__MODULE__{conn: port}, request) do
+    Port.command(port, request)
+  end
+
+  # 0 tells the worker not to cap the scan
+  defp max_memory(:infinity), do: 0
+  defp max_memory(bytes), do: bytes
+
+  defp encode_request({:scan_file, path, options}, max_memory) do
+    [<<?F, options::32, max_memory::64>>, path]
+  end
+
+  defp encode_request({:scan_buffer, buffer, options}, max_memory) do
+    [<<?B, options::32, max_memory::64>>, buffer]
+  end
+
+  defp encode_request({:scan_shared, {_ref, fd, size}, options}, max_memory) do
+    os_pid = String.to_integer(System.pid())
+    <<?M, options::32, max_memory::64, os_pid::32, fd::32, size::64>>
+  end
+
+  defp decode_reply(<<?C, peak::64>>, pool) do
+    emit_scan(pool, peak, :clean)
+    {:scanned, {:ok, :clean}, %{peak_memory: peak}}
+  end
+
+  defp decode_reply(<<?V, peak::64, name::binary>>, pool) do
+    emit_scan(pool, peak, :virus)
+    {:scanned, {:virus, name}, %{peak_memory: peak}}
+  end
+
+  defp decode_reply(<<?L, peak::64>>, pool) do
+    emit_scan(pool, peak, :memory_limit)
+    {:scanned, {:error, "scan memory limit exceeded"}, %{peak_memory: peak}}
+  end
+
+  defp decode_reply(<<?E, message::binary>>, _pool), do: {:error, message}
+
+  defp emit_scan(pool, peak, result) do
+    :telemetry.execute(
+      [:ex_clamav, :isolated, :scan],
+      %{peak_memory: peak},
+      %{pool: pool, result: result}
+    )
+  end
+
+  defp fail_current(%__MODULE__{current: {from, _request}}, message) do
+    GenServer.reply(from, {:error, message})
+  end
+
+  defp fail_current(_state, _message), do: :ok
+
+  defp disconnect(%__MODULE__{conn: nil}), do: :ok
+
+  # The OS process exits on its own once it reads EOF (or fails to write a
+  # reply) on the closed port or socket.
+  defp disconnect(%__MODULE__{zygote: zygote, conn: conn}) do
+    if zygote, do: :gen_tcp.close(conn), else: Port.close(conn)
+    :ok
+  rescue
+    ArgumentError -> :ok
+  end
+
+  # A worker stuck inside libclamav never reads EOF, so a timed-out scan is
+  # killed outright. Called before the connection is closed, and only if the
+  # pid still runs clamav_worker, so a recycled pid is never signalled.
+  defp kill_worker(%__MODULE__{os_pid: os_pid}) do
+    case File.read_link("/proc/#{os_pid}/exe") do
+      {:ok, target} ->
+        if String.starts_with?(Path.basename(target), "clamav_worker") do
+          System.cmd("kill", ["-9", Integer.to_string(os_pid)], stderr_to_stdout: true)
+        end
+
+        :ok
+
+      {:error, _reason} ->
+        :ok
+    end
+  end
+
+  defp start_timer(:infinity), do: nil
+  defp start_timer(timeout), do: Process.send_after(self(), :scan_timeout, timeout)
+
+  defp cancel_timer(nil), do: :ok
+  defp cancel_timer(ref), do: Process.cancel_timer(ref)
+end
@@ -0,0 +1,156 @@
+defmodule ExClamav.Isolated.Zygote do
+  @moduledoc false
+
+  # Owns the `clamav_worker --zygote` process of an `ExClamav.Isolated` pool.
+  # The zygote compiles the engine once and forks a scanner for every worker
+  # connection, so scanners share the signature pages copy-on-write.
+  #
+  # A definition reload starts a fresh zygote on a new socket, publishes the
+  # new path and asks the pool to move its workers over. Scanners forked from
+  # the old zygote keep serving until their worker reconnects, so reloads do
+  # not fail in-flight scans.
+
+  use GenServer
+
+  alias ExClamav.Isolated
+  alias ExClamav.Isolated.Pool
+
+  require Logger
+
+  @load_timeout :timer.minutes(5)
+
+  defstruct [:pool, :database_path, :port, :socket_path]
+
+  def start_link(opts) do
+    GenServer.start_link(__MODULE__, opts, name: server_name(Keyword.fetch!(opts, :pool)))
+  end
+
+  def child_spec(opts) do
+    %{
+      id: __MODULE__,
+      start: {__MODULE__, :start_link, [opts]},
+      shutdown: 5_000,
+      restart: :permanent,
+      type: :worker
+    }
+  end
+
+  @doc false
+  def socket_path(pool) do
+    :persistent_term.get({__MODULE__, pool, :socket_path})
+  end
+
+  @doc false
+  def reload(pool, database_path) do
+    GenServer.cast(server_name(pool), {:reload, database_path})
+  end
+
+  # ── GenServer Callbacks ────────────────────────────────────────────────────
+
+  @impl true
+  def init(opts) do
+    Process.flag(:trap_exit, true)
+
+    pool = Keyword.fetch!(opts, :pool)
+    database_path = Keyword.fetch!(opts, :database_path)
+
+    # Started synchronously: the workers that follow in the supervisor connect
+    # to the socket as soon as they start.
+    case start_zygote(database_path) do
+      {:ok, port, socket_path} ->
+        :persistent_term.put({__MODULE__, pool, :socket_path}, socket_path)
+
+        {:ok,
+         %__MODULE__{
+           pool: pool,
+           database_path: database_path,
+           port: port,
+           socket_path: socket_path
+         }}
+
+      {:error, reason} ->
+        {:stop, {:zygote_start_failed, reason}}
+    end
+  end
+
+  @impl true
+  def handle_cast({:reload, database_path}, state) do
+    database_path = database_path || state.database_path
+
+    case start_zygote(database_path) do
+      {:ok, port, socket_path} ->
+        :persistent_term.put({__MODULE__, state.pool, :socket_path}, socket_path)
+        stop_zygote(state)
+        Pool.reload_workers(state.pool)
+
+        {:noreply,
+         %{state | port: port, socket_path: socket_path, database_path: database_path}}
+
+      {:error, reason} ->
+        Logger.error("Isolated: zygote reload failed, keeping current engine: #{reason}")
+        {:noreply, state}
+    end
+  end
+
+  @impl true
+  def handle_info({port, {:exit_status, status}}, %__MODULE__{port: port} = state) do
+    Logger.error("Isolated: zygote exited with status #{status}")
+    {:stop, {:zygote_exited, status}, %{state | port: nil}}
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, state) do
+    stop_zygote(state)
+    :ok
+  end
+
+  # ── Internal ──────────────────────────────────────────────────────────────
+
+  defp start_zygote(database_path) do
+    executable = Isolated.executable()
+
+    socket_path =
+      Path.join(System.tmp_dir!(), "ex_clamav_zygote_#{System.unique_integer([:positive])}.sock")
+
+    port =
+      Port.open({:spawn_executable, executable}, [
+        :binary,
+        :exit_status,
+        :use_stdio,
+        packet: 4,
+        args: [database_path, "--zygote", socket_path]
+      ])
+
+    receive do
+      {^port, {:data, <<?R, _signatures::32>>}} ->
+        {:ok, port, socket_path}
+
+      {^port, {:data, <<?E, message::binary>>}} ->
+        {:error, message}
+
+      {^port, {:exit_status, status}} ->
+        {:error, "clamav_worker zygote exited with status #{status}"}
+    after
+      @load_timeout ->
+        Port.close(port)
+        {:error, "clamav_worker zygote did not become ready"}
+    end
+  end
+
+  # Closing stdin makes the zygote unlink its socket and exit; the scanners
+  # it already forked keep running until their connections close.
+  defp stop_zygote(%__MODULE__{port: nil}), do: :ok
+
+  defp stop_zygote(%__MODULE__{port: port}) do
+    Port.close(port)
+    :ok
+  rescue
+    ArgumentError -> :ok
+  end
+
+  defp server_name(pool), do: Module.concat(pool, Zygote)
+end
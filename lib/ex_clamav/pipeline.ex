@@ -0,0 +1,219 @@
+defmodule ExClamav.Pipeline do
+  @moduledoc """
+  A composable ingest pipeline with per-stage concurrency, batching and
+  telemetry.
+
+  Services that scan uploads usually repeat the same steps: size check,
+  hash, cache lookup, allowlist, engine scan, metadata capture and result
+  store. `ExClamav.Pipeline` gives those steps explicit stage boundaries, so
+  each stage can run with its own concurrency and batch size and report its
+  own latency and throughput, instead of only the engine scan being visible.
+
+  Items are maps that stages enrich as they pass through (binaries are
+  wrapped as `%{buffer: binary}`). A stage function returns:
+
+  * `{:ok, item}` — continue with the next stage.
+  * `{:done, item}` — finish early, skipping the remaining stages (for
+    example on a cache hit).
+  * `{:error, reason}` — stop the item with an error.
+
+  Stages declared with `:batch_size` receive a list of up to that many
+  items and must return one result per item, in order. Exceptions raised by
+  a stage, and exits such as a timed-out `GenServer.call/3` inside it,
+  become `{:error, message}` for the items it was handling. Stage calls run
+  in tasks linked to the caller, so a stage must not link to processes that
+  may crash: such a crash still takes the caller down. Results are returned
+  in input order.
+
+  Ready-made stages live in `ExClamav.Pipeline.Stages`.
+
+  ## Usage
+
+      alias ExClamav.Pipeline
+      alias ExClamav.Pipeline.Stages
+
+      pipeline =
+        Pipeline.new(:uploads)
+        |> Pipeline.stage(:size, Stages.max_size(25 * 1024 * 1024))
+        |> Pipeline.stage(:hash, Stages.hash(), concurrency: 4)
+        |> Pipeline.stage(:cache, Stages.cache_lookup(ExClamav.VerdictCache))
+        |> Pipeline.stage(:allowlist, Stages.allowlist(:trusted))
+        |> Pipeline.stage(:scan, Stages.scan(engine), concurrency: 8)
+        |> Pipeline.stage(:store, Stages.cache_store(ExClamav.VerdictCache))
+
+      Pipeline.run(pipeline, uploads)
+      #=> [{:ok, %{buffer: ..., digest: ..., verdict: {:ok, :clean}}}, ...]
+
+  ## Stage options
+
+  * `:concurrency` — batches of this stage processed in parallel (default: `System.schedulers_online/0`).
+  * `:batch_size`  — hand the stage lists of up to this many items (default: unbatched).
+  * `:timeout`     — per-call timeout in ms; timed-out items fail (default: `:infinity`).
+
+  ## Telemetry
+
+  Every stage call is wrapped in a `[:ex_clamav, :pipeline, :stage]` span
+  (`:start`, `:stop` and `:exception` events). The `:stop` event carries
+  `:duration` plus `:count` (items handled) and `:errors` measurements.
+  Metadata: `:pipeline`, `:stage` and `:batch_size`.
+  """
+
+  alias ExClamav.Pipeline.Stage
+
+  @type item :: map()
+  @type stage_result :: {:ok, item()} | {:done, item()} | {:error, term()}
+  @type result :: {:ok, item()} | {:error, term()}
+
+  @type stage_fun :: (item() -> stage_result()) | ([item()] -> [stage_result()])
+
+  @type stage_option ::
+          {:concurrency, pos_integer()}
+          | {:batch_size, pos_integer()}
+          | {:timeout, timeout()}
+
+  @type t :: %__MODULE__{name: term(), stages: [Stage.t()]}
+
+  defstruct name: :default, stages: []
+
+  defmodule Stage do
+    @moduledoc false
+
+    @type t :: %__MODULE__{
+            name: term(),
+            fun: function(),
+            concurrency: pos_integer(),
+            batch_size: pos_integer() | nil,
+            timeout: timeout()
+          }
+
+    defstruct [:name, :fun, :concurrency, :batch_size, :timeout]
+  end
+
+  @doc """
+  Create an empty pipeline. `name` is reported in telemetry metadata.
+  """
+  @spec new(term()) :: t()
+  def new(name \\ :default), do: %__MODULE__{name: name}
+
+  @doc """
+  Append a stage. See the module documentation for the stage contract.
+  """
+  @spec stage(t(), term(), stage_fun(), [stage_option()]) :: t()
+  def stage(%__MODULE__{} = pipeline, name, fun, opts \\ []) when is_function(fun, 1) do
+    stage = %Stage{
+      name: name,
+      fun: fun,
+      concurrency: Keyword.get(opts, :concurrency, System.schedulers_online()),
+      batch_size: Keyword.get(opts, :batch_size),
+      timeout: Keyword.get(opts, :timeout, :infinity)
+    }
+
+    %{pipeline | stages: pipeline.stages ++ [stage]}
+  end
+
+  @doc """
+  Lazily run `enumerable` through the pipeline, yielding one result per input.
+
+  Stages overlap: while one stage works on a batch, earlier stages already
+  process the following items.
+  """
+  @spec stream(t(), Enumerable.t()) :: Enumerable.t()
+  def stream(%__MODULE__{} = pipeline, enumerable) do
+    items = Stream.map(enumerable, &{:cont, wrap(&1)})
+
+    pipeline.stages
+    |> Enum.reduce(items, &run_stage(&2, &1, pipeline.name))
+    |> Stream.map(fn
+      {:cont, item} -> {:ok, item}
+      {:done, item} -> {:ok, item}
+      {:error, _reason} = error -> error
+    end)
+  end
+
+  @doc """
+  Run `enumerable` through the pipeline and collect the results in input order.
+  """
+  @spec run(t(), Enumerable.t()) :: [result()]
+  def run(%__MODULE__{} = pipeline, enumerable) do
+    pipeline |> stream(enumerable) |> Enum.to_list()
+  end
+
+  # ── Stages ───────────────────────────────────────────────────────────────
+
+  defp wrap(buffer) when is_binary(buffer), do: %{buffer: buffer}
+  defp wrap(item) when is_map(item), do: item
+
+  defp run_stage(envelopes, %Stage{} = stage, pipeline) do
+    envelopes
+    |> Stream.chunk_every(stage.batch_size || 1)
+    |> Task.async_stream(&run_batch(&1, stage, pipeline),
+      max_concurrency: stage.concurrency,
+      timeout: stage.timeout,
+      on_timeout: :kill_task,
+      zip_input_on_exit: true
+    )
+    |> Stream.flat_map(fn
+      {:ok, envelopes} ->
+        envelopes
+
+      {:exit, {envelopes, reason}} ->
+        fail_pending(envelopes, "Stage #{inspect(stage.name)} exited: #{inspect(reason)}")
+    end)
+  end
+
+  # Items that already finished or failed pass through untouched.
+  defp run_batch(envelopes, stage, pipeline) do
+    case for({:cont, item} <- envelopes, do: item) do
+      [] -> envelopes
+      items -> merge(envelopes, call_stage(stage, items, pipeline))
+    end
+  end
+
+  defp call_stage(stage, items, pipeline) do
+    metadata = %{pipeline: pipeline, stage: stage.name, batch_size: length(items)}
+
+    :telemetry.span([:ex_clamav, :pipeline, :stage], metadata, fn ->
+      results = invoke(stage, items)
+      errors = Enum.count(results, &match?({:error, _}, &1))
+      {results, %{count: length(items), errors: errors}, metadata}
+    end)
+  rescue
+    exception ->
+      List.duplicate({:error, Exception.message(exception)}, length(items))
+  catch
+    :exit, reason ->
+      message = "Stage #{inspect(stage.name)} exited: #{inspect(reason)}"
+      List.duplicate({:error, message}, length(items))
+  end
+
+  defp invoke(%Stage{batch_size: nil, fun: fun}, [item]), do: [normalize(fun.(item))]
+
+  defp invoke(%Stage{name: name, fun: fun}, items) do
+    case fun.(items) do
+      results when is_list(results) and length(results) == length(items) ->
+        Enum.map(results, &normalize/1)
+
+      _other ->
+        raise ArgumentError,
+              "batched stage #{inspect(name)} must return one result per item"
+    end
+  end
+
+  defp normalize({:ok, item}) when is_map(item), do: {:cont, item}
+  defp normalize({:done, item}) when is_map(item), do: {:done, item}
+  defp normalize({:error, _reason} = error), do: error
+  defp normalize(other), do: {:error, "Unexpected stage result: #{inspect(other)}"}
+
+  defp merge([{:cont, _item} | envelopes], [result | results]),
+    do: [result | merge(envelopes, results)]
+
+  defp merge([envelope | envelopes], results), do: [envelope | merge(envelopes, results)]
+  defp merge([], []), do: []
+
+  defp fail_pending(envelopes, reason) do
+    Enum.map(envelopes, fn
+      {:cont, _item} -> {:error, reason}
+      envelope -> envelope
+    end)
+  end
+end
@@ -0,0 +1,110 @@
+defmodule ExClamav.Pipeline.Stages do
+  @moduledoc """
+  Ready-made stages for `ExClamav.Pipeline`.
+
+  They operate on items carrying the content to scan under `:buffer` and
+  add their findings under well-known keys:
+
+  * `max_size/1` — sets `:size`.
+  * `hash/0` — sets `:digest`.
+  * `cache_lookup/1` — sets `:verdict` and `cached: true` on a hit, finishing the item.
+  * `allowlist/1` — sets `verdict: {:ok, :clean}` and `allowlisted: true` on a hit,
+    finishing the item.
+  * `scan/2` — sets `:verdict`.
+  * `cache_store/1` — caches `:verdict` under `:digest`.
+
+  Application-specific steps (metadata capture, result stores) are plain
+  functions following the same contract.
+  """
+
+  alias ExClamav.Allowlist
+  alias ExClamav.ClamavGenServer
+  alias ExClamav.Engine
+  alias ExClamav.VerdictCache
+
+  @doc """
+  Reject items whose buffer is larger than `limit` bytes.
+  """
+  @spec max_size(non_neg_integer()) :: ExClamav.Pipeline.stage_fun()
+  def max_size(limit) do
+    fn %{buffer: buffer} = item ->
+      size = byte_size(buffer)
+
+      if size > limit do
+        {:error, "Input of #{size} bytes exceeds the #{limit} byte limit"}
+      else
+        {:ok, Map.put(item, :size, size)}
+      end
+    end
+  end
+
+  @doc """
+  Compute the SHA-256 digest used by the verdict cache.
+  """
+  @spec hash() :: ExClamav.Pipeline.stage_fun()
+  def hash do
+    fn %{buffer: buffer} = item -> {:ok, Map.put(item, :digest, VerdictCache.digest(buffer))} end
+  end
+
+  @doc """
+  Finish items whose digest already has a cached verdict.
+  """
+  @spec cache_lookup(atom()) :: ExClamav.Pipeline.stage_fun()
+  def cache_lookup(cache \\ VerdictCache) do
+    fn %{digest: digest} = item ->
+      case VerdictCache.get(cache, digest) do
+        {:ok, verdict} -> {:done, Map.merge(item, %{verdict: verdict, cached: true})}
+        :miss -> {:ok, item}
+      end
+    end
+  end
+
+  @doc """
+  Finish items whose digest is in the allowlist registered under `name`.
+
+  Runs after `hash/0`, which provides the digest.
+  """
+  @spec allowlist(Allowlist.name()) :: ExClamav.Pipeline.stage_fun()
+  def allowlist(name) do
+    fn %{digest: digest} = item ->
+      if Allowlist.member?(name, digest) do
+        {:done, Map.merge(item, %{verdict: {:ok, :clean}, allowlisted: true})}
+      else
+        {:ok, item}
+      end
+    end
+  end
+
+  @doc """
+  Scan the buffer with an engine or a running `ExClamav.ClamavGenServer`.
+  """
+  @spec scan(Engine.t() | GenServer.server(), non_neg_integer()) ::
+          ExClamav.Pipeline.stage_fun()
+  def scan(engine_or_server, options \\ 0)
+
+  def scan(%Engine{} = engine, options) do
+    fn %{buffer: buffer} = item -> verdict(item, Engine.scan_buffer(engine, buffer, options)) end
+  end
+
+  def scan(server, _options) do
+    fn %{buffer: buffer} = item -> verdict(item, ClamavGenServer.scan_buffer(server, buffer)) end
+  end
+
+  defp verdict(_item, {:error, _reason} = error), do: error
+  defp verdict(item, verdict), do: {:ok, Map.put(item, :verdict, verdict)}
+
+  @doc """
+  Remember definitive verdicts so later duplicates finish at `cache_lookup/1`.
+  """
+  @spec cache_store(atom()) :: ExClamav.Pipeline.stage_fun()
+  def cache_store(cache \\ VerdictCache) do
+    fn
+      %{digest: digest, verdict: verdict} = item ->
+        VerdictCache.put(cache, digest, verdict)
+        {:ok, item}
+
+      item ->
+        {:ok, item}
+    end
+  end
+end
@@ -0,0 +1,126 @@
+defmodule ExClamav.ScanStream do
+  @moduledoc """
+  Lazy, concurrent scanning of large enumerables.
+
+  Bulk jobs that wrap `Task.async_stream/3` around `ExClamav.Engine.scan_file/3`
+  pay a task and a NIF dispatch per item and cannot share the concurrency
+  limit of the service's scan pool. `stream/2` (also available as
+  `ExClamav.stream_scan/2`) pulls items lazily, groups them into chunks and
+  scans each chunk with one native batch call: against an engine directly,
+  or as one job on an `ExClamav.ClamavGenServer` pool, where it counts
+  against the pool's `:max_concurrency` like any other request.
+
+  Memory stays bounded: at most `:max_concurrency` chunks are in flight, and
+  a chunk is closed early once its buffers reach `:max_chunk_bytes` (files
+  are read by the engine and do not count).
+
+  ## Usage
+
+      Path.wildcard("/srv/archive/**/*")
+      |> ExClamav.stream_scan(source: &{:file, &1}, engine: engine, ordered: false)
+      |> Stream.filter(&match?({_path, {:virus, _}}, &1))
+      |> Enum.each(&quarantine/1)
+
+  Each item is emitted as `{item, verdict}`.
+
+  ## Options
+
+  * `:engine`          — scan with this `ExClamav.Engine` directly.
+  * `:server`          — otherwise, scan through this `ClamavGenServer`
+    (default: `ExClamav.ClamavGenServer`).
+  * `:source`          — `fn item -> {:file, path} | {:buffer, binary} end`
+    (default: binaries are scanned as buffers; `{:file, _}` and
+    `{:buffer, _}` items are used as is).
+  * `:chunk_size`      — items per native batch (default: `32`).
+  * `:max_chunk_bytes` — buffered bytes per chunk (default: 16 MiB).
+  * `:max_concurrency` — chunks scanned at once (default: `System.schedulers_online/0`).
+  * `:ordered`         — emit results in input order (default: `true`).
+  * `:scan_options`    — libclamav options mask for `:engine` scans (default: `0`).
+  * `:tenant`, `:priority`, `:deadline` — passed to the `:server` pool (see
+    `ExClamav.ClamavGenServer.scan_file/3`).
+  """
+
+  alias ExClamav.ClamavGenServer
+  alias ExClamav.Engine
+
+  @type option ::
+          {:engine, Engine.t()}
+          | {:server, GenServer.server()}
+          | {:source, (term() -> ClamavGenServer.item())}
+          | {:chunk_size, pos_integer()}
+          | {:max_chunk_bytes, pos_integer()}
+          | {:max_concurrency, pos_integer()}
+          | {:ordered, boolean()}
+          | {:scan_options, non_neg_integer()}
+          | ClamavGenServer.scan_option()
+
+  @doc """
+  Returns a stream of `{item, verdict}` for the items of `enumerable`.
+  """
+  @spec stream(Enumerable.t(), [option()]) :: Enumerable.t()
+  def stream(enumerable, opts \\ []) do
+    source = Keyword.get(opts, :source, &default_source/1)
+    chunk_size = Keyword.get(opts, :chunk_size, 32)
+    max_bytes = Keyword.get(opts, :max_chunk_bytes, 16 * 1024 * 1024)
+    scan_chunk = chunk_scanner(opts)
+
+    enumerable
+    |> Stream.map(&{&1, source.(&1)})
+    |> chunk(chunk_size, max_bytes)
+    |> Task.async_stream(
+      fn chunk ->
+        {originals, items} = Enum.unzip(chunk)
+        Enum.zip(originals, scan_chunk.(items))
+      end,
+      max_concurrency: Keyword.get(opts, :max_concurrency, System.schedulers_online()),
+      ordered: Keyword.get(opts, :ordered, true),
+      timeout: :infinity
+    )
+    |> Stream.flat_map(fn {:ok, results} -> results end)
+  end
+
+  defp chunk(stream, chunk_size, max_bytes) do
+    Stream.chunk_while(
+      stream,
+      {[], 0, 0},
+      fn {_original, item} = entry, {acc, count, bytes} ->
+        acc = [entry | acc]
+        count = count + 1
+        bytes = bytes + item_bytes(item)
+
+        if count >= chunk_size or bytes >= max_bytes,
+          do: {:cont, Enum.reverse(acc), {[], 0, 0}},
+          else: {:cont, {acc, count, bytes}}
+      end,
+      fn
+        {[], _count, _bytes} -> {:cont, {[], 0, 0}}
+        {acc, _count, _bytes} -> {:cont, Enum.reverse(acc), {[], 0, 0}}
+      end
+    )
+  end
+
+  defp item_bytes({:buffer, buffer}), do: byte_size(buffer)
+  defp item_bytes({:file, _path}), do: 0
+
+  defp chunk_scanner(opts) do
+    case Keyword.fetch(opts, :engine) do
+      {:ok, engine} ->
+        scan_options = Keyword.get(opts, :scan_options, 0)
+
+        fn items ->
+          case Engine.scan_batch(engine, items, scan_options) do
+            {:error, _reason} = error -> List.duplicate(error, length(items))
+            verdicts -> verdicts
+          end
+        end
+
+      :error ->
+        server = Keyword.get(opts, :server, ClamavGenServer)
+        scan_opts = Keyword.take(opts, [:tenant, :priority, :deadline])
+        &ClamavGenServer.scan_batch(server, &1, scan_opts)
+    end
+  end
+
+  defp default_source(item) when is_binary(item), do: {:buffer, item}
+  defp default_source({kind, _} = item) when kind in [:file, :buffer], do: item
+end
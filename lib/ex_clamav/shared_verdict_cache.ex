@@ -0,0 +1,191 @@
+defmodule ExClamav.SharedVerdictCache do
+  @moduledoc """
+  A persistent verdict cache shared by every OS process on the host.
+
+  `ExClamav.VerdictCache` lives in ETS, so it is empty after every deploy and
+  each BEAM node on a host keeps its own copy. `ExClamav.SharedVerdictCache`
+  keeps verdicts in a memory-mapped file instead: an open-addressing table of
+  fixed-size slots keyed by SHA-256 digest, which survives restarts and is
+  read and written concurrently by all nodes that open the same path.
+
+  Every entry records the database generation it was computed with, and
+  lookups only match entries for the generation they ask for. Loading new
+  definitions therefore invalidates the cache in O(1) without rewriting the
+  file; stale slots are reused as new verdicts arrive. Use `generation/1`
+  rather than libclamav's database version, which only tracks `daily` and
+  stays 0 for local signature directories.
+
+  Writers never wait for each other: a verdict whose slot is being written
+  by another process is simply not cached. Only definitive verdicts
+  (`{:ok, :clean}` and `{:virus, name}`) are stored.
+
+  ## Usage
+
+      {:ok, _slots} = ExClamav.SharedVerdictCache.open(:host, "/var/cache/ex_clamav/verdicts")
+
+      generation = ExClamav.SharedVerdictCache.generation("/var/lib/clamav")
+      digest = ExClamav.VerdictCache.digest(buffer)
+
+      ExClamav.SharedVerdictCache.fetch(:host, digest, generation, fn ->
+        ExClamav.scan_buffer(engine, buffer)
+      end)
+
+  `ExClamav.ClamavGenServer` accepts `shared_cache: :host` to consult and
+  fill the cache around its scans.
+
+  ## Options
+
+  * `:slots` — capacity of a newly created file, 128 bytes each; an existing
+    file keeps the size it was created with (default: `262_144`, 32 MiB).
+  """
+
+  alias ExClamav.VerdictCache
+
+  @type name :: atom()
+  @type digest :: <<_::256>>
+  @type verdict :: {:ok, :clean} | {:virus, String.t()}
+  @type generation :: non_neg_integer()
+
+  @default_slots 262_144
+
+  # Virus names longer than a slot holds are not cached.
+  @max_name_size 78
+
+  @doc """
+  Create or open the cache file at `path` and register it under `name`.
+
+  Returns the number of slots in the file.
+  """
+  @spec open(name(), Path.t(), [{:slots, pos_integer()}]) ::
+          {:ok, pos_integer()} | {:error, String.t()}
+  def open(name, path, opts \\ []) when is_atom(name) do
+    slots = Keyword.get(opts, :slots, @default_slots)
+
+    with :ok <- mkdir_p(Path.dirname(path)) do
+      case ExClamav.Nif.vcache_open(path, slots) do
+        {:ok, ref, slots} ->
+          :persistent_term.put({__MODULE__, name}, %{ref: ref, path: path, slots: slots})
+          {:ok, slots}
+
+        {:error, reason} ->
+          {:error, IO.chardata_to_string(reason)}
+      end
+    end
+  end
+
+  @doc """
+  Unregister the cache; the file stays on disk for the next `open/3`.
+  """
+  @spec close(name()) :: :ok
+  def close(name) do
+    :persistent_term.erase({__MODULE__, name})
+    :ok
+  end
+
+  @doc """
+  The generation of the signature database in `database_path`: a 64-bit hash
+  over the name and SHA-256 of every file in the directory, so it changes
+  whenever main, daily, bytecode or a local signature file does.
+
+  Hash the directory before loading an engine from it. Definitions replaced
+  during the load then end up under the old generation, never the reverse.
+  If the directory cannot be read a random generation is returned, so
+  nothing cached under it outlives the engine.
+  """
+  @spec generation(Path.t()) :: generation()
+  def generation(database_path) do
+    with {:ok, names} <- File.ls(database_path),
+         {:ok, parts} <- digest_files(database_path, Enum.sort(names)) do
+      <<generation::64, _::binary>> = :crypto.hash(:sha256, parts)
+      generation
+    else
+      _ -> :binary.decode_unsigned(:crypto.strong_rand_bytes(8))
+    end
+  end
+
+  defp digest_files(dir, names) do
+    Enum.reduce_while(names, {:ok, []}, fn name, {:ok, acc} ->
+      path = Path.join(dir, name)
+
+      if File.regular?(path) do
+        case VerdictCache.file_digest(path) do
+          {:ok, digest} -> {:cont, {:ok, [acc, name, 0, digest]}}
+          {:error, _reason} = error -> {:halt, error}
+        end
+      else
+        {:cont, {:ok, acc}}
+      end
+    end)
+  end
+
+  @doc """
+  Look up the verdict for `digest` computed with database `generation`.
+  """
+  @spec get(name(), digest(), generation()) :: {:ok, verdict()} | :miss
+  def get(name, <<_::256>> = digest, version) when is_integer(version) and version >= 0 do
+    case ExClamav.Nif.vcache_get(ref(name), digest, version) do
+      :miss -> :miss
+      verdict -> {:ok, verdict}
+    end
+  end
+
+  @doc """
+  Store a verdict. Errors and overly long virus names are not cached.
+  """
+  @spec put(name(), digest(), generation(), term()) :: :ok
+  def put(name, <<_::256>> = digest, version, verdict) when is_integer(version) do
+    case verdict do
+      {:ok, :clean} ->
+        ExClamav.Nif.vcache_put(ref(name), digest, version, 1, "")
+
+      {:virus, virus} when byte_size(virus) <= @max_name_size ->
+        ExClamav.Nif.vcache_put(ref(name), digest, version, 2, virus)
+
+      _other ->
+        :ok
+    end
+
+    :ok
+  end
+
+  @doc """
+  Return the cached verdict for `digest`, or compute it with `fun` and cache it.
+  """
+  @spec fetch(name(), digest(), generation(), (-> term())) :: term()
+  def fetch(name, digest, version, fun) when is_function(fun, 0) do
+    case get(name, digest, version) do
+      {:ok, verdict} ->
+        verdict
+
+      :miss ->
+        verdict = fun.()
+        put(name, digest, version, verdict)
+        verdict
+    end
+  end
+
+  @doc """
+  Returns the path and slot count of an open cache.
+  """
+  @spec info(name()) :: %{path: Path.t(), slots: pos_integer()} | nil
+  def info(name) do
+    case :persistent_term.get({__MODULE__, name}, nil) do
+      %{path: path, slots: slots} -> %{path: path, slots: slots}
+      nil -> nil
+    end
+  end
+
+  defp ref(name) do
+    case :persistent_term.get({__MODULE__, name}, nil) do
+      %{ref: ref} -> ref
+      nil -> raise ArgumentError, "no shared verdict cache open as #{inspect(name)}"
+    end
+  end
+
+  defp mkdir_p(dir) do
+    case File.mkdir_p(dir) do
+      :ok -> :ok
+      {:error, reason} -> {:error, reason |> :file.format_error() |> IO.chardata_to_string()}
+    end
+  end
+end
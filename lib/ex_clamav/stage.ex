@@ -0,0 +1,81 @@
+if Code.ensure_loaded?(GenStage) do
+  defmodule ExClamav.Stage do
+    @moduledoc """
+    A GenStage producer-consumer that scans events against an
+    `ExClamav.ClamavGenServer`.
+
+    For GenStage pipelines that do not use Broadway. Each batch of events
+    received from upstream is queued on the scan pool at once, and the stage
+    asks for more only after every verdict is in, so demand follows the
+    pool's real capacity. Every event is emitted downstream as
+    `{event, verdict}`, in order.
+
+    Requires the optional `:gen_stage` dependency.
+
+    ## Usage
+
+        {:ok, producer} = GenStage.from_enumerable(Path.wildcard("/uploads/*"))
+
+        {:ok, scanner} =
+          ExClamav.Stage.start_link(
+            source: &{:file, &1},
+            subscribe_to: [{producer, max_demand: 32}]
+          )
+
+        GenStage.stream([scanner])
+        |> Stream.filter(&match?({_path, {:virus, _}}, &1))
+        |> Enum.to_list()
+
+    Set `max_demand` at or above the pool's `:max_concurrency` (or run
+    several stages), so the pool is kept busy.
+
+    ## Options
+
+    * `:name`         — registered name (default: none).
+    * `:server`       — the `ClamavGenServer` to scan with
+      (default: `ExClamav.ClamavGenServer`).
+    * `:source`       — `fn event -> {:file, path} | {:buffer, binary} end`
+      (default: binaries are scanned as buffers; `{:file, _}` and
+      `{:buffer, _}` events are used as is).
+    * `:subscribe_to` — upstream subscriptions, as for `GenStage` (default: `[]`).
+    * `:tenant`, `:priority`, `:deadline` — passed to the pool for every
+      event (see `ExClamav.ClamavGenServer.scan_file/3`).
+    """
+
+    use GenStage
+
+    alias ExClamav.ClamavGenServer
+
+    @doc """
+    Starts the stage.
+    """
+    @spec start_link(keyword()) :: GenServer.on_start()
+    def start_link(opts \\ []) do
+      case Keyword.get(opts, :name) do
+        nil -> GenStage.start_link(__MODULE__, opts)
+        name -> GenStage.start_link(__MODULE__, opts, name: name)
+      end
+    end
+
+    @impl true
+    def init(opts) do
+      state = %{
+        server: Keyword.get(opts, :server, ClamavGenServer),
+        source: Keyword.get(opts, :source, &default_source/1),
+        scan_opts: Keyword.take(opts, [:tenant, :priority, :deadline])
+      }
+
+      {:producer_consumer, state, subscribe_to: Keyword.get(opts, :subscribe_to, [])}
+    end
+
+    @impl true
+    def handle_events(events, _from, state) do
+      items = Enum.map(events, state.source)
+      verdicts = ClamavGenServer.scan_many(state.server, items, state.scan_opts)
+      {:noreply, Enum.zip(events, verdicts), state}
+    end
+
+    defp default_source(event) when is_binary(event), do: {:buffer, event}
+    defp default_source({kind, _} = item) when kind in [:file, :buffer], do: item
+  end
+end
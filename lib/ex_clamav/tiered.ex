@@ -0,0 +1,417 @@
+defmodule ExClamav.Tiered do
+  @moduledoc """
+  Two-tier scanning: a fast provisional verdict now, a thorough one later.
+
+  Interactive uploads need an answer within tens of milliseconds, but a
+  thorough scan of some content takes seconds. `ExClamav.Tiered` answers
+  every scan with a fast first pass that uses a lightweight options profile
+  and only looks at the leading bytes. Content that is risky by type or size
+  is then queued for a thorough background pass, and subscribers are told
+  when that pass disagrees with the provisional verdict. Interactive latency
+  no longer depends on the worst-case scan depth.
+
+  A virus found by the fast pass is final; nothing is re-scanned.
+
+  ## Usage
+
+      {:ok, _pid} = ExClamav.Tiered.start_link(database_path: "/var/lib/clamav")
+      :ok = ExClamav.Tiered.subscribe()
+
+      case ExClamav.Tiered.scan_buffer(upload) do
+        {verdict, :final} -> verdict
+        {verdict, {:provisional, ref}} -> MyApp.Uploads.mark_provisional(ref, verdict)
+      end
+
+      # Only sent when the thorough pass changes the verdict.
+      receive do
+        {:clamav_verdict_changed, ref, %{provisional: old, verdict: new}} -> ...
+      end
+
+  ## Options
+
+  * `:name`             — registered name (default: `ExClamav.Tiered`; `nil` for none).
+  * `:database_path`    — database directory (default: system default).
+  * `:fast_options`     — libclamav options mask for the first pass (default: `0`).
+  * `:fast_max_bytes`   — the first pass scans at most this many leading bytes (default: 1 MiB).
+  * `:deep_options`     — options mask for the background pass (default: `0b1111`:
+    archives, mail, OLE2 and broken executables).
+  * `:risky_types`      — `ExClamav.FileType` types that always get the background
+    pass (default: containers, executables and documents).
+  * `:deep_if`          — `fn %{type: type, size: size} -> boolean end` replacing the
+    default rule (risky type, or larger than `:fast_max_bytes`).
+  * `:deep_concurrency` — background scans run in parallel (default: `2`).
+  * `:max_pending`      — queued background scans; beyond this the thorough pass
+    runs inline and the verdict is final (default: `1_000`).
+  * `:auto_reload`      — reload the engine on definition updates (default: `false`).
+  * `:updater`          — the `DefinitionUpdater` to subscribe to
+    (default: `ExClamav.DefinitionUpdater`).
+
+  ## Telemetry
+
+  * `[:ex_clamav, :tiered, :deep_scan]` — after every background pass.
+    Measurements: `:duration` and `:queue_time` (native time units).
+    Metadata: `:type`, `:size` and `:changed` (boolean).
+  """
+
+  use GenServer
+
+  require Logger
+
+  alias ExClamav.DefinitionUpdater.Snapshots
+  alias ExClamav.Engine
+  alias ExClamav.FileType
+
+  @type verdict :: {:ok, :clean} | {:virus, String.t()} | {:error, String.t()}
+  @type result :: {verdict(), :final | {:provisional, reference()}}
+
+  @type option ::
+          {:name, GenServer.name() | nil}
+          | {:database_path, Path.t() | nil}
+          | {:fast_options, non_neg_integer()}
+          | {:fast_max_bytes, pos_integer()}
+          | {:deep_options, non_neg_integer()}
+          | {:risky_types, [FileType.t()]}
+          | {:deep_if, (map() -> boolean())}
+          | {:deep_concurrency, pos_integer()}
+          | {:max_pending, non_neg_integer()}
+          | {:auto_reload, boolean()}
+          | {:updater, GenServer.server()}
+
+  @default_risky_types [
+    :pe,
+    :elf,
+    :macho,
+    :zip,
+    :rar,
+    :seven_zip,
+    :gzip,
+    :bzip2,
+    :xz,
+    :pdf,
+    :ole2,
+    :rtf,
+    :html
+  ]
+
+  defstruct [
+    :engine,
+    :database_path,
+    :profile,
+    :task_sup,
+    :deep_concurrency,
+    :max_pending,
+    :reload,
+    :pending_reload,
+    queue: :queue.new(),
+    running: %{},
+    subscribers: %{}
+  ]
+
+  # ── Public API ─────────────────────────────────────────────────────────────
+
+  @doc """
+  Starts the server and loads its engine.
+
+  See module documentation for available options.
+  """
+  @spec start_link([option()]) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    genserver_opts =
+      case Keyword.fetch(opts, :name) do
+        {:ok, nil} -> []
+        {:ok, name} -> [name: name]
+        :error -> [name: __MODULE__]
+      end
+
+    GenServer.start_link(__MODULE__, opts, genserver_opts)
+  end
+
+  @doc """
+  Returns a child spec for supervision trees.
+  """
+  @spec child_spec([option()]) :: Supervisor.child_spec()
+  def child_spec(opts) do
+    %{
+      id: Keyword.get(opts, :name) || __MODULE__,
+      start: {__MODULE__, :start_link, [opts]},
+      shutdown: 5_000,
+      restart: :permanent,
+      type: :worker
+    }
+  end
+
+  @doc """
+  Scan a buffer with the fast pass, queueing a thorough pass when needed.
+
+  The fast pass runs in the calling process and reads the engine from
+  `:persistent_term`, so concurrent callers are not serialised behind each
+  other or behind an engine reload.
+  """
+  @spec scan_buffer(GenServer.server(), binary()) :: result()
+  def scan_buffer(server \\ __MODULE__, buffer) when is_binary(buffer) do
+    %{engine: engine, profile: profile} = :persistent_term.get({__MODULE__, whereis!(server)})
+
+    size = byte_size(buffer)
+    sample = binary_part(buffer, 0, min(size, profile.fast_max_bytes))
+    verdict = Engine.scan_buffer(engine, sample, profile.fast_options)
+    info = %{type: FileType.detect(buffer), size: size}
+
+    cond do
+      match?({:virus, _name}, verdict) ->
+        {verdict, :final}
+
+      not deep?(profile, info) ->
+        {verdict, :final}
+
+      true ->
+        case GenServer.call(server, {:enqueue, buffer, verdict, info}) do
+          {:queued, ref} -> {verdict, {:provisional, ref}}
+          :full -> {Engine.scan_buffer(engine, buffer, profile.deep_options), :final}
+        end
+    end
+  end
+
+  @doc """
+  Receive `{:clamav_verdict_changed, ref, details}` whenever a background
+  pass changes a provisional verdict. `details` holds `:provisional`,
+  `:verdict`, `:type` and `:size`.
+  """
+  @spec subscribe(GenServer.server()) :: :ok
+  def subscribe(server \\ __MODULE__) do
+    GenServer.call(server, {:subscribe, self()})
+  end
+
+  @doc """
+  Stop receiving verdict change notifications.
+  """
+  @spec unsubscribe(GenServer.server()) :: :ok
+  def unsubscribe(server \\ __MODULE__) do
+    GenServer.call(server, {:unsubscribe, self()})
+  end
+
+  @doc """
+  Returns the number of queued and running background scans.
+  """
+  @spec status(GenServer.server()) :: %{queued: non_neg_integer(), running: non_neg_integer()}
+  def status(server \\ __MODULE__) do
+    GenServer.call(server, :status)
+  end
+
+  defp whereis!(server) do
+    case GenServer.whereis(server) do
+      pid when is_pid(pid) -> pid
+      _ -> exit({:noproc, {__MODULE__, :scan_buffer, [server]}})
+    end
+  end
+
+  defp deep?(%{deep_if: deep_if}, info) when is_function(deep_if, 1), do: deep_if.(info)
+
+  defp deep?(profile, %{type: type, size: size}) do
+    type in profile.risky_types or size > profile.fast_max_bytes
+  end
+
+  # ── GenServer Callbacks ────────────────────────────────────────────────────
+
+  @impl true
+  def init(opts) do
+    # So terminate/2 runs and drops the published engine.
+    Process.flag(:trap_exit, true)
+
+    database_path = Keyword.get(opts, :database_path)
+
+    profile = %{
+      fast_options: Keyword.get(opts, :fast_options, 0),
+      fast_max_bytes: Keyword.get(opts, :fast_max_bytes, 1024 * 1024),
+      deep_options: Keyword.get(opts, :deep_options, 0b1111),
+      risky_types: Keyword.get(opts, :risky_types, @default_risky_types),
+      deep_if: Keyword.get(opts, :deep_if)
+    }
+
+    with {:ok, engine} <- load_engine(database_path) do
+      if Keyword.get(opts, :auto_reload, false) do
+        ExClamav.DefinitionUpdater.subscribe(
+          Keyword.get(opts, :updater, ExClamav.DefinitionUpdater)
+        )
+      end
+
+      {:ok, task_sup} = Task.Supervisor.start_link()
+      publish(engine, profile)
+
+      {:ok,
+       %__MODULE__{
+         engine: engine,
+         database_path: database_path,
+         profile: profile,
+         task_sup: task_sup,
+         deep_concurrency: Keyword.get(opts, :deep_concurrency, 2),
+         max_pending: Keyword.get(opts, :max_pending, 1_000)
+       }}
+    else
+      {:error, reason} -> {:stop, {:failed_to_initialize_engine, reason}}
+    end
+  end
+
+  defp load_engine(database_path) do
+    ExClamav.new_engine_with_database(database_path && Snapshots.resolve(database_path))
+  end
+
+  # Fast passes read the engine from here without calling the server.
+  defp publish(engine, profile) do
+    :persistent_term.put({__MODULE__, self()}, %{engine: engine, profile: profile})
+  end
+
+  @impl true
+  def handle_call({:enqueue, buffer, provisional, info}, _from, state) do
+    if :queue.len(state.queue) >= state.max_pending do
+      {:reply, :full, state}
+    else
+      ref = make_ref()
+      job = {ref, buffer, provisional, info, System.monotonic_time()}
+      state = start_jobs(%{state | queue: :queue.in(job, state.queue)})
+      {:reply, {:queued, ref}, state}
+    end
+  end
+
+  def handle_call({:subscribe, pid}, _from, state) do
+    if Map.has_key?(state.subscribers, pid) do
+      {:reply, :ok, state}
+    else
+      ref = Process.monitor(pid)
+      {:reply, :ok, %{state | subscribers: Map.put(state.subscribers, pid, ref)}}
+    end
+  end
+
+  def handle_call({:unsubscribe, pid}, _from, state) do
+    case Map.pop(state.subscribers, pid) do
+      {nil, _subscribers} ->
+        {:reply, :ok, state}
+
+      {ref, subscribers} ->
+        Process.demonitor(ref, [:flush])
+        {:reply, :ok, %{state | subscribers: subscribers}}
+    end
+  end
+
+  def handle_call(:status, _from, state) do
+    {:reply, %{queued: :queue.len(state.queue), running: map_size(state.running)}, state}
+  end
+
+  @impl true
+  def handle_info({ref, result}, %{reload: {ref, database_path}} = state) do
+    Process.demonitor(ref, [:flush])
+    state = %{state | reload: nil}
+
+    state =
+      case result do
+        {:ok, engine} ->
+          Logger.info("Tiered: engine reloaded from #{database_path}")
+          publish(engine, state.profile)
+          %{state | engine: engine, database_path: database_path}
+
+        {:error, reason} ->
+          Logger.error("Tiered: failed to reload engine — #{reason}")
+          state
+      end
+
+    {:noreply, start_reload(state)}
+  end
+
+  def handle_info({:DOWN, ref, :process, _pid, reason}, %{reload: {ref, _path}} = state) do
+    Logger.error("Tiered: engine reload crashed — #{inspect(reason)}")
+    {:noreply, start_reload(%{state | reload: nil})}
+  end
+
+  def handle_info({task_ref, verdict}, %{running: running} = state)
+      when is_map_key(running, task_ref) do
+    Process.demonitor(task_ref, [:flush])
+    {job, running} = Map.pop(running, task_ref)
+    finish(job, verdict, state.subscribers)
+    {:noreply, start_jobs(%{state | running: running})}
+  end
+
+  def handle_info({:DOWN, ref, :process, _pid, reason}, %{running: running} = state)
+      when is_map_key(running, ref) do
+    {job, running} = Map.pop(running, ref)
+    finish(job, {:error, "deep scan crashed: #{inspect(reason)}"}, state.subscribers)
+    {:noreply, start_jobs(%{state | running: running})}
+  end
+
+  def handle_info({:DOWN, ref, :process, pid, _reason}, state) do
+    case Map.pop(state.subscribers, pid) do
+      {^ref, subscribers} -> {:noreply, %{state | subscribers: subscribers}}
+      _ -> {:noreply, state}
+    end
+  end
+
+  # Loading a database takes seconds, so it runs in a task while scans keep
+  # using the current engine; updates arriving meanwhile collapse into one
+  # follow-up reload. The old engine is not freed: callers may still be
+  # running a fast pass with it, and its resource is released once the last
+  # of them drops it.
+  def handle_info({:clamav_definition_updated, metadata}, state) do
+    database_path = metadata[:database_path] || state.database_path
+    {:noreply, start_reload(%{state | pending_reload: database_path})}
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, _state) do
+    :persistent_term.erase({__MODULE__, self()})
+    :ok
+  end
+
+  defp start_reload(%{reload: nil, pending_reload: database_path} = state)
+       when not is_nil(database_path) do
+    task = Task.Supervisor.async_nolink(state.task_sup, fn -> load_engine(database_path) end)
+    %{state | reload: {task.ref, database_path}, pending_reload: nil}
+  end
+
+  defp start_reload(state), do: state
+
+  defp start_jobs(state) do
+    with true <- map_size(state.running) < state.deep_concurrency,
+         {{:value, job}, queue} <- :queue.out(state.queue) do
+      {_ref, buffer, _provisional, _info, _enqueued_at} = job
+      engine = state.engine
+      options = state.profile.deep_options
+
+      task =
+        Task.Supervisor.async_nolink(state.task_sup, fn ->
+          started = System.monotonic_time()
+          {Engine.scan_buffer(engine, buffer, options), started}
+        end)
+
+      start_jobs(%{state | queue: queue, running: Map.put(state.running, task.ref, job)})
+    else
+      _ -> state
+    end
+  end
+
+  defp finish({ref, _buffer, provisional, info, enqueued_at}, result, subscribers) do
+    {verdict, started} =
+      case result do
+        {verdict, started} when is_integer(started) -> {verdict, started}
+        {:error, _reason} = error -> {error, System.monotonic_time()}
+      end
+
+    now = System.monotonic_time()
+    changed = verdict != provisional
+
+    :telemetry.execute(
+      [:ex_clamav, :tiered, :deep_scan],
+      %{duration: now - started, queue_time: started - enqueued_at},
+      Map.put(info, :changed, changed)
+    )
+
+    if changed do
+      details = Map.merge(info, %{provisional: provisional, verdict: verdict})
+
+      Enum.each(subscribers, fn {pid, _monitor} ->
+        send(pid, {:clamav_verdict_changed, ref, details})
+      end)
+    end
+  end
+end
@@ -0,0 +1,117 @@
+defmodule ExClamav.Tracing do
+  @moduledoc """
+  Optional OpenTelemetry spans for scans served by `ExClamav.ClamavGenServer`.
+
+  A scan's latency is split between queueing in the server, dispatch to a
+  pool task and the engine call itself, none of which is visible from the
+  caller. When the `:opentelemetry_api` package is available, the server
+  records one `ex_clamav.scan` span per request, as a child of the trace
+  context that was current in the calling process, with three children:
+
+  * `ex_clamav.queue_wait` — from the request reaching the server to a pool
+    slot being assigned.
+  * `ex_clamav.dispatch` — from assignment until the pool task starts.
+  * `ex_clamav.engine` — the scan itself: allowlist and cache lookups, the
+    dirty scheduler switch and libclamav.
+
+  Attributes: `clamav.type`, `clamav.size`, `clamav.tenant`,
+  `clamav.priority` and `clamav.verdict` (plus `clamav.virus` when one is
+  found). Requests dropped at their deadline get only the scan and wait
+  spans, with an error status.
+
+  Spans are recorded when the scan completes, from timestamps taken along
+  the way, so tracing adds no messages or processes to the scan path.
+  Without an SDK installed the API is a no-op. Pass `tracing: false` to the
+  server to turn spans off.
+  """
+
+  @available Code.ensure_loaded?(:otel_tracer)
+
+  @doc """
+  Whether the OpenTelemetry API was available at compile time.
+  """
+  @spec available?() :: boolean()
+  def available?, do: @available
+
+  if @available do
+    @doc false
+    def current_context, do: :otel_ctx.get_current()
+
+    @doc false
+    # `job` carries `:trace_ctx`, `:enqueued_at` and `:started_at`; `timings`
+    # the task's own start and the scan duration. All native monotonic time,
+    # which is the OpenTelemetry timestamp unit.
+    def record_scan(%{trace_ctx: ctx} = job, timings, verdict) when not is_nil(ctx) do
+      tracer = :opentelemetry.get_application_tracer(__MODULE__)
+      finished = timings.started + timings.duration
+
+      scan = start(tracer, ctx, "ex_clamav.scan", job.enqueued_at, attributes(job, verdict))
+      scan_ctx = :otel_tracer.set_current_span(ctx, scan)
+
+      child(tracer, scan_ctx, "ex_clamav.queue_wait", job.enqueued_at, job.started_at)
+      child(tracer, scan_ctx, "ex_clamav.dispatch", job.started_at, timings.started)
+      child(tracer, scan_ctx, "ex_clamav.engine", timings.started, finished)
+
+      set_status(scan, verdict)
+      :otel_span.end_span(scan, finished)
+      :ok
+    end
+
+    def record_scan(_job, _timings, _verdict), do: :ok
+
+    @doc false
+    def record_expired(%{trace_ctx: ctx} = job, now) when not is_nil(ctx) do
+      tracer = :opentelemetry.get_application_tracer(__MODULE__)
+      verdict = {:error, "deadline exceeded"}
+
+      scan = start(tracer, ctx, "ex_clamav.scan", job.enqueued_at, attributes(job, verdict))
+      scan_ctx = :otel_tracer.set_current_span(ctx, scan)
+      child(tracer, scan_ctx, "ex_clamav.queue_wait", job.enqueued_at, now)
+
+      set_status(scan, verdict)
+      :otel_span.end_span(scan, now)
+      :ok
+    end
+
+    def record_expired(_job, _now), do: :ok
+
+    defp start(tracer, ctx, name, started, attributes) do
+      :otel_tracer.start_span(ctx, tracer, name, %{start_time: started, attributes: attributes})
+    end
+
+    defp child(tracer, ctx, name, started, finished) do
+      span = start(tracer, ctx, name, started, %{})
+      :otel_span.end_span(span, finished)
+    end
+
+    defp set_status(span, {:error, reason}),
+      do: :otel_span.set_status(span, :opentelemetry.status(:error, reason))
+
+    defp set_status(_span, _verdict), do: :ok
+
+    defp attributes(job, verdict) do
+      base = %{
+        "clamav.type": Atom.to_string(job.type),
+        "clamav.size": job.size,
+        "clamav.tenant": inspect(job.tenant),
+        "clamav.priority": Atom.to_string(job.priority)
+      }
+
+      case verdict do
+        {:ok, :clean} -> Map.put(base, :"clamav.verdict", "clean")
+        {:virus, name} -> Map.merge(base, %{"clamav.verdict": "virus", "clamav.virus": name})
+        {:error, _reason} -> Map.put(base, :"clamav.verdict", "error")
+        results when is_list(results) -> Map.put(base, :"clamav.verdict", "batch")
+      end
+    end
+  else
+    @doc false
+    def current_context, do: nil
+
+    @doc false
+    def record_scan(_job, _timings, _verdict), do: :ok
+
+    @doc false
+    def record_expired(_job, _now), do: :ok
+  end
+end
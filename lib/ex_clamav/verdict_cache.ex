@@ -0,0 +1,261 @@
+defmodule ExClamav.VerdictCache do
+  @moduledoc """
+  An in-memory cache of scan verdicts keyed by content hash.
+
+  Entries are stored in a public ETS table so lookups and inserts happen in the
+  calling process. Every entry is tagged with the cache *generation*; bumping
+  the generation (on a definition update) invalidates all existing verdicts in
+  O(1), and stale entries are pruned lazily in the background.
+
+  Only definitive verdicts (`{:ok, :clean}` and `{:virus, name}`) are cached —
+  errors are always retried.
+
+  ## Usage
+
+      children = [
+        {ExClamav.DefinitionUpdater, database_path: "/var/lib/clamav"},
+        {ExClamav.VerdictCache, updater: ExClamav.DefinitionUpdater}
+      ]
+
+      digest = ExClamav.VerdictCache.digest(buffer)
+
+      case ExClamav.VerdictCache.get(ExClamav.VerdictCache, digest) do
+        {:ok, verdict} -> verdict
+        :miss -> ...
+      end
+
+  ## Options
+
+  * `:name`        — registered name, also used to locate the table (default: `ExClamav.VerdictCache`).
+  * `:max_entries` — soft upper bound on cached verdicts (default: `100_000`).
+  * `:updater`     — optional `DefinitionUpdater` to subscribe to; updates invalidate the cache.
+  """
+
+  use GenServer
+
+  require Logger
+
+  @type verdict :: {:ok, :clean} | {:virus, String.t()}
+  @type digest :: <<_::256>>
+
+  @type option ::
+          {:name, atom()}
+          | {:max_entries, pos_integer()}
+          | {:updater, GenServer.server()}
+
+  defstruct [:name, :table, :generation, :max_entries]
+
+  @default_max_entries 100_000
+
+  # ── Public API ─────────────────────────────────────────────────────────────
+
+  @doc """
+  Starts the cache.
+
+  See module documentation for available options.
+  """
+  @spec start_link([option()]) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    name = Keyword.get(opts, :name, __MODULE__)
+    GenServer.start_link(__MODULE__, Keyword.put(opts, :name, name), name: name)
+  end
+
+  @doc """
+  Returns a child spec for supervision trees.
+  """
+  @spec child_spec([option()]) :: Supervisor.child_spec()
+  def child_spec(opts) do
+    %{
+      id: Keyword.get(opts, :name, __MODULE__),
+      start: {__MODULE__, :start_link, [opts]},
+      shutdown: 5_000,
+      restart: :permanent,
+      type: :worker
+    }
+  end
+
+  @doc """
+  Compute the cache key (SHA-256) for a binary.
+  """
+  @spec digest(binary()) :: digest()
+  def digest(buffer) when is_binary(buffer), do: :crypto.hash(:sha256, buffer)
+
+  @doc """
+  Compute the cache key (SHA-256) for a file without loading it into memory.
+  """
+  @spec file_digest(Path.t()) :: {:ok, digest()} | {:error, File.posix()}
+  def file_digest(path) do
+    case File.open(path, [:read, :raw, :binary], &hash_stream/1) do
+      {:ok, digest} -> {:ok, digest}
+      {:error, _reason} = error -> error
+    end
+  end
+
+  defp hash_stream(io, ctx \\ :crypto.hash_init(:sha256)) do
+    case IO.binread(io, 1_048_576) do
+      :eof -> :crypto.hash_final(ctx)
+      data when is_binary(data) -> hash_stream(io, :crypto.hash_update(ctx, data))
+    end
+  end
+
+  @doc """
+  Look up a cached verdict for the current generation.
+  """
+  @spec get(atom(), digest()) :: {:ok, verdict()} | :miss
+  def get(cache \\ __MODULE__, digest) do
+    {table, generation} = lookup(cache)
+    current = :atomics.get(generation, 1)
+
+    case :ets.lookup(table, digest) do
+      [{^digest, ^current, verdict}] -> {:ok, verdict}
+      _ -> :miss
+    end
+  end
+
+  @doc """
+  Store a verdict. Errors are ignored so they are retried on the next scan.
+  """
+  @spec put(atom(), digest(), term()) :: :ok
+  def put(cache \\ __MODULE__, digest, verdict) do
+    {_table, generation} = lookup(cache)
+    put_for_generation(cache, digest, verdict, :atomics.get(generation, 1))
+  end
+
+  @doc """
+  Return the cached verdict for `digest`, or compute it with `fun` and cache it.
+
+  The verdict is tagged with the generation observed *before* `fun` runs, so a
+  scan that straddles a definition update is never cached as current.
+  """
+  @spec fetch(atom(), digest(), (-> term())) :: term()
+  def fetch(cache \\ __MODULE__, digest, fun) when is_function(fun, 0) do
+    {_table, generation} = lookup(cache)
+    started_generation = :atomics.get(generation, 1)
+
+    case get(cache, digest) do
+      {:ok, verdict} ->
+        verdict
+
+      :miss ->
+        verdict = fun.()
+        put_for_generation(cache, digest, verdict, started_generation)
+        verdict
+    end
+  end
+
+  defp put_for_generation(cache, digest, {:ok, :clean} = verdict, gen),
+    do: insert(cache, digest, verdict, gen)
+
+  defp put_for_generation(cache, digest, {:virus, _name} = verdict, gen),
+    do: insert(cache, digest, verdict, gen)
+
+  defp put_for_generation(_cache, _digest, _verdict, _gen), do: :ok
+
+  defp insert(cache, digest, verdict, gen) do
+    {table, _generation} = lookup(cache)
+    :ets.insert(table, {digest, gen, verdict})
+    maybe_prune(cache)
+  end
+
+  @doc """
+  Invalidate every cached verdict by bumping the generation.
+  """
+  @spec invalidate(atom()) :: :ok
+  def invalidate(cache \\ __MODULE__) do
+    {_table, generation} = lookup(cache)
+    :atomics.add(generation, 1, 1)
+    GenServer.cast(cache, :prune)
+  end
+
+  @doc """
+  Returns the number of stored entries and the current generation.
+  """
+  @spec info(atom()) :: %{size: non_neg_integer(), generation: non_neg_integer()}
+  def info(cache \\ __MODULE__) do
+    {table, generation} = lookup(cache)
+    %{size: :ets.info(table, :size), generation: :atomics.get(generation, 1)}
+  end
+
+  defp maybe_prune(cache) do
+    {table, _generation} = lookup(cache)
+
+    if :ets.info(table, :size) > max_entries(cache) do
+      GenServer.cast(cache, :prune)
+    end
+
+    :ok
+  end
+
+  defp lookup(cache) when is_atom(cache) do
+    :persistent_term.get({__MODULE__, cache})
+  end
+
+  defp max_entries(cache) do
+    :persistent_term.get({__MODULE__, cache, :max_entries})
+  end
+
+  # ── GenServer Callbacks ────────────────────────────────────────────────────
+
+  @impl true
+  def init(opts) do
+    Process.flag(:trap_exit, true)
+
+    name = Keyword.fetch!(opts, :name)
+    max_entries = Keyword.get(opts, :max_entries, @default_max_entries)
+
+    table = :ets.new(__MODULE__, [:set, :public, read_concurrency: true, write_concurrency: true])
+    generation = :atomics.new(1, signed: false)
+
+    :persistent_term.put({__MODULE__, name}, {table, generation})
+    :persistent_term.put({__MODULE__, name, :max_entries}, max_entries)
+
+    case Keyword.fetch(opts, :updater) do
+      {:ok, updater} -> ExClamav.DefinitionUpdater.subscribe(updater)
+      :error -> :ok
+    end
+
+    {:ok,
+     %__MODULE__{name: name, table: table, generation: generation, max_entries: max_entries}}
+  end
+
+  @impl true
+  def handle_cast(:prune, state) do
+    current = :atomics.get(state.generation, 1)
+
+    # Drop every entry from an older generation first.
+    :ets.select_delete(state.table, [{{:_, :"$1", :_}, [{:"=/=", :"$1", current}], [true]}])
+
+    # Still over budget: drop arbitrary entries down to 3/4 of the limit.
+    excess = :ets.info(state.table, :size) - div(state.max_entries * 3, 4)
+    if excess > 0, do: drop_entries(state.table, :ets.first(state.table), excess)
+
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info({:clamav_definition_updated, _metadata}, state) do
+    Logger.debug("VerdictCache: definitions updated, invalidating cached verdicts")
+    invalidate(state.name)
+    {:noreply, state}
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, state) do
+    :persistent_term.erase({__MODULE__, state.name})
+    :persistent_term.erase({__MODULE__, state.name, :max_entries})
+    :ok
+  end
+
+  defp drop_entries(_table, :"$end_of_table", _count), do: :ok
+  defp drop_entries(_table, _key, 0), do: :ok
+
+  defp drop_entries(table, key, count) do
+    next = :ets.next(table, key)
+    :ets.delete(table, key)
+    drop_entries(table, next, count - 1)
+  end
+end
@@ -1,7 +1,88 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <erl_nif.h>
 #include <clamav.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * USDT probes (provider "ex_clamav") for tracing live nodes with bpftrace or
+ * perf, e.g. `bpftrace -e 'usdt:priv/clamav_nif.so:ex_clamav:scan__done
+ * { @ns = hist(arg3); }'`. Every probe has a semaphore that the tracer bumps
+ * while attached, and arguments (including the clock reads behind the ns
+ * durations) are only evaluated when it is set, so an untraced probe costs
+ * one load and a predicted branch and they stay in release builds. Without
+ * <sys/sdt.h> (HAVE_SYS_SDT_H unset by the Makefile) they compile to nothing.
+ *
+ *   engine__load(path)                  engine__loaded(ret, signatures, ns)
+ *   engine__compile()                   engine__compiled(ret, ns)
+ *   engine__free(engine)
+ *   scan__start(kind, size)             scan__done(kind, size, ret, ns, virus)
+ *   fmap__open(kind, size, map)
+ *   pread__enter(offset, count)         pread__return(offset, bytes)
+ *
+ * kind is "file", "buffer", "range" or "batch"; size is 0 for path scans.
+ * Every scan__start is paired with a scan__done; a scan that fails before
+ * libclamav runs reports ret CL_EMAP.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define USDT_ENABLED 1
+#define PROBE_SEMAPHORE(name) ex_clamav_##name##_semaphore
+#define PROBE_DEFINE(name) \
+    __attribute__((section(".probes"), visibility("hidden"))) \
+    volatile unsigned short PROBE_SEMAPHORE(name) = 0
+#define PROBE_ENABLED(name) __builtin_expect(PROBE_SEMAPHORE(name) != 0, 0)
+#define PROBE_IF(name, probe) do { if (PROBE_ENABLED(name)) { probe; } } while (0)
+#define PROBE0(name) PROBE_IF(name, DTRACE_PROBE(ex_clamav, name))
+#define PROBE1(name, a) PROBE_IF(name, DTRACE_PROBE1(ex_clamav, name, a))
+#define PROBE2(name, a, b) PROBE_IF(name, DTRACE_PROBE2(ex_clamav, name, a, b))
+#define PROBE3(name, a, b, c) PROBE_IF(name, DTRACE_PROBE3(ex_clamav, name, a, b, c))
+#define PROBE5(name, a, b, c, d, e) PROBE_IF(name, DTRACE_PROBE5(ex_clamav, name, a, b, c, d, e))
+/* The start time is only taken while `done` is traced; a tracer that attaches
+ * mid-call sees a duration of 0 for that call. */
+#define PROBE_CLOCK(var, done) \
+    ErlNifTime var = PROBE_ENABLED(done) ? enif_monotonic_time(ERL_NIF_NSEC) : 0
+#define PROBE_ELAPSED(var) ((var) ? enif_monotonic_time(ERL_NIF_NSEC) - (var) : 0)
+
+PROBE_DEFINE(engine__load);
+PROBE_DEFINE(engine__loaded);
+PROBE_DEFINE(engine__compile);
+PROBE_DEFINE(engine__compiled);
+PROBE_DEFINE(engine__free);
+PROBE_DEFINE(scan__start);
+PROBE_DEFINE(scan__done);
+PROBE_DEFINE(fmap__open);
+PROBE_DEFINE(pread__enter);
+PROBE_DEFINE(pread__return);
+#else
+#define USDT_ENABLED 0
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#define PROBE5(name, a, b, c, d, e) ((void)0)
+#define PROBE_CLOCK(var, done) ((void)0)
+#endif
+
+/*
+ * Layout version of nif_state. ExClamav.Nif passes the version it expects as
+ * load_info, and an upgrade only adopts the previous library's state when the
+ * layouts match.
+ */
+#define NIF_ABI_VERSION 1
 
 #define ENGINE_INVALID_ERROR "Engine resource is invalid or has been freed"
 #define ENGINE_NOT_INITIALIZED_ERROR "Engine not initialized with database"
@@ -12,6 +93,106 @@ typedef struct {
     int initialized;
 } engine_handle;
 
+// Resource type for files opened once and scanned by byte range
+typedef struct {
+    int fd;
+    ErlNifUInt64 size;
+} file_handle;
+
+/*
+ * Resource type for an mmap'd allowlist of SHA-256 digests. File layout:
+ *
+ *   "EXCLALW1" | count:u64le | index[65537]:u32le | digests[count][32]
+ *
+ * Digests are sorted; index[p] is the position of the first digest whose
+ * two leading bytes are >= p, so a lookup is one bucket of a binary search.
+ */
+#define ALLOWLIST_MAGIC "EXCLALW1"
+#define ALLOWLIST_BUCKETS 65536
+#define ALLOWLIST_HEADER_SIZE (16 + (ALLOWLIST_BUCKETS + 1) * 4)
+#define ALLOWLIST_DIGEST_SIZE 32
+
+typedef struct {
+    const unsigned char* base;
+    size_t size;
+    ErlNifUInt64 count;
+} allowlist_handle;
+
+/*
+ * Resource type for a verdict cache shared by every process on the host that
+ * maps the same file. File layout (native byte order, the file never leaves
+ * the host):
+ *
+ *   vcache_header | vcache_slot[slots]
+ *
+ * Slots are probed linearly from the digest's leading bytes. Each slot is
+ * guarded by a lock word holding a sequence number (high 32 bits) and, while
+ * a writer fills the slot, the CLOCK_MONOTONIC second it was locked at plus
+ * one (low 32 bits, 0 when unlocked). Readers discard copies taken while the
+ * slot was locked or whose word changed underneath them. A writer killed
+ * mid-write (an OOM kill, say) leaves its slot locked; once the lock is
+ * VCACHE_STALE_LOCK_S old, or was taken before the last reboot, the next
+ * writer takes it over with a new sequence number. Entries carry the database
+ * generation they were computed with, so loading new definitions invalidates
+ * them without touching the file.
+ *
+ * Files with an older layout are unlinked and recreated. Processes still
+ * running the old code keep their mapping of the unlinked file.
+ */
+#define VCACHE_MAGIC "EXCLPVC2"
+#define VCACHE_OLD_MAGIC "EXCLPVC1"
+#define VCACHE_PROBES 8
+#define VCACHE_DIGEST_SIZE 32
+#define VCACHE_NAME_SIZE 78
+#define VCACHE_STALE_LOCK_S 10
+
+enum { VCACHE_EMPTY = 0, VCACHE_CLEAN = 1, VCACHE_VIRUS = 2 };
+
+typedef struct {
+    char magic[8];
+    uint64_t slots;
+    unsigned char reserved[48];
+} vcache_header;
+
+typedef struct {
+    _Atomic uint64_t lock;
+    uint64_t version;
+    unsigned char digest[VCACHE_DIGEST_SIZE];
+    uint8_t verdict;
+    uint8_t name_len;
+    char name[VCACHE_NAME_SIZE];
+} vcache_slot;
+
+_Static_assert(sizeof(vcache_header) == 64, "vcache_header must be 64 bytes");
+_Static_assert(sizeof(vcache_slot) == 128, "vcache_slot must be 128 bytes");
+
+typedef struct {
+    unsigned char* base;
+    size_t size;
+    uint64_t slots;
+} vcache_handle;
+
+// Resource type for buffers shared with out-of-process scan workers
+typedef struct {
+    int fd;
+    size_t size;
+} shared_buffer_handle;
+
+/*
+ * Module state kept in priv_data. On a hot code upgrade the new library adopts
+ * the old library's state instead of allocating its own, so old and new code
+ * share it until the old code is purged; refs counts the loaded instances and
+ * the last unload frees it. Engine resources themselves survive the upgrade
+ * through ERL_NIF_RT_TAKEOVER and are never rebuilt.
+ */
+typedef struct {
+    int abi;
+    ErlNifMutex* lock;
+    unsigned int refs;
+    unsigned int upgrades;
+    long live_engines;
+} nif_state;
+
 // Forward declarations
 static ERL_NIF_TERM init_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM engine_new_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
@@ -22,23 +203,89 @@ static ERL_NIF_TERM scan_file_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
 static ERL_NIF_TERM scan_buffer_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM get_version_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM get_database_version_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM get_database_time_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM shared_buffer_new_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_info_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM file_open_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM scan_file_range_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM scan_batch_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM cvd_verify_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM allowlist_open_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM allowlist_lookup_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM vcache_open_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM vcache_get_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM vcache_put_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
 
 // Resource type handling
 static ErlNifResourceType* ENGINE_RESOURCE_TYPE = NULL;
+static ErlNifResourceType* SHARED_BUFFER_RESOURCE_TYPE = NULL;
+static ErlNifResourceType* FILE_RESOURCE_TYPE = NULL;
+static ErlNifResourceType* ALLOWLIST_RESOURCE_TYPE = NULL;
+static ErlNifResourceType* VCACHE_RESOURCE_TYPE = NULL;
+static nif_state* STATE = NULL;
+
+static void count_engine(long delta) {
+    if (STATE) {
+        enif_mutex_lock(STATE->lock);
+        STATE->live_engines += delta;
+        // Engines adopted from an older layout were never counted here, so
+        // their frees must not drive the count below zero.
+        if (STATE->live_engines < 0) {
+            STATE->live_engines = 0;
+        }
+        enif_mutex_unlock(STATE->lock);
+    }
+}
 
 static void engine_destructor(ErlNifEnv* env, void* arg) {
     (void)env;
     engine_handle* handle = (engine_handle*)arg;
     if (handle && handle->engine) {
+        PROBE1(engine__free, handle->engine);
         cl_engine_free(handle->engine);
         handle->engine = NULL;
         handle->initialized = 0;
     }
+    count_engine(-1);
 }
 
-static int load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info) {
-    (void)priv_data;
-    (void)load_info;
+static void shared_buffer_destructor(ErlNifEnv* env, void* arg) {
+    (void)env;
+    shared_buffer_handle* handle = (shared_buffer_handle*)arg;
+    if (handle && handle->fd >= 0) {
+        close(handle->fd);
+        handle->fd = -1;
+    }
+}
+
+static void file_destructor(ErlNifEnv* env, void* arg) {
+    (void)env;
+    file_handle* handle = (file_handle*)arg;
+    if (handle && handle->fd >= 0) {
+        close(handle->fd);
+        handle->fd = -1;
+    }
+}
+
+static void allowlist_destructor(ErlNifEnv* env, void* arg) {
+    (void)env;
+    allowlist_handle* handle = (allowlist_handle*)arg;
+    if (handle && handle->base) {
+        munmap((void*)handle->base, handle->size);
+        handle->base = NULL;
+    }
+}
+
+static void vcache_destructor(ErlNifEnv* env, void* arg) {
+    (void)env;
+    vcache_handle* handle = (vcache_handle*)arg;
+    if (handle && handle->base) {
+        munmap(handle->base, handle->size);
+        handle->base = NULL;
+    }
+}
+
+static int open_resource_types(ErlNifEnv* env) {
     // Register resource type for engine handles
     ENGINE_RESOURCE_TYPE = enif_open_resource_type(
         env,
@@ -53,12 +300,141 @@ static int load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info) {
         return -1;
     }
 
+    SHARED_BUFFER_RESOURCE_TYPE = enif_open_resource_type(
+        env,
+        NULL,
+        "shared_buffer_handle",
+        shared_buffer_destructor,
+        ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER,
+        NULL
+    );
+
+    if (SHARED_BUFFER_RESOURCE_TYPE == NULL) {
+        return -1;
+    }
+
+    FILE_RESOURCE_TYPE = enif_open_resource_type(
+        env,
+        NULL,
+        "file_handle",
+        file_destructor,
+        ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER,
+        NULL
+    );
+
+    if (FILE_RESOURCE_TYPE == NULL) {
+        return -1;
+    }
+
+    ALLOWLIST_RESOURCE_TYPE = enif_open_resource_type(
+        env,
+        NULL,
+        "allowlist_handle",
+        allowlist_destructor,
+        ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER,
+        NULL
+    );
+
+    if (ALLOWLIST_RESOURCE_TYPE == NULL) {
+        return -1;
+    }
+
+    VCACHE_RESOURCE_TYPE = enif_open_resource_type(
+        env,
+        NULL,
+        "vcache_handle",
+        vcache_destructor,
+        ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER,
+        NULL
+    );
+
+    if (VCACHE_RESOURCE_TYPE == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int check_abi(ErlNifEnv* env, ERL_NIF_TERM load_info) {
+    int abi;
+    return enif_get_int(env, load_info, &abi) && abi == NIF_ABI_VERSION;
+}
+
+static nif_state* state_new(void) {
+    nif_state* state = enif_alloc(sizeof(nif_state));
+    if (!state) {
+        return NULL;
+    }
+
+    state->lock = enif_mutex_create("clamav_nif_state");
+    if (!state->lock) {
+        enif_free(state);
+        return NULL;
+    }
+
+    state->abi = NIF_ABI_VERSION;
+    state->refs = 1;
+    state->upgrades = 0;
+    state->live_engines = 0;
+    return state;
+}
+
+static int load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info) {
+    if (!check_abi(env, load_info) || open_resource_types(env) != 0) {
+        return -1;
+    }
+
+    STATE = state_new();
+    if (!STATE) {
+        return -1;
+    }
+
+    *priv_data = STATE;
     return 0;
 }
 
 static int upgrade(ErlNifEnv* env, void** priv_data, void** old_priv_data, ERL_NIF_TERM load_info) {
-    (void)old_priv_data;
-    return load(env, priv_data, load_info);
+    if (!check_abi(env, load_info) || open_resource_types(env) != 0) {
+        return -1;
+    }
+
+    nif_state* old_state = (nif_state*)*old_priv_data;
+
+    if (old_state && old_state->abi == NIF_ABI_VERSION) {
+        enif_mutex_lock(old_state->lock);
+        old_state->refs++;
+        old_state->upgrades++;
+        enif_mutex_unlock(old_state->lock);
+        STATE = old_state;
+    } else {
+        // Older layout: engines still carry over, only the counters restart;
+        // live_engines undercounts until the adopted engines are freed.
+        STATE = state_new();
+        if (!STATE) {
+            return -1;
+        }
+    }
+
+    *priv_data = STATE;
+    return 0;
+}
+
+static void unload(ErlNifEnv* env, void* priv_data) {
+    (void)env;
+    nif_state* state = (nif_state*)priv_data;
+
+    if (!state) {
+        return;
+    }
+
+    enif_mutex_lock(state->lock);
+    unsigned int refs = --state->refs;
+    enif_mutex_unlock(state->lock);
+
+    if (refs == 0) {
+        enif_mutex_destroy(state->lock);
+        enif_free(state);
+    }
 }
 
 static ERL_NIF_TERM make_error(ErlNifEnv* env, const char* error) {
@@ -70,6 +446,27 @@ static ERL_NIF_TERM make_clamav_error(ErlNifEnv* env, int error_code) {
     return make_error(env, error_msg);
 }
 
+// {ok, clean}, {ok, virus, Name} or {error, Reason} for a libclamav scan result
+static ERL_NIF_TERM make_scan_result(ErlNifEnv* env, int ret, const char* virus_name) {
+    switch (ret) {
+        case CL_CLEAN:
+            return enif_make_tuple2(
+                env,
+                enif_make_atom(env, "ok"),
+                enif_make_atom(env, "clean")
+            );
+        case CL_VIRUS:
+            return enif_make_tuple3(
+                env,
+                enif_make_atom(env, "ok"),
+                enif_make_atom(env, "virus"),
+                enif_make_string(env, virus_name ? virus_name : "", ERL_NIF_LATIN1)
+            );
+        default:
+            return make_clamav_error(env, ret);
+    }
+}
+
 static int get_c_string(ErlNifEnv* env, ERL_NIF_TERM term, char* buffer, size_t buffer_size) {
     ErlNifBinary bin;
 
@@ -160,6 +557,7 @@ static ERL_NIF_TERM engine_new_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM
 
     handle->engine = engine;
     handle->initialized = 0;
+    count_engine(1);
 
     ERL_NIF_TERM result = enif_make_resource(env, handle);
     enif_release_resource(handle);
@@ -177,6 +575,7 @@ static ERL_NIF_TERM engine_free_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM
     }
 
     if (handle->engine) {
+        PROBE1(engine__free, handle->engine);
         cl_engine_free(handle->engine);
         handle->engine = NULL;
     }
@@ -204,7 +603,10 @@ static ERL_NIF_TERM load_database_nif(ErlNifEnv* env, int argc, const ERL_NIF_TE
     }
 
     unsigned int signatures = 0;
+    PROBE1(engine__load, database_path);
+    PROBE_CLOCK(load_started, engine__loaded);
     int ret = cl_load(database_path, handle->engine, &signatures, CL_DB_STDOPT);
+    PROBE3(engine__loaded, ret, signatures, PROBE_ELAPSED(load_started));
 
     if (ret != CL_SUCCESS) {
         return make_clamav_error(env, ret);
@@ -237,7 +639,10 @@ static ERL_NIF_TERM compile_engine_nif(ErlNifEnv* env, int argc, const ERL_NIF_T
         return make_error(env, ENGINE_NOT_INITIALIZED_ERROR);
     }
 
+    PROBE0(engine__compile);
+    PROBE_CLOCK(compile_started, engine__compiled);
     int ret = cl_engine_compile(handle->engine);
+    PROBE2(engine__compiled, ret, PROBE_ELAPSED(compile_started));
 
     if (ret != CL_SUCCESS) {
         return make_clamav_error(env, ret);
@@ -279,6 +684,9 @@ static ERL_NIF_TERM scan_file_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
 
     init_scan_options(&scan_opts, options_mask);
 
+    PROBE2(scan__start, "file", 0);
+    PROBE_CLOCK(scan_started, scan__done);
+
     int ret = cl_scanfile(
         file_path,
         &virus_name,
@@ -287,23 +695,9 @@ static ERL_NIF_TERM scan_file_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
         &scan_opts
     );
 
-    switch (ret) {
-        case CL_CLEAN:
-            return enif_make_tuple2(
-                env,
-                enif_make_atom(env, "ok"),
-                enif_make_atom(env, "clean")
-            );
-        case CL_VIRUS:
-            return enif_make_tuple3(
-                env,
-                enif_make_atom(env, "ok"),
-                enif_make_atom(env, "virus"),
-                enif_make_string(env, virus_name ? virus_name : "", ERL_NIF_LATIN1)
-            );
-        default:
-            return make_clamav_error(env, ret);
-    }
+    PROBE5(scan__done, "file", 0, ret, PROBE_ELAPSED(scan_started), virus_name);
+
+    return make_scan_result(env, ret, virus_name);
 }
 
 // Scan a buffer in memory
@@ -340,8 +734,13 @@ static ERL_NIF_TERM scan_buffer_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM
 
     init_scan_options(&scan_opts, options_mask);
 
+    PROBE2(scan__start, "buffer", buffer.size);
+    PROBE_CLOCK(scan_started, scan__done);
+
     map = cl_fmap_open_memory(buffer.data, buffer.size);
+    PROBE3(fmap__open, "buffer", buffer.size, map);
     if (!map) {
+        PROBE5(scan__done, "buffer", buffer.size, CL_EMAP, PROBE_ELAPSED(scan_started), NULL);
         return make_error(env, "Failed to create fmap");
     }
 
@@ -356,24 +755,286 @@ static ERL_NIF_TERM scan_buffer_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM
     );
 
     cl_fmap_close(map);
+    PROBE5(scan__done, "buffer", buffer.size, ret, PROBE_ELAPSED(scan_started), virus_name);
 
-    switch (ret) {
-        case CL_CLEAN:
-            return enif_make_tuple2(
-                env,
-                enif_make_atom(env, "ok"),
-                enif_make_atom(env, "clean")
-            );
-        case CL_VIRUS:
-            return enif_make_tuple3(
-                env,
-                enif_make_atom(env, "ok"),
-                enif_make_atom(env, "virus"),
-                enif_make_string(env, virus_name ? virus_name : "", ERL_NIF_LATIN1)
-            );
-        default:
-            return make_clamav_error(env, ret);
+    return make_scan_result(env, ret, virus_name);
+}
+
+// Open a file once so many byte ranges can be scanned from one descriptor
+static ERL_NIF_TERM file_open_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    char file_path[1024];
+    struct stat st;
+
+    if (!get_c_string(env, argv[0], file_path, sizeof(file_path))) {
+        return enif_make_badarg(env);
+    }
+
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return make_error(env, strerror(errno));
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ERL_NIF_TERM error = make_error(env, strerror(errno));
+        close(fd);
+        return error;
+    }
+
+    file_handle* handle = enif_alloc_resource(FILE_RESOURCE_TYPE, sizeof(file_handle));
+    if (!handle) {
+        close(fd);
+        return make_error(env, "Failed to allocate resource");
+    }
+
+    handle->fd = fd;
+    handle->size = (ErlNifUInt64)st.st_size;
+
+    ERL_NIF_TERM result = enif_make_resource(env, handle);
+    enif_release_resource(handle);
+
+    return enif_make_tuple3(
+        env,
+        enif_make_atom(env, "ok"),
+        result,
+        enif_make_uint64(env, handle->size)
+    );
+}
+
+/*
+ * Handle for cl_fmap_open_handle. libclamav requires the map's offset to be
+ * page-aligned and counts its length from the start of the handle, so each
+ * range is mapped from 0 and the callback shifts reads by base instead.
+ */
+typedef struct {
+    int fd;
+    off_t base;
+} range_handle;
+
+/*
+ * pread callback for cl_fmap_open_handle. pread never moves the file offset,
+ * so any number of ranges can be scanned concurrently from the same
+ * descriptor.
+ */
+static off_t range_pread(void* handle, void* buf, size_t count, off_t offset) {
+    range_handle* range = handle;
+    ssize_t n;
+
+    offset += range->base;
+    PROBE2(pread__enter, offset, count);
+
+    do {
+        n = pread(range->fd, buf, count, offset);
+    } while (n < 0 && errno == EINTR);
+
+    PROBE2(pread__return, offset, n);
+
+    return (off_t)n;
+}
+
+// Scan length bytes starting at offset, from a path or an opened file
+static ERL_NIF_TERM scan_file_range_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    engine_handle* handle;
+    file_handle* file = NULL;
+    char file_path[1024];
+    ErlNifUInt64 offset;
+    ErlNifUInt64 length;
+    ErlNifUInt64 size;
+    unsigned int options_mask = 0;
+    const char* virus_name = NULL;
+    unsigned long int scanned = 0;
+    struct cl_scan_options scan_opts;
+    int fd;
+
+    if (!enif_get_resource(env, argv[0], ENGINE_RESOURCE_TYPE, (void**)&handle)) {
+        return enif_make_badarg(env);
+    }
+
+    if (!handle->engine) {
+        return make_error(env, ENGINE_INVALID_ERROR);
     }
+
+    if (!handle->initialized) {
+        return make_error(env, ENGINE_NOT_INITIALIZED_ERROR);
+    }
+
+    if (!enif_get_uint64(env, argv[2], &offset) ||
+        !enif_get_uint64(env, argv[3], &length) ||
+        !enif_get_uint(env, argv[4], &options_mask)) {
+        return enif_make_badarg(env);
+    }
+
+    if (enif_get_resource(env, argv[1], FILE_RESOURCE_TYPE, (void**)&file)) {
+        if (file->fd < 0) {
+            return make_error(env, "File resource has been closed");
+        }
+        fd = file->fd;
+        size = file->size;
+    } else if (get_c_string(env, argv[1], file_path, sizeof(file_path))) {
+        struct stat st;
+
+        fd = open(file_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return make_clamav_error(env, CL_EOPEN);
+        }
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return make_clamav_error(env, CL_ESTAT);
+        }
+        size = (ErlNifUInt64)st.st_size;
+    } else {
+        return enif_make_badarg(env);
+    }
+
+    if (offset > size || length > size - offset) {
+        if (!file) {
+            close(fd);
+        }
+        return make_error(env, "Range exceeds file size");
+    }
+
+    init_scan_options(&scan_opts, options_mask);
+
+    PROBE2(scan__start, "range", length);
+    PROBE_CLOCK(scan_started, scan__done);
+
+    int ret = CL_CLEAN;
+    if (length > 0) {
+        range_handle range = {.fd = fd, .base = (off_t)offset};
+        cl_fmap_t* map = cl_fmap_open_handle(
+            &range,
+            0,
+            (size_t)length,
+            range_pread,
+            1
+        );
+        PROBE3(fmap__open, "range", length, map);
+
+        if (!map) {
+            PROBE5(scan__done, "range", length, CL_EMAP, PROBE_ELAPSED(scan_started), NULL);
+            if (!file) {
+                close(fd);
+            }
+            return make_error(env, "Failed to create fmap");
+        }
+
+        ret = cl_scanmap_callback(map, NULL, &virus_name, &scanned, handle->engine, &scan_opts, NULL);
+        cl_fmap_close(map);
+    }
+
+    PROBE5(scan__done, "range", length, ret, PROBE_ELAPSED(scan_started), virus_name);
+
+    if (!file) {
+        close(fd);
+    }
+
+    return make_scan_result(env, ret, virus_name);
+}
+
+// Scan one {file, Path} or {buffer, Binary} item of a batch
+static ERL_NIF_TERM scan_batch_item(
+    ErlNifEnv* env,
+    engine_handle* handle,
+    struct cl_scan_options* scan_opts,
+    ERL_NIF_TERM item
+) {
+    const ERL_NIF_TERM* fields;
+    int arity;
+    char kind[8];
+    const char* virus_name = NULL;
+    unsigned long int scanned = 0;
+    int ret;
+
+    if (!enif_get_tuple(env, item, &arity, &fields) || arity != 2 ||
+        !enif_get_atom(env, fields[0], kind, sizeof(kind), ERL_NIF_LATIN1)) {
+        return make_error(env, "Invalid batch item");
+    }
+
+    if (strcmp(kind, "file") == 0) {
+        char file_path[1024];
+
+        if (!get_c_string(env, fields[1], file_path, sizeof(file_path))) {
+            return make_error(env, "Invalid batch item");
+        }
+
+        PROBE2(scan__start, "batch", 0);
+        PROBE_CLOCK(scan_started, scan__done);
+        ret = cl_scanfile(file_path, &virus_name, &scanned, handle->engine, scan_opts);
+        PROBE5(scan__done, "batch", 0, ret, PROBE_ELAPSED(scan_started), virus_name);
+    } else if (strcmp(kind, "buffer") == 0) {
+        ErlNifBinary buffer;
+        cl_fmap_t* map;
+
+        if (!enif_inspect_binary(env, fields[1], &buffer)) {
+            return make_error(env, "Invalid batch item");
+        }
+
+        PROBE2(scan__start, "batch", buffer.size);
+        PROBE_CLOCK(scan_started, scan__done);
+
+        map = cl_fmap_open_memory(buffer.data, buffer.size);
+        PROBE3(fmap__open, "batch", buffer.size, map);
+        if (!map) {
+            PROBE5(scan__done, "batch", buffer.size, CL_EMAP, PROBE_ELAPSED(scan_started), NULL);
+            return make_error(env, "Failed to create fmap");
+        }
+
+        ret = cl_scanmap_callback(map, NULL, &virus_name, &scanned, handle->engine, scan_opts, NULL);
+        cl_fmap_close(map);
+        PROBE5(scan__done, "batch", buffer.size, ret, PROBE_ELAPSED(scan_started), virus_name);
+    } else {
+        return make_error(env, "Invalid batch item");
+    }
+
+    return make_scan_result(env, ret, virus_name);
+}
+
+// Scan a list of items in one call. Bulk scans then pay one NIF dispatch and
+// one dirty scheduler switch per batch instead of per item. A bad item
+// yields an error in its position rather than failing the whole batch.
+static ERL_NIF_TERM scan_batch_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    engine_handle* handle;
+    unsigned int length;
+    unsigned int options_mask = 0;
+    struct cl_scan_options scan_opts;
+    ERL_NIF_TERM list = argv[1];
+    ERL_NIF_TERM head;
+
+    if (!enif_get_resource(env, argv[0], ENGINE_RESOURCE_TYPE, (void**)&handle)) {
+        return enif_make_badarg(env);
+    }
+
+    if (!enif_get_list_length(env, argv[1], &length) ||
+        !enif_get_uint(env, argv[2], &options_mask)) {
+        return enif_make_badarg(env);
+    }
+
+    if (!handle->engine) {
+        return make_error(env, ENGINE_INVALID_ERROR);
+    }
+
+    if (!handle->initialized) {
+        return make_error(env, ENGINE_NOT_INITIALIZED_ERROR);
+    }
+
+    init_scan_options(&scan_opts, options_mask);
+
+    ERL_NIF_TERM* results = enif_alloc(sizeof(ERL_NIF_TERM) * (length > 0 ? length : 1));
+    if (!results) {
+        return make_error(env, "Failed to allocate batch results");
+    }
+
+    for (unsigned int i = 0; i < length; i++) {
+        enif_get_list_cell(env, list, &head, &list);
+        results[i] = scan_batch_item(env, handle, &scan_opts, head);
+    }
+
+    ERL_NIF_TERM result = enif_make_list_from_array(env, results, length);
+    enif_free(results);
+
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), result);
 }
 
 // Get ClamAV version
@@ -408,6 +1069,549 @@ static ERL_NIF_TERM get_database_version_nif(ErlNifEnv* env, int argc, const ERL
     return enif_make_ulong(env, (unsigned long)version);
 }
 
+// Build time of the newest loaded database, in seconds since the epoch.
+static ERL_NIF_TERM get_database_time_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    engine_handle* handle;
+    int err = 0;
+    long long db_time;
+
+    if (!enif_get_resource(env, argv[0], ENGINE_RESOURCE_TYPE, (void**)&handle)) {
+        return enif_make_badarg(env);
+    }
+
+    if (!handle->engine) {
+        return make_error(env, ENGINE_INVALID_ERROR);
+    }
+
+    db_time = cl_engine_get_num(handle->engine, CL_ENGINE_DB_TIME, &err);
+
+    if (err != CL_SUCCESS) {
+        return make_clamav_error(env, err);
+    }
+
+    return enif_make_ulong(env, (unsigned long)db_time);
+}
+
+// Copy a binary into an anonymous memfd so an out-of-process worker can map
+// it through /proc/<pid>/fd/<fd> instead of receiving it over a pipe.
+static ERL_NIF_TERM shared_buffer_new_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    ErlNifBinary buffer;
+
+    if (!enif_inspect_binary(env, argv[0], &buffer)) {
+        return enif_make_badarg(env);
+    }
+
+#ifdef __linux__
+    int fd = memfd_create("ex_clamav_buffer", MFD_CLOEXEC);
+    if (fd < 0) {
+        return make_error(env, strerror(errno));
+    }
+
+    size_t written = 0;
+    while (written < buffer.size) {
+        ssize_t n = write(fd, buffer.data + written, buffer.size - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERL_NIF_TERM error = make_error(env, strerror(errno));
+            close(fd);
+            return error;
+        }
+        written += (size_t)n;
+    }
+
+    shared_buffer_handle* handle = enif_alloc_resource(SHARED_BUFFER_RESOURCE_TYPE, sizeof(shared_buffer_handle));
+    if (!handle) {
+        close(fd);
+        return make_error(env, "Failed to allocate resource");
+    }
+
+    handle->fd = fd;
+    handle->size = buffer.size;
+
+    ERL_NIF_TERM result = enif_make_resource(env, handle);
+    enif_release_resource(handle);
+
+    return enif_make_tuple4(
+        env,
+        enif_make_atom(env, "ok"),
+        result,
+        enif_make_int(env, fd),
+        enif_make_uint64(env, (ErlNifUInt64)buffer.size)
+    );
+#else
+    return make_error(env, "Shared buffers require memfd_create (Linux only)");
+#endif
+}
+
+// Report the module state carried across upgrades
+static ERL_NIF_TERM nif_info_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    (void)argv;
+    ERL_NIF_TERM map = enif_make_new_map(env);
+
+    enif_mutex_lock(STATE->lock);
+    unsigned int upgrades = STATE->upgrades;
+    unsigned int refs = STATE->refs;
+    long live_engines = STATE->live_engines;
+    enif_mutex_unlock(STATE->lock);
+
+    enif_make_map_put(env, map, enif_make_atom(env, "abi"), enif_make_int(env, STATE->abi), &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "upgrades"), enif_make_ulong(env, upgrades), &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "loaded_instances"), enif_make_ulong(env, refs), &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "live_engines"), enif_make_long(env, live_engines), &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "usdt"),
+                      enif_make_atom(env, USDT_ENABLED ? "true" : "false"), &map);
+
+    return map;
+}
+
+// Verify a downloaded .cvd (header, MD5 and digital signature) before it
+// replaces the live copy.
+static ERL_NIF_TERM cvd_verify_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    char file_path[1024];
+    cl_error_t ret;
+
+    if (!get_c_string(env, argv[0], file_path, sizeof(file_path))) {
+        return enif_make_badarg(env);
+    }
+
+    ret = cl_cvdverify(file_path);
+
+    if (ret != CL_SUCCESS) {
+        return make_clamav_error(env, ret);
+    }
+
+    return enif_make_atom(env, "ok");
+}
+
+static uint32_t read_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const unsigned char* p) {
+    return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+// Map an allowlist file read-only; the mapping is shared with every process
+// on the host that opens the same file.
+static ERL_NIF_TERM allowlist_open_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    char file_path[1024];
+    struct stat st;
+    void* base;
+    uint64_t count;
+    uint32_t bucket;
+
+    if (!get_c_string(env, argv[0], file_path, sizeof(file_path))) {
+        return enif_make_badarg(env);
+    }
+
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return make_error(env, strerror(errno));
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ERL_NIF_TERM error = make_error(env, strerror(errno));
+        close(fd);
+        return error;
+    }
+
+    if ((size_t)st.st_size < ALLOWLIST_HEADER_SIZE) {
+        close(fd);
+        return make_error(env, "Invalid allowlist file");
+    }
+
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        return make_error(env, strerror(errno));
+    }
+
+    const unsigned char* bytes = (const unsigned char*)base;
+    count = read_le64(bytes + 8);
+
+    if (memcmp(bytes, ALLOWLIST_MAGIC, 8) != 0 ||
+        count > ((uint64_t)st.st_size - ALLOWLIST_HEADER_SIZE) / ALLOWLIST_DIGEST_SIZE ||
+        (uint64_t)st.st_size != ALLOWLIST_HEADER_SIZE + count * ALLOWLIST_DIGEST_SIZE) {
+        munmap(base, (size_t)st.st_size);
+        return make_error(env, "Invalid allowlist file");
+    }
+
+    // The index must be monotonic and end at count, or lookups could read
+    // past the digests.
+    uint32_t previous = 0;
+    for (bucket = 0; bucket <= ALLOWLIST_BUCKETS; bucket++) {
+        uint32_t position = read_le32(bytes + 16 + bucket * 4);
+        if (position < previous || position > count) {
+            munmap(base, (size_t)st.st_size);
+            return make_error(env, "Invalid allowlist index");
+        }
+        previous = position;
+    }
+
+    if (previous != count) {
+        munmap(base, (size_t)st.st_size);
+        return make_error(env, "Invalid allowlist index");
+    }
+
+#ifdef MADV_RANDOM
+    madvise(base, (size_t)st.st_size, MADV_RANDOM);
+#endif
+
+    allowlist_handle* handle = enif_alloc_resource(ALLOWLIST_RESOURCE_TYPE, sizeof(allowlist_handle));
+    if (!handle) {
+        munmap(base, (size_t)st.st_size);
+        return make_error(env, "Failed to allocate resource");
+    }
+
+    handle->base = bytes;
+    handle->size = (size_t)st.st_size;
+    handle->count = count;
+
+    ERL_NIF_TERM result = enif_make_resource(env, handle);
+    enif_release_resource(handle);
+
+    return enif_make_tuple3(env, enif_make_atom(env, "ok"), result, enif_make_uint64(env, count));
+}
+
+// Constant-time in practice: the bucket for the digest's two leading bytes
+// holds count / 65536 entries on average.
+static ERL_NIF_TERM allowlist_lookup_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    allowlist_handle* handle;
+    ErlNifBinary digest;
+
+    if (!enif_get_resource(env, argv[0], ALLOWLIST_RESOURCE_TYPE, (void**)&handle) ||
+        !enif_inspect_binary(env, argv[1], &digest) ||
+        digest.size != ALLOWLIST_DIGEST_SIZE) {
+        return enif_make_badarg(env);
+    }
+
+    const unsigned char* index = handle->base + 16;
+    const unsigned char* digests = handle->base + ALLOWLIST_HEADER_SIZE;
+    uint32_t prefix = ((uint32_t)digest.data[0] << 8) | digest.data[1];
+    uint32_t lo = read_le32(index + prefix * 4);
+    uint32_t hi = read_le32(index + (prefix + 1) * 4);
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(digests + (size_t)mid * ALLOWLIST_DIGEST_SIZE, digest.data, ALLOWLIST_DIGEST_SIZE);
+
+        if (cmp == 0) {
+            return enif_make_atom(env, "true");
+        }
+
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return enif_make_atom(env, "false");
+}
+
+// Create the cache file with `slots` empty slots, or map an existing one with
+// the size it was created with. The exclusive lock only serialises creation.
+static ERL_NIF_TERM vcache_open_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    char file_path[1024];
+    ErlNifUInt64 slots;
+    vcache_header header;
+    struct stat st;
+    const char* error = NULL;
+
+    if (!get_c_string(env, argv[0], file_path, sizeof(file_path)) ||
+        !enif_get_uint64(env, argv[1], &slots) ||
+        slots == 0 || slots > (SIZE_MAX - sizeof(vcache_header)) / sizeof(vcache_slot)) {
+        return enif_make_badarg(env);
+    }
+
+    int fd;
+
+    for (;;) {
+        fd = open(file_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return make_error(env, strerror(errno));
+        }
+
+        if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+            ERL_NIF_TERM result = make_error(env, strerror(errno));
+            close(fd);
+            return result;
+        }
+
+        // Another opener replaced the file while this one waited for the lock.
+        if (st.st_nlink == 0) {
+            close(fd);
+            continue;
+        }
+
+        if ((size_t)st.st_size >= sizeof(header) &&
+            pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+            memcmp(header.magic, VCACHE_OLD_MAGIC, 8) == 0) {
+            if (unlink(file_path) < 0) {
+                ERL_NIF_TERM result = make_error(env, strerror(errno));
+                close(fd);
+                return result;
+            }
+            close(fd);
+            continue;
+        }
+
+        break;
+    }
+
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, VCACHE_MAGIC, 8);
+        header.slots = slots;
+
+        // ftruncate leaves the slots zeroed, which is the empty state.
+        if (ftruncate(fd, (off_t)(sizeof(header) + slots * sizeof(vcache_slot))) < 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            error = strerror(errno);
+        }
+    } else if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+               memcmp(header.magic, VCACHE_MAGIC, 8) != 0 ||
+               header.slots == 0 ||
+               header.slots > ((uint64_t)st.st_size - sizeof(header)) / sizeof(vcache_slot) ||
+               (uint64_t)st.st_size != sizeof(header) + header.slots * sizeof(vcache_slot)) {
+        error = "Invalid verdict cache file";
+    } else {
+        slots = header.slots;
+    }
+
+    flock(fd, LOCK_UN);
+
+    if (error) {
+        ERL_NIF_TERM result = make_error(env, error);
+        close(fd);
+        return result;
+    }
+
+    size_t size = sizeof(vcache_header) + (size_t)slots * sizeof(vcache_slot);
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        return make_error(env, strerror(errno));
+    }
+
+#ifdef MADV_RANDOM
+    madvise(base, size, MADV_RANDOM);
+#endif
+
+    vcache_handle* handle = enif_alloc_resource(VCACHE_RESOURCE_TYPE, sizeof(vcache_handle));
+    if (!handle) {
+        munmap(base, size);
+        return make_error(env, "Failed to allocate resource");
+    }
+
+    handle->base = (unsigned char*)base;
+    handle->size = size;
+    handle->slots = slots;
+
+    ERL_NIF_TERM result = enif_make_resource(env, handle);
+    enif_release_resource(handle);
+
+    return enif_make_tuple3(env, enif_make_atom(env, "ok"), result, enif_make_uint64(env, slots));
+}
+
+static vcache_slot* vcache_slot_at(vcache_handle* handle, const unsigned char* digest, unsigned int probe) {
+    uint64_t start;
+    memcpy(&start, digest, sizeof(start));
+    vcache_slot* slots = (vcache_slot*)(handle->base + sizeof(vcache_header));
+    return &slots[(start % handle->slots + probe) % handle->slots];
+}
+
+#define VCACHE_LOCK_STAMP(word) ((uint32_t)(word))
+#define VCACHE_LOCK_SEQ(word) ((word) >> 32)
+
+// Lock stamp for now; never 0, which marks an unlocked slot.
+static uint32_t vcache_stamp(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec + 1;
+}
+
+// A lock stamped long ago, or after now (i.e. before a reboot), has no live writer.
+static int vcache_abandoned(uint64_t word, uint32_t now) {
+    uint32_t stamp = VCACHE_LOCK_STAMP(word);
+    return stamp != 0 && (uint32_t)(now - stamp) >= VCACHE_STALE_LOCK_S;
+}
+
+// Take a consistent copy of a slot; fails if a writer holds or changed it.
+static int vcache_read(vcache_slot* slot, vcache_slot* copy) {
+    uint64_t before = atomic_load_explicit(&slot->lock, memory_order_acquire);
+    if (VCACHE_LOCK_STAMP(before) != 0) {
+        return 0;
+    }
+
+    copy->verdict = slot->verdict;
+    copy->name_len = slot->name_len;
+    copy->version = slot->version;
+    memcpy(copy->digest, slot->digest, VCACHE_DIGEST_SIZE);
+    memcpy(copy->name, slot->name, VCACHE_NAME_SIZE);
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->lock, memory_order_relaxed) == before;
+}
+
+static int get_vcache_args(ErlNifEnv* env, const ERL_NIF_TERM argv[], vcache_handle** handle,
+                           ErlNifBinary* digest, ErlNifUInt64* version) {
+    return enif_get_resource(env, argv[0], VCACHE_RESOURCE_TYPE, (void**)handle) &&
+           (*handle)->base != NULL &&
+           enif_inspect_binary(env, argv[1], digest) &&
+           digest->size == VCACHE_DIGEST_SIZE &&
+           enif_get_uint64(env, argv[2], version);
+}
+
+// Returns {:ok, :clean}, {:virus, name} or :miss. A slot that is being
+// written counts as a miss rather than waiting for the writer.
+static ERL_NIF_TERM vcache_get_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    vcache_handle* handle;
+    ErlNifBinary digest;
+    ErlNifUInt64 version;
+    vcache_slot copy;
+    unsigned int probe;
+
+    if (!get_vcache_args(env, argv, &handle, &digest, &version)) {
+        return enif_make_badarg(env);
+    }
+
+    for (probe = 0; probe < VCACHE_PROBES && probe < handle->slots; probe++) {
+        if (!vcache_read(vcache_slot_at(handle, digest.data, probe), &copy)) {
+            continue;
+        }
+
+        // Slots are never emptied, so the digest cannot be further along.
+        if (copy.verdict == VCACHE_EMPTY) {
+            break;
+        }
+
+        if (memcmp(copy.digest, digest.data, VCACHE_DIGEST_SIZE) != 0) {
+            continue;
+        }
+
+        if (copy.version != version) {
+            break;
+        }
+
+        if (copy.verdict == VCACHE_CLEAN) {
+            return enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_atom(env, "clean"));
+        }
+
+        ERL_NIF_TERM name;
+        unsigned char* data = enif_make_new_binary(env, copy.name_len, &name);
+        memcpy(data, copy.name, copy.name_len);
+        return enif_make_tuple2(env, enif_make_atom(env, "virus"), name);
+    }
+
+    return enif_make_atom(env, "miss");
+}
+
+// Store a verdict (1 = clean, 2 = virus) in the slot already holding the
+// digest, else the first empty one, else the first holding another database
+// generation or abandoned by a dead writer, else a digest-chosen victim.
+// Returns :busy if a live writer holds that slot; the verdict is simply not
+// cached then.
+static ERL_NIF_TERM vcache_put_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    (void)argc;
+    vcache_handle* handle;
+    ErlNifBinary digest;
+    ErlNifUInt64 version;
+    ErlNifBinary name;
+    unsigned int verdict;
+    unsigned int probe;
+    unsigned int probes;
+    vcache_slot copy;
+    vcache_slot* empty = NULL;
+    vcache_slot* stale = NULL;
+    vcache_slot* target = NULL;
+
+    if (!get_vcache_args(env, argv, &handle, &digest, &version) ||
+        !enif_get_uint(env, argv[3], &verdict) ||
+        (verdict != VCACHE_CLEAN && verdict != VCACHE_VIRUS) ||
+        !enif_inspect_binary(env, argv[4], &name) ||
+        name.size > VCACHE_NAME_SIZE) {
+        return enif_make_badarg(env);
+    }
+
+    probes = handle->slots < VCACHE_PROBES ? (unsigned int)handle->slots : VCACHE_PROBES;
+    uint32_t now = vcache_stamp();
+
+    for (probe = 0; probe < probes && !target; probe++) {
+        vcache_slot* slot = vcache_slot_at(handle, digest.data, probe);
+
+        if (!vcache_read(slot, &copy)) {
+            uint64_t word = atomic_load_explicit(&slot->lock, memory_order_relaxed);
+            if (!stale && vcache_abandoned(word, now)) {
+                stale = slot;
+            }
+            continue;
+        }
+
+        if (copy.verdict == VCACHE_EMPTY) {
+            if (!empty) {
+                empty = slot;
+            }
+        } else if (memcmp(copy.digest, digest.data, VCACHE_DIGEST_SIZE) == 0) {
+            target = slot;
+        } else if (copy.version != version && !stale) {
+            stale = slot;
+        }
+    }
+
+    if (!target) {
+        target = empty ? empty
+               : stale ? stale
+               : vcache_slot_at(handle, digest.data, digest.data[8] % probes);
+    }
+
+    // Taking over an abandoned lock bumps the sequence number, so the dead
+    // writer's release can never match should it turn out to be alive.
+    uint64_t word = atomic_load_explicit(&target->lock, memory_order_relaxed);
+    uint64_t seq = VCACHE_LOCK_SEQ(word);
+    if (VCACHE_LOCK_STAMP(word) != 0) {
+        if (!vcache_abandoned(word, now)) {
+            return enif_make_atom(env, "busy");
+        }
+        seq++;
+    }
+
+    uint64_t locked = ((seq & 0xFFFFFFFFu) << 32) | now;
+    if (!atomic_compare_exchange_strong_explicit(&target->lock, &word, locked,
+                                                 memory_order_acquire, memory_order_relaxed)) {
+        return enif_make_atom(env, "busy");
+    }
+
+    atomic_thread_fence(memory_order_release);
+
+    target->verdict = (uint8_t)verdict;
+    target->name_len = (uint8_t)name.size;
+    target->version = version;
+    memcpy(target->digest, digest.data, VCACHE_DIGEST_SIZE);
+    memset(target->name, 0, VCACHE_NAME_SIZE);
+    memcpy(target->name, name.data, name.size);
+
+    uint64_t released = ((seq + 1) & 0xFFFFFFFFu) << 32;
+    if (!atomic_compare_exchange_strong_explicit(&target->lock, &locked, released,
+                                                 memory_order_release, memory_order_relaxed)) {
+        return enif_make_atom(env, "busy");
+    }
+
+    return enif_make_atom(env, "ok");
+}
+
 // NIF function definitions
 static ErlNifFunc nif_funcs[] = {
     {"init", 1, init_nif, 0},
@@ -430,7 +1634,19 @@ static ErlNifFunc nif_funcs[] = {
     {"scan_buffer", 2, scan_buffer_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"scan_buffer", 3, scan_buffer_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"get_version", 0, get_version_nif, 0},
-    {"get_database_version", 1, get_database_version_nif, 0}
+    {"get_database_version", 1, get_database_version_nif, 0},
+    {"get_database_time", 1, get_database_time_nif, 0},
+    {"shared_buffer_new", 1, shared_buffer_new_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"nif_info", 0, nif_info_nif, 0},
+    {"file_open", 1, file_open_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"scan_file_range", 5, scan_file_range_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"scan_batch", 3, scan_batch_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"cvd_verify", 1, cvd_verify_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"allowlist_open", 1, allowlist_open_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"allowlist_lookup", 2, allowlist_lookup_nif, 0},
+    {"vcache_open", 2, vcache_open_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"vcache_get", 3, vcache_get_nif, 0},
+    {"vcache_put", 5, vcache_put_nif, 0}
 };
 
-ERL_NIF_INIT(Elixir.ExClamav.Nif, nif_funcs, load, NULL, upgrade, NULL)
+ERL_NIF_INIT(Elixir.ExClamav.Nif, nif_funcs, load, NULL, upgrade, unload)
@@ -0,0 +1,747 @@
+/*
+ * clamav_worker — out-of-process scan worker driven by ExClamav.Isolated.
+ *
+ * The worker loads and compiles an engine once, then serves scan requests
+ * read from stdin and answers on stdout. Both directions use the framing of
+ * an Erlang port opened with {packet, 4}: a 4-byte big-endian length followed
+ * by the payload.
+ *
+ * Requests (first byte is the opcode, options are a big-endian uint32,
+ * max_memory a big-endian uint64 heap cap for the scan in bytes, 0 for none):
+ *
+ *   'F' <options:4> <max_memory:8> <path...>                 scan a file by path
+ *   'B' <options:4> <max_memory:8> <data...>                 scan an inline buffer
+ *   'M' <options:4> <max_memory:8> <pid:4> <fd:4> <size:8>   scan a memfd owned by <pid>
+ *
+ * Replies (peak is the scan's peak heap use in bytes, see below):
+ *
+ *   'R' <signatures:4>     engine ready (sent once after start-up)
+ *   'C' <peak:8>           clean
+ *   'V' <peak:8> <name...> virus found
+ *   'L' <peak:8>           aborted: the scan reached max_memory
+ *   'E' <message...>       error
+ *
+ * Memfd buffers are opened through /proc/<pid>/fd/<fd>, so the bytes are
+ * shared with the BEAM rather than copied through the pipe. Because the
+ * worker is a separate process, a libclamav crash only takes down this
+ * worker; the Elixir side replies with an error and starts a new one.
+ *
+ * Zygote mode (clamav_worker <database_path> --zygote <socket_path>) loads
+ * and compiles the engine once, listens on a unix socket and forks one
+ * scanner per accepted connection. The children inherit the compiled engine
+ * copy-on-write, so N scanners cost roughly the memory of one engine. Each
+ * child speaks the protocol above on its socket and announces itself with
+ * 'R' <signatures:4> <pid:4>; the zygote answers 'R' <signatures:4> on stdout
+ * once the socket is listening and exits when stdin is closed. Children exit
+ * when their connection closes, so they never outlive the BEAM.
+ *
+ * Memory accounting: libclamav's size and recursion limits do not bound heap
+ * use, and a crafted file can make one scan allocate gigabytes. The worker
+ * defines malloc and friends itself (forwarding to glibc's __libc_* entry
+ * points), which interposes them for libclamav as well, and while a scan runs
+ * tracks live and peak bytes allocated since it started. An allocation that
+ * would take the scan past max_memory fails with ENOMEM, libclamav unwinds
+ * with CL_EMEM, and the worker replies 'L' whatever the scan returned, since
+ * its verdict may rest on an incomplete scan. The worker is single-threaded,
+ * so the counters need no synchronisation. On other C libraries the hooks
+ * are compiled out and peak is reported as 0.
+ */
+#define _GNU_SOURCE
+#include <clamav.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define MAX_PATH_LEN 4096
+#define REQUEST_HEADER_LEN 13
+
+static struct cl_engine *engine = NULL;
+static unsigned int signatures = 0;
+
+/* Descriptors the request loop talks on: stdio for a port, the socket for a zygote child. */
+static int in_fd = STDIN_FILENO;
+static int out_fd = STDOUT_FILENO;
+
+/* Per-scan heap accounting; only active between begin_accounting() and end_accounting(). */
+static int accounting = 0;
+static long long live_bytes = 0;
+static long long peak_bytes = 0;
+static long long memory_cap = 0;
+static int cap_exceeded = 0;
+
+#ifdef __GLIBC__
+/*
+ * Addresses of the blocks charged to the current scan, kept in an
+ * open-addressing set. Only these are refunded when freed: blocks allocated
+ * before the scan (engine tables, zygote state) were never charged, and
+ * refunding them would let the scan allocate past max_memory. The table is
+ * mmap'd so maintaining it never re-enters malloc.
+ */
+#define OWNED_INITIAL_SLOTS 4096
+
+static uintptr_t *owned = NULL;
+static size_t owned_slots = 0;
+static size_t owned_count = 0;
+
+static size_t owned_home(uintptr_t addr) {
+    return (size_t)((uint64_t)(addr >> 4) * 0x9E3779B97F4A7C15ULL) & (owned_slots - 1);
+}
+
+static void owned_reset(void) {
+    if (owned) {
+        munmap(owned, owned_slots * sizeof(*owned));
+    }
+    owned = NULL;
+    owned_slots = 0;
+    owned_count = 0;
+}
+
+static int owned_grow(void) {
+    size_t old_slots = owned_slots;
+    uintptr_t *old = owned;
+    size_t slots = old_slots ? old_slots * 2 : OWNED_INITIAL_SLOTS;
+
+    uintptr_t *table = mmap(NULL, slots * sizeof(*table), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        return -1;
+    }
+
+    owned = table;
+    owned_slots = slots;
+    for (size_t i = 0; i < old_slots; i++) {
+        if (old[i]) {
+            size_t j = owned_home(old[i]);
+            while (owned[j]) {
+                j = (j + 1) & (slots - 1);
+            }
+            owned[j] = old[i];
+        }
+    }
+    if (old) {
+        munmap(old, old_slots * sizeof(*old));
+    }
+    return 0;
+}
+
+/* If the set cannot grow the block goes untracked and stays charged until the scan ends. */
+static void owned_add(void *ptr) {
+    if ((owned_count + 1) * 2 > owned_slots && owned_grow() < 0) {
+        return;
+    }
+    size_t i = owned_home((uintptr_t)ptr);
+    while (owned[i]) {
+        i = (i + 1) & (owned_slots - 1);
+    }
+    owned[i] = (uintptr_t)ptr;
+    owned_count++;
+}
+
+/* Slot holding ptr, or owned_slots when the scan does not own it. */
+static size_t owned_find(const void *ptr) {
+    if (!owned) {
+        return owned_slots;
+    }
+    size_t i = owned_home((uintptr_t)ptr);
+    while (owned[i] != (uintptr_t)ptr) {
+        if (!owned[i]) {
+            return owned_slots;
+        }
+        i = (i + 1) & (owned_slots - 1);
+    }
+    return i;
+}
+
+/* Removes ptr if the scan owns it, shifting later entries back so probe chains stay intact. */
+static int owned_take(const void *ptr) {
+    size_t mask = owned_slots - 1;
+    size_t hole = owned_find(ptr);
+
+    if (hole == owned_slots) {
+        return 0;
+    }
+    for (size_t j = (hole + 1) & mask; owned[j]; j = (j + 1) & mask) {
+        if (((j - owned_home(owned[j])) & mask) >= ((j - hole) & mask)) {
+            owned[hole] = owned[j];
+            hole = j;
+        }
+    }
+    owned[hole] = 0;
+    owned_count--;
+    return 1;
+}
+#endif
+
+static void begin_accounting(uint64_t max_memory) {
+#ifdef __GLIBC__
+    owned_reset();
+#endif
+    live_bytes = 0;
+    peak_bytes = 0;
+    memory_cap = max_memory > (uint64_t)INT64_MAX ? 0 : (long long)max_memory;
+    cap_exceeded = 0;
+    accounting = 1;
+}
+
+static void end_accounting(void) {
+    accounting = 0;
+}
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+/* Whether the scan may grow by size bytes; records the refusal otherwise. */
+static int admit(size_t size) {
+    if (!accounting || memory_cap == 0 ||
+        (size <= (size_t)memory_cap && live_bytes + (long long)size <= memory_cap)) {
+        return 1;
+    }
+    cap_exceeded = 1;
+    errno = ENOMEM;
+    return 0;
+}
+
+static void charge(void *ptr) {
+    if (accounting && ptr) {
+        owned_add(ptr);
+        live_bytes += (long long)malloc_usable_size(ptr);
+        if (live_bytes > peak_bytes) {
+            peak_bytes = live_bytes;
+        }
+    }
+}
+
+static void refund(void *ptr) {
+    if (accounting && ptr && owned_take(ptr)) {
+        live_bytes -= (long long)malloc_usable_size(ptr);
+    }
+}
+
+void *malloc(size_t size) {
+    if (!admit(size)) {
+        return NULL;
+    }
+    void *ptr = __libc_malloc(size);
+    charge(ptr);
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!admit(count * size)) {
+        return NULL;
+    }
+    void *ptr = __libc_calloc(count, size);
+    charge(ptr);
+    return ptr;
+}
+
+/* Growing a block the scan does not own charges the whole new block, like a fresh malloc. */
+void *realloc(void *ptr, size_t size) {
+    int scan_owned = accounting && ptr && owned_find(ptr) != owned_slots;
+    size_t old_size = scan_owned ? malloc_usable_size(ptr) : 0;
+
+    if (size > old_size && !admit(size - old_size)) {
+        return NULL;
+    }
+
+    void *grown = __libc_realloc(ptr, size);
+    if (accounting && (grown || size == 0)) {
+        if (scan_owned) {
+            owned_take(ptr);
+            live_bytes -= (long long)old_size;
+        }
+        charge(grown);
+    }
+    return grown;
+}
+
+void *reallocarray(void *ptr, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, count * size);
+}
+
+void free(void *ptr) {
+    refund(ptr);
+    __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (!admit(size)) {
+        return NULL;
+    }
+    void *ptr = __libc_memalign(alignment, size);
+    charge(ptr);
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (size > SIZE_MAX - (page - 1)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = memalign(alignment, size);
+    if (!ptr && size != 0) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+#endif
+
+static int read_full(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    return ((uint64_t)get_u32(p) << 32) | (uint64_t)get_u32(p + 4);
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static int send_reply(char tag, const void *payload, size_t len) {
+    unsigned char header[5];
+    put_u32(header, (uint32_t)(len + 1));
+    header[4] = (unsigned char)tag;
+    if (write_full(out_fd, header, sizeof(header)) < 0) {
+        return -1;
+    }
+    if (len > 0 && write_full(out_fd, payload, len) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int send_error(const char *message) {
+    return send_reply('E', message, strlen(message));
+}
+
+/* Mirrors init_scan_options() in clamav_nif.c so both modes accept the same masks. */
+static void init_scan_options(struct cl_scan_options *opts, unsigned int options_mask) {
+    memset(opts, 0, sizeof(*opts));
+
+    opts->general = options_mask &
+        (CL_SCAN_GENERAL_ALLMATCHES |
+         CL_SCAN_GENERAL_COLLECT_METADATA |
+         CL_SCAN_GENERAL_HEURISTICS |
+         CL_SCAN_GENERAL_HEURISTIC_PRECEDENCE |
+         CL_SCAN_GENERAL_UNPRIVILEGED);
+
+    if (options_mask & 0x1) {
+        opts->parse |= CL_SCAN_PARSE_ARCHIVE;
+    }
+    if (options_mask & 0x2) {
+        opts->parse |= CL_SCAN_PARSE_MAIL;
+    }
+    if (options_mask & 0x4) {
+        opts->parse |= CL_SCAN_PARSE_OLE2;
+    }
+    if (options_mask & 0x8) {
+        opts->heuristic |= CL_SCAN_HEURISTIC_BROKEN;
+    }
+}
+
+static int send_result(int ret, const char *virus_name) {
+    unsigned char payload[8 + 1024];
+    size_t name_len = 0;
+
+    end_accounting();
+
+    uint64_t peak = peak_bytes > 0 ? (uint64_t)peak_bytes : 0;
+    put_u32(payload, (uint32_t)(peak >> 32));
+    put_u32(payload + 4, (uint32_t)peak);
+
+    if (cap_exceeded) {
+#ifdef __GLIBC__
+        /* Hand the aborted scan's arenas back to the kernel before the next request. */
+        malloc_trim(0);
+#endif
+        return send_reply('L', payload, 8);
+    }
+
+    switch (ret) {
+        case CL_CLEAN:
+            return send_reply('C', payload, 8);
+        case CL_VIRUS:
+            if (virus_name) {
+                name_len = strlen(virus_name);
+                if (name_len > sizeof(payload) - 8) {
+                    name_len = sizeof(payload) - 8;
+                }
+                memcpy(payload + 8, virus_name, name_len);
+            }
+            return send_reply('V', payload, 8 + name_len);
+        default:
+            return send_error(cl_strerror(ret));
+    }
+}
+
+static int handle_scan_file(const unsigned char *req, size_t len, struct cl_scan_options *opts) {
+    char path[MAX_PATH_LEN];
+    const char *virus_name = NULL;
+    unsigned long int scanned = 0;
+
+    if (len >= sizeof(path)) {
+        return send_error("Path too long");
+    }
+    memcpy(path, req, len);
+    path[len] = '\0';
+
+    int ret = cl_scanfile(path, &virus_name, &scanned, engine, opts);
+    return send_result(ret, virus_name);
+}
+
+static int handle_scan_buffer(const unsigned char *req, size_t len, struct cl_scan_options *opts) {
+    const char *virus_name = NULL;
+    unsigned long int scanned = 0;
+
+    cl_fmap_t *map = cl_fmap_open_memory(req, len);
+    if (!map) {
+        return send_error("Failed to create fmap");
+    }
+
+    int ret = cl_scanmap_callback(map, NULL, &virus_name, &scanned, engine, opts, NULL);
+    cl_fmap_close(map);
+    return send_result(ret, virus_name);
+}
+
+static int handle_scan_memfd(const unsigned char *req, size_t len, struct cl_scan_options *opts) {
+    char proc_path[64];
+    const char *virus_name = NULL;
+    unsigned long int scanned = 0;
+
+    if (len != 16) {
+        return send_error("Malformed memfd request");
+    }
+
+    uint32_t owner_pid = get_u32(req);
+    uint32_t owner_fd = get_u32(req + 4);
+    uint64_t size = get_u64(req + 8);
+
+    snprintf(proc_path, sizeof(proc_path), "/proc/%u/fd/%u", owner_pid, owner_fd);
+
+    int fd = open(proc_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return send_error("Failed to open shared buffer");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size != size) {
+        close(fd);
+        return send_error("Shared buffer size mismatch");
+    }
+
+    int ret = cl_scandesc(fd, NULL, &virus_name, &scanned, engine, opts);
+    close(fd);
+    return send_result(ret, virus_name);
+}
+
+static int handle_request(const unsigned char *req, size_t len) {
+    struct cl_scan_options opts;
+    int status;
+
+    if (len < REQUEST_HEADER_LEN) {
+        return send_error("Malformed request");
+    }
+
+    const unsigned char *body = req + REQUEST_HEADER_LEN;
+    size_t body_len = len - REQUEST_HEADER_LEN;
+
+    init_scan_options(&opts, get_u32(req + 1));
+    begin_accounting(get_u64(req + 5));
+
+    switch (req[0]) {
+        case 'F':
+            status = handle_scan_file(body, body_len, &opts);
+            break;
+        case 'B':
+            status = handle_scan_buffer(body, body_len, &opts);
+            break;
+        case 'M':
+            status = handle_scan_memfd(body, body_len, &opts);
+            break;
+        default:
+            status = send_error("Unknown request");
+            break;
+    }
+
+    /* Requests rejected before reaching libclamav reply through send_error. */
+    end_accounting();
+    return status;
+}
+
+static int load_engine(const char *database_path) {
+    int ret;
+
+    if ((ret = cl_init(CL_INIT_DEFAULT)) != CL_SUCCESS) {
+        send_error(cl_strerror(ret));
+        return -1;
+    }
+
+    engine = cl_engine_new();
+    if (!engine) {
+        send_error("Failed to create engine");
+        return -1;
+    }
+
+    if ((ret = cl_load(database_path, engine, &signatures, CL_DB_STDOPT)) != CL_SUCCESS ||
+        (ret = cl_engine_compile(engine)) != CL_SUCCESS) {
+        send_error(cl_strerror(ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int send_ready(int with_pid) {
+    unsigned char payload[8];
+
+    put_u32(payload, signatures);
+    if (!with_pid) {
+        return send_reply('R', payload, 4);
+    }
+    put_u32(payload + 4, (uint32_t)getpid());
+    return send_reply('R', payload, sizeof(payload));
+}
+
+/* Serves requests until the peer closes the connection. Returns 0 on EOF. */
+static int serve(void) {
+    unsigned char header[4];
+    unsigned char *request = NULL;
+    size_t capacity = 0;
+    int status = 0;
+
+    for (;;) {
+        int r = read_full(in_fd, header, sizeof(header));
+        if (r <= 0) {
+            status = r;
+            break;
+        }
+
+        size_t len = get_u32(header);
+        if (len > capacity) {
+            unsigned char *grown = realloc(request, len);
+            if (!grown) {
+                status = -1;
+                break;
+            }
+            request = grown;
+            capacity = len;
+        }
+
+        if (read_full(in_fd, request, len) <= 0 || handle_request(request, len) < 0) {
+            status = -1;
+            break;
+        }
+    }
+
+    free(request);
+    return status;
+}
+
+static int listen_unix(const char *socket_path) {
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        send_error("Socket path too long");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        send_error("Failed to create zygote socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    /* Only the BEAM's user may connect. */
+    mode_t old_umask = umask(077);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+
+    if (ret < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        send_error("Failed to listen on zygote socket");
+        return -1;
+    }
+
+    return fd;
+}
+
+static void run_child(int conn_fd) {
+    /* The child talks only on its connection; drop the zygote's port pipes. */
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+
+    in_fd = conn_fd;
+    out_fd = conn_fd;
+
+    if (send_ready(1) < 0) {
+        _exit(1);
+    }
+    _exit(serve() < 0 ? 1 : 0);
+}
+
+static int run_zygote(const char *socket_path) {
+    int listen_fd = listen_unix(socket_path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    /* Children are never waited for; let the kernel reap them. */
+    signal(SIGCHLD, SIG_IGN);
+
+    if (send_ready(0) < 0) {
+        unlink(socket_path);
+        return 1;
+    }
+
+    struct pollfd fds[2] = {
+        {.fd = STDIN_FILENO, .events = POLLIN},
+        {.fd = listen_fd, .events = POLLIN},
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        /* The port only ever closes stdin; any readiness there means shut down. */
+        if (fds[0].revents) {
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn_fd < 0) {
+                continue;
+            }
+
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(listen_fd);
+                run_child(conn_fd);
+            }
+            close(conn_fd);
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    cl_engine_free(engine);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2 && !(argc == 4 && strcmp(argv[2], "--zygote") == 0)) {
+        fprintf(stderr, "usage: %s <database_path> [--zygote <socket_path>]\n", argv[0]);
+        return 2;
+    }
+
+    if (load_engine(argv[1]) < 0) {
+        return 1;
+    }
+
+    if (argc == 4) {
+        return run_zygote(argv[3]);
+    }
+
+    if (send_ready(0) < 0) {
+        return 1;
+    }
+
+    int status = serve();
+    cl_engine_free(engine);
+    return status < 0 ? 1 : 0;
+}
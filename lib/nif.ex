@@ -3,14 +3,25 @@ defmodule ExClamav.Nif do
   NIF interface to libclamav.
 
   This module provides direct bindings to the ClamAV C library.
+
+  ## Hot code upgrades
+
+  Loaded engines survive a hot upgrade of this module: the new library takes
+  over the existing engine resources and the module state kept in
+  `priv_data`, so references held by running processes stay valid and no
+  database is reloaded. `load_nifs/0` passes `@nif_abi` as load info; a library
+  built for a different state layout refuses to load rather than misreading it.
   """
 
   @on_load :load_nifs
 
+  # Must match NIF_ABI_VERSION in clamav_nif.c.
+  @nif_abi 1
+
   def load_nifs do
     path = :filename.join(:code.priv_dir(:ex_clamav), ~c"clamav_nif")
 
-    case :erlang.load_nif(path, 0) do
+    case :erlang.load_nif(path, @nif_abi) do
       :ok -> :ok
       {:error, reason} -> raise "failed to load NIF library, reason: #{inspect(reason)}"
     end
@@ -71,4 +82,96 @@ defmodule ExClamav.Nif do
   def get_database_version(_engine_ref) do
     raise "NIF get_database_version/1 not implemented"
   end
+
+  # Get the build time of the loaded databases (seconds since the epoch)
+  @spec get_database_time(reference()) :: non_neg_integer() | {:error, String.t()}
+  def get_database_time(_engine_ref) do
+    raise "NIF get_database_time/1 not implemented"
+  end
+
+  # Copy a buffer into a memfd shared with out-of-process scan workers
+  @spec shared_buffer_new(binary()) ::
+          {:ok, reference(), non_neg_integer(), non_neg_integer()} | {:error, String.t()}
+  def shared_buffer_new(_buffer) do
+    raise "NIF shared_buffer_new/1 not implemented"
+  end
+
+  # Open a file for byte-range scanning
+  @spec file_open(String.t()) :: {:ok, reference(), non_neg_integer()} | {:error, String.t()}
+  def file_open(_file_path) do
+    raise "NIF file_open/1 not implemented"
+  end
+
+  # Scan a byte range of a file given by path or opened with file_open/1
+  @spec scan_file_range(
+          reference(),
+          String.t() | reference(),
+          non_neg_integer(),
+          non_neg_integer(),
+          non_neg_integer()
+        ) ::
+          {:ok, :clean} | {:ok, :virus, String.t()} | {:error, String.t()}
+  def scan_file_range(_engine_ref, _file, _offset, _length, _options) do
+    raise "NIF scan_file_range/5 not implemented"
+  end
+
+  # Scan a list of {:file, path} / {:buffer, binary} items in one call
+  @spec scan_batch(reference(), [{:file, String.t()} | {:buffer, binary()}], non_neg_integer()) ::
+          {:ok, [{:ok, :clean} | {:ok, :virus, charlist()} | {:error, charlist()}]}
+          | {:error, String.t()}
+  def scan_batch(_engine_ref, _items, _options) do
+    raise "NIF scan_batch/3 not implemented"
+  end
+
+  # Verify the header, checksum and signature of a .cvd file
+  @spec cvd_verify(String.t()) :: :ok | {:error, String.t()}
+  def cvd_verify(_file_path) do
+    raise "NIF cvd_verify/1 not implemented"
+  end
+
+  # Map an allowlist file of sorted SHA-256 digests
+  @spec allowlist_open(String.t()) :: {:ok, reference(), non_neg_integer()} | {:error, String.t()}
+  def allowlist_open(_file_path) do
+    raise "NIF allowlist_open/1 not implemented"
+  end
+
+  # Check a SHA-256 digest against an opened allowlist
+  @spec allowlist_lookup(reference(), binary()) :: boolean()
+  def allowlist_lookup(_allowlist_ref, _digest) do
+    raise "NIF allowlist_lookup/2 not implemented"
+  end
+
+  # Create or map a host-shared verdict cache file
+  @spec vcache_open(String.t(), pos_integer()) ::
+          {:ok, reference(), pos_integer()} | {:error, String.t()}
+  def vcache_open(_file_path, _slots) do
+    raise "NIF vcache_open/2 not implemented"
+  end
+
+  # Look up a verdict for a SHA-256 digest computed with a database version
+  @spec vcache_get(reference(), binary(), non_neg_integer()) ::
+          {:ok, :clean} | {:virus, binary()} | :miss
+  def vcache_get(_vcache_ref, _digest, _version) do
+    raise "NIF vcache_get/3 not implemented"
+  end
+
+  # Store a verdict (1 = clean, 2 = virus) for a digest and database version
+  @spec vcache_put(reference(), binary(), non_neg_integer(), 1 | 2, binary()) :: :ok | :busy
+  def vcache_put(_vcache_ref, _digest, _version, _verdict, _name) do
+    raise "NIF vcache_put/5 not implemented"
+  end
+
+  # Module state carried across hot code upgrades, and whether USDT probes
+  # were compiled in. After an upgrade from a library with an older state
+  # layout, live_engines only counts engines created since the upgrade
+  @spec nif_info() :: %{
+          abi: non_neg_integer(),
+          upgrades: non_neg_integer(),
+          loaded_instances: non_neg_integer(),
+          live_engines: non_neg_integer(),
+          usdt: boolean()
+        }
+  def nif_info() do
+    raise "NIF nif_info/0 not implemented"
+  end
 end
@@ -40,6 +40,10 @@ defmodule ExClamav.MixProject do
   defp deps do
     [
       {:elixir_make, "~> 0.9.0", runtime: false},
+      {:telemetry, "~> 1.0"},
+      {:gen_stage, "~> 1.2", optional: true},
+      {:broadway, "~> 1.1", optional: true},
+      {:opentelemetry_api, "~> 1.4", optional: true},
       {:ex_doc, "~> 0.40", only: :dev, runtime: false, warn_if_outdated: true}
     ]
   end
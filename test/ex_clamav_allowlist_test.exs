@@ -0,0 +1,89 @@
+defmodule ExClamav.AllowlistTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.Allowlist
+  alias ExClamav.ClamavGenServer
+
+  @moduletag :tmp_dir
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  setup %{tmp_dir: tmp_dir} do
+    name = :"allowlist_#{System.unique_integer([:positive])}"
+    on_exit(fn -> Allowlist.unload(name) end)
+    {:ok, name: name, path: Path.join(tmp_dir, "trusted.alw")}
+  end
+
+  defp sha256(data), do: :crypto.hash(:sha256, data)
+
+  test "builds, loads and looks up digests", %{name: name, path: path} do
+    digests = Enum.map(1..1000, &sha256("file #{&1}"))
+    hex = digests |> Enum.take(10) |> Enum.map(&Base.encode16/1)
+
+    assert {:ok, 1000} = Allowlist.build(digests ++ hex, path)
+    assert {:ok, 1000} = Allowlist.load(name, path)
+    assert %{count: 1000, path: ^path} = Allowlist.info(name)
+
+    assert Enum.all?(digests, &Allowlist.member?(name, &1))
+    refute Allowlist.member?(name, sha256("file 1001"))
+    refute Allowlist.member?(:not_loaded, hd(digests))
+  end
+
+  test "reads sha256sum output", %{name: name, path: path, tmp_dir: tmp_dir} do
+    source = Path.join(tmp_dir, "trusted.sha256")
+
+    File.write!(source, """
+    # vendor installers
+    #{Base.encode16(sha256("setup.exe"), case: :lower)}  setup.exe
+
+    #{Base.encode16(sha256("tool.msi"), case: :lower)}  tool.msi
+    """)
+
+    assert {:ok, 2} = Allowlist.build_from_file(source, path)
+    assert {:ok, 2} = Allowlist.load(name, path)
+    assert Allowlist.member?(name, sha256("tool.msi"))
+  end
+
+  test "rejects malformed digests and files", %{name: name, path: path} do
+    assert {:error, "Invalid SHA-256 digest: " <> _} = Allowlist.build(["abc"], path)
+
+    File.write!(path, "not an allowlist")
+    assert {:error, _reason} = Allowlist.load(name, path)
+  end
+
+  test "emits a lookup event", %{name: name, path: path} do
+    handler = "allowlist-test-#{inspect(self())}"
+    test_pid = self()
+
+    :telemetry.attach(
+      handler,
+      [:ex_clamav, :allowlist, :lookup],
+      fn _event, measurements, metadata, _config ->
+        send(test_pid, {:lookup, measurements, metadata})
+      end,
+      nil
+    )
+
+    on_exit(fn -> :telemetry.detach(handler) end)
+
+    {:ok, 1} = Allowlist.build([sha256("known")], path)
+    {:ok, 1} = Allowlist.load(name, path)
+
+    Allowlist.member?(name, sha256("known"))
+    assert_receive {:lookup, %{count: 1}, %{name: ^name, result: :hit}}
+  end
+
+  test "ClamavGenServer skips allowlisted content", %{name: name, path: path, tmp_dir: tmp_dir} do
+    {:ok, 1} = Allowlist.build([sha256(@eicar)], path)
+    {:ok, 1} = Allowlist.load(name, path)
+
+    server = start_supervised!({ClamavGenServer, name: nil, allowlist: name})
+
+    file = Path.join(tmp_dir, "eicar_file")
+    File.write!(file, @eicar)
+
+    assert {:ok, :clean} = ClamavGenServer.scan_buffer(server, @eicar)
+    assert {:ok, :clean} = ClamavGenServer.scan_file(server, file)
+    assert {:virus, "Eicar-Test-Signature"} = ClamavGenServer.scan_buffer(server, @eicar <> "\n")
+  end
+end
@@ -0,0 +1,102 @@
+defmodule ExClamav.ArchiveTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.Archive
+  alias ExClamav.Engine
+  alias ExClamav.VerdictCache
+
+  @moduletag :tmp_dir
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  setup_all do
+    {:ok, engine} = ExClamav.new_engine_with_database()
+    on_exit(fn -> Engine.free(engine) end)
+    {:ok, engine: engine}
+  end
+
+  setup do
+    cache = :"archive_cache_#{System.unique_integer([:positive])}"
+    start_supervised!({VerdictCache, name: cache})
+
+    handler = "archive-test-#{inspect(self())}"
+    test_pid = self()
+
+    :telemetry.attach(
+      handler,
+      [:ex_clamav, :archive, :scan],
+      fn _event, measurements, metadata, _config ->
+        send(test_pid, {:archive_scan, measurements, metadata})
+      end,
+      nil
+    )
+
+    on_exit(fn -> :telemetry.detach(handler) end)
+    {:ok, cache: cache}
+  end
+
+  defp zip(members) do
+    entries = for {name, data} <- members, do: {String.to_charlist(name), data}
+    {:ok, {_name, zip}} = :zip.create(~c"bundle.zip", entries, [:memory])
+    zip
+  end
+
+  test "only scans members that changed since the last upload", %{engine: engine, cache: cache} do
+    first = zip([{"a.txt", "alpha"}, {"b.txt", "beta"}, {"docs/", ""}, {"docs/c.txt", "gamma"}])
+
+    assert {:ok, :clean} = Archive.scan_buffer(engine, first, cache: cache)
+    assert_receive {:archive_scan, %{members: 3, scanned: 3}, %{mode: :members}}
+
+    second = zip([{"a.txt", "alpha"}, {"b.txt", "beta v2"}, {"docs/c.txt", "gamma"}])
+
+    assert {:ok, :clean} = Archive.scan_buffer(engine, second, cache: cache)
+    assert_receive {:archive_scan, %{members: 3, scanned: 1}, %{mode: :members}}
+  end
+
+  test "reports the first infected member", %{engine: engine, cache: cache, tmp_dir: tmp_dir} do
+    path = Path.join(tmp_dir, "bundle.zip")
+    File.write!(path, zip([{"readme.txt", "hello"}, {"eicar.com", @eicar}, {"z.txt", "z"}]))
+
+    assert {:virus, "Eicar-Test-Signature"} = Archive.scan_file(engine, path, cache: cache)
+    assert_receive {:archive_scan, %{members: 2, scanned: 2}, %{mode: :members}}
+
+    # The cached member verdict is reused on the next upload.
+    assert {:virus, "Eicar-Test-Signature"} = Archive.scan_file(engine, path, cache: cache)
+    assert_receive {:archive_scan, %{members: 2, scanned: 0}, %{mode: :members}}
+  end
+
+  test "matches signatures written against the container", %{cache: cache, tmp_dir: tmp_dir} do
+    marker = "ex_clamav container marker"
+    db = Path.join(tmp_dir, "db")
+    File.mkdir_p!(db)
+    File.write!(Path.join(db, "local.ndb"), "Test.Container:0:*:#{Base.encode16(marker)}\n")
+
+    {:ok, engine} = ExClamav.new_engine_with_database(db)
+    on_exit(fn -> Engine.free(engine) end)
+
+    {:ok, {_name, bundle}} =
+      :zip.create(~c"bundle.zip", [{~c"a.txt", "alpha"}], [
+        :memory,
+        comment: String.to_charlist(marker)
+      ])
+
+    assert {:virus, "Test.Container" <> _} = Archive.scan_buffer(engine, bundle, cache: cache)
+    assert_receive {:archive_scan, %{members: 0, scanned: 0}, %{mode: :members}}
+
+    # The container verdict is kept apart from one for the same bytes as a member.
+    assert :miss = VerdictCache.get(cache, VerdictCache.digest(bundle))
+  end
+
+  test "scans other content and oversized archives whole", %{engine: engine, cache: cache} do
+    assert {:virus, "Eicar-Test-Signature"} = Archive.scan_buffer(engine, @eicar, cache: cache)
+    assert_receive {:archive_scan, %{members: 0, scanned: 1}, %{mode: :whole}}
+
+    bundle = zip([{"a.txt", "alpha"}, {"b.txt", "beta"}])
+
+    assert {:ok, :clean} = Archive.scan_buffer(engine, bundle, cache: cache, max_members: 1)
+    assert_receive {:archive_scan, _measurements, %{mode: :whole}}
+
+    assert {:ok, :clean} = Archive.scan_buffer(engine, bundle, cache: nil, max_member_size: 4)
+    assert_receive {:archive_scan, _measurements, %{mode: :whole}}
+  end
+end
@@ -0,0 +1,64 @@
+defmodule ExClamav.BroadwayTest do
+  use ExUnit.Case, async: false
+
+  alias Broadway.Message
+  alias ExClamav.ClamavGenServer
+
+  @moduletag :tmp_dir
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  setup_all do
+    %{server: start_supervised!({ClamavGenServer, name: nil, max_concurrency: 2})}
+  end
+
+  defp message(data), do: %Message{data: data, acknowledger: Broadway.NoopAcknowledger.init()}
+
+  describe "ExClamav.Broadway.scan/2" do
+    test "attaches verdicts and fails infected messages", %{server: server, tmp_dir: tmp_dir} do
+      path = Path.join(tmp_dir, "eicar_file")
+      File.write!(path, @eicar)
+
+      messages = [message("harmless"), message({:file, path}), message(@eicar)]
+
+      assert [clean, infected_file, infected_buffer] =
+               ExClamav.Broadway.scan(messages, server: server)
+
+      assert clean.status == :ok
+      assert clean.metadata.clamav_verdict == {:ok, :clean}
+      assert infected_file.status == {:failed, {:virus, "Eicar-Test-Signature"}}
+      assert infected_buffer.metadata.clamav_verdict == {:virus, "Eicar-Test-Signature"}
+    end
+
+    test "keeps infected messages and fails scan errors", %{server: server, tmp_dir: tmp_dir} do
+      missing = Path.join(tmp_dir, "missing")
+
+      assert [infected, missing] =
+               ExClamav.Broadway.scan([message(@eicar), message(missing)],
+                 server: server,
+                 source: fn
+                   %Message{data: @eicar} -> {:buffer, @eicar}
+                   %Message{data: path} -> {:file, path}
+                 end,
+                 on_virus: :keep
+               )
+
+      assert infected.status == :ok
+      assert {:failed, reason} = missing.status
+      assert is_binary(reason)
+    end
+  end
+
+  describe "ExClamav.Stage" do
+    test "emits events with their verdicts in order", %{server: server} do
+      events = ["one", @eicar, "two", "three"]
+      {:ok, producer} = GenStage.from_enumerable(events)
+
+      {:ok, stage} =
+        ExClamav.Stage.start_link(server: server, subscribe_to: [{producer, max_demand: 2}])
+
+      assert [{"one", {:ok, :clean}}, {@eicar, {:virus, _}}, {"two", _}, {"three", _}] =
+               [stage] |> GenStage.stream() |> Enum.take(4)
+    end
+  end
+end
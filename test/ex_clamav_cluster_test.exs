@@ -0,0 +1,105 @@
+defmodule ExClamav.ClusterTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.ClamavGenServer
+  alias ExClamav.Cluster
+  alias ExClamav.Engine
+  alias ExClamav.VerdictCache
+
+  @moduletag :tmp_dir
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  setup_all do
+    :ok = Engine.init()
+    server = start_supervised!({ClamavGenServer, name: nil})
+
+    for name <- [:cluster_test_a, :cluster_test_b] do
+      start_supervised!(
+        {Cluster, name: name, server: server, group: :cluster_test, advertise_interval_ms: 50}
+      )
+    end
+
+    start_supervised!({VerdictCache, name: :cluster_test_cache})
+
+    start_supervised!(
+      {Cluster,
+       name: :cluster_test_hash,
+       server: server,
+       group: :cluster_test_hash,
+       routing: :hash,
+       cache: :cluster_test_cache}
+    )
+
+    :ok
+  end
+
+  test "routers discover each other through :pg" do
+    Process.sleep(100)
+    assert length(Cluster.members(:cluster_test_a)) == 2
+    assert length(Cluster.members(:cluster_test_b)) == 2
+  end
+
+  test "scan_buffer/2 routes to a member and returns its verdict" do
+    assert {:virus, "Eicar-Test-Signature"} = Cluster.scan_buffer(:cluster_test_a, @eicar)
+    assert {:ok, :clean} = Cluster.scan_buffer(:cluster_test_b, "harmless content")
+  end
+
+  test "scan_file/2 routes file scans", %{tmp_dir: tmp_dir} do
+    path = Path.join(tmp_dir, "eicar_file")
+    File.write!(path, @eicar)
+
+    assert {:virus, "Eicar-Test-Signature"} = Cluster.scan_file(:cluster_test_a, path)
+  end
+
+  test "advertises the scan server's scheduler backlog as load" do
+    # A one-byte-per-second quota keeps all but the first request queued.
+    server =
+      start_supervised!(
+        {ClamavGenServer, name: nil, max_concurrency: 1, tenants: [slow: [rate: 1]]},
+        id: :cluster_backlog_server
+      )
+
+    start_supervised!(
+      {Cluster,
+       name: :cluster_test_backlog,
+       server: server,
+       group: :cluster_test_backlog,
+       advertise_interval_ms: 50}
+    )
+
+    for _ <- 1..3 do
+      Task.start(fn -> ClamavGenServer.scan_buffer(server, "backlog", tenant: :slow) end)
+    end
+
+    Process.sleep(200)
+    assert [%{queue_depth: depth}] = Cluster.members(:cluster_test_backlog)
+    assert depth >= 2
+  end
+
+  test "a node without a running scan server takes no scans" do
+    start_supervised!(
+      {Cluster,
+       name: :cluster_test_no_server,
+       server: :cluster_test_missing_server,
+       group: :cluster_test_no_server,
+       advertise_interval_ms: 50}
+    )
+
+    Process.sleep(100)
+    assert [] = Cluster.members(:cluster_test_no_server)
+    assert {:error, "no scan nodes available"} = Cluster.scan_buffer(:cluster_test_no_server, "x")
+  end
+
+  test "hash routing reuses the owner's cached verdict" do
+    payload = "hash affinity #{System.unique_integer()}"
+    %{size: before} = VerdictCache.info(:cluster_test_cache)
+
+    assert {:ok, :clean} = Cluster.scan_buffer(:cluster_test_hash, payload)
+    assert {:ok, :clean} = Cluster.scan_buffer(:cluster_test_hash, payload)
+
+    assert %{size: size} = VerdictCache.info(:cluster_test_cache)
+    assert size == before + 1
+    assert {:ok, {:ok, :clean}} = VerdictCache.get(:cluster_test_cache, VerdictCache.digest(payload))
+  end
+end
@@ -0,0 +1,119 @@
+defmodule ExClamav.DefinitionUpdater.MirrorTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.DefinitionUpdater
+  alias ExClamav.DefinitionUpdater.Mirror
+
+  @moduletag :tmp_dir
+
+  setup %{tmp_dir: tmp_dir} do
+    db = Path.join(tmp_dir, "db")
+    mirror = Path.join(tmp_dir, "mirror")
+    File.mkdir_p!(db)
+    File.mkdir_p!(mirror)
+
+    write_container(tmp_dir, Path.join(db, "daily.cld"), 1, %{
+      "daily.ndb" => "Sig.A:0:*:41\nSig.B:0:*:42\n"
+    })
+
+    # Only the header of the mirror's full database is read while patching.
+    File.write!(Path.join(mirror, "daily.cvd"), header(3))
+
+    write_cdiff(mirror, "daily-2.cdiff", [
+      "OPEN daily.ndb",
+      "DEL 1 Sig.A",
+      "ADD Sig.C:0:*:43",
+      "CLOSE"
+    ])
+
+    write_cdiff(mirror, "daily-3.cdiff", ["OPEN daily.ndb", "XCHG 1 Sig.B Sig.D:0:*:44", "CLOSE"])
+
+    {:ok, db: db, mirror: mirror}
+  end
+
+  test "applies cdiff patches from a file:// mirror", %{db: db, mirror: mirror} do
+    opts = [mirror: "file://" <> mirror, databases: ["daily"]]
+
+    assert {:ok, ["daily"]} = Mirror.update(db, opts)
+
+    assert {3, %{"daily.ndb" => "Sig.D:0:*:44\nSig.C:0:*:43\n"}} =
+             read_container(Path.join(db, "daily.cld"))
+
+    assert {:ok, []} = Mirror.update(db, opts)
+    assert File.ls!(db) == ["daily.cld"]
+  end
+
+  test "does not apply patches without a published checksum", %{db: db, mirror: mirror} do
+    File.rm!(Path.join(mirror, "daily-3.cdiff.sha256"))
+
+    # The fallback full download is not a valid signed CVD.
+    assert {:error, "daily: daily.cvd: " <> _} =
+             Mirror.update(db, mirror: mirror, databases: ["daily"])
+
+    assert {1, _files} = read_container(Path.join(db, "daily.cld"))
+
+    assert {:ok, ["daily"]} =
+             Mirror.update(db, mirror: mirror, databases: ["daily"], require_checksums: false)
+  end
+
+  test "keeps the local database when a patch fails its checksum", %{db: db, mirror: mirror} do
+    File.write!(Path.join(mirror, "daily-3.cdiff.sha256"), String.duplicate("0", 64) <> "\n")
+
+    # The fallback full download is not a valid signed CVD either.
+    assert {:error, "daily: daily.cvd: " <> _} =
+             Mirror.update(db, mirror: mirror, databases: ["daily"])
+
+    assert {1, _files} = read_container(Path.join(db, "daily.cld"))
+    assert File.ls!(db) == ["daily.cld"]
+  end
+
+  test "DefinitionUpdater notifies subscribers in native mode", %{db: db, mirror: mirror} do
+    {:ok, pid} =
+      DefinitionUpdater.start_link(
+        name: nil,
+        database_path: db,
+        mode: :native,
+        mirror: "file://" <> mirror,
+        mirror_options: [databases: ["daily"]],
+        run_on_start: false
+      )
+
+    DefinitionUpdater.subscribe(pid)
+    assert :ok = DefinitionUpdater.update_now(pid)
+    assert_receive {:clamav_definition_updated, %{database_path: ^db}}, 5_000
+    assert %{last_result: :updated} = DefinitionUpdater.status(pid)
+
+    GenServer.stop(pid)
+  end
+
+  # ── Fixtures ─────────────────────────────────────────────────────────────
+
+  defp header(version) do
+    "ClamAV-VDB:18 Oct 2026 10-00 +0000:#{version}:2:90:X:X:test:1792317600"
+    |> String.pad_trailing(512)
+  end
+
+  defp write_container(tmp_dir, path, version, files) do
+    tar = Path.join(tmp_dir, "container.tar")
+    entries = for {name, data} <- files, do: {String.to_charlist(name), data}
+    :ok = :erl_tar.create(String.to_charlist(tar), entries)
+    File.write!(path, header(version) <> File.read!(tar))
+    File.rm!(tar)
+  end
+
+  defp read_container(path) do
+    <<header::binary-512, body::binary>> = File.read!(path)
+    {:ok, %{version: version}} = Mirror.parse_header(header)
+    {:ok, entries} = :erl_tar.extract({:binary, body}, [:memory])
+    {version, Map.new(entries, fn {name, data} -> {List.to_string(name), data} end)}
+  end
+
+  defp write_cdiff(mirror, name, commands) do
+    script = Enum.join(commands, "\n") <> "\n"
+    cdiff = :zlib.gzip(script) <> ":unverified-dsig"
+    File.write!(Path.join(mirror, name), cdiff)
+
+    digest = :sha256 |> :crypto.hash(cdiff) |> Base.encode16(case: :lower)
+    File.write!(Path.join(mirror, name <> ".sha256"), digest <> "\n")
+  end
+end
@@ -2,6 +2,7 @@ defmodule ExClamav.DefinitionUpdaterTest do
   use ExUnit.Case, async: false
 
   alias ExClamav.DefinitionUpdater
+  alias ExClamav.DefinitionUpdater.Snapshots
 
   import ExClamav.Test.FreshclamHelpers
 
@@ -100,6 +101,11 @@ defmodule ExClamav.DefinitionUpdaterTest do
       assert metadata.database_path == db_path
       assert %DateTime{} = metadata.updated_at
       assert is_list(metadata.fingerprint)
+      assert metadata.size_deltas == %{"daily.cvd" => 8}
+      assert %{last_duration_ms: ms, last_size_deltas: %{"daily.cvd" => 8}} =
+               DefinitionUpdater.status(pid)
+
+      assert is_integer(ms)
 
       GenServer.stop(pid)
     end
@@ -154,6 +160,90 @@ defmodule ExClamav.DefinitionUpdaterTest do
     end
   end
 
+  describe "versioned databases" do
+    test "seeds the first snapshot and never publishes a set that fails to load", %{
+      tmp_dir: tmp_dir
+    } do
+      db_path = create_fake_db(tmp_dir)
+      freshclam = create_fake_freshclam(tmp_dir, simulate_update: true)
+
+      {:ok, pid} =
+        DefinitionUpdater.start_link(
+          name: nil,
+          database_path: db_path,
+          freshclam_path: freshclam,
+          keep_versions: 2,
+          run_on_start: false,
+          interval_ms: :timer.hours(24)
+        )
+
+      assert %{current_version: version, versions: [version]} = DefinitionUpdater.status(pid)
+      current = Path.join(db_path, "current")
+      assert File.read!(Path.join(current, "main.cvd")) == "fake-main-db"
+
+      :ok = DefinitionUpdater.subscribe(pid)
+      DefinitionUpdater.update_now(pid)
+
+      # The fake daily.cvd cannot be loaded, so `current` must not move.
+      assert_receive {:clamav_definition_update_failed, %{reason: "new definitions" <> _}}, 5_000
+      assert %{current_version: ^version, versions: [^version]} = DefinitionUpdater.status(pid)
+      refute File.exists?(Path.join(current, "daily.cvd"))
+      assert Path.wildcard(Path.join([db_path, "versions", ".staging-*"]), match_dot: true) == []
+
+      GenServer.stop(pid)
+    end
+
+    test "rollback/1 flips current back and notifies subscribers", %{tmp_dir: tmp_dir} do
+      db_path = create_fake_db(tmp_dir)
+      :ok = Snapshots.init(db_path)
+      {:ok, staging} = Snapshots.stage(db_path)
+      File.write!(Path.join(staging, "daily.cvd"), "fake-daily-db")
+      {:ok, newest, _path} = Snapshots.commit(db_path, staging)
+
+      {:ok, pid} =
+        DefinitionUpdater.start_link(
+          name: nil,
+          database_path: db_path,
+          freshclam_path: create_fake_freshclam(tmp_dir),
+          keep_versions: 2,
+          run_on_start: false,
+          interval_ms: :timer.hours(24)
+        )
+
+      assert %{current_version: ^newest, versions: [first, ^newest]} =
+               DefinitionUpdater.status(pid)
+
+      :ok = DefinitionUpdater.subscribe(pid)
+      assert {:ok, ^first} = DefinitionUpdater.rollback(pid)
+
+      assert_receive {:clamav_definition_updated,
+                      %{version: ^first, database_path: path} = metadata}
+
+      assert path == Path.join([db_path, "versions", first])
+      assert is_integer(metadata.duration_ms) and metadata.duration_ms >= 0
+      assert metadata.size_deltas == %{"daily.cvd" => -byte_size("fake-daily-db")}
+      assert {:error, _reason} = DefinitionUpdater.rollback(pid)
+
+      GenServer.stop(pid)
+    end
+
+    test "prune keeps the newest versions and the current one", %{tmp_dir: tmp_dir} do
+      db_path = create_fake_db(tmp_dir)
+      :ok = Snapshots.init(db_path)
+
+      for _ <- 1..3 do
+        {:ok, staging} = Snapshots.stage(db_path)
+        {:ok, _version, _path} = Snapshots.commit(db_path, staging)
+      end
+
+      [oldest | _] = versions = Snapshots.list(db_path)
+      :ok = Snapshots.activate(db_path, oldest)
+      Snapshots.prune(db_path, 2)
+
+      assert Snapshots.list(db_path) == [oldest | Enum.take(versions, -2)]
+    end
+  end
+
   describe "compute_fingerprint/1" do
     test "computes fingerprint from database files", %{tmp_dir: tmp_dir} do
       db_path = create_fake_db(tmp_dir)
@@ -0,0 +1,110 @@
+defmodule ExClamav.DiskImageTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.DiskImage
+  alias ExClamav.Engine
+
+  @moduletag :tmp_dir
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  setup_all do
+    {:ok, engine} = ExClamav.new_engine_with_database()
+    on_exit(fn -> Engine.free(engine) end)
+    {:ok, engine: engine}
+  end
+
+  test "walks a bare FAT12 volume and scans its files", %{engine: engine, tmp_dir: tmp_dir} do
+    path = Path.join(tmp_dir, "fat.img")
+    File.write!(path, fat12_volume())
+
+    assert {:ok, report} = DiskImage.scan(engine, path)
+    assert report.scheme == :none
+
+    assert [
+             %{partition: 0, path: "/EICAR.COM", result: {:virus, "Eicar-Test-Signature"}},
+             %{partition: 0, path: "/README.TXT", result: {:ok, :clean}}
+           ] = report.results
+
+    assert [%{path: "/EICAR.COM"}] = report.infected
+  end
+
+  test "finds the volume through an MBR partition table", %{engine: engine, tmp_dir: tmp_dir} do
+    path = Path.join(tmp_dir, "mbr.img")
+    File.write!(path, mbr([{0x01, 1, 64}]) <> fat12_volume())
+
+    assert {:ok, %{scheme: :mbr, partitions: [partition], infected: [infected]}} =
+             DiskImage.scan(engine, path)
+
+    assert partition.offset == 512
+    assert %{partition: 0, path: "/EICAR.COM"} = infected
+  end
+
+  test "walks each directory once on looping FAT volumes", %{engine: engine, tmp_dir: tmp_dir} do
+    # LOOP (cluster 4) holds EICAR.COM plus two subdirectories that point
+    # back at cluster 4, which would double the walk at every level.
+    loop =
+      dir_entry("EICAR   COM", 2, byte_size(@eicar)) <>
+        dir_entry("A          ", 4, 0, 0x10) <> dir_entry("B          ", 4, 0, 0x10)
+
+    path = Path.join(tmp_dir, "loop.img")
+    File.write!(path, fat12_volume(dir_entry("LOOP       ", 4, 0, 0x10), [loop]))
+
+    assert {:ok, report} = DiskImage.scan(engine, path)
+
+    assert ["/EICAR.COM", "/LOOP/EICAR.COM", "/README.TXT"] =
+             report.results |> Enum.map(& &1.path) |> Enum.sort()
+  end
+
+  test "scans whole partitions in :partitions mode", %{engine: engine, tmp_dir: tmp_dir} do
+    path = Path.join(tmp_dir, "raw.img")
+    File.write!(path, mbr([{0x83, 1, 2}]) <> pad(@eicar, 1024))
+
+    assert {:ok, %{results: [%{partition: 0, path: nil, result: result}]}} =
+             DiskImage.scan(engine, path, mode: :partitions)
+
+    assert {:virus, "Eicar-Test-Signature"} = result
+  end
+
+  # 64 sectors of 512 bytes: boot sector, one FAT, one root directory sector,
+  # then data clusters 2 (EICAR.COM) and 3 (README.TXT), followed by any extra
+  # single-cluster chains from 4 on.
+  defp fat12_volume(extra_root \\ <<>>, extra_clusters \\ []) do
+    boot =
+      <<0xEB, 0x3C, 0x90, "MSDOS5.0", 512::little-16, 1, 1::little-16, 1, 16::little-16,
+        64::little-16, 0xF8, 1::little-16, 0::64, 0::little-32, 0x80, 0, 0x29, 0::32,
+        "NO NAME    ", "FAT12   ">>
+
+    fat = <<0xF8, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF>>
+
+    root =
+      dir_entry("EICAR   COM", 2, byte_size(@eicar)) <>
+        dir_entry("README  TXT", 3, 5) <> extra_root
+
+    IO.iodata_to_binary([
+      pad(boot, 510),
+      <<0x55, 0xAA>>,
+      pad(fat, 512),
+      pad(root, 512),
+      pad(@eicar, 512),
+      pad("hello", 512),
+      Enum.map(extra_clusters, &pad(&1, 512)),
+      pad(<<>>, (59 - length(extra_clusters)) * 512)
+    ])
+  end
+
+  defp dir_entry(name, cluster, size, attributes \\ 0x20) do
+    <<name::binary-11, attributes, 0::64, 0::16, 0::32, cluster::little-16, size::little-32>>
+  end
+
+  defp mbr(partitions) do
+    entries =
+      for {type, lba, count} <- partitions, into: <<>> do
+        <<0, 0::24, type, 0::24, lba::little-32, count::little-32>>
+      end
+
+    <<0::size(446 * 8), pad(entries, 64)::binary, 0x55, 0xAA>>
+  end
+
+  defp pad(data, size), do: data <> :binary.copy(<<0>>, size - byte_size(data))
+end
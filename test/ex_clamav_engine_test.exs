@@ -20,6 +20,15 @@ defmodule ExClamavEngineTest do
     assert is_reference(ref)
   end
 
+  test "tracks engine resources in the module state kept across upgrades" do
+    assert %{abi: 1, loaded_instances: 1, live_engines: live} = ExClamav.Nif.nif_info()
+    assert live >= 1
+  end
+
+  test "reports whether USDT probes were compiled in" do
+    assert is_boolean(ExClamav.Nif.nif_info().usdt)
+  end
+
   test "returns an error tuple when a file is missing", %{engine: engine} do
     tmp_path =
       Path.join(System.tmp_dir!(), "ex_clamav_missing_file_#{System.unique_integer([:positive])}")
@@ -42,6 +51,84 @@ defmodule ExClamavEngineTest do
     File.rm!(tmp_path)
   end
 
+  test "scans byte ranges of a file in place", %{engine: engine} do
+    tmp_path =
+      Path.join(System.tmp_dir!(), "ex_clamav_range_test_#{System.unique_integer([:positive])}")
+
+    eicar = "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+    padding = String.duplicate("A", 4096)
+
+    File.write!(tmp_path, padding <> eicar <> padding)
+
+    assert {:ok, :clean} = Engine.scan_file_range(engine, tmp_path, 0, 4096)
+
+    assert {:virus, "Eicar-Test-Signature"} =
+             Engine.scan_file_range(engine, tmp_path, 4096, byte_size(eicar))
+
+    {:ok, file} = Engine.open_file(tmp_path)
+    assert file.size == 8192 + byte_size(eicar)
+
+    results =
+      [{0, 4096}, {4096, byte_size(eicar)}, {4096 + byte_size(eicar), 4096}]
+      |> Task.async_stream(fn {offset, length} ->
+        Engine.scan_file_range(engine, file, offset, length)
+      end)
+      |> Enum.map(fn {:ok, result} -> result end)
+
+    assert [{:ok, :clean}, {:virus, "Eicar-Test-Signature"}, {:ok, :clean}] = results
+
+    assert {:error, "Range exceeds file size"} =
+             Engine.scan_file_range(engine, file, file.size - 1, 2)
+
+    File.rm!(tmp_path)
+  end
+
+  test "scans byte ranges at unaligned offsets", %{engine: engine} do
+    tmp_path =
+      Path.join(System.tmp_dir!(), "ex_clamav_unaligned_#{System.unique_integer([:positive])}")
+
+    eicar = "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+    File.write!(tmp_path, String.duplicate("A", 1536) <> eicar <> String.duplicate("A", 5000))
+
+    {:ok, file} = Engine.open_file(tmp_path)
+
+    assert {:virus, "Eicar-Test-Signature"} =
+             Engine.scan_file_range(engine, file, 1536, byte_size(eicar))
+
+    assert {:ok, :clean} = Engine.scan_file_range(engine, file, 1536 + byte_size(eicar), 4164)
+    assert {:ok, :clean} = Engine.scan_file_range(engine, tmp_path, 100, 1000)
+
+    File.rm!(tmp_path)
+  end
+
+  test "scans a batch of files and buffers in one call", %{engine: engine} do
+    tmp_path =
+      Path.join(System.tmp_dir!(), "ex_clamav_batch_test_#{System.unique_integer([:positive])}")
+
+    eicar = "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+    File.write!(tmp_path, eicar)
+
+    assert [
+             {:virus, "Eicar-Test-Signature"},
+             {:ok, :clean},
+             {:virus, "Eicar-Test-Signature"},
+             {:error, "Can't open file or directory"},
+             {:error, "Invalid batch item"}
+           ] =
+             Engine.scan_batch(engine, [
+               {:file, tmp_path},
+               {:buffer, "clean"},
+               {:buffer, eicar},
+               {:file, tmp_path <> ".missing"},
+               {:folder, tmp_path}
+             ])
+
+    assert [] = Engine.scan_batch(engine, [])
+
+    File.rm!(tmp_path)
+  end
+
   test "returns clean when scanning a clean file", %{engine: engine} do
     tmp_path =
       Path.join(System.tmp_dir!(), "ex_clamav_clean_file_#{System.unique_integer([:positive])}")
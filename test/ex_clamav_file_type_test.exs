@@ -0,0 +1,24 @@
+defmodule ExClamav.FileTypeTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.FileType
+
+  test "recognises common magic bytes" do
+    assert :pe = FileType.detect("MZ" <> <<0x90, 0>>)
+    assert :elf = FileType.detect(<<0x7F, "ELF", 2, 1>>)
+    assert :zip = FileType.detect(<<"PK", 3, 4, 20, 0>>)
+    assert :pdf = FileType.detect("%PDF-1.7\n")
+    assert :ole2 = FileType.detect(<<0xD0, 0xCF, 0x11, 0xE0, 0xA1, 0xB1, 0x1A, 0xE1, 0>>)
+    assert :gzip = FileType.detect(<<0x1F, 0x8B, 8, 0>>)
+  end
+
+  test "tells text, markup and binary data apart" do
+    assert :empty = FileType.detect("")
+    assert :text = FileType.detect("plain old text, ünïcödé included")
+    assert :html = FileType.detect("  <!DOCTYPE html><html></html>")
+    assert :binary = FileType.detect(<<1, 2, 0, 255, 254>>)
+
+    # A multi-byte character cut off by the sample limit is still text.
+    assert :text = FileType.detect(String.duplicate("a", 511) <> "é")
+  end
+end
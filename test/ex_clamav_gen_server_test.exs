@@ -2,6 +2,7 @@ defmodule ExClamav.ClamavGenServerTest do
   use ExUnit.Case, async: false
 
   alias ExClamav.ClamavGenServer
+  alias ExClamav.ClamavGenServer.Scheduler
   alias ExClamav.Engine
 
   @moduletag :tmp_dir
@@ -36,6 +37,261 @@ defmodule ExClamav.ClamavGenServerTest do
     end
   end
 
+  describe "scan_many/3" do
+    test "queues every item and returns verdicts in order", %{server: server, tmp_dir: tmp_dir} do
+      tmp_path = Path.join(tmp_dir, "eicar_file")
+      File.write!(tmp_path, @eicar)
+
+      assert [{:virus, "Eicar-Test-Signature"}, {:ok, :clean}, {:virus, _}] =
+               ClamavGenServer.scan_many(server, [
+                 {:file, tmp_path},
+                 {:buffer, "totally safe data"},
+                 {:buffer, @eicar}
+               ])
+    end
+  end
+
+  describe "status/1" do
+    test "reports the age of the definitions serving scans", %{server: server} do
+      status = ClamavGenServer.status(server)
+
+      assert is_integer(status.database_version)
+      assert %DateTime{} = status.definitions_built_at
+      assert status.definitions_age_s >= 0
+      assert %DateTime{} = status.loaded_at
+      assert status.last_reload_latency_ms == nil
+    end
+
+    test "measures reload latency from the update event" do
+      pid = start_supervised!({ClamavGenServer, name: nil}, id: :reload_metrics)
+      handler = "reload-metrics-#{inspect(self())}"
+      test_pid = self()
+
+      :telemetry.attach(
+        handler,
+        [:ex_clamav, :engine, :reload],
+        fn _event, measurements, metadata, _config ->
+          send(test_pid, {:reload, measurements, metadata})
+        end,
+        nil
+      )
+
+      on_exit(fn -> :telemetry.detach(handler) end)
+
+      updated_at = DateTime.add(DateTime.utc_now(), -1, :second)
+      send(pid, {:clamav_definition_updated, %{updated_at: updated_at, version: nil}})
+
+      assert_receive {:reload, %{duration: duration, latency: latency}, %{result: :ok}}, 30_000
+      assert latency >= duration
+      assert ClamavGenServer.status(pid).last_reload_latency_ms >= 1_000
+    end
+  end
+
+  describe "scheduling" do
+    test "serves the cheapest predicted scan first" do
+      scheduler =
+        Scheduler.new(aging: 0.0)
+        |> Scheduler.push(%{id: :archive, type: :zip, size: 50_000_000}, 0)
+        |> Scheduler.push(%{id: :note, type: :text, size: 100}, 1)
+        |> Scheduler.push(%{id: :binary, type: :binary, size: 5_000_000}, 2)
+
+      assert Scheduler.size(scheduler) == 3
+      assert {:ok, %{id: :note}, scheduler} = Scheduler.pop(scheduler, 3)
+      assert {:ok, %{id: :binary}, scheduler} = Scheduler.pop(scheduler, 3)
+      assert {:ok, %{id: :archive}, scheduler} = Scheduler.pop(scheduler, 3)
+      assert :empty = Scheduler.pop(scheduler, 3)
+    end
+
+    test "ages waiting scans so expensive ones are not starved" do
+      second = System.convert_time_unit(1, :second, :native)
+
+      scheduler =
+        Scheduler.new(aging: 1.0)
+        |> Scheduler.push(%{id: :archive, type: :zip, size: 50_000_000}, 0)
+        |> Scheduler.push(%{id: :note, type: :text, size: 100}, 10 * second)
+
+      assert {:ok, %{id: :archive}, _scheduler} = Scheduler.pop(scheduler, 10 * second)
+    end
+
+    test "learns per-type throughput from observed scans" do
+      second = System.convert_time_unit(1, :second, :native)
+      scheduler = Scheduler.new()
+      job = %{type: :zip, size: 10_000_000}
+      initial = Scheduler.predict(scheduler, :zip, job.size)
+
+      {:ok, job, scheduler} = scheduler |> Scheduler.push(job, 0) |> Scheduler.pop(0)
+      {scheduler, error} = Scheduler.observe(scheduler, job, 2 * second)
+
+      assert error > 0
+      assert Scheduler.predict(scheduler, :zip, job.size) == 2 * second
+      assert Scheduler.predict(scheduler, :zip, job.size) > initial
+      assert Scheduler.predict(scheduler, :text, job.size) == initial
+      assert %{throughput: %{zip: 5_000_000}, queued: 0} = Scheduler.stats(scheduler)
+    end
+
+    test "shares scan time between tenants by weight" do
+      job = %{type: :binary, size: 1_000_000}
+
+      scheduler =
+        Enum.reduce(1..4, Scheduler.new(tenants: [web: [weight: 3]]), fn _, acc ->
+          acc
+          |> Scheduler.push(Map.put(job, :tenant, :bulk), 0)
+          |> Scheduler.push(Map.put(job, :tenant, :web), 0)
+        end)
+
+      {served, _scheduler} =
+        Enum.map_reduce(1..4, scheduler, fn _, acc ->
+          {:ok, job, acc} = Scheduler.pop(acc, 0)
+          {job.tenant, acc}
+        end)
+
+      assert Enum.frequencies(served) == %{bulk: 1, web: 3}
+    end
+
+    test "throttles tenants over their byte-rate quota" do
+      second = System.convert_time_unit(1, :second, :native)
+      job = %{type: :text, size: 1_500, tenant: :bulk}
+
+      scheduler =
+        Scheduler.new(tenants: [bulk: [rate: 1_000]])
+        |> Scheduler.push(job, 0)
+        |> Scheduler.push(job, 0)
+
+      assert {:ok, _job, scheduler} = Scheduler.pop(scheduler, 0)
+      assert {:wait, 500, scheduler} = Scheduler.pop(scheduler, 0)
+      assert %{tenants: %{bulk: %{queued: 1, throttled: 1}}} = Scheduler.stats(scheduler)
+      assert {:ok, _job, _scheduler} = Scheduler.pop(scheduler, second)
+    end
+
+    test "serves priority classes in order and deadlines earliest first" do
+      scheduler =
+        Scheduler.new()
+        |> Scheduler.push(%{id: :sweep, type: :text, size: 10, priority: :low}, 0)
+        |> Scheduler.push(%{id: :upload, type: :zip, size: 50_000_000}, 0)
+        |> Scheduler.push(%{id: :late, type: :text, size: 10, deadline: 900}, 0)
+        |> Scheduler.push(%{id: :check, type: :zip, size: 50_000_000, priority: :high}, 0)
+        |> Scheduler.push(%{id: :soon, type: :text, size: 10, deadline: 500}, 0)
+
+      {served, _scheduler} =
+        Enum.map_reduce(1..5, scheduler, fn _, acc ->
+          {:ok, job, acc} = Scheduler.pop(acc, 0)
+          {job.id, acc}
+        end)
+
+      assert served == [:check, :soon, :late, :upload, :sweep]
+    end
+
+    test "lets a deadline override fair queuing only when it is close" do
+      second = System.convert_time_unit(1, :second, :native)
+      job = %{type: :binary, size: 1_000_000}
+
+      # :web has used its share, so fair queuing picks :bulk next.
+      {:ok, _job, scheduler} =
+        Scheduler.new()
+        |> Scheduler.push(Map.put(job, :tenant, :web), 0)
+        |> Scheduler.pop(0)
+
+      relaxed =
+        scheduler
+        |> Scheduler.push(Map.merge(job, %{id: :web, tenant: :web, deadline: 3600 * second}), 0)
+        |> Scheduler.push(Map.merge(job, %{id: :bulk, tenant: :bulk}), 0)
+
+      assert {:ok, %{id: :bulk}, _scheduler} = Scheduler.pop(relaxed, 0)
+
+      # Waiting behind :bulk would leave less than its own cost to spare.
+      deadline = div(Scheduler.predict(scheduler, :binary, job.size) * 3, 2)
+
+      urgent =
+        scheduler
+        |> Scheduler.push(Map.merge(job, %{id: :web, tenant: :web, deadline: deadline}), 0)
+        |> Scheduler.push(Map.merge(job, %{id: :bulk, tenant: :bulk}), 0)
+
+      assert {:ok, %{id: :web}, _scheduler} = Scheduler.pop(urgent, 0)
+    end
+
+    test "drops requests whose deadline has passed", %{server: server} do
+      scheduler =
+        Scheduler.new()
+        |> Scheduler.push(%{id: :stale, type: :text, size: 10, deadline: 100}, 0)
+        |> Scheduler.push(%{id: :fresh, type: :text, size: 10, deadline: 300}, 0)
+
+      assert {:expired, %{id: :stale}, scheduler} = Scheduler.pop(scheduler, 200)
+      assert {:ok, %{id: :fresh}, scheduler} = Scheduler.pop(scheduler, 200)
+      assert %{tenants: %{default: %{expired: 1}}} = Scheduler.stats(scheduler)
+
+      expired = System.monotonic_time(:millisecond) - 1
+
+      assert {:error, "deadline exceeded"} =
+               ClamavGenServer.scan_buffer(server, @eicar, deadline: expired)
+
+      assert {:virus, _name} =
+               ClamavGenServer.scan_buffer(server, @eicar, deadline: expired + 60_000)
+    end
+
+    test "runs concurrent scans and reports them", %{tmp_dir: tmp_dir} do
+      pid = start_supervised!({ClamavGenServer, name: nil, max_concurrency: 2}, id: :scheduled)
+      handler = "scheduler-#{inspect(self())}"
+      test_pid = self()
+
+      :telemetry.attach(
+        handler,
+        [:ex_clamav, :scheduler, :scan],
+        fn _event, measurements, metadata, _config ->
+          send(test_pid, {:scheduled, measurements, metadata})
+        end,
+        nil
+      )
+
+      on_exit(fn -> :telemetry.detach(handler) end)
+
+      eicar_path = Path.join(tmp_dir, "eicar_file")
+      File.write!(eicar_path, @eicar)
+
+      results =
+        [
+          fn -> ClamavGenServer.scan_file(pid, eicar_path) end,
+          fn -> ClamavGenServer.scan_buffer(pid, "plain text", tenant: :acme) end,
+          fn -> ClamavGenServer.scan_buffer(pid, @eicar) end,
+          fn -> ClamavGenServer.scan_file(pid, Path.join(tmp_dir, "missing")) end
+        ]
+        |> Enum.map(&Task.async/1)
+        |> Task.await_many(30_000)
+
+      assert [{:virus, "Eicar-Test-Signature"}, {:ok, :clean}, {:virus, _}, {:error, _}] =
+               results
+
+      tenants =
+        for _ <- 1..4 do
+          assert_receive {:scheduled, %{wait: wait, duration: duration}, metadata}
+          assert wait >= 0 and duration >= 0
+          assert metadata.type in [:text, :binary]
+          metadata.tenant
+        end
+
+      assert Enum.sort(tenants) == [:acme, :default, :default, :default]
+
+      assert %{queued: 0, running: 0, throughput: throughput} =
+               ClamavGenServer.status(pid).scheduler
+
+      assert Map.has_key?(throughput, :text)
+    end
+  end
+
+  describe "tracing" do
+    test "serves scans with tracing enabled or disabled" do
+      assert is_boolean(ExClamav.Tracing.available?())
+
+      for tracing <- [true, false] do
+        {:ok, pid} = ClamavGenServer.start_link(name: nil, tracing: tracing)
+
+        assert {:virus, "Eicar-Test-Signature"} = ClamavGenServer.scan_buffer(pid, @eicar)
+        assert [{:ok, :clean}] = ClamavGenServer.scan_batch(pid, [{:buffer, "safe"}])
+
+        GenServer.stop(pid)
+      end
+    end
+  end
+
   describe "termination" do
     test "frees engine resources when the server stops" do
       {:ok, pid} = ClamavGenServer.start_link(name: nil)
@@ -0,0 +1,98 @@
+defmodule ExClamav.HashIndexTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.HashIndex
+
+  @moduletag :tmp_dir
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  setup %{tmp_dir: tmp_dir} do
+    db = Path.join(tmp_dir, "db")
+    File.mkdir_p!(db)
+
+    File.write!(Path.join(db, "local.hdb"), """
+    #{hex(:md5, @eicar)}:#{byte_size(@eicar)}:Eicar-Test-Signature
+    #{hex(:sha, "dropper")}:7:Win.Dropper.Sha1-1
+    """)
+
+    File.write!(Path.join(db, "local.hsb"), """
+    #{hex(:sha256, "payload")}:*:Win.Trojan.Payload-1:73
+    #{hex(:sha256, "vendor tool")}:11:Win.Tool.Vendor-1
+    """)
+
+    File.write!(Path.join(db, "local.sfp"), "#{hex(:sha256, "vendor tool")}:11:Vendor.Tool\n")
+
+    {:ok, db: db}
+  end
+
+  defp hex(type, data), do: type |> :crypto.hash(data) |> Base.encode16(case: :lower)
+
+  defp start_index(db) do
+    name = :"hash_index_#{System.unique_integer([:positive])}"
+    start_supervised!({HashIndex, name: name, database_path: db})
+    # info/1 is served after the initial build has finished.
+    HashIndex.info(name)
+    name
+  end
+
+  test "matches MD5, SHA-1 and SHA-256 hash signatures", %{db: db} do
+    index = start_index(db)
+
+    assert {:virus, "Eicar-Test-Signature"} =
+             HashIndex.lookup(index, :crypto.hash(:md5, @eicar), byte_size(@eicar))
+
+    assert {:virus, "Win.Dropper.Sha1-1"} = HashIndex.lookup(index, hex(:sha, "dropper"), 7)
+
+    # A hex MD5 has the length of a raw SHA-256.
+    assert {:virus, "Eicar-Test-Signature"} =
+             HashIndex.lookup(index, hex(:md5, @eicar), byte_size(@eicar))
+
+    assert {:virus, "Eicar-Test-Signature"} =
+             HashIndex.lookup(index, String.upcase(hex(:md5, @eicar)), byte_size(@eicar))
+
+    # "*" matches any size.
+    assert {:virus, "Win.Trojan.Payload-1"} =
+             HashIndex.lookup(index, :crypto.hash(:sha256, "payload"), 123)
+
+    assert :unknown = HashIndex.lookup(index, :crypto.hash(:md5, @eicar), 1)
+    assert :unknown = HashIndex.lookup(index, :crypto.hash(:sha256, "harmless"), 8)
+  end
+
+  test "false-positive entries override signatures", %{db: db} do
+    index = start_index(db)
+    assert :unknown = HashIndex.lookup(index, :crypto.hash(:sha256, "vendor tool"), 11)
+  end
+
+  test "indexes hash databases inside containers", %{db: db, tmp_dir: tmp_dir} do
+    tar = Path.join(tmp_dir, "daily.tar")
+
+    :ok =
+      :erl_tar.create(String.to_charlist(tar), [
+        {~c"daily.hsb", "#{hex(:sha256, "packed")}:6:Win.Packed-1\n"},
+        {~c"daily.ndb", "Sig.A:0:*:41\n"}
+      ])
+
+    header = String.pad_trailing("ClamAV-VDB:18 Oct 2026 10-00 +0000:2:1:90:X:X:test:0", 512)
+    File.write!(Path.join(db, "daily.cld"), header <> File.read!(tar))
+
+    index = start_index(db)
+    assert {:virus, "Win.Packed-1"} = HashIndex.lookup(index, hex(:sha256, "packed"), 6)
+    assert %{entries: 6} = HashIndex.info(index)
+  end
+
+  test "rebuilds from a new database directory", %{db: db, tmp_dir: tmp_dir} do
+    index = start_index(db)
+
+    other = Path.join(tmp_dir, "other")
+    File.mkdir_p!(other)
+    File.write!(Path.join(other, "new.hsb"), "#{hex(:sha256, "fresh")}:5:Win.Fresh-1\n")
+
+    assert {:ok, 1} = HashIndex.rebuild(index, other)
+    assert {:virus, "Win.Fresh-1"} = HashIndex.lookup(index, hex(:sha256, "fresh"), 5)
+    assert :unknown = HashIndex.lookup(index, hex(:sha256, "payload"), 7)
+
+    assert {:error, "cannot list " <> _} = HashIndex.rebuild(index, Path.join(tmp_dir, "gone"))
+    assert %{database_path: ^other, entries: 1} = HashIndex.info(index)
+  end
+end
@@ -0,0 +1,220 @@
+defmodule ExClamav.ICAPTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.ClamavGenServer
+  alias ExClamav.Engine
+  alias ExClamav.ICAP
+  alias ExClamav.ICAP.Protocol
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  @res_hdr "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n\r\n"
+
+  setup_all do
+    :ok = Engine.init()
+    server = start_supervised!({ClamavGenServer, name: nil})
+    icap = start_supervised!({ICAP, name: nil, port: 0, server: server, acceptors: 2})
+    %{port: ICAP.port(icap), server: server}
+  end
+
+  describe "Protocol" do
+    test "parses request lines and encapsulated offsets" do
+      assert {:ok, :respmod, "icap://localhost/scan"} =
+               Protocol.parse_request_line("RESPMOD icap://localhost/scan ICAP/1.0\r\n")
+
+      assert {:error, :bad_request} = Protocol.parse_request_line("GET / HTTP/1.1\r\n")
+
+      assert {:ok, [req_hdr: 0, res_hdr: 40, res_body: 95]} =
+               Protocol.parse_encapsulated("req-hdr=0, res-hdr=40, res-body=95")
+
+      assert {:ok, 95, true} = Protocol.header_block(req_hdr: 0, res_hdr: 40, res_body: 95)
+      assert {:ok, 40, false} = Protocol.header_block(req_hdr: 0, null_body: 40)
+    end
+
+    test "parses chunk sizes with the ieof extension" do
+      assert {:ok, 26, false} = Protocol.parse_chunk_size("1a\r\n")
+      assert {:ok, 0, true} = Protocol.parse_chunk_size("0; ieof\r\n")
+      assert {:error, :bad_request} = Protocol.parse_chunk_size("zz\r\n")
+    end
+  end
+
+  describe "OPTIONS" do
+    test "advertises preview and 204 support", %{port: port} do
+      socket = connect(port)
+      :ok = :gen_tcp.send(socket, "OPTIONS icap://localhost/scan ICAP/1.0\r\nHost: localhost\r\n\r\n")
+
+      response = recv_response(socket)
+      assert response =~ "ICAP/1.0 200 OK"
+      assert response =~ "Allow: 204"
+      assert response =~ "Preview: "
+
+      :gen_tcp.close(socket)
+    end
+  end
+
+  describe "RESPMOD" do
+    test "answers 204 for clean bodies and keeps the connection open", %{port: port} do
+      socket = connect(port)
+
+      :ok = :gen_tcp.send(socket, respmod("harmless content", allow_204: true))
+      response = recv_response(socket)
+      assert response =~ "ICAP/1.0 204 No Content"
+      assert response =~ "Encapsulated: null-body=0\r\n"
+
+      :ok = :gen_tcp.send(socket, respmod("more harmless content", allow_204: true))
+      assert recv_response(socket) =~ "ICAP/1.0 204 No Content"
+
+      :gen_tcp.close(socket)
+    end
+
+    test "echoes clean bodies when 204 is not allowed", %{port: port} do
+      socket = connect(port)
+
+      :ok = :gen_tcp.send(socket, respmod("harmless content"))
+      response = recv_response(socket)
+      assert response =~ "ICAP/1.0 200 OK"
+      assert response =~ "harmless content"
+
+      :gen_tcp.close(socket)
+    end
+
+    test "echoes bodies spooled to disk in fixed-size chunks", %{server: server} do
+      icap =
+        start_supervised!(
+          {ICAP, name: nil, port: 0, server: server, max_memory_body: 1_024},
+          id: :spooling_icap
+        )
+
+      socket = connect(ICAP.port(icap))
+      body = :binary.copy("harmless content ", 10_000)
+
+      :ok = :gen_tcp.send(socket, respmod(body))
+      response = recv_response(socket)
+      assert response =~ "ICAP/1.0 200 OK"
+
+      [_head, chunked] = :binary.split(response, @res_hdr)
+      assert dechunk(chunked) == body
+
+      :gen_tcp.close(socket)
+    end
+
+    test "rejects chunks larger than the configured maximum", %{port: port} do
+      socket = connect(port)
+
+      request = [
+        "RESPMOD icap://localhost/scan ICAP/1.0\r\n",
+        "Host: localhost\r\n",
+        "Encapsulated: res-hdr=0, res-body=#{byte_size(@res_hdr)}\r\n\r\n",
+        @res_hdr,
+        "FFFFFFFFFF\r\n"
+      ]
+
+      :ok = :gen_tcp.send(socket, request)
+      response = recv_response(socket)
+      assert response =~ "ICAP/1.0 400 Bad Request"
+      assert response =~ "Encapsulated: null-body=0"
+
+      :gen_tcp.close(socket)
+    end
+
+    test "rejects requests with too many ICAP headers", %{port: port} do
+      socket = connect(port)
+
+      request = [
+        "RESPMOD icap://localhost/scan ICAP/1.0\r\n",
+        for(n <- 1..200, do: "X-Filler-#{n}: x\r\n"),
+        "\r\n"
+      ]
+
+      :ok = :gen_tcp.send(socket, request)
+      assert recv_response(socket) =~ "ICAP/1.0 413 Request Entity Too Large"
+
+      :gen_tcp.close(socket)
+    end
+
+    test "blocks infected bodies with a 403 response", %{port: port} do
+      socket = connect(port)
+
+      :ok = :gen_tcp.send(socket, respmod(@eicar, allow_204: true))
+      response = recv_response(socket)
+      assert response =~ "ICAP/1.0 200 OK"
+      assert response =~ "X-Virus-ID: Eicar-Test-Signature"
+      assert response =~ "HTTP/1.1 403 Forbidden"
+
+      :gen_tcp.close(socket)
+    end
+
+    test "requests the remainder of the body after a preview", %{port: port} do
+      socket = connect(port)
+      {preview, rest} = String.split_at(@eicar, 10)
+
+      request = [
+        "RESPMOD icap://localhost/scan ICAP/1.0\r\n",
+        "Host: localhost\r\n",
+        "Allow: 204\r\n",
+        "Preview: 10\r\n",
+        "Encapsulated: res-hdr=0, res-body=#{byte_size(@res_hdr)}\r\n\r\n",
+        @res_hdr,
+        chunk(preview),
+        "0\r\n\r\n"
+      ]
+
+      :ok = :gen_tcp.send(socket, request)
+      assert {:ok, "ICAP/1.0 100 Continue\r\n\r\n"} = :gen_tcp.recv(socket, 0, 5_000)
+
+      :ok = :gen_tcp.send(socket, [chunk(rest), "0\r\n\r\n"])
+      assert recv_response(socket) =~ "X-Virus-ID: Eicar-Test-Signature"
+
+      :gen_tcp.close(socket)
+    end
+  end
+
+  # ── Helpers ──────────────────────────────────────────────────────────────
+
+  defp connect(port) do
+    {:ok, socket} = :gen_tcp.connect(~c"127.0.0.1", port, [:binary, active: false])
+    socket
+  end
+
+  defp respmod(body, opts \\ []) do
+    allow = if Keyword.get(opts, :allow_204, false), do: "Allow: 204\r\n", else: ""
+
+    [
+      "RESPMOD icap://localhost/scan ICAP/1.0\r\n",
+      "Host: localhost\r\n",
+      allow,
+      "Encapsulated: res-hdr=0, res-body=#{byte_size(@res_hdr)}\r\n\r\n",
+      @res_hdr,
+      chunk(body),
+      "0\r\n\r\n"
+    ]
+  end
+
+  defp dechunk(data, acc \\ []) do
+    [size, rest] = :binary.split(data, "\r\n")
+
+    case String.to_integer(size, 16) do
+      0 ->
+        IO.iodata_to_binary(acc)
+
+      size ->
+        <<chunk::binary-size(size), "\r\n", rest::binary>> = rest
+        dechunk(rest, [acc, chunk])
+    end
+  end
+
+  defp chunk(data), do: [Integer.to_string(byte_size(data), 16), "\r\n", data, "\r\n"]
+
+  # Reads until the ICAP header block (and any chunked body) is complete.
+  defp recv_response(socket, acc \\ <<>>) do
+    {:ok, data} = :gen_tcp.recv(socket, 0, 5_000)
+    acc = acc <> data
+
+    cond do
+      String.starts_with?(acc, "ICAP/1.0 204") and String.contains?(acc, "\r\n\r\n") -> acc
+      String.contains?(acc, "null-body") and String.contains?(acc, "\r\n\r\n") -> acc
+      String.ends_with?(acc, "0\r\n\r\n") -> acc
+      true -> recv_response(socket, acc)
+    end
+  end
+end
@@ -0,0 +1,119 @@
+defmodule ExClamav.IsolatedTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.Isolated
+
+  @moduletag :tmp_dir
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  setup_all do
+    start_supervised!({Isolated, name: :isolated_test, pool_size: 2, shared_threshold: 1024})
+    start_supervised!({Isolated, name: :isolated_zygote_test, pool_size: 2, zygote: true})
+    :ok
+  end
+
+  test "scans small buffers inline" do
+    assert {:ok, :clean} = Isolated.scan_buffer(:isolated_test, "harmless content")
+    assert {:virus, "Eicar-Test-Signature"} = Isolated.scan_buffer(:isolated_test, @eicar)
+  end
+
+  test "scans large buffers through shared memory" do
+    padding = String.duplicate(" ", 4096)
+    assert {:ok, :clean} = Isolated.scan_buffer(:isolated_test, padding)
+    assert {:virus, "Eicar-Test-Signature"} = Isolated.scan_buffer(:isolated_test, @eicar <> padding)
+  end
+
+  test "scans files by path", %{tmp_dir: tmp_dir} do
+    path = Path.join(tmp_dir, "eicar_file")
+    File.write!(path, @eicar)
+
+    assert {:virus, "Eicar-Test-Signature"} = Isolated.scan_file(:isolated_test, path)
+  end
+
+  test "serves more concurrent scans than workers" do
+    results =
+      1..8
+      |> Task.async_stream(fn _ -> Isolated.scan_buffer(:isolated_test, @eicar) end)
+      |> Enum.map(fn {:ok, result} -> result end)
+
+    assert Enum.all?(results, &match?({:virus, _}, &1))
+  end
+
+  test "keeps serving while workers reload one at a time" do
+    ExClamav.Isolated.Pool.reload_workers(:isolated_test)
+
+    results =
+      1..8
+      |> Task.async_stream(fn _ -> Isolated.scan_buffer(:isolated_test, @eicar) end,
+        timeout: :timer.minutes(2)
+      )
+      |> Enum.map(fn {:ok, result} -> result end)
+
+    assert Enum.all?(results, &match?({:virus, "Eicar-Test-Signature"}, &1))
+  end
+
+  test "reports each scan's peak heap use" do
+    test_pid = self()
+    handler = "isolated-scan-#{inspect(test_pid)}"
+
+    :telemetry.attach(
+      handler,
+      [:ex_clamav, :isolated, :scan],
+      fn _event, measurements, metadata, _config ->
+        send(test_pid, {:scan, measurements, metadata})
+      end,
+      nil
+    )
+
+    on_exit(fn -> :telemetry.detach(handler) end)
+
+    assert {:virus, _} = Isolated.scan_buffer(:isolated_test, @eicar)
+    assert_receive {:scan, %{peak_memory: peak}, %{pool: :isolated_test, result: :virus}}
+    assert peak > 0
+  end
+
+  test "returns each scan's peak heap use with the verdict" do
+    assert {{:virus, "Eicar-Test-Signature"}, %{peak_memory: peak}} =
+             Isolated.scan_buffer_with_stats(:isolated_test, @eicar)
+
+    assert peak > 0
+  end
+
+  test "aborts scans that exceed the memory cap" do
+    start_supervised!({Isolated, name: :isolated_capped_test, pool_size: 1, max_scan_memory: 1})
+
+    assert {:error, "scan memory limit exceeded"} =
+             Isolated.scan_buffer(:isolated_capped_test, "harmless content")
+
+    # The worker survives the aborted scan.
+    assert {:error, "scan memory limit exceeded"} =
+             Isolated.scan_buffer(:isolated_capped_test, @eicar)
+  end
+
+  test "fails requests handed to a worker that dies before serving them" do
+    start_supervised!({Isolated, name: :isolated_crash_test, pool_size: 1})
+
+    wait_until(fn -> map_size(:sys.get_state(:isolated_crash_test).workers) == 1 end)
+    [worker] = Map.keys(:sys.get_state(:isolated_crash_test).workers)
+    :sys.suspend(worker)
+
+    scan = Task.async(fn -> Isolated.scan_buffer(:isolated_crash_test, "harmless content") end)
+    wait_until(fn -> Map.has_key?(:sys.get_state(:isolated_crash_test).busy, worker) end)
+    Process.exit(worker, :kill)
+
+    assert {:error, "scan worker crashed"} = Task.await(scan)
+  end
+
+  test "zygote workers scan with the shared engine" do
+    assert {:ok, :clean} = Isolated.scan_buffer(:isolated_zygote_test, "harmless content")
+    assert {:virus, "Eicar-Test-Signature"} = Isolated.scan_buffer(:isolated_zygote_test, @eicar)
+  end
+
+  defp wait_until(fun) do
+    unless fun.() do
+      Process.sleep(10)
+      wait_until(fun)
+    end
+  end
+end
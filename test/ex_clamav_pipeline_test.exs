@@ -0,0 +1,108 @@
+defmodule ExClamav.PipelineTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.Engine
+  alias ExClamav.Pipeline
+  alias ExClamav.Pipeline.Stages
+  alias ExClamav.VerdictCache
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  setup_all do
+    {:ok, engine} = ExClamav.new_engine_with_database()
+    on_exit(fn -> Engine.free(engine) end)
+    {:ok, engine: engine}
+  end
+
+  setup do
+    cache = :"pipeline_cache_#{System.unique_integer([:positive])}"
+    start_supervised!({VerdictCache, name: cache})
+    {:ok, cache: cache}
+  end
+
+  defp scan_pipeline(engine, cache) do
+    Pipeline.new(:test)
+    |> Pipeline.stage(:size, Stages.max_size(1024))
+    |> Pipeline.stage(:hash, Stages.hash(), concurrency: 2)
+    |> Pipeline.stage(:cache, Stages.cache_lookup(cache))
+    |> Pipeline.stage(:scan, Stages.scan(engine), concurrency: 4)
+    |> Pipeline.stage(:store, Stages.cache_store(cache))
+  end
+
+  test "runs items through the built-in stages in input order", %{engine: engine, cache: cache} do
+    pipeline = scan_pipeline(engine, cache)
+    too_big = :binary.copy("a", 2048)
+
+    assert [
+             {:ok, %{verdict: {:ok, :clean}, size: 5}},
+             {:ok, %{verdict: {:virus, "Eicar-Test-Signature"}}},
+             {:error, "Input of 2048 bytes exceeds the 1024 byte limit"}
+           ] = Pipeline.run(pipeline, ["hello", @eicar, too_big])
+
+    # The second run is served from the verdict cache.
+    assert [{:ok, %{verdict: {:virus, "Eicar-Test-Signature"}, cached: true}}] =
+             Pipeline.run(pipeline, [@eicar])
+  end
+
+  test "hands batched stages lists and keeps results aligned" do
+    pipeline =
+      Pipeline.new()
+      |> Pipeline.stage(:double, &{:ok, Map.update!(&1, :n, fn n -> n * 2 end)}, concurrency: 4)
+      |> Pipeline.stage(
+        :batch,
+        fn items ->
+          Enum.map(items, fn
+            %{n: 6} -> {:error, :six}
+            item -> {:done, Map.put(item, :batched, true)}
+          end)
+        end,
+        batch_size: 3,
+        concurrency: 1
+      )
+      |> Pipeline.stage(:never, fn _item -> raise "finished items skip later stages" end)
+
+    results = Pipeline.run(pipeline, Enum.map(1..5, &%{n: &1}))
+
+    assert [
+             {:ok, %{n: 2, batched: true}},
+             {:ok, %{n: 4, batched: true}},
+             {:error, :six},
+             {:ok, %{n: 8, batched: true}},
+             {:ok, %{n: 10, batched: true}}
+           ] = results
+  end
+
+  test "turns stage exceptions into errors and emits stage telemetry" do
+    handler = "pipeline-test-#{inspect(self())}"
+    test_pid = self()
+
+    :telemetry.attach(
+      handler,
+      [:ex_clamav, :pipeline, :stage, :stop],
+      fn _event, measurements, metadata, _config ->
+        send(test_pid, {:stage, metadata.stage, measurements})
+      end,
+      nil
+    )
+
+    on_exit(fn -> :telemetry.detach(handler) end)
+
+    pipeline =
+      Pipeline.new()
+      |> Pipeline.stage(:ok, &{:ok, &1}, batch_size: 2)
+      |> Pipeline.stage(:boom, fn _item -> raise "boom" end)
+
+    assert [{:error, "boom"}, {:error, "boom"}] = Pipeline.run(pipeline, ["a", "b"])
+    assert_receive {:stage, :ok, %{count: 2, errors: 0, duration: duration}}
+    assert is_integer(duration)
+  end
+
+  test "turns stage exits into errors instead of crashing the caller" do
+    pipeline =
+      Pipeline.new()
+      |> Pipeline.stage(:call, fn _item -> GenServer.call(:no_such_server, :ping) end)
+
+    assert [{:error, "Stage :call exited: " <> _}] = Pipeline.run(pipeline, ["a"])
+    assert Process.alive?(self())
+  end
+end
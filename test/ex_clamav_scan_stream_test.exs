@@ -0,0 +1,72 @@
+defmodule ExClamav.ScanStreamTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.ClamavGenServer
+  alias ExClamav.Engine
+
+  @moduletag :tmp_dir
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  setup_all do
+    {:ok, engine} = ExClamav.new_engine_with_database()
+    on_exit(fn -> Engine.free(engine) end)
+    {:ok, engine: engine}
+  end
+
+  defp pulled_count(count) do
+    receive do
+      {:pulled, _item} -> pulled_count(count + 1)
+    after
+      0 -> count
+    end
+  end
+
+  test "scans lazily in chunks and keeps input order", %{engine: engine} do
+    items = Enum.map(1..100, &if(rem(&1, 10) == 0, do: @eicar, else: "item #{&1}"))
+    test_pid = self()
+
+    results =
+      items
+      |> Stream.each(&send(test_pid, {:pulled, &1}))
+      |> ExClamav.stream_scan(engine: engine, chunk_size: 8, max_concurrency: 2)
+      |> Enum.take(5)
+
+    assert Enum.map(results, &elem(&1, 0)) == Enum.take(items, 5)
+    assert Enum.all?(results, &match?({_item, {:ok, :clean}}, &1))
+
+    # Only the chunks needed for the first results were pulled.
+    assert pulled_count(0) <= 3 * 8
+
+    verdicts = items |> ExClamav.stream_scan(engine: engine, ordered: false) |> Map.new()
+    assert map_size(verdicts) == 90 + 1
+    assert verdicts[@eicar] == {:virus, "Eicar-Test-Signature"}
+  end
+
+  test "scans files through the server pool", %{tmp_dir: tmp_dir} do
+    server = start_supervised!({ClamavGenServer, name: nil, max_concurrency: 2})
+
+    paths =
+      for name <- ["a", "b", "eicar"] do
+        path = Path.join(tmp_dir, name)
+        File.write!(path, if(name == "eicar", do: @eicar, else: name))
+        path
+      end
+
+    assert [{_, {:ok, :clean}}, {_, {:ok, :clean}}, {_, {:virus, "Eicar-Test-Signature"}}] =
+             paths
+             |> ExClamav.stream_scan(server: server, source: &{:file, &1}, chunk_size: 2)
+             |> Enum.to_list()
+
+    assert %{throughput: %{batch: _}} = ClamavGenServer.status(server).scheduler
+  end
+
+  test "closes chunks early at the byte bound", %{engine: engine} do
+    buffers = List.duplicate(String.duplicate("a", 1_000), 10)
+
+    assert 10 =
+             buffers
+             |> ExClamav.stream_scan(engine: engine, chunk_size: 100, max_chunk_bytes: 2_500)
+             |> Enum.count()
+  end
+end
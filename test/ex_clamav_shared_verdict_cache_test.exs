@@ -0,0 +1,115 @@
+defmodule ExClamav.SharedVerdictCacheTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.ClamavGenServer
+  alias ExClamav.SharedVerdictCache
+  alias ExClamav.VerdictCache
+
+  @moduletag :tmp_dir
+
+  setup %{tmp_dir: tmp_dir} do
+    name = :"shared_cache_#{System.unique_integer([:positive])}"
+    on_exit(fn -> SharedVerdictCache.close(name) end)
+    {:ok, name: name, path: Path.join([tmp_dir, "cache", "verdicts"])}
+  end
+
+  test "stores verdicts per database generation", %{name: name, path: path} do
+    assert {:ok, 1024} = SharedVerdictCache.open(name, path, slots: 1024)
+
+    clean = VerdictCache.digest("clean")
+    infected = VerdictCache.digest("infected")
+
+    assert :miss = SharedVerdictCache.get(name, clean, 1)
+
+    SharedVerdictCache.put(name, clean, 1, {:ok, :clean})
+    SharedVerdictCache.put(name, infected, 1, {:virus, "Eicar-Test-Signature"})
+    SharedVerdictCache.put(name, VerdictCache.digest("error"), 1, {:error, "boom"})
+
+    assert {:ok, {:ok, :clean}} = SharedVerdictCache.get(name, clean, 1)
+    assert {:ok, {:virus, "Eicar-Test-Signature"}} = SharedVerdictCache.get(name, infected, 1)
+    assert :miss = SharedVerdictCache.get(name, VerdictCache.digest("error"), 1)
+
+    # A new database generation invalidates every entry.
+    assert :miss = SharedVerdictCache.get(name, infected, 2)
+  end
+
+  test "survives reopening and is shared between mappings", %{name: name, path: path} do
+    {:ok, 64} = SharedVerdictCache.open(name, path, slots: 64)
+    other = :"#{name}_other"
+    on_exit(fn -> SharedVerdictCache.close(other) end)
+
+    # An existing file keeps its size.
+    assert {:ok, 64} = SharedVerdictCache.open(other, path, slots: 4096)
+
+    digest = VerdictCache.digest("payload")
+    SharedVerdictCache.put(name, digest, 7, {:virus, "Win.Test-1"})
+    assert {:ok, {:virus, "Win.Test-1"}} = SharedVerdictCache.get(other, digest, 7)
+
+    SharedVerdictCache.close(name)
+    assert {:ok, 64} = SharedVerdictCache.open(name, path)
+    assert {:ok, {:virus, "Win.Test-1"}} = SharedVerdictCache.get(name, digest, 7)
+  end
+
+  test "keeps working when the table is full", %{name: name, path: path} do
+    {:ok, 8} = SharedVerdictCache.open(name, path, slots: 8)
+
+    for n <- 1..100 do
+      digest = VerdictCache.digest("item #{n}")
+      SharedVerdictCache.put(name, digest, 1, {:ok, :clean})
+      assert {:ok, {:ok, :clean}} = SharedVerdictCache.get(name, digest, 1)
+    end
+  end
+
+  test "rejects files that are not a verdict cache", %{name: name, path: path} do
+    File.mkdir_p!(Path.dirname(path))
+    File.write!(path, "something else")
+
+    assert {:error, "Invalid verdict cache file"} = SharedVerdictCache.open(name, path)
+  end
+
+  test "recreates files in the previous slot format", %{name: name, path: path} do
+    File.mkdir_p!(Path.dirname(path))
+    File.write!(path, ["EXCLPVC1", :binary.copy(<<0>>, 56 + 128)])
+
+    assert {:ok, 16} = SharedVerdictCache.open(name, path, slots: 16)
+    assert File.stat!(path).size == 64 + 16 * 128
+  end
+
+  test "reclaims slots left locked by a dead writer", %{name: name, path: path} do
+    {:ok, 1} = SharedVerdictCache.open(name, path, slots: 1)
+
+    # Lock word of the only slot: taken at boot and never released.
+    {:ok, file} = :file.open(path, [:read, :write, :binary])
+    :ok = :file.pwrite(file, 64, <<1::little-32, 6::little-32>>)
+    :ok = File.close(file)
+
+    digest = VerdictCache.digest("payload")
+    SharedVerdictCache.put(name, digest, 1, {:virus, "Win.Test-1"})
+    assert {:ok, {:virus, "Win.Test-1"}} = SharedVerdictCache.get(name, digest, 1)
+  end
+
+  test "generation follows the database files", %{tmp_dir: tmp_dir} do
+    db = Path.join(tmp_dir, "db")
+    File.mkdir_p!(db)
+    File.write!(Path.join(db, "local.ndb"), "Test.One:0:*:deadbeef\n")
+
+    generation = SharedVerdictCache.generation(db)
+    assert generation == SharedVerdictCache.generation(db)
+
+    File.write!(Path.join(db, "local.ndb"), "Test.Two:0:*:deadbeef\n")
+    refute generation == SharedVerdictCache.generation(db)
+  end
+
+  test "ClamavGenServer answers from the shared cache", %{name: name, path: path} do
+    {:ok, _slots} = SharedVerdictCache.open(name, path, slots: 1024)
+    server = start_supervised!({ClamavGenServer, name: nil, shared_cache: name})
+
+    assert {:ok, :clean} = ClamavGenServer.scan_buffer(server, "harmless")
+
+    # Another node on the host recorded a different verdict for this generation.
+    %{cache_generation: generation} = ClamavGenServer.status(server)
+    SharedVerdictCache.put(name, VerdictCache.digest("harmless"), generation, {:virus, "Shared"})
+
+    assert {:virus, "Shared"} = ClamavGenServer.scan_buffer(server, "harmless")
+  end
+end
@@ -0,0 +1,88 @@
+defmodule ExClamav.TieredTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.Tiered
+
+  @eicar "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*"
+
+  defp start_tiered(opts \\ []) do
+    server = start_supervised!({Tiered, Keyword.put(opts, :name, nil)})
+    :ok = Tiered.subscribe(server)
+    server
+  end
+
+  setup do
+    handler = "tiered-test-#{inspect(self())}"
+    test_pid = self()
+
+    :telemetry.attach(
+      handler,
+      [:ex_clamav, :tiered, :deep_scan],
+      fn _event, measurements, metadata, _config ->
+        send(test_pid, {:deep_scan, measurements, metadata})
+      end,
+      nil
+    )
+
+    on_exit(fn -> :telemetry.detach(handler) end)
+  end
+
+  test "answers low-risk content with a final fast verdict" do
+    server = start_tiered()
+
+    assert {{:ok, :clean}, :final} = Tiered.scan_buffer(server, "just some text")
+    assert {{:virus, "Eicar-Test-Signature"}, :final} = Tiered.scan_buffer(server, @eicar)
+  end
+
+  test "notifies subscribers when the thorough pass changes the verdict" do
+    # The fast pass only sees a prefix that is too short to match.
+    server = start_tiered(fast_max_bytes: 32)
+
+    assert {{:ok, :clean}, {:provisional, ref}} = Tiered.scan_buffer(server, @eicar)
+
+    assert_receive {:clamav_verdict_changed, ^ref,
+                    %{provisional: {:ok, :clean}, verdict: {:virus, "Eicar-Test-Signature"}}},
+                   5_000
+
+    assert_receive {:deep_scan, %{duration: _, queue_time: _}, %{changed: true, size: 68}}
+  end
+
+  test "re-scans risky types in the background without noise" do
+    server = start_tiered()
+    zip_like = <<"PK", 3, 4>> <> "not really an archive"
+
+    assert {{:ok, :clean}, {:provisional, ref}} = Tiered.scan_buffer(server, zip_like)
+    assert_receive {:deep_scan, _measurements, %{changed: false, type: :zip}}, 5_000
+    refute_received {:clamav_verdict_changed, ^ref, _details}
+
+    assert %{queued: 0, running: 0} = Tiered.status(server)
+  end
+
+  test "runs the thorough pass inline when the queue is full" do
+    server = start_tiered(fast_max_bytes: 32, max_pending: 0)
+    assert {{:virus, "Eicar-Test-Signature"}, :final} = Tiered.scan_buffer(server, @eicar)
+  end
+
+  test "honours a custom deep rule" do
+    server = start_tiered(fast_max_bytes: 32, deep_if: fn %{type: type} -> type == :pdf end)
+    assert {{:ok, :clean}, :final} = Tiered.scan_buffer(server, @eicar)
+  end
+
+  test "keeps answering fast passes while a new engine loads" do
+    server = start_tiered()
+
+    send(server, {:clamav_definition_updated, %{}})
+    assert {{:ok, :clean}, :final} = Tiered.scan_buffer(server, "just some text")
+    assert %{queued: 0} = Tiered.status(server)
+
+    wait_until(fn -> is_nil(:sys.get_state(server).reload) end)
+    assert {{:virus, "Eicar-Test-Signature"}, :final} = Tiered.scan_buffer(server, @eicar)
+  end
+
+  defp wait_until(fun) do
+    unless fun.() do
+      Process.sleep(50)
+      wait_until(fun)
+    end
+  end
+end
@@ -0,0 +1,63 @@
+defmodule ExClamav.VerdictCacheTest do
+  use ExUnit.Case, async: false
+
+  alias ExClamav.VerdictCache
+
+  setup do
+    start_supervised!({VerdictCache, name: :verdict_cache_test, max_entries: 8})
+    :ok
+  end
+
+  test "caches definitive verdicts by digest" do
+    digest = VerdictCache.digest("harmless content")
+
+    assert :miss = VerdictCache.get(:verdict_cache_test, digest)
+    :ok = VerdictCache.put(:verdict_cache_test, digest, {:ok, :clean})
+    assert {:ok, {:ok, :clean}} = VerdictCache.get(:verdict_cache_test, digest)
+  end
+
+  test "does not cache errors" do
+    digest = VerdictCache.digest("broken content")
+
+    :ok = VerdictCache.put(:verdict_cache_test, digest, {:error, "boom"})
+    assert :miss = VerdictCache.get(:verdict_cache_test, digest)
+  end
+
+  test "fetch/3 only runs the scan on a miss" do
+    digest = VerdictCache.digest("eicar-ish")
+    verdict = {:virus, "Eicar-Test-Signature"}
+
+    assert ^verdict = VerdictCache.fetch(:verdict_cache_test, digest, fn -> verdict end)
+    assert ^verdict = VerdictCache.fetch(:verdict_cache_test, digest, fn -> flunk("rescanned") end)
+  end
+
+  test "invalidate/1 drops verdicts from earlier generations" do
+    digest = VerdictCache.digest("harmless content")
+    :ok = VerdictCache.put(:verdict_cache_test, digest, {:ok, :clean})
+
+    :ok = VerdictCache.invalidate(:verdict_cache_test)
+    assert :miss = VerdictCache.get(:verdict_cache_test, digest)
+    assert %{generation: 1} = VerdictCache.info(:verdict_cache_test)
+  end
+
+  test "prunes entries beyond :max_entries" do
+    for i <- 1..20 do
+      VerdictCache.put(:verdict_cache_test, VerdictCache.digest("item #{i}"), {:ok, :clean})
+    end
+
+    # Pruning is asynchronous; a synchronous call flushes the cast.
+    _ = :sys.get_state(:verdict_cache_test)
+    assert %{size: size} = VerdictCache.info(:verdict_cache_test)
+    assert size <= 8
+  end
+
+  test "file_digest/1 matches digest/1" do
+    path = Path.join(System.tmp_dir!(), "ex_clamav_digest_#{System.unique_integer([:positive])}")
+    File.write!(path, "harmless content")
+
+    assert {:ok, digest} = VerdictCache.file_digest(path)
+    assert digest == VerdictCache.digest("harmless content")
+
+    File.rm!(path)
+  end
+end